@@ -0,0 +1,155 @@
+#!/bin/sh
+# Regression tests. Each tests/cases/*.upl names
+# its upl options on a first "// args:" line; its stdout, stderr and exit
+# status must match the .out file next to it; @modules in the options is a
+# scratch copy of tests/modules, where imports write their snapshots.
+# tests/fuzz holds inputs for --fuzz-regress.
+#
+#   gcc -o upl upl.c -pthread && tests/run.sh [./upl]
+#   gcc -DUPL_ALLOC_TRACK -o upl upl.c -pthread && tests/run.sh    also checks allocations
+#   UPDATE=1 tests/run.sh    rewrites the .out files after a deliberate change
+
+UPL=${1:-./upl}
+DIR=$(dirname "$0")
+failed=0
+total=0
+modules=$(mktemp -d)
+scratch=$(mktemp -d)
+trap 'rm -rf "$modules" "$scratch"' EXIT
+cp "$DIR"/modules/*.upl "$modules"
+
+for src in "$DIR"/cases/*.upl; do
+    expected=${src%.upl}.out
+    args=$(sed -n '1s|^// args:||p' "$src" | sed "s|@modules|$modules|g")
+    actual=$("$UPL" $args "$src" 2>&1; echo "exit $?")
+    total=$((total + 1))
+    if [ -n "$UPDATE" ]; then
+        printf '%s\n' "$actual" > "$expected"
+    elif ! printf '%s\n' "$actual" | diff -u "$expected" - > /dev/null 2>&1; then
+        echo "FAIL $src ($args)"
+        printf '%s\n' "$actual" | diff -u "$expected" - | head -40
+        failed=$((failed + 1))
+    fi
+done
+
+echo "$((total - failed))/$total cases passed"
+
+# Minimized fuzzer finds and hand-written worst cases must stay within the
+# --fuzz-regress time and memory budgets per byte
+if ! "$UPL" --fuzz-regress "$DIR/fuzz" > /dev/null; then
+    echo "FAIL fuzz corpus over budget:"
+    "$UPL" --fuzz-regress "$DIR/fuzz" | grep FAIL
+    failed=$((failed + 1))
+fi
+
+# The LL(1) engine and the lexer thread of --pipeline must not change the
+# trees and diagnostics of the default recursive descent parse
+for src in "$DIR"/cases/*.upl "$DIR"/fuzz/*.upl; do
+    { "$UPL" "$src" 2>&1; echo "exit $?"; } > "$scratch/expected"
+    for mode in --ll1 --pipeline; do
+        actual=$("$UPL" $mode "$src" 2>&1; echo "exit $?")
+        if ! printf '%s\n' "$actual" | diff -u "$scratch/expected" - > /dev/null 2>&1; then
+            echo "FAIL $mode differs: $src"
+            printf '%s\n' "$actual" | diff -u "$scratch/expected" - | head -40
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+# Nesting is bounded by memory, not the C stack, with --ll1
+awk 'BEGIN { print "begin int x = 0;"
+    for (i = 0; i < 1000000; i++) print "if (x > 0) then {"
+    for (i = 0; i < 1000000; i++) print "}"
+    print "end" }' > "$scratch/deep1m.upl"
+if ! "$UPL" --passes=parse --ll1 "$scratch/deep1m.upl" > /dev/null; then
+    echo "FAIL --ll1 on a 1000000-deep input"
+    failed=$((failed + 1))
+fi
+
+# A request nested past the server's default --max-depth gets exit status 3
+# instead of overflowing a worker's stack, and the server keeps answering
+awk 'BEGIN { print "begin int x = 0;"
+    for (i = 0; i < 30000; i++) print "if (x > 0) then {"
+    for (i = 0; i < 30000; i++) print "}"
+    print "end" }' > "$scratch/deep.upl"
+"$UPL" --serve "$scratch/upl.sock" --workers 1 &
+server=$!
+tries=0
+while [ ! -S "$scratch/upl.sock" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+"$UPL" --client "$scratch/upl.sock" "$scratch/deep.upl" > /dev/null
+status=$?
+if [ $status -ne 3 ]; then
+    echo "FAIL deep request to --serve: exit $status, expected 3"
+    failed=$((failed + 1))
+fi
+if ! "$UPL" --client "$scratch/upl.sock" "$DIR/cases/fold.upl" > /dev/null; then
+    echo "FAIL --serve stopped answering after a deep request"
+    failed=$((failed + 1))
+fi
+kill $server 2> /dev/null
+wait $server 2> /dev/null
+
+# --check-files gives the same diagnostics in every input mode, for paths
+# read from more than one --list
+echo 'begin int x = ; end' > "$scratch/bad.upl"
+printf '%s\n' "$DIR/cases/fold.upl" "$scratch/missing.upl" > "$scratch/list1"
+printf '%s\n' "$DIR/cases/check.upl" "$scratch/bad.upl" > "$scratch/list2"
+expected="$scratch/missing.upl: could not read: No such file or directory
+$scratch/bad.upl:
+- Error at line 1: Invalid primary expression
+4 files, 1 with errors, 1 unreadable
+exit 1"
+for io in stdio pool uring; do
+    "$UPL" --check-files --io $io --list "$scratch/list1" --list "$scratch/list2" > "$scratch/out" 2> /dev/null
+    status=$?
+    actual=$(grep -v ' files/s ' "$scratch/out"; echo "exit $status")
+    if [ "$actual" != "$expected" ]; then
+        echo "FAIL --check-files --io $io"
+        printf '%s\n' "$actual"
+        failed=$((failed + 1))
+    fi
+done
+
+# --diff matches statements by structure: an edit shows as added, removed
+# and changed statements, and a change of layout alone is no difference
+printf '%s\n' 'begin' 'int x = 1;' 'int y = 2;' 'print(x);' 'print(y);' 'end' > "$scratch/old.upl"
+printf '%s\n' 'begin' 'int x = 1;' 'print(x + 1);' 'print(x);' 'int z = 3;' 'print(z);' 'end' > "$scratch/new.upl"
+printf '%s\n' 'begin int x = 1;' '    int y=2; print( x );' 'print(y); end' > "$scratch/layout.upl"
+expected="- removed DeclStmt: $scratch/old.upl line 3
+- added PrintStmt: $scratch/new.upl line 3
+- added DeclStmt: $scratch/new.upl line 5
+- changed PrintStmt: $scratch/old.upl line 5, $scratch/new.upl line 6
+- 4 statements differ: 1 changed, 2 added, 1 removed; 2 identical subtrees skipped
+exit 1"
+actual=$("$UPL" --diff "$scratch/old.upl" "$scratch/new.upl" 2>&1; echo "exit $?")
+if [ "$actual" != "$expected" ]; then
+    echo "FAIL --diff of an edit"
+    printf '%s\n' "$actual"
+    failed=$((failed + 1))
+fi
+actual=$("$UPL" --diff "$scratch/old.upl" "$scratch/layout.upl" 2>&1; echo "exit $?")
+if [ "$actual" != "- no differences
+exit 0" ]; then
+    echo "FAIL --diff of a layout-only change"
+    printf '%s\n' "$actual"
+    failed=$((failed + 1))
+fi
+
+# Lexer allocations per token in steady state; only a -DUPL_ALLOC_TRACK
+# build can count them
+if "$UPL" --alloc-check "$DIR/cases/fold.upl" > /dev/null 2>&1; then
+    for src in "$DIR"/cases/*.upl "$DIR"/fuzz/*.upl; do
+        if ! out=$("$UPL" --alloc-check "$src" 2>&1); then
+            echo "FAIL allocation budget: $src"
+            echo "$out"
+            failed=$((failed + 1))
+        fi
+    done
+else
+    echo "allocation checks skipped (build with -DUPL_ALLOC_TRACK to run them)"
+fi
+
+[ "$failed" -eq 0 ]
@@ -1,14 +1,95 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "upl.h"
 
 #define MAX_TOKEN_LEN 100
 #define MAX_STMTS 100
-#define MAX_ERRORS 100
 #define MAX_TOKENS 2000
 #define MAX_SYMBOLS 100
+#define ARENA_BLOCK_SIZE 65536
+#define AST_INITIAL_NODES 1024
+#define MAX_WORKERS 64
+#define MAX_REQUEST_LEN (64u << 20)
+#define SERVE_TIMEOUT_MS 30000 // A connection idle this long in a read or write is dropped
+#define SERVE_MAX_DEPTH 1000 // Default --max-depth of requests; deeper ones could overflow a worker's stack
+#define BENCH_RECURSIVE_MAX_DEPTH 5000 // Deeper inputs could overflow the C stack
+#define UNROLL_MAX_TRIPS 4
+#define UNROLL_MAX_STMTS 16 // Statements produced by unrolling one loop
+#define RING_SIZE 4096      // Token slots between the lexer and parser threads, a power of two
+#define RING_SPINS 64       // Polls before a waiting thread yields the core
+#define ALLOC_CHECK_MAX_PER_TOKEN 0.01 // Lexer allocations per token allowed by --alloc-check
+#define FUZZ_MAX_LEN 4096        // Longest input the fuzzer builds
+#define FUZZ_MIN_LEN 256         // Shorter inputs are timed mostly by fixed costs
+#define FUZZ_FEATURES 65536      // Coverage bitmap size, a power of two
+#define FUZZ_CORPUS_MAX 512
+#define FUZZ_NAMES 8             // Variables x0..x7 in generated code
+#define FUZZ_TIMING_RUNS 3       // Parses per timing; the fastest counts
+#define FUZZ_REGRESS_RUNS 5
+#define FUZZ_MINIMIZE_KEEP 0.8   // Share of the cost per byte a minimized input must keep
+#define FUZZ_MAX_NS_PER_BYTE 2000 // Default --fuzz-regress budgets
+#define FUZZ_MAX_MEM_PER_BYTE 1024
+#define READ_AHEAD 256  // Files loaded ahead of the parser by --check-files
+#define URING_BATCH 64  // Files per io_uring submission round
+#define GOVERNOR_CLOCK_MASK 255 // Limit checks between clock reads, minus one
+#define LIMIT_EXIT_STATUS 3     // Exit status when a resource limit stopped the parse
+#define CAPTURE_MAGIC "UPLCAP1\n" // First bytes of a capture log
+#define HIST_SUB_BITS 7 // Significant bits kept by latency histograms, under 1% error
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define SNAPSHOT_MAGIC "UPLSNAP2" // First bytes of a precompiled module
+#define MODULE_PATH_MAX 4096
+
+// Heap phases for the allocation tracker
+typedef enum {
+    ALLOC_OTHER, ALLOC_LEX, ALLOC_PARSE, ALLOC_PHASE_COUNT
+} AllocPhase;
+
+#ifdef UPL_ALLOC_TRACK
+// Allocation tracking build: every heap call in this file goes through the
+// tracker, which charges it to the calling function and line and to the
+// phase of the calling thread. upl --alloc-profile turns recording on.
+#define ALLOC_MAX_SITES 256
+#define LIFETIME_BUCKETS 8 // Decades from under 1us to 1s and over
+void* track_malloc(size_t size, const char *func, int line);
+void* track_calloc(size_t count, size_t size, const char *func, int line);
+void* track_realloc(void *ptr, size_t size, const char *func, int line);
+void* track_aligned_alloc(size_t alignment, size_t size, const char *func, int line);
+char* track_strdup(const char *s, const char *func, int line);
+void track_free(void *ptr);
+#define malloc(size) track_malloc(size, __func__, __LINE__)
+#define calloc(count, size) track_calloc(count, size, __func__, __LINE__)
+#define realloc(ptr, size) track_realloc(ptr, size, __func__, __LINE__)
+#define aligned_alloc(alignment, size) track_aligned_alloc(alignment, size, __func__, __LINE__)
+#define strdup(s) track_strdup(s, __func__, __LINE__)
+#define free(ptr) track_free(ptr)
+extern __thread AllocPhase alloc_phase;
+#define ALLOC_PHASE(phase) (alloc_phase = (phase))
+#else
+#define ALLOC_PHASE(phase) ((void)0)
+#endif
 
 typedef enum {
     TOK_BEGIN, TOK_END, TOK_IF, TOK_THEN, TOK_ELSE, TOK_DO, TOK_WHILE, TOK_FOR,
@@ -17,33 +98,137 @@ typedef enum {
     TOK_LBRACE, TOK_RBRACE, TOK_SEMICOLON, TOK_EOF, TOK_ERROR
 } TokenType;
 
+#define TOKEN_COUNT (TOK_ERROR + 1)
+
 typedef struct {
     TokenType type;
     char text[MAX_TOKEN_LEN];
     int line;
+    int next_line; // Index of the first token on a later line
+    int next_sync; // Index of the first statement boundary at or after this token
+    int depth;     // Brace nesting depth; a '}' has the depth of the block it closes
+    int enclosing; // Innermost '{' still open at this token, or -1
+    int match;     // For '{', the matching '}', or -1
+    int decls;     // 'int' and 'bool' tokens before this one
 } Token;
 
-typedef struct Node {
-    char *label;
-    struct Node **children;
-    int num_children;
-} Node;
-
-typedef struct {
-    int line;
-    char message[256];
-} Error;
-
-typedef struct {
+typedef struct TokenList {
     Token *tokens;
     int capacity;
     int count;
+    int line_pending; // First token whose next_line is not known yet
+    int sync_pending; // First token whose next_sync is not known yet
+    int *braces;      // Indices of the open '{' tokens
+    int brace_count;
+    int brace_capacity;
+    int paren_count;  // Open '(' tokens
+    int decl_count;   // 'int' and 'bool' tokens so far
 } TokenList;
 
+// Single-producer/single-consumer token queue from the lexer thread to the
+// parser. head and tail only grow and are masked into slots; each sits on its
+// own cache line so the two threads do not fight over one.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head; // Next slot the lexer fills
+    _Alignas(64) _Atomic uint64_t tail; // Next slot the parser takes
+    _Alignas(64) uint64_t cached_tail;  // Lexer's last view of tail
+    _Atomic int stop;                   // Set when the parser gives up early
+    Token slots[RING_SIZE];
+} TokenRing;
+
+// Token type bitsets for FIRST/FOLLOW sets
+typedef uint32_t TokenSet;
+#define TOKEN_BIT(t) (1u << (t))
+
+typedef enum {
+    NT_PROG, NT_STMTS, NT_STMT, NT_ELSE_OPT, NT_TYPE, NT_EXPR, NT_COUNT
+} Nonterminal;
+
+const TokenSet first_sets[NT_COUNT] = {
+    [NT_PROG] = TOKEN_BIT(TOK_BEGIN),
+    [NT_STMTS] = TOKEN_BIT(TOK_IF) | TOKEN_BIT(TOK_DO) | TOKEN_BIT(TOK_PRINT) | TOKEN_BIT(TOK_INT)
+        | TOKEN_BIT(TOK_BOOL) | TOKEN_BIT(TOK_FOR) | TOKEN_BIT(TOK_ID),
+    [NT_STMT] = TOKEN_BIT(TOK_IF) | TOKEN_BIT(TOK_DO) | TOKEN_BIT(TOK_PRINT) | TOKEN_BIT(TOK_INT)
+        | TOKEN_BIT(TOK_BOOL) | TOKEN_BIT(TOK_FOR) | TOKEN_BIT(TOK_ID),
+    [NT_ELSE_OPT] = TOKEN_BIT(TOK_ELSE),
+    [NT_TYPE] = TOKEN_BIT(TOK_INT) | TOKEN_BIT(TOK_BOOL),
+    [NT_EXPR] = TOKEN_BIT(TOK_ID) | TOKEN_BIT(TOK_NUM) | TOKEN_BIT(TOK_TRUE) | TOKEN_BIT(TOK_FALSE)
+        | TOKEN_BIT(TOK_LPAREN),
+};
+
+const TokenSet follow_sets[NT_COUNT] = {
+    [NT_PROG] = TOKEN_BIT(TOK_EOF),
+    [NT_STMTS] = TOKEN_BIT(TOK_END) | TOKEN_BIT(TOK_RBRACE) | TOKEN_BIT(TOK_EOF),
+    [NT_STMT] = TOKEN_BIT(TOK_IF) | TOKEN_BIT(TOK_DO) | TOKEN_BIT(TOK_PRINT) | TOKEN_BIT(TOK_INT)
+        | TOKEN_BIT(TOK_BOOL) | TOKEN_BIT(TOK_FOR) | TOKEN_BIT(TOK_ID) | TOKEN_BIT(TOK_END)
+        | TOKEN_BIT(TOK_RBRACE) | TOKEN_BIT(TOK_EOF),
+    [NT_ELSE_OPT] = TOKEN_BIT(TOK_IF) | TOKEN_BIT(TOK_DO) | TOKEN_BIT(TOK_PRINT) | TOKEN_BIT(TOK_INT)
+        | TOKEN_BIT(TOK_BOOL) | TOKEN_BIT(TOK_FOR) | TOKEN_BIT(TOK_ID) | TOKEN_BIT(TOK_END)
+        | TOKEN_BIT(TOK_RBRACE) | TOKEN_BIT(TOK_EOF),
+    [NT_TYPE] = TOKEN_BIT(TOK_ID),
+    [NT_EXPR] = TOKEN_BIT(TOK_RPAREN) | TOKEN_BIT(TOK_SEMICOLON),
+};
+
+// Recovery resumes at statement keywords and block ends (identifiers are too
+// common inside expressions to be trusted), or right after a ';'
+#define SYNC_STOP_SET ((first_sets[NT_STMT] & ~TOKEN_BIT(TOK_ID)) | follow_sets[NT_STMTS])
+
+// LL(1) engine grammar: productions are runs of items after a header
+typedef enum {
+    G_PROG, G_STMTS, G_STMT_LIST, G_STMT, G_IF_STMT, G_ELSE_OPT, G_DO_WHILE, G_PRINT, G_DECL, G_TYPE,
+    G_INIT_DECL, G_INIT_TAIL, G_ASSIGN, G_FOR, G_FOR_INIT, G_UPDATE, G_EXPR, G_EQ, G_EQ_TAIL, G_REL,
+    G_REL_TAIL, G_ADD, G_ADD_TAIL, G_MUL, G_MUL_TAIL, G_PRIM, G_COUNT
+} GrammarSymbol;
+
+typedef enum {
+    GI_PROD, GI_TERM, GI_NONTERM, GI_ACTION
+} GrammarItemType;
+
+typedef enum {
+    A_ENTER, A_EXIT, A_EV_LEAF, A_LEAF, A_NONE, A_BUILD, A_BLOCK, A_DECLARED, A_PEEK_ASSIGN,
+    A_DECL_LINE, A_ADD_SYMBOL, A_EXPR_BEGIN, A_EXPR_END, A_LIST_BEGIN, A_LIST_END, A_STMT_BEGIN,
+    A_STMT_END, A_ELSE_BEGIN, A_ELSE_END
+} GrammarAction;
+
+typedef struct {
+    uint8_t type;        // GrammarItemType
+    uint8_t arg;         // Left-hand side, token, nonterminal or action
+    uint8_t kind;        // Node kind of an action; default flag of a production; error style of a token
+    uint8_t count;       // Children to build, or the value slot an action works on
+    const char *message; // Reported when a token does not match
+} GrammarItem;
+
+// Where a failed statement or else branch resumes
+typedef struct {
+    int type;  // A_LIST_BEGIN, A_STMT_BEGIN or A_ELSE_BEGIN
+    int failed;
+    int count; // Statements collected by a list
+    int ev_base;
+    uint32_t values;
+    uint32_t node_mark;
+    uint32_t child_mark;
+} LLFrame;
+
+typedef struct {
+    uint16_t *items; // Parse stack of grammar[] indices
+    uint32_t item_count;
+    uint32_t item_capacity;
+    NodeId *values;  // Nodes built so far
+    uint32_t value_count;
+    uint32_t value_capacity;
+    LLFrame *frames;
+    uint32_t frame_count;
+    uint32_t frame_capacity;
+    int decl_line;
+    uint32_t expr_node_mark;
+    uint32_t expr_child_mark;
+} LLState;
+
 typedef struct {
     char *name;
     char *type; // "int" or "bool"
     int line;
+    char *module; // Module that declares it, NULL for the program's own
 } Symbol;
 
 typedef struct {
@@ -51,184 +236,1282 @@ typedef struct {
     int count;
 } SymbolTable;
 
-TokenList token_list;
-SymbolTable symbol_table;
-Token current_token;
-FILE *file;
-int line = 1;
-Error errors[MAX_ERRORS];
-int error_count = 0;
-int token_index = -1;
-int last_error_line = 0; // Track the line of the last error
+// Precompiled module (name.upls next to name.upl): the header, then the
+// sources it was built from (the module first, then what it imports), its
+// symbols, its tree nodes, their child ids and a string table. Symbol i is
+// declared by the i-th declaration and names the source declaring it, so an
+// import can leave out modules that are already in. Tree nodes
+// are AstNodes whose token is a string offset for names, literals and types;
+// children come before their parents and the last node is the Stmts list of
+// the module's declarations. All counts are checked against the file size,
+// so a snapshot is mapped and used in place.
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    uint32_t source_count;
+    uint32_t symbol_count;
+    uint32_t node_count; // Node 0 is unused
+    uint32_t child_count;
+    uint32_t string_bytes;
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t hash; // Of the module source text
+    uint64_t size;
+    uint32_t name;
+    uint32_t reserved;
+} SnapshotSource;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;   // NK_TYPE_INT or NK_TYPE_BOOL
+    uint32_t source; // Index of the source that declares it
+} SnapshotSymbol;
+
+// A snapshot in use: a mapped file, or a heap buffer when the file could
+// not be written
+typedef struct {
+    char *data;
+    size_t size;
+    int mapped;
+    int line; // Of the import directive
+    const SnapshotHeader *header;
+    const SnapshotSource *sources;
+    const SnapshotSymbol *symbols;
+    const AstNode *nodes;
+    const NodeId *children;
+    const char *strings;
+    uint8_t *skip; // Per declaration: its module was already imported
+} Snapshot;
+
+// A module source an import was built from, to go into the snapshot of
+// the program being parsed
+typedef struct {
+    char name[MAX_TOKEN_LEN];
+    uint64_t hash;
+    uint64_t size;
+} ModuleSource;
+
+// Modules being compiled, innermost first, to catch import cycles
+typedef struct ImportChain {
+    const char *name;
+    const struct ImportChain *parent;
+} ImportChain;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for nodes and strings; blocks are kept when rewound
+typedef struct {
+    ArenaBlock *head;
+    ArenaBlock *current;
+    size_t bytes; // Handed out since the last rewind
+} Arena;
+
+// Profile counters for one source line
+typedef struct {
+    uint64_t lex_ns;
+    uint64_t parse_ns;
+    uint32_t tokens;
+    uint32_t nodes;
+    uint32_t probes;      // is_variable_declared calls
+    uint32_t probe_steps; // Symbols compared by those calls
+    uint32_t syncs;       // skip_to_sync jumps
+    uint32_t sync_tokens; // Tokens skipped by them
+} LineProfile;
+
+// One node of the tree of open-construct stacks, for folded output
+typedef struct {
+    int parent;
+    int first_child;
+    int next_sibling;
+    NodeKind kind;
+    uint64_t parse_ns; // Time with this stack innermost
+    uint32_t nodes;
+    uint32_t probes;
+    uint32_t sync_tokens;
+} ProfileFrame;
+
+typedef struct {
+    LineProfile *lines;
+    int line_capacity;
+    ProfileFrame *frames;
+    int frame_count;
+    int frame_capacity;
+    int current;      // Innermost open construct
+    uint64_t last_ns; // End of the last attributed interval
+} Profile;
+
+// Parse mode bits of a capture record
+#define CAPTURE_EVENTS 0x1
+#define CAPTURE_LL1 0x2
+#define CAPTURE_PIPELINED 0x4 // Lexing overlapped parsing, so no lex time is recorded
+#define CAPTURE_LAZY 0x8
+#define CAPTURE_HASH_CONS 0x10
+
+// Log file shared by capturing parsers. Each record is the monotonic clock
+// at the start of the parse, mode bits, exit status, lex and parse times and
+// input length, all varints but the two bytes, then the input bytes.
+struct CaptureLog {
+    FILE *file;
+    pthread_mutex_t lock;
+};
+
+// One parse read back from a capture log; src points into the mapped log
+typedef struct {
+    const char *src;
+    size_t len;
+    uint64_t start_ns; // Monotonic clock
+    uint64_t lex_ns;
+    uint64_t parse_ns;
+    uint8_t flags;
+    uint8_t status;
+} CaptureRecord;
+
+// Log-linear latency histogram in nanoseconds, HDR style: each power of two
+// is split into 2^HIST_SUB_BITS buckets
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} Histogram;
+
+// Shared expression nodes by structure, open addressing over node ids
+typedef struct {
+    NodeId *slots;     // NO_NODE marks a free slot
+    uint32_t capacity; // Power of two
+    uint32_t count;
+    uint32_t *uses;    // Per shared node: occurrences built
+    uint32_t uses_capacity;
+    HashConsStats stats;
+} InternTable;
+
+// Block body skimmed by a lazy parse, with the state its parse will need
+typedef struct {
+    NodeId node;         // NK_LAZY_STMTS placeholder, rewritten when forced
+    int lbrace;          // Token index of the '{'
+    int symbols;         // Symbols declared before the block
+    int last_error_line;
+} LazyBlock;
+
+struct Parser {
+    TokenList token_list;
+    SymbolTable symbol_table;
+    Arena arena;
+    Ast ast;
+    ParserEngine engine;
+    int hash_cons;             // Share identical expression subtrees
+    InternTable intern;
+    LLState ll;                // LL(1) engine stacks, kept between parses
+    const ParseEvents *events; // Set while parsing in event mode
+    NodeKind *ev_stack;        // Kinds of the open enter events
+    int ev_depth;
+    int ev_capacity;
+    Token current_token;
+    const char *src;
+    size_t src_len;
+    size_t src_pos;
+    int line;
+    Error errors[MAX_ERRORS];
+    int error_count;
+    int token_index;
+    int last_error_line; // Track the line of the last error
+    int synced;          // Set after a resync until the next token is consumed
+    Profile *profile;    // Set by upl --profile; NULL otherwise
+    CaptureLog *capture; // Every parse is appended here when set
+    int timed;           // Keep the lex and parse times of each parse
+    uint64_t lex_ns;
+    uint64_t parse_ns;
+    int pipelined;       // Lex on a second thread while building trees
+    TokenRing *ring;     // Kept between pipelined parses
+    TokenRing *ring_in;  // Set while a pipelined parse still expects tokens
+    TokenRing *ring_out; // Set on the lexer side: add_token publishes here
+    Parser *lexer;       // Lexer state for the second thread
+    pthread_t lexer_thread;
+    ParseLimits limits;
+    int limited;          // Some limit or a cancel flag is set
+    ParseLimit limit_hit; // Limit that stopped this parse
+    uint64_t deadline_ns;
+    uint32_t poll_count;  // Limit checks, for spacing out clock reads
+    int lazy;             // Skim declaration-free block bodies
+    LazyBlock *lazy_blocks;
+    int lazy_count;
+    int lazy_capacity;
+    int lazy_diverged;    // A forced body could have changed what followed it
+    ParseResult result;   // Of the last parse, for parser_force_all
+    char *module_dir;     // Where imports are looked up; NULL for the current directory
+    ModuleAccess module_access;
+    const ImportChain *chain;
+    Snapshot *imports;    // Modules imported by this parse, until it ends
+    int import_count;
+    int import_capacity;
+    int imports_emitted;  // Their declarations were sent as events
+    ModuleSource *import_sources;
+    int import_source_count;
+    int import_source_capacity;
+};
+
+typedef struct {
+    NodeId *items;
+    int count;
+    int capacity;
+} NodeList;
+
+// Nodes on the way down a tree, each with the index of the next child to
+// visit, for walks that finish a node after its children
+typedef struct {
+    NodeId id;
+    int child;
+} WalkFrame;
+
+typedef struct {
+    WalkFrame *items;
+    int count;
+    int capacity;
+} WalkStack;
+
+#define VAR_WORDS ((MAX_SYMBOLS + 63) / 64)
+
+// One bit per symbol table index
+typedef struct {
+    uint64_t bits[VAR_WORDS];
+} VarSet;
+
+// Variables a subtree assigns or declares, counted up to two
+typedef struct {
+    VarSet once;
+    VarSet twice;
+    int declares;
+} LoopEffects;
+
+typedef struct {
+    Parser *p;
+    FILE *report;
+    int temp_count;
+    int changed;
+    int *optimized; // Per node: 1 + index into effects of a loop already optimized
+    int optimized_count;
+    LoopEffects *effects;
+    int effects_count;
+    int effects_capacity;
+    NodeList stack;
+} LoopPass;
+
+// A statement list being rewritten by the loop pass
+typedef struct {
+    NodeId stmts;
+    int index; // Statement being rewritten
+    int phase; // Statement lists inside it already rewritten
+    NodeList out;
+    int changed;
+} LoopFrame;
+
+// A node searched for invariant expressions; a copy of a shared node is
+// kept only if something below it was hoisted
+typedef struct {
+    NodeId id;
+    int child; // Next slot to search
+    int end;
+    int copied;
+    int hoisted; // Count when the node was reached
+} HoistFrame;
+
+// An integer expression as a * var + b; constant if it reads no variable
+typedef struct {
+    int constant;
+    long long a;
+    long long b;
+} Affine;
+
+// An operator on the way down an expression, with its first operand's form
+typedef struct {
+    NodeId id;
+    int child;
+    Affine first;
+} AffineFrame;
+
+// var takes start, start + step, ... ; trips is the number of body runs
+typedef struct {
+    const char *var;
+    long long start;
+    long long step;
+    NodeId update; // Update node of a for loop, stepping statement of a do-while
+    int has_trips;
+    long long trips;
+} Induction;
+
+// A statement, a loop or if test, or a for header store
+typedef struct {
+    NodeId node;
+    NodeId expr;       // Expression read here, if any
+    int succ[2];       // Successor nodes, -1 if absent
+    int var;           // Symbol stored here, or -1
+    VarSet use;
+    VarSet gen_uninit; // Declared here without an initializer
+    VarSet live_in;
+    VarSet live_out;
+    VarSet uninit_in;  // Possibly uninitialized on entry
+} CfgNode;
+
+typedef struct {
+    int line;
+    int order;
+    char text[160];
+} DataflowNote;
+
+typedef struct {
+    Parser *p;
+    CfgNode *nodes;
+    int count;
+    int capacity;
+    VarSet read;    // Symbols read anywhere
+    VarSet pinned;  // Symbols stored by for headers, which always stay
+    uint8_t *drop;  // Per node: statement to remove
+    NodeList stack; // Scratch for expression walks
+    DataflowNote *notes;
+    int note_count;
+    int note_capacity;
+} Cfg;
+
+// A statement list being added to a Cfg, from its last statement back
+typedef struct {
+    NodeId stmts;
+    int index;   // Statement being added
+    int next;    // Entry of what follows it
+    int phase;   // Statement lists of that statement already added
+    int held[2]; // Its nodes added before its lists, or the then entry
+} CfgFrame;
+
+// Fuzzer input and its cost per source byte
+typedef struct {
+    char *text;
+    size_t len;
+    double ns_per_byte;
+    double mem_per_byte;
+} FuzzInput;
+
+typedef struct {
+    Parser *p;
+    uint64_t rng;      // xorshift state
+    uint8_t *features; // Coverage bitmap
+    int feature_count;
+    FuzzInput *corpus;
+    int corpus_count;
+    int seed_count;    // Leading corpus entries never replaced
+    uint64_t baseline_ns;
+    long long execs;
+    NodeList stack;    // Scratch for tree walks
+} Fuzzer;
+
+typedef enum {
+    IO_STDIO, IO_POOL, IO_URING
+} InputMode;
+
+// A file for --check-files; data is filled in by the reader and freed once
+// the parser is done with it
+typedef struct {
+    const char *path;
+    char *data;
+    size_t len;
+    int error; // errno of the failed step, 0 if loaded
+    int ready;
+} InputFile;
+
+// io_uring instance with its mapped submission and completion queues
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned queued; // Entries filled in but not yet published
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+typedef struct {
+    InputFile *files;
+    int count;
+    InputMode mode;
+    int next;     // Next file a reader thread claims
+    int consumed; // Files the parser is done with
+    _Atomic long syscalls;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Uring ring;
+    pthread_t threads[MAX_WORKERS];
+    int thread_count;
+} InputReader;
+
+typedef struct {
+    InputMode mode; // Mode actually used
+    double ms;
+    size_t bytes;
+    long syscalls; // -1 if libc made them, as in the stdio mode
+    int failed;
+    int unreadable;
+} CheckStats;
+
+// State of upl --diff; index 0 is the old program, 1 the new one
+typedef struct {
+    Parser *p[2];
+    const Ast *ast[2];
+    uint64_t *hashes[2];
+    const char *names[2];
+    FILE *out;
+    int changed;
+    int added;
+    int removed;
+    long skipped; // Subtrees found equal by hash without looking inside
+} AstDiff;
+
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} IntList;
+
+// SSA intermediate representation: basic blocks of instructions, phis
+// first, each block ending in one terminator (jmp, br or ret)
+typedef enum {
+    IR_CONST, IR_UNDEF, IR_PHI, IR_ADD, IR_MUL, IR_EQ, IR_GT, IR_GTE, IR_PRINT, IR_JMP, IR_BR, IR_RET
+} IrOp;
+
+// Values are named by instruction index. A replaced value forwards to its
+// replacement until ir_resolve rewrites the operands.
+typedef struct {
+    uint8_t op;       // IrOp
+    uint8_t type;     // NK_TYPE_INT or NK_TYPE_BOOL for values, NK_NONE otherwise
+    uint8_t dead;
+    uint8_t num_args;
+    int block;
+    int args[2];      // A phi has one operand per predecessor, in order
+    int targets[2];   // Successors of jmp and br
+    int var;          // Symbol a phi or undef stands for, or -1
+    int forward;      // Replacement value, or -1
+    long long value;  // IR_CONST
+} IrInstr;
+
+typedef struct {
+    int var;
+    int value;
+} IrDef;
+
+typedef struct {
+    IntList phis;
+    IntList code;        // The terminator last
+    int preds[2];        // Structured control flow joins at most two edges
+    int pred_count;
+    int sealed;          // All predecessors known
+    int dead;
+    IrDef *defs;         // While lowering: value of each variable stored so far
+    int def_count;
+    int def_capacity;
+    IrDef *incomplete;   // Phis placed before the block was sealed
+    int incomplete_count;
+    int incomplete_capacity;
+} IrBlock;
+
+typedef struct {
+    Parser *p;
+    IrInstr *instrs;
+    int instr_count;
+    int instr_capacity;
+    IrBlock *blocks;     // b0 is the entry
+    int block_count;
+    int block_capacity;
+    int current;         // Block being filled while lowering
+    int failed;
+} Ir;
+
+// A statement list being lowered into an Ir
+typedef struct {
+    NodeId stmts;
+    int index;     // Statement being lowered
+    int phase;     // Statement lists of that statement already lowered
+    int blocks[3]; // Blocks it made before its lists, to finish it with
+} IrFrame;
+
+// A read waiting on the predecessors of a block: for a phi, one operand
+// per predecessor; otherwise, the value of the single predecessor
+typedef struct {
+    int block; // Block to store the value in, or -1
+    int phi;   // Or -1
+    int arg;   // Operands found so far
+    int args[2];
+} IrReadFrame;
+
+// Dominator tree of the reachable blocks
+typedef struct {
+    int *order;       // Reverse postorder
+    int count;
+    int *rpo_index;   // -1 if unreachable
+    int *idom;
+    int *pre;         // Tree preorder and postorder numbers
+    int *post;
+    int *child_start; // Children of b: children[child_start[b] .. child_start[b + 1] - 1]
+    int *children;
+} IrDom;
+
+// SCCP lattice: not known yet, one constant, or overdefined
+enum { SCCP_UNKNOWN, SCCP_CONSTANT, SCCP_OVERDEFINED };
+
+typedef struct {
+    Ir *ir;
+    uint8_t *state;      // Per value
+    long long *value;
+    uint8_t *block_exec;
+    uint8_t *edge_exec;  // Per block and predecessor index
+    int *use_start;
+    int *uses;
+    IntList flow;        // Edges found executable, as block * 2 + predecessor index
+    IntList work;        // Values whose operands changed
+} IrSccp;
+
+// Pass manager (upl --passes=...). Stages and analyses stay valid until a
+// transform changes the tree; checks, transforms and output run each time.
+// IR passes rewrite the SSA form, which is itself an analysis of the tree.
+typedef enum {
+    PASS_STAGE, PASS_ANALYSIS, PASS_CHECK, PASS_TRANSFORM, PASS_IR, PASS_OUTPUT
+} PassKind;
+
+typedef enum {
+    PASS_LEX, PASS_PARSE, PASS_SYMBOLS, PASS_TYPES, PASS_CFG, PASS_CHECK_TYPES, PASS_UNINIT,
+    PASS_FOLD, PASS_LOOPS, PASS_DSE, PASS_PRINT, PASS_SSA, PASS_SCCP, PASS_GVN, PASS_DCE,
+    PASS_VERIFY_IR, PASS_PRINT_IR, PASS_COUNT
+} PassId;
+
+#define PASS_BIT(id) (1u << (id))
+
+typedef struct PassManager PassManager;
+
+typedef struct {
+    const char *name;
+    PassKind kind;
+    uint32_t requires;           // PASS_BIT set of passes to run first
+    int (*run)(PassManager *pm); // Returns the number of changes made
+} PassInfo;
+
+// A declared variable and its uses in the current tree
+typedef struct {
+    NodeKind type; // NK_TYPE_INT or NK_TYPE_BOOL
+    NodeId decl;   // Its InitDecl, or NO_NODE if a pass removed it
+    int reads;
+    int writes;
+} SymbolInfo;
+
+typedef struct {
+    uint64_t ns;
+    long tree_bytes; // Change in token, tree and arena bytes
+    long heap_bytes; // Change in heap in use
+    int runs;
+    int reused;      // Requests served by a still valid result
+    int changes;
+} PassStats;
+
+struct PassManager {
+    Parser *p;
+    const char *src;
+    size_t len;
+    FILE *out;
+    ParseResult result;
+    uint32_t valid;   // Stages and analyses whose results are current
+    uint32_t skipped; // Passes already reported as skipped
+    SymbolInfo *symbols; // By symbol table index
+    int symbol_count;
+    uint8_t *types;      // Per node: NK_TYPE_INT, NK_TYPE_BOOL or NK_NONE
+    Cfg cfg;
+    NodeList stack;      // Scratch for tree walks
+    DataflowNote *notes;
+    int note_count;
+    int note_capacity;
+    int folds;
+    Ir ir;
+    int ir_errors;       // Found by the verify pass
+    PassStats stats[PASS_COUNT];
+};
+
+// A statement list being folded, with the statements kept so far
+typedef struct {
+    NodeId stmts;
+    int index; // Statement being folded
+    int phase; // Statement lists of that statement already folded
+    NodeList out;
+    int spliced;
+} FoldFrame;
 
 // Function prototypes
-void init_token_list(void);
-void free_token_list(void);
-void add_token(TokenType type, const char *text, int line);
-void next_token(void);
-void tokenize_file(void);
-void add_error(int line, const char *format, ...);
-void print_errors(void);
-Node* make_node(const char *label, int num_children, ...);
-void free_tree(Node *node);
-void print_tree(Node *node, int depth);
-Node* parse_prog(void);
-Node* parse_stmts(void);
-Node* parse_stmt(void);
-Node* parse_if_stmt(void);
-Node* parse_if_then(void);
-Node* parse_else_opt(void);
-Node* parse_do_while_stmt(void);
-Node* parse_print_stmt(void);
-Node* parse_decl_stmt(void);
-Node* parse_type(void);
-Node* parse_init_decl(int *line, const char *type);
-Node* parse_assign_stmt(void);
-Node* parse_for_stmt(void);
-Node* parse_expr(void);
-Node* parse_eq_expr(void);
-Node* parse_rel_expr(void);
-Node* parse_add_expr(void);
-Node* parse_mul_expr(void);
-Node* parse_prim_expr(void);
-Node* parse_lit(void);
-void skip_to_sync(void);
-void init_symbol_table(void);
-void free_symbol_table(void);
-void add_symbol(const char *name, const char *type, int line);
-int is_variable_declared(const char *name);
+void* arena_alloc(Arena *arena, size_t size);
+char* arena_strdup(Arena *arena, const char *s);
+void arena_rewind(Arena *arena);
+void arena_free(Arena *arena);
+void init_token_list(Parser *p);
+void free_token_list(Parser *p);
+void add_token(Parser *p, TokenType type, const char *text, int line);
+void index_token(TokenList *list, int index);
+void ring_wait(int *spins);
+int ring_push(TokenRing *ring, TokenType type, const char *text, int line);
+void pull_tokens(Parser *p, int count);
+void* lexer_thread_main(void *arg);
+int pipeline_start(Parser *p);
+int pipeline_finish(Parser *p);
+void next_token(Parser *p);
+int lex_getc(Parser *p);
+void lex_ungetc(Parser *p, int c);
+void tokenize_file(Parser *p);
+void add_error(Parser *p, int line, const char *format, ...);
+size_t parser_memory(const Parser *p);
+int governor_stop(Parser *p, ParseLimit limit, int line);
+int governor_check(Parser *p);
+void governor_token(Parser *p);
+int limit_option(int argc, char *argv[], int *i, ParseLimits *limits);
+ParseResult parse_result(Parser *p, NodeId root, int keep_tree);
+void vadd_error(Parser *p, int line, const char *format, va_list args);
+void syntax_error(Parser *p, const char *format, ...);
+int error_is_reported(const Error *errors, int i);
+const char* token_text(Parser *p, int index);
+void init_ast(Parser *p);
+void free_ast(Parser *p);
+NodeId new_node(Parser *p, NodeKind kind, int num_children, int token);
+NodeId make_node(Parser *p, NodeKind kind, int num_children, ...);
+NodeId make_node_list(Parser *p, NodeKind kind, const NodeId *children, int num_children);
+void set_anchor_token(Parser *p, NodeId id);
+NodeId make_leaf(Parser *p, NodeKind kind, int token);
+int is_pure_expr(NodeKind kind);
+int is_operator(NodeKind kind);
+uint32_t node_hash(const Ast *ast, NodeId id);
+int node_equal(const Ast *ast, NodeId a, NodeId b);
+void intern_insert(InternTable *table, const Ast *ast, NodeId id);
+void intern_grow(InternTable *table, const Ast *ast);
+NodeId intern_node(Parser *p, NodeId id);
+NodeId copy_node(Parser *p, NodeId id);
+int kind_has_text(NodeKind kind);
+void ev_enter(Parser *p, NodeKind kind, int line);
+void ev_leaf(Parser *p, NodeKind kind, int token);
+void ev_exit(Parser *p);
+void ev_unwind(Parser *p, int depth);
+int json_main(int argc, char *argv[]);
+NodeId parse_prog(Parser *p);
+NodeId parse_stmts(Parser *p);
+NodeId parse_stmt(Parser *p);
+NodeId parse_block_stmts(Parser *p);
+NodeId parser_force(Parser *p, NodeId id);
+NodeId parse_if_stmt(Parser *p);
+NodeId parse_if_then(Parser *p);
+NodeId parse_else_opt(Parser *p);
+NodeId parse_do_while_stmt(Parser *p);
+NodeId parse_print_stmt(Parser *p);
+NodeId parse_decl_stmt(Parser *p);
+NodeId parse_type(Parser *p);
+NodeId parse_init_decl(Parser *p, int *line, const char *type);
+NodeId parse_assign_stmt(Parser *p);
+NodeId parse_for_stmt(Parser *p);
+NodeId parse_expr(Parser *p);
+NodeId parse_eq_expr(Parser *p);
+NodeId parse_rel_expr(Parser *p);
+NodeId parse_add_expr(Parser *p);
+NodeId parse_mul_expr(Parser *p);
+NodeId parse_prim_expr(Parser *p);
+NodeId parse_lit(Parser *p);
+int ll1_first(uint32_t start, uint32_t end, const TokenSet *first, const int *nullable, TokenSet *set);
+void ll1_build_table(void);
+void ll1_push_value(LLState *s, NodeId value);
+LLFrame* ll1_push_frame(LLState *s, int type);
+int ll1_expand(Parser *p, int nt);
+int ll1_action(Parser *p, const GrammarItem *item);
+int ll1_recover(Parser *p);
+NodeId ll1_parse(Parser *p);
+void skip_to_sync(Parser *p);
+int next_boundary(const TokenList *list, int index);
+void init_symbol_table(Parser *p);
+void free_symbol_table(Parser *p);
+void add_symbol(Parser *p, const char *name, const char *type, int line);
+int is_variable_declared(Parser *p, const char *name);
+void node_list_push(NodeList *list, NodeId id);
+void walk_push(WalkStack *stack, NodeId id);
+int synth_token(Parser *p, TokenType type, const char *text, int line);
+int node_line(Parser *p, NodeId id);
+NodeId make_num(Parser *p, long long value, int line);
+void set_children(Parser *p, NodeId id, const NodeId *children, int num_children);
+NodeId clone_tree(Parser *p, NodeId id);
+int is_var(const Ast *ast, NodeId id, const char *name);
+int affine_combine(NodeKind kind, const Affine *x, Affine *y);
+int affine_form(const Ast *ast, NodeId expr, const char *var, Affine *form);
+int eval_int(const Ast *ast, NodeId id, long long *value);
+void effects_add(LoopEffects *e, int var);
+const LoopEffects* optimized_loop(LoopPass *lp, NodeId id);
+void remember_loop(LoopPass *lp, NodeId loop, const LoopEffects *e);
+void loop_effects(LoopPass *lp, NodeId id, LoopEffects *e);
+int count_assigns(LoopPass *lp, NodeId id, const char *name);
+int declares_vars(LoopPass *lp, NodeId id);
+int is_invariant(LoopPass *lp, NodeId expr, const LoopEffects *loop, int *reads);
+int affine_in(const Ast *ast, NodeId expr, const char *var, long long *a, long long *b);
+int induction_step(const Ast *ast, NodeId stmt, const char **var, long long *step);
+int trip_count(const Ast *ast, NodeId cond, Induction *ind, int first_test);
+int analyze_for(LoopPass *lp, NodeId loop, Induction *ind);
+int analyze_do_while(LoopPass *lp, NodeId stmts, int index, Induction *ind);
+NodeId init_stmt(Parser *p, NodeId init);
+int closed_form(LoopPass *lp, NodeId loop, const Induction *ind, NodeList *out);
+int unroll(LoopPass *lp, NodeId loop, const Induction *ind, NodeList *out);
+int hoist_expr(LoopPass *lp, const LoopEffects *loop, NodeId parent, int slot, NodeList *out);
+int hoist_slot(LoopPass *lp, const LoopEffects *loop, NodeId parent, int slot, NodeList *out);
+int hoist_invariants(LoopPass *lp, const LoopEffects *loop, NodeId id, NodeList *out);
+void optimize_loop(LoopPass *lp, NodeId stmts, int index, NodeList *out);
+int nested_stmts(const Ast *ast, NodeId id, NodeId lists[2]);
+NodeId optimize_stmt(LoopPass *lp, LoopFrame *f);
+void optimize_stmts(LoopPass *lp, NodeId stmts);
+void var_add(VarSet *set, int var);
+int var_has(const VarSet *set, int var);
+int symbol_index(Parser *p, const char *name);
+void collect_reads(Cfg *g, NodeId expr, VarSet *set);
+int cfg_add(Cfg *g, NodeId node, NodeId expr, int next);
+int cfg_store(Cfg *g, NodeId node, NodeId name, NodeId expr, int next);
+int cfg_decl(Cfg *g, NodeId node, NodeId init_decl, int next);
+NodeId cfg_stmt(Cfg *g, CfgFrame *f, int entry, int *list_next);
+int cfg_stmts(Cfg *g, NodeId stmts, int next);
+void solve_liveness(Cfg *g);
+void solve_uninit(Cfg *g);
+void dataflow_note(Cfg *g, int line, const char *format, ...);
+int compare_notes(const void *a, const void *b);
+void warn_uninit(Cfg *g);
+int find_dead_stores(Cfg *g);
+void drop_stmts(Cfg *g, NodeId id);
+void print_hash_cons_stats(FILE *out, const Parser *p);
+int alloc_main(int argc, char *argv[]);
+uint64_t fuzz_rand(Fuzzer *f);
+int fuzz_below(Fuzzer *f, int n);
+int fuzz_feature(Fuzzer *f, uint32_t hash);
+int log2_bucket(uint64_t n);
+int fuzz_coverage(Fuzzer *f, const ParseResult *result);
+int fuzz_measure(Fuzzer *f, FuzzInput *input, int runs);
+void fuzz_expr(Fuzzer *f, char *out, size_t cap, int depth);
+void fuzz_snippet(Fuzzer *f, char *out, size_t cap);
+void fuzz_mutate(Fuzzer *f, char *buf, size_t *len);
+void fuzz_add(Fuzzer *f, const FuzzInput *input);
+double fuzz_score(const FuzzInput *input, int by_memory);
+void fuzz_minimize(Fuzzer *f, FuzzInput *input, int by_memory);
+void fuzz_save(const char *dir, const char *kind, const FuzzInput *input);
+int fuzz_main(int argc, char *argv[]);
+int fuzz_regress_main(int argc, char *argv[]);
+long uring_enter(Uring *ring, unsigned submit, unsigned wait);
+int uring_init(Uring *ring, unsigned entries);
+void uring_free(Uring *ring);
+struct io_uring_sqe* uring_sqe(Uring *ring, uint8_t opcode, uint64_t user_data);
+int uring_submit(Uring *ring, unsigned wait);
+int uring_reap(Uring *ring, uint64_t *user_data);
+void read_rest(InputReader *r, InputFile *file, int fd, size_t capacity);
+void load_file_pread(InputReader *r, InputFile *file);
+void* pool_reader_main(void *arg);
+void uring_load_batch(InputReader *r, int first, int n);
+void* uring_reader_main(void *arg);
+const char* input_mode_name(InputMode mode);
+void input_reader_start(InputReader *r, InputFile *files, int count, InputMode mode, int threads);
+InputFile* input_reader_wait(InputReader *r, int i);
+void input_reader_release(InputReader *r, int i);
+void input_reader_finish(InputReader *r);
+int check_files(Parser *p, InputFile *files, int count, InputMode mode, int threads, int report, CheckStats *stats);
+void print_check_stats(int count, const CheckStats *stats);
+int check_files_main(int argc, char *argv[]);
+uint64_t diff_hash(const AstDiff *d, int side, NodeId id);
+const char* stmt_name(const Ast *ast, NodeId stmt);
+void diff_report(AstDiff *d, const char *what, NodeId x, NodeId y);
+int header_differs(AstDiff *d, NodeId x, NodeId y);
+void diff_lists(AstDiff *d, NodeId x, NodeId y);
+void diff_stmt(AstDiff *d, NodeId x, NodeId y);
+void diff_run(AstDiff *d, const NodeId *removed, int removed_count, const NodeId *added, int added_count);
+void diff_stmts(AstDiff *d, NodeId x, NodeId y);
+int diff_main(int argc, char *argv[]);
+void int_list_push(IntList *list, int value);
+void ir_def_push(IrDef **items, int *count, int *capacity, int var, int value);
+int ir_arity(IrOp op);
+int ir_instr(Ir *ir, IrOp op, NodeKind type, int a, int b);
+int ir_emit(Ir *ir, IrOp op, NodeKind type, int a, int b);
+int ir_const(Ir *ir, NodeKind type, long long value);
+int ir_new_block(Ir *ir);
+void ir_jump(Ir *ir, int target);
+void ir_branch(Ir *ir, int cond, int then_block, int else_block);
+NodeKind ir_var_type(Ir *ir, int var);
+void ir_write(Ir *ir, int block, int var, int value);
+int ir_new_phi(Ir *ir, int block, int var);
+int ir_read_from(Ir *ir, int block, int var, int phi);
+int ir_read(Ir *ir, int block, int var);
+void ir_phi_operands(Ir *ir, int phi);
+void ir_seal(Ir *ir, int block);
+int ir_find(Ir *ir, int value);
+int ir_lower_expr(Ir *ir, NodeId id);
+void ir_lower_store(Ir *ir, NodeId name, NodeId value);
+void ir_lower_init_decl(Ir *ir, NodeId init_decl);
+NodeId ir_lower_stmt(Ir *ir, IrFrame *f);
+void ir_lower_stmts(Ir *ir, NodeId stmts);
+int ir_trivial_phi(Ir *ir, int phi);
+int ir_remove_trivial_phis(Ir *ir);
+void ir_resolve(Ir *ir);
+void ir_free(Ir *ir);
+int ir_build(Ir *ir, Parser *p, NodeId root);
+void ir_size(const Ir *ir, int *blocks, int *instrs, int *phis);
+int ir_succs(const Ir *ir, int block, int *succs);
+void ir_remove_pred(Ir *ir, int block, int pred);
+int ir_dom_eval(int v, int *ancestor, int *label, const int *semi, IntList *path);
+void ir_dominators(const Ir *ir, IrDom *dom);
+int ir_dominates(const IrDom *dom, int a, int b);
+void ir_dom_free(IrDom *dom);
+void ir_users(const Ir *ir, int **start, int **uses);
+void sccp_mark_edge(IrSccp *s, int from, int to);
+void sccp_set(IrSccp *s, int i, int state, long long value);
+void sccp_visit(IrSccp *s, int i);
+void sccp_visit_block(IrSccp *s, int b, int phis_only);
+int ir_sccp(Ir *ir);
+int ir_commutes(IrOp op);
+uint32_t ir_value_hash(Ir *ir, int i);
+int ir_same_value(Ir *ir, int i, int j);
+int ir_gvn(Ir *ir);
+int ir_dce(Ir *ir);
+void ir_error(FILE *out, int *errors, const char *format, ...);
+int ir_verify(Ir *ir, FILE *out);
+void ir_print(FILE *out, const Ir *ir);
+size_t heap_in_use(void);
+void pass_note(PassManager *pm, int line, const char *format, ...);
+void flush_notes(PassManager *pm, DataflowNote *notes, int *count);
+int pass_lex(PassManager *pm);
+int pass_parse(PassManager *pm);
+int pass_symbols(PassManager *pm);
+NodeKind expr_type(PassManager *pm, NodeId id);
+int pass_types(PassManager *pm);
+int pass_cfg(PassManager *pm);
+void check_store(PassManager *pm, NodeId name, NodeId value);
+void check_cond(PassManager *pm, NodeId cond, const char *what);
+void check_operands(PassManager *pm, NodeId id);
+int pass_check_types(PassManager *pm);
+int pass_uninit(PassManager *pm);
+NodeId make_bool(Parser *p, int value, int line);
+int is_int_expr(Parser *p, NodeId id);
+int declares_any(PassManager *pm, NodeId id);
+NodeId fold_node(PassManager *pm, NodeId id);
+NodeId fold_expr(PassManager *pm, NodeId id);
+void fold_slot(PassManager *pm, NodeId parent, int slot);
+NodeId fold_stmt(PassManager *pm, FoldFrame *f);
+void fold_stmts(PassManager *pm, NodeId stmts);
+int pass_fold(PassManager *pm);
+int pass_loops(PassManager *pm);
+int pass_dse(PassManager *pm);
+int pass_print(PassManager *pm);
+int pass_ssa(PassManager *pm);
+int run_ir_opt(PassManager *pm, const char *name, int (*opt)(Ir *ir));
+int pass_sccp(PassManager *pm);
+int pass_gvn(PassManager *pm);
+int pass_dce(PassManager *pm);
+int pass_verify_ir(PassManager *pm);
+int pass_print_ir(PassManager *pm);
+int find_pass(const char *name, size_t len);
+void run_pass(PassManager *pm, PassId id, int listed);
+void print_pass_stats(FILE *out, const PassManager *pm);
+int passes_main(int argc, char *argv[]);
+int run_pass_main(int argc, char *argv[], int (*pass)(Parser *p, NodeId root, FILE *report));
+int opt_loops_main(int argc, char *argv[]);
+int ast_same_shape(const Ast *a, NodeId x, const Ast *b, NodeId y);
+int max_nesting(Parser *p);
+int results_agree(const ParseResult *a, const ParseResult *b);
+int bench_main(int argc, char *argv[]);
+uint64_t now_ns(void);
+LineProfile* profile_line(Profile *prof, int line);
+void profile_lex(Parser *p, int line);
+void profile_tick(Parser *p);
+void profile_node(Parser *p);
+void profile_probe(Parser *p, int steps);
+void profile_sync(Parser *p, int skipped);
+void profile_enter(void *ctx, NodeKind kind, int line);
+void profile_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line);
+void profile_exit(void *ctx, NodeKind kind);
+void print_folded(FILE *out, const Profile *prof);
+int compare_line_cost(const void *a, const void *b, void *arg);
+int profile_main(int argc, char *argv[]);
+char* read_file(FILE *file, size_t *len);
+int read_full(int fd, void *buf, size_t len);
+int write_full(int fd, const void *buf, size_t len);
+int connect_socket(const char *path);
+double now_ms(void);
+void serve_usage(const char *program);
+int serve_main(int argc, char *argv[]);
+void client_usage(const char *program);
+int client_main(int argc, char *argv[]);
+int put_varint(uint8_t *out, uint64_t value);
+int get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value);
+void capture_record(Parser *p, int events, uint64_t start, uint64_t lexed, uint64_t end, int status);
+CaptureRecord* capture_load(const char *path, int *count, void **map, size_t *map_len);
+int hist_index(uint64_t value);
+uint64_t hist_bucket_max(int index);
+void hist_add(Histogram *h, uint64_t value);
+void hist_merge(Histogram *into, const Histogram *from);
+uint64_t hist_percentile(const Histogram *h, double q);
+void print_hist_row(FILE *out, const char *name, const Histogram *h);
+void replay_enter(void *ctx, NodeKind kind, int line);
+void replay_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line);
+void replay_exit(void *ctx, NodeKind kind);
+void replay_usage(const char *program);
+int replay_main(int argc, char *argv[]);
+int module_name_ok(const char *name);
+void module_path(const Parser *p, const char *name, const char *ext, char *out);
+uint64_t content_hash(const char *data, size_t len);
+int snapshot_view(Snapshot *s, char *data, size_t size, int mapped);
+int snapshot_text_ok(NodeKind kind, const char *text);
+// Nodes must form declarations as the parser builds them, which is all the
+// passes expect; the last node is the list of them
+int snapshot_shape_ok(const Snapshot *s, NodeId id, int last);
+int snapshot_open(Snapshot *s, const char *path);
+void snapshot_close(Snapshot *s);
+int snapshot_fresh(const Parser *p, const Snapshot *s);
+char* snapshot_build(Parser *m, NodeId root, const char *name, uint64_t hash, uint64_t size, size_t *out_size);
+int snapshot_write(const Parser *p, const char *name, const char *data, size_t size);
+char* module_build(Parser *m, const char *name, size_t *size, ParseResult *result);
+int module_load(Parser *p, const char *name, int line, Snapshot *s);
+void import_symbols(Parser *p, const Snapshot *s);
+int module_imported(const Parser *p, const char *name);
+void import_module(Parser *p, const char *name, int line);
+void parse_imports(Parser *p);
+void import_emit(Parser *p);
+void import_tree(Parser *p, const Snapshot *s, NodeList *decls);
+void link_imports(Parser *p, NodeId root);
+void release_imports(Parser *p);
+void set_module_dir_of(Parser *p, const char *path);
+int precompile_main(int argc, char *argv[]);
+
+// Allocate from the arena, growing it by a block when the current one is full
+void* arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->current;
+    while (block && block->used + size > block->size) {
+        block = block->next;
+        if (block) block->used = 0;
+    }
+    if (!block) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        block->size = block_size;
+        block->used = 0;
+        block->next = NULL;
+        if (arena->current) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            arena->head = block;
+        }
+    }
+    arena->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->bytes += size;
+    return ptr;
+}
+
+char* arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+// Drop all allocations but keep the blocks for the next parse
+void arena_rewind(Arena *arena) {
+    if (arena->head) arena->head->used = 0;
+    arena->current = arena->head;
+    arena->bytes = 0;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->current = NULL;
+}
 
 // Initialize token list
-void init_token_list() {
-    token_list.capacity = MAX_TOKENS;
-    token_list.count = 0;
-    token_list.tokens = malloc(sizeof(Token) * token_list.capacity);
+void init_token_list(Parser *p) {
+    p->token_list.capacity = MAX_TOKENS;
+    p->token_list.count = 0;
+    p->token_list.tokens = malloc(sizeof(Token) * p->token_list.capacity);
 }
 
 // Free token list
-void free_token_list() {
-    free(token_list.tokens);
-    token_list.count = 0;
-    token_list.capacity = 0;
+void free_token_list(Parser *p) {
+    free(p->token_list.tokens);
+    free(p->token_list.braces);
+    p->token_list.count = 0;
+    p->token_list.capacity = 0;
 }
 
 // Add token to list
-void add_token(TokenType type, const char *text, int line) {
-    if (token_list.count >= token_list.capacity) {
-        token_list.capacity *= 2;
-        token_list.tokens = realloc(token_list.tokens, sizeof(Token) * token_list.capacity);
+void add_token(Parser *p, TokenType type, const char *text, int line) {
+    if (p->ring_out) {
+        // A stopped parser no longer wants tokens; end the lexing loop
+        if (!ring_push(p->ring_out, type, text, line)) p->limit_hit = UPL_LIMIT_CANCELLED;
+        return;
+    }
+    if (p->token_list.count >= p->token_list.capacity) {
+        p->token_list.capacity *= 2;
+        p->token_list.tokens = realloc(p->token_list.tokens, sizeof(Token) * p->token_list.capacity);
+    }
+    p->token_list.tokens[p->token_list.count].type = type;
+    strncpy(p->token_list.tokens[p->token_list.count].text, text, MAX_TOKEN_LEN - 1);
+    p->token_list.tokens[p->token_list.count].text[MAX_TOKEN_LEN - 1] = '\0';
+    p->token_list.tokens[p->token_list.count].line = line;
+    p->token_list.tokens[p->token_list.count].next_line = -1;
+    p->token_list.tokens[p->token_list.count].next_sync = -1;
+    index_token(&p->token_list, p->token_list.count);
+    p->token_list.count++;
+    if (p->profile) profile_lex(p, line);
+    if (p->limited) governor_token(p);
+}
+
+// Fill in the line and statement jump targets that this token resolves
+void index_token(TokenList *list, int index) {
+    Token *tokens = list->tokens;
+    tokens[index].depth = list->brace_count;
+    tokens[index].enclosing = list->brace_count > 0 ? list->braces[list->brace_count - 1] : -1;
+    tokens[index].match = -1;
+    tokens[index].decls = list->decl_count;
+    if (tokens[index].type == TOK_INT || tokens[index].type == TOK_BOOL) list->decl_count++;
+    if (tokens[index].type == TOK_LBRACE) {
+        if (list->brace_count >= list->brace_capacity) {
+            list->brace_capacity = list->brace_capacity ? list->brace_capacity * 2 : 64;
+            list->braces = realloc(list->braces, sizeof(int) * list->brace_capacity);
+        }
+        list->braces[list->brace_count++] = index;
+    } else if (tokens[index].type == TOK_RBRACE && list->brace_count > 0) {
+        tokens[list->braces[--list->brace_count]].match = index;
+    } else if (tokens[index].type == TOK_LPAREN) {
+        list->paren_count++;
+    } else if (tokens[index].type == TOK_RPAREN && list->paren_count > 0) {
+        list->paren_count--;
+    }
+    if (index > 0 && tokens[index - 1].line != tokens[index].line) {
+        for (int i = list->line_pending; i < index; i++) tokens[i].next_line = index;
+        list->line_pending = index;
     }
-    token_list.tokens[token_list.count].type = type;
-    strncpy(token_list.tokens[token_list.count].text, text, MAX_TOKEN_LEN - 1);
-    token_list.tokens[token_list.count].text[MAX_TOKEN_LEN - 1] = '\0';
-    token_list.tokens[token_list.count].line = line;
-    token_list.count++;
+    if ((SYNC_STOP_SET & TOKEN_BIT(tokens[index].type)) || (index > 0 && tokens[index - 1].type == TOK_SEMICOLON)) {
+        for (int i = list->sync_pending; i <= index; i++) tokens[i].next_sync = index;
+        list->sync_pending = index + 1;
+    }
+}
+
+// Poll briefly for the other thread, then give up the core
+void ring_wait(int *spins) {
+    if (++*spins > RING_SPINS) sched_yield();
+}
+
+// Lexer side: wait for a free slot, fill it, then publish it. Returns 0
+// without pushing once the parser has stopped.
+int ring_push(TokenRing *ring, TokenType type, const char *text, int line) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int spins = 0;
+    while (head - ring->cached_tail >= RING_SIZE) {
+        if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) return 0;
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail >= RING_SIZE) ring_wait(&spins);
+    }
+    if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) return 0;
+    Token *slot = &ring->slots[head & (RING_SIZE - 1)];
+    slot->type = type;
+    strncpy(slot->text, text, MAX_TOKEN_LEN - 1);
+    slot->text[MAX_TOKEN_LEN - 1] = '\0';
+    slot->line = line;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Parser side: move published tokens into the token list until it holds
+// count tokens. Indexing happens here, so jump targets are filled in as in a
+// sequential parse. Once EOF arrives the pipeline is drained and this is a no-op.
+void pull_tokens(Parser *p, int count) {
+    TokenRing *ring = p->ring_in;
+    if (!ring) return;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int spins = 0;
+    while (p->token_list.count < count && !p->limit_hit) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            ring_wait(&spins);
+            continue;
+        }
+        int eof = 0;
+        for (; tail != head && !eof; tail++) {
+            const Token *token = &ring->slots[tail & (RING_SIZE - 1)];
+            add_token(p, token->type, token->text, token->line);
+            if (token->type == TOK_EOF) {
+                eof = 1;
+                p->line = token->line;
+            }
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (eof) {
+            p->ring_in = NULL;
+            return;
+        }
+    }
+}
+
+void* lexer_thread_main(void *arg) {
+    ALLOC_PHASE(ALLOC_LEX);
+    tokenize_file(arg);
+    return NULL;
+}
+
+// Start lexing p->src on a second thread; returns 0 if the thread could not
+// be started and the caller should tokenize in place
+int pipeline_start(Parser *p) {
+    if (!p->ring) p->ring = aligned_alloc(64, sizeof(TokenRing));
+    if (!p->lexer) p->lexer = calloc(1, sizeof(Parser));
+    if (!p->ring || !p->lexer) return 0;
+    Parser *lexer = p->lexer;
+    parser_reset(lexer);
+    lexer->src = p->src;
+    lexer->src_len = p->src_len;
+    lexer->ring_out = p->ring;
+    atomic_store_explicit(&p->ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->ring->stop, 0, memory_order_relaxed);
+    p->ring->cached_tail = 0;
+    if (pthread_create(&p->lexer_thread, NULL, lexer_thread_main, lexer) != 0) return 0;
+    p->ring_in = p->ring;
+    return 1;
+}
+
+// Take the rest of the tokens and wait for the lexer thread. Returns the
+// number of lexical errors, which the parse did not see.
+int pipeline_finish(Parser *p) {
+    pull_tokens(p, INT32_MAX);
+    p->ring_in = NULL; // Left set when a limit stopped the parse
+    pthread_join(p->lexer_thread, NULL);
+    return p->lexer->error_count;
 }
 
 // Initialize symbol table
-void init_symbol_table() {
-    symbol_table.count = 0;
-    symbol_table.symbols = malloc(sizeof(Symbol) * MAX_SYMBOLS);
+void init_symbol_table(Parser *p) {
+    p->symbol_table.count = 0;
+    p->symbol_table.symbols = malloc(sizeof(Symbol) * MAX_SYMBOLS);
 }
 
 // Free symbol table
-void free_symbol_table() {
-    for (int i = 0; i < symbol_table.count; i++) {
-        free(symbol_table.symbols[i].name);
-        free(symbol_table.symbols[i].type);
-    }
-    free(symbol_table.symbols);
+void free_symbol_table(Parser *p) {
+    free(p->symbol_table.symbols);
+    p->symbol_table.count = 0;
 }
 
 // Add symbol to table
-void add_symbol(const char *name, const char *type, int line) {
-    if (symbol_table.count >= MAX_SYMBOLS) {
-        add_error(line, "Too many variables declared");
+void add_symbol(Parser *p, const char *name, const char *type, int line) {
+    if (p->symbol_table.count >= MAX_SYMBOLS) {
+        add_error(p, line, "Too many variables declared");
         return;
     }
-    for (int i = 0; i < symbol_table.count; i++) {
-        if (strcmp(symbol_table.symbols[i].name, name) == 0) {
-            add_error(line, "Variable %s already declared", name);
+    for (int i = 0; i < p->symbol_table.count; i++) {
+        if (strcmp(p->symbol_table.symbols[i].name, name) == 0) {
+            add_error(p, line, "Variable %s already declared", name);
             return;
         }
     }
-    symbol_table.symbols[symbol_table.count].name = strdup(name);
-    symbol_table.symbols[symbol_table.count].type = strdup(type);
-    symbol_table.symbols[symbol_table.count].line = line;
-    symbol_table.count++;
+    p->symbol_table.symbols[p->symbol_table.count].name = arena_strdup(&p->arena, name);
+    p->symbol_table.symbols[p->symbol_table.count].type = arena_strdup(&p->arena, type);
+    p->symbol_table.symbols[p->symbol_table.count].line = line;
+    p->symbol_table.symbols[p->symbol_table.count].module = NULL;
+    p->symbol_table.count++;
 }
 
 // Check if variable is declared
-int is_variable_declared(const char *name) {
-    for (int i = 0; i < symbol_table.count; i++) {
-        if (strcmp(symbol_table.symbols[i].name, name) == 0) {
+int is_variable_declared(Parser *p, const char *name) {
+    for (int i = 0; i < p->symbol_table.count; i++) {
+        if (strcmp(p->symbol_table.symbols[i].name, name) == 0) {
+            if (p->profile) profile_probe(p, i + 1);
             return 1;
         }
     }
+    if (p->profile) profile_probe(p, p->symbol_table.count);
     return 0;
 }
 
-void next_token() {
-    if (token_index + 1 < token_list.count) {
-        token_index++;
-        current_token = token_list.tokens[token_index];
+void next_token(Parser *p) {
+    if (p->profile) profile_tick(p);
+    pull_tokens(p, p->token_index + 2);
+    p->synced = 0;
+    if (p->token_index + 1 < p->token_list.count && !p->limit_hit) {
+        p->token_index++;
+        p->current_token = p->token_list.tokens[p->token_index];
     } else {
-        current_token.type = TOK_EOF;
-        current_token.line = line;
-        current_token.text[0] = '\0';
+        p->current_token.type = TOK_EOF;
+        p->current_token.line = p->line;
+        p->current_token.text[0] = '\0';
     }
 }
 
-void tokenize_file() {
+// Read the next source byte, or EOF at the end of the buffer
+int lex_getc(Parser *p) {
+    if (p->src_pos >= p->src_len) return EOF;
+    return (unsigned char)p->src[p->src_pos++];
+}
+
+void lex_ungetc(Parser *p, int c) {
+    if (c != EOF) p->src_pos--;
+}
+
+void tokenize_file(Parser *p) {
     int c;
     char text[MAX_TOKEN_LEN];
-    while ((c = fgetc(file)) != EOF) {
-        if (c == '\n') { line++; continue; }
+    if (p->profile) p->profile->last_ns = now_ns();
+    while (!p->limit_hit && (c = lex_getc(p)) != EOF) {
+        if (c == '\n') { p->line++; continue; }
         if (isspace(c)) continue;
         if (c == '/') {
-            int next = fgetc(file);
+            int next = lex_getc(p);
             if (next == '/') {
-                while ((c = fgetc(file)) != '\n' && c != EOF);
-                if (c == '\n') line++;
+                while ((c = lex_getc(p)) != '\n' && c != EOF);
+                if (c == '\n') p->line++;
                 continue;
             } else if (next == '*') {
                 int prev = 0;
-                while ((c = fgetc(file)) != EOF) {
+                while ((c = lex_getc(p)) != EOF) {
                     if (prev == '*' && c == '/') break;
-                    if (c == '\n') line++;
+                    if (c == '\n') p->line++;
                     prev = c;
                 }
-                if (c == EOF) add_error(line, "Unterminated block comment");
+                if (c == EOF) add_error(p, p->line, "Unterminated block comment");
                 continue;
             } else {
-                ungetc(next, file);
+                lex_ungetc(p, next);
                 text[0] = c; text[1] = '\0';
-                add_token(TOK_ERROR, text, line);
-                add_error(line, "Unsupported operator: %c", c);
+                add_token(p, TOK_ERROR, text, p->line);
+                add_error(p, p->line, "Unsupported operator: %c", c);
                 continue;
             }
         }
         if (isalpha(c)) {
             int i = 0;
             text[i++] = c;
-            while ((c = fgetc(file)) != EOF && isalnum(c)) {
+            while ((c = lex_getc(p)) != EOF && isalnum(c)) {
                 if (i < MAX_TOKEN_LEN - 1) text[i++] = c;
             }
             text[i] = '\0';
-            ungetc(c, file);
-            if (strcmp(text, "begin") == 0) add_token(TOK_BEGIN, text, line);
-            else if (strcmp(text, "end") == 0) add_token(TOK_END, text, line);
-            else if (strcmp(text, "if") == 0) add_token(TOK_IF, text, line);
-            else if (strcmp(text, "then") == 0) add_token(TOK_THEN, text, line);
-            else if (strcmp(text, "else") == 0) add_token(TOK_ELSE, text, line);
-            else if (strcmp(text, "do") == 0) add_token(TOK_DO, text, line);
-            else if (strcmp(text, "while") == 0) add_token(TOK_WHILE, text, line);
-            else if (strcmp(text, "for") == 0) add_token(TOK_FOR, text, line);
-            else if (strcmp(text, "print") == 0) add_token(TOK_PRINT, text, line);
-            else if (strcmp(text, "int") == 0) add_token(TOK_INT, text, line);
-            else if (strcmp(text, "bool") == 0) add_token(TOK_BOOL, text, line);
-            else if (strcmp(text, "true") == 0) add_token(TOK_TRUE, text, line);
-            else if (strcmp(text, "false") == 0) add_token(TOK_FALSE, text, line);
+            lex_ungetc(p, c);
+            if (strcmp(text, "begin") == 0) add_token(p, TOK_BEGIN, text, p->line);
+            else if (strcmp(text, "end") == 0) add_token(p, TOK_END, text, p->line);
+            else if (strcmp(text, "if") == 0) add_token(p, TOK_IF, text, p->line);
+            else if (strcmp(text, "then") == 0) add_token(p, TOK_THEN, text, p->line);
+            else if (strcmp(text, "else") == 0) add_token(p, TOK_ELSE, text, p->line);
+            else if (strcmp(text, "do") == 0) add_token(p, TOK_DO, text, p->line);
+            else if (strcmp(text, "while") == 0) add_token(p, TOK_WHILE, text, p->line);
+            else if (strcmp(text, "for") == 0) add_token(p, TOK_FOR, text, p->line);
+            else if (strcmp(text, "print") == 0) add_token(p, TOK_PRINT, text, p->line);
+            else if (strcmp(text, "int") == 0) add_token(p, TOK_INT, text, p->line);
+            else if (strcmp(text, "bool") == 0) add_token(p, TOK_BOOL, text, p->line);
+            else if (strcmp(text, "true") == 0) add_token(p, TOK_TRUE, text, p->line);
+            else if (strcmp(text, "false") == 0) add_token(p, TOK_FALSE, text, p->line);
             else {
 		int valid = 1, hasNum = 0;
 		if (!text[0] || !isalpha(text[0])) valid =  0;
@@ -238,10 +1521,10 @@ void tokenize_file() {
 	         	 else if (hasNum) valid =  0;
    		 }
                 if (valid) {
-                    add_token(TOK_ID, text, line);
+                    add_token(p, TOK_ID, text, p->line);
                 } else {
-                    add_token(TOK_ERROR, text, line);
-                    add_error(line, "Invalid identifier: %s", text);
+                    add_token(p, TOK_ERROR, text, p->line);
+                    add_error(p, p->line, "Invalid identifier: %s", text);
                 }
             }
             continue;
@@ -249,910 +1532,7903 @@ void tokenize_file() {
         if (isdigit(c)) {
             int i = 0;
             text[i++] = c;
-            while ((c = fgetc(file)) != EOF && isdigit(c)) {
+            while ((c = lex_getc(p)) != EOF && isdigit(c)) {
                 if (i < MAX_TOKEN_LEN - 1) text[i++] = c;
             }
             text[i] = '\0';
-            ungetc(c, file);
-            add_token(TOK_NUM, text, line);
+            lex_ungetc(p, c);
+            add_token(p, TOK_NUM, text, p->line);
             continue;
         }
         if (c == '=') {
-            int next = fgetc(file);
+            int next = lex_getc(p);
             if (next == '=') {
                 text[0] = '='; text[1] = '='; text[2] = '\0';
-                add_token(TOK_EQ, text, line);
+                add_token(p, TOK_EQ, text, p->line);
             } else {
-                ungetc(next, file);
+                lex_ungetc(p, next);
                 text[0] = '='; text[1] = '\0';
-                add_token(TOK_ASSIGN, text, line);
+                add_token(p, TOK_ASSIGN, text, p->line);
             }
             continue;
         }
         if (c == '>') {
-            int next = fgetc(file);
+            int next = lex_getc(p);
             if (next == '=') {
                 text[0] = '>'; text[1] = '='; text[2] = '\0';
-                add_token(TOK_GTE, text, line);
+                add_token(p, TOK_GTE, text, p->line);
             } else {
-                ungetc(next, file);
+                lex_ungetc(p, next);
                 text[0] = '>'; text[1] = '\0';
-                add_token(TOK_GT, text, line);
+                add_token(p, TOK_GT, text, p->line);
             }
             continue;
         }
         if (c == '+') {
             text[0] = '+'; text[1] = '\0';
-            add_token(TOK_PLUS, text, line);
+            add_token(p, TOK_PLUS, text, p->line);
             continue;
         }
         if (c == '*') {
             text[0] = '*'; text[1] = '\0';
-            add_token(TOK_MUL, text, line);
+            add_token(p, TOK_MUL, text, p->line);
             continue;
         }
         if (c == '(') {
             text[0] = '('; text[1] = '\0';
-            add_token(TOK_LPAREN, text, line);
+            add_token(p, TOK_LPAREN, text, p->line);
             continue;
         }
         if (c == ')') {
             text[0] = ')'; text[1] = '\0';
-            add_token(TOK_RPAREN, text, line);
+            add_token(p, TOK_RPAREN, text, p->line);
             continue;
         }
         if (c == '{') {
             text[0] = '{'; text[1] = '\0';
-            add_token(TOK_LBRACE, text, line);
+            add_token(p, TOK_LBRACE, text, p->line);
             continue;
         }
         if (c == '}') {
             text[0] = '}'; text[1] = '\0';
-            add_token(TOK_RBRACE, text, line);
+            add_token(p, TOK_RBRACE, text, p->line);
             continue;
         }
         if (c == ';') {
             text[0] = ';'; text[1] = '\0';
-            add_token(TOK_SEMICOLON, text, line);
+            add_token(p, TOK_SEMICOLON, text, p->line);
             continue;
         }
         if (c == '<') {
             text[0] = '<'; text[1] = '\0';
-            add_token(TOK_ERROR, text, line);
-            add_error(line, "Unsupported operator: %c", c);
+            add_token(p, TOK_ERROR, text, p->line);
+            add_error(p, p->line, "Unsupported operator: %c", c);
             continue;
         }
         text[0] = c; text[1] = '\0';
-        add_token(TOK_ERROR, text, line);
-        add_error(line, "Unsupported operator: %c", c);
+        add_token(p, TOK_ERROR, text, p->line);
+        add_error(p, p->line, "Unsupported operator: %c", c);
     }
-    add_token(TOK_EOF, "", line);
+    add_token(p, TOK_EOF, "", p->line);
 }
 
-void add_error(int line, const char *format, ...) {
-    if (error_count >= MAX_ERRORS) return;
-    if (line == last_error_line) return; // Skip additional errors on the same line
-    char message[256];
+void add_error(Parser *p, int line, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    vsnprintf(message, 256, format, args);
+    vadd_error(p, line, format, args);
     va_end(args);
+}
+
+void vadd_error(Parser *p, int line, const char *format, va_list args) {
+    if (p->error_count >= MAX_ERRORS || p->limit_hit) return;
+    if (line == p->last_error_line) return; // Skip additional errors on the same line
+    char message[256];
+    vsnprintf(message, 256, format, args);
     // Avoid duplicate errors with the same message on the same line
-    for (int i = 0; i < error_count; i++) {
-        if (errors[i].line == line && strcmp(errors[i].message, message) == 0) {
+    for (int i = 0; i < p->error_count; i++) {
+        if (p->errors[i].line == line && strcmp(p->errors[i].message, message) == 0) {
             return;
         }
     }
-    errors[error_count].line = line;
-    strncpy(errors[error_count].message, message, 256);
-    error_count++;
-    last_error_line = line; // Update the last error line
+    p->errors[p->error_count].line = line;
+    strncpy(p->errors[p->error_count].message, message, 256);
+    p->error_count++;
+    p->last_error_line = line; // Update the last error line
 }
 
-void print_errors() {
-    int printed_lines[MAX_ERRORS] = {0}; // Track printed line numbers
-    for (int i = 0; i < error_count; i++) {
-        int line = errors[i].line;
-        // Print only the first error for each line
-        if (!printed_lines[line]) {
-            printf("- Error at line %d: %s\n", line, errors[i].message);
-            printed_lines[line] = 1;
-        }
-    }
+// Token, tree and arena bytes in use by the current parse
+size_t parser_memory(const Parser *p) {
+    return sizeof(Token) * p->token_list.count + sizeof(AstNode) * p->ast.node_count
+        + sizeof(NodeId) * p->ast.child_count + p->arena.bytes;
 }
 
-Node* make_node(const char *label, int num_children, ...) {
-    Node *node = malloc(sizeof(Node));
-    node->label = strdup(label);
-    node->num_children = num_children;
-    node->children = malloc(sizeof(Node*) * num_children);
-    va_list args;
-    va_start(args, num_children);
-    for (int i = 0; i < num_children; i++) {
-        node->children[i] = va_arg(args, Node*);
-    }
-    va_end(args);
-    return node;
+// Stop the parse for good: record the one limit diagnostic, make every
+// later token EOF so the parser unwinds, and release a pipelined lexer
+int governor_stop(Parser *p, ParseLimit limit, int line) {
+    const ParseLimits *l = &p->limits;
+    char message[256];
+    if (limit == UPL_LIMIT_INPUT) snprintf(message, sizeof(message), "Resource limit exceeded: input is over %zu bytes", l->max_input_bytes);
+    else if (limit == UPL_LIMIT_TOKENS) snprintf(message, sizeof(message), "Resource limit exceeded: more than %u tokens", l->max_tokens);
+    else if (limit == UPL_LIMIT_NODES) snprintf(message, sizeof(message), "Resource limit exceeded: more than %u tree nodes", l->max_nodes);
+    else if (limit == UPL_LIMIT_DEPTH) snprintf(message, sizeof(message), "Resource limit exceeded: nesting deeper than %u", l->max_depth);
+    else if (limit == UPL_LIMIT_TIME) snprintf(message, sizeof(message), "Resource limit exceeded: parse took over %g ms", l->max_ms);
+    else if (limit == UPL_LIMIT_MEMORY) snprintf(message, sizeof(message), "Resource limit exceeded: over %zu bytes of parser memory", l->max_memory);
+    else snprintf(message, sizeof(message), "Parse cancelled");
+    // Always kept, even over MAX_ERRORS or next to an error on the same line
+    int slot = p->error_count < MAX_ERRORS ? p->error_count++ : MAX_ERRORS - 1;
+    p->errors[slot].line = line;
+    strcpy(p->errors[slot].message, message);
+    p->limit_hit = limit;
+    if (p->ring_in) atomic_store_explicit(&p->ring_in->stop, 1, memory_order_relaxed);
+    p->current_token.type = TOK_EOF;
+    p->current_token.text[0] = '\0';
+    return 1;
 }
 
-void free_tree(Node *node) {
-    if (!node) return;
-    for (int i = 0; i < node->num_children; i++) {
-        free_tree(node->children[i]);
+// Cooperative check from the lexing, statement, expression and recovery
+// loops; nonzero once the parse must stop. The clock is read only every
+// GOVERNOR_CLOCK_MASK + 1 checks.
+int governor_check(Parser *p) {
+    if (!p->limited) return 0;
+    if (p->limit_hit) return 1;
+    const ParseLimits *l = &p->limits;
+    int line = p->token_index >= 0 ? p->current_token.line : p->line;
+    if (l->cancel && atomic_load_explicit(l->cancel, memory_order_relaxed)) return governor_stop(p, UPL_LIMIT_CANCELLED, line);
+    if (l->max_nodes && p->ast.node_count > l->max_nodes) return governor_stop(p, UPL_LIMIT_NODES, line);
+    if (l->max_memory && parser_memory(p) > l->max_memory) return governor_stop(p, UPL_LIMIT_MEMORY, line);
+    if (p->deadline_ns && (++p->poll_count & GOVERNOR_CLOCK_MASK) == 0 && now_ns() > p->deadline_ns) {
+        return governor_stop(p, UPL_LIMIT_TIME, line);
     }
-    free(node->label);
-    free(node->children);
-    free(node);
+    return 0;
 }
 
-void print_tree(Node *node, int depth) {
-    if (!node) return;
-    for (int i = 0; i < depth; i++) printf("  ");
-    printf("%s\n", node->label);
-    for (int i = 0; i < node->num_children; i++) {
-        print_tree(node->children[i], depth + 1);
+// Limits on the token just added: count, and braces and parentheses open
+// at once, which bound the parser's recursion
+void governor_token(Parser *p) {
+    const TokenList *list = &p->token_list;
+    const Token *token = &list->tokens[list->count - 1];
+    if (p->limit_hit) return;
+    if (p->limits.max_tokens && token->type != TOK_EOF && (uint32_t)list->count > p->limits.max_tokens) {
+        governor_stop(p, UPL_LIMIT_TOKENS, token->line);
+    } else if (p->limits.max_depth && (uint32_t)(list->brace_count + list->paren_count) > p->limits.max_depth) {
+        governor_stop(p, UPL_LIMIT_DEPTH, token->line);
+    } else {
+        governor_check(p);
     }
 }
 
-void skip_to_sync() {
-    int current_line = current_token.line;
-    while (token_index < token_list.count && token_list.tokens[token_index].line == current_line) {
-        token_index++;
-    }
-    if (token_index < token_list.count) {
-        current_token = token_list.tokens[token_index];
-    } else {
-        current_token.type = TOK_EOF;
-        current_token.line = line;
-        current_token.text[0] = '\0';
+// Only the first error for each line is reported
+int error_is_reported(const Error *errors, int i) {
+    for (int j = 0; j < i; j++) {
+        if (errors[j].line == errors[i].line) return 0;
     }
+    return 1;
 }
 
-Node* parse_prog() {
-    if (current_token.type != TOK_BEGIN) {
-        add_error(current_token.line, "Expected 'begin'");
-        skip_to_sync();
-        return NULL;
-    }
-    next_token();
-    Node *stmts = parse_stmts();
-    if (current_token.type != TOK_END) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'end'");
+void print_errors(FILE *out, const Error *errors, int count) {
+    for (int i = 0; i < count; i++) {
+        if (error_is_reported(errors, i)) {
+            fprintf(out, "- Error at line %d: %s\n", errors[i].line, errors[i].message);
         }
-        skip_to_sync();
-        free_tree(stmts);
-        return NULL;
     }
-    next_token();
-    return make_node("Prog", 1, stmts ? stmts : make_node("Stmts", 0));
 }
 
-Node* parse_stmts() {
-    Node *stmt_list[MAX_STMTS];
-    int stmt_count = 0;
-    while (current_token.type != TOK_END && current_token.type != TOK_RBRACE && current_token.type != TOK_EOF) {
-        if (stmt_count >= MAX_STMTS) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Too many statements");
-            }
-            skip_to_sync();
-            break;
-        }
-        Node *stmt = parse_stmt();
-        if (stmt) {
-            stmt_list[stmt_count++] = stmt;
-        } else {
-            if (current_token.line != last_error_line) {
-                skip_to_sync();
-            }
-        }
-    }
-    if (stmt_count == 0) return NULL;
-    Node *node = malloc(sizeof(Node));
-    node->label = strdup("Stmts");
-    node->num_children = stmt_count;
-    node->children = malloc(sizeof(Node*) * stmt_count);
-    for (int i = 0; i < stmt_count; i++) {
-        node->children[i] = stmt_list[i];
-    }
-    return node;
+const char* token_text(Parser *p, int index) {
+    return p->token_list.tokens[index].text;
 }
 
-Node* parse_stmt() {
-    // Reset last_error_line for a new statement
-    if (current_token.line != last_error_line) {
-        last_error_line = 0;
-    }
-    if (current_token.type == TOK_IF) return parse_if_stmt();
-    else if (current_token.type == TOK_DO) return parse_do_while_stmt();
-    else if (current_token.type == TOK_PRINT) return parse_print_stmt();
-    else if (current_token.type == TOK_INT || current_token.type == TOK_BOOL) return parse_decl_stmt();
-    else if (current_token.type == TOK_FOR) return parse_for_stmt();
-    else if (current_token.type == TOK_ID) {
-        // Peek at the next token to distinguish assignment from invalid declaration
-        Token next = token_index + 1 < token_list.count ? token_list.tokens[token_index + 1] : current_token;
-        if (next.type == TOK_ASSIGN) {
-            return parse_assign_stmt();
-        } else {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected 'int' or 'bool' for declaration or '=' for assignment");
-            }
-            skip_to_sync();
-            return NULL;
-        }
-    }
-    else {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'int', 'bool', identifier, or statement keyword");
-        }
-        skip_to_sync();
-        return NULL;
-    }
+void init_ast(Parser *p) {
+    p->ast.node_capacity = AST_INITIAL_NODES;
+    p->ast.nodes = malloc(sizeof(AstNode) * p->ast.node_capacity);
+    p->ast.child_capacity = AST_INITIAL_NODES;
+    p->ast.children = malloc(sizeof(NodeId) * p->ast.child_capacity);
+    p->ast.tokens = &p->token_list;
+    p->ast.node_count = 1; // Reserve NO_NODE
+    p->ast.child_count = 0;
 }
 
-Node* parse_if_stmt() {
-    Node *if_then = parse_if_then();
-    if (!if_then) return NULL;
-    Node *else_opt = parse_else_opt();
-    return make_node("IfStmt", 2, if_then, else_opt);
+void free_ast(Parser *p) {
+    free(p->ast.nodes);
+    free(p->ast.children);
+    p->ast.nodes = NULL;
+    p->ast.children = NULL;
 }
 
-Node* parse_if_then() {
-    if (current_token.type != TOK_IF) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'if'");
-        }
-        skip_to_sync();
-        return NULL;
+// Append a node with room for num_children child ids
+NodeId new_node(Parser *p, NodeKind kind, int num_children, int token) {
+    Ast *ast = &p->ast;
+    if (ast->node_count >= ast->node_capacity) {
+        ast->node_capacity *= 2;
+        ast->nodes = realloc(ast->nodes, sizeof(AstNode) * ast->node_capacity);
     }
-    int if_line = current_token.line;
-    next_token();
-    if (current_token.type != TOK_LPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '('");
-        }
-        skip_to_sync();
-        return NULL;
+    while (ast->child_count + num_children > ast->child_capacity) {
+        ast->child_capacity *= 2;
+        ast->children = realloc(ast->children, sizeof(NodeId) * ast->child_capacity);
     }
-    next_token();
-    Node *expr = parse_expr();
-    if (!expr) {
-        skip_to_sync();
-        return NULL;
+    if (p->profile) profile_node(p);
+    AstNode *node = &ast->nodes[ast->node_count];
+    node->kind = kind;
+    node->num_children = num_children;
+    node->first_child = ast->child_count;
+    node->token = token;
+    ast->child_count += num_children;
+    return ast->node_count++;
+}
+
+NodeId make_node(Parser *p, NodeKind kind, int num_children, ...) {
+    NodeId id = new_node(p, kind, num_children, 0);
+    NodeId *children = p->ast.children + p->ast.nodes[id].first_child;
+    va_list args;
+    va_start(args, num_children);
+    for (int i = 0; i < num_children; i++) {
+        children[i] = va_arg(args, NodeId);
     }
-    if (current_token.type != TOK_RPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ')'");
+    va_end(args);
+    set_anchor_token(p, id);
+    return intern_node(p, id);
+}
+
+NodeId make_node_list(Parser *p, NodeKind kind, const NodeId *children, int num_children) {
+    NodeId id = new_node(p, kind, num_children, 0);
+    memcpy(p->ast.children + p->ast.nodes[id].first_child, children, sizeof(NodeId) * num_children);
+    set_anchor_token(p, id);
+    return intern_node(p, id);
+}
+
+// Inner nodes are anchored at their first child's token, for line numbers
+void set_anchor_token(Parser *p, NodeId id) {
+    AstNode *node = &p->ast.nodes[id];
+    node->token = p->token_index > 0 ? p->token_index : 0;
+    for (int i = 0; i < node->num_children; i++) {
+        NodeId child = p->ast.children[node->first_child + i];
+        if (child) {
+            node->token = p->ast.nodes[child].token;
+            break;
         }
-        skip_to_sync();
-        free_tree(expr);
-        return NULL;
     }
-    next_token();
-    if (current_token.type != TOK_THEN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'then'");
+}
+
+NodeId make_leaf(Parser *p, NodeKind kind, int token) {
+    return intern_node(p, new_node(p, kind, 0, token));
+}
+
+// Hash-consing of pure expression nodes. Children are built first, so they
+// are already shared and an inner node is identified by its kind and child
+// ids; leaves by their kind and text.
+
+int is_pure_expr(NodeKind kind) {
+    return kind == NK_ID || kind == NK_NUM || kind == NK_TRUE || kind == NK_FALSE || kind == NK_ADD_EXPR
+        || kind == NK_MUL_EXPR || kind == NK_EQ_EXPR || kind == NK_GT || kind == NK_GTE;
+}
+
+// The expressions with operands
+int is_operator(NodeKind kind) {
+    return kind == NK_ADD_EXPR || kind == NK_MUL_EXPR || kind == NK_EQ_EXPR || kind == NK_GT || kind == NK_GTE;
+}
+
+uint32_t node_hash(const Ast *ast, NodeId id) {
+    const AstNode *node = &ast->nodes[id];
+    uint32_t hash = 2166136261u ^ node->kind;
+    if (node->num_children == 0) {
+        for (const char *c = ast_text(ast, id); *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    } else {
+        for (int i = 0; i < node->num_children; i++) {
+            hash = (hash ^ ast->children[node->first_child + i]) * 16777619u;
         }
-        skip_to_sync();
-        free_tree(expr);
-        return NULL;
     }
-    next_token();
-    if (current_token.type != TOK_LBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '{'");
+    return hash ^ (hash >> 15);
+}
+
+int node_equal(const Ast *ast, NodeId a, NodeId b) {
+    const AstNode *x = &ast->nodes[a], *y = &ast->nodes[b];
+    if (x->kind != y->kind || x->num_children != y->num_children) return 0;
+    if (x->num_children == 0) return strcmp(ast_text(ast, a), ast_text(ast, b)) == 0;
+    return memcmp(ast->children + x->first_child, ast->children + y->first_child,
+        sizeof(NodeId) * x->num_children) == 0;
+}
+
+void intern_insert(InternTable *table, const Ast *ast, NodeId id) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = node_hash(ast, id) & mask;
+    while (table->slots[i]) i = (i + 1) & mask;
+    table->slots[i] = id;
+    table->count++;
+}
+
+void intern_grow(InternTable *table, const Ast *ast) {
+    NodeId *old = table->slots;
+    uint32_t old_capacity = table->capacity;
+    table->capacity = old_capacity ? old_capacity * 2 : 1024;
+    table->slots = calloc(table->capacity, sizeof(NodeId));
+    table->count = 0;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i]) intern_insert(table, ast, old[i]);
+    }
+    free(old);
+}
+
+// Return the shared node equal to the one just built, giving the new one's
+// storage back, or keep the new one as the shared copy
+NodeId intern_node(Parser *p, NodeId id) {
+    Ast *ast = &p->ast;
+    InternTable *table = &p->intern;
+    if (!p->hash_cons || !is_pure_expr(ast_kind(ast, id))) return id;
+    if (2 * (table->count + 1) > table->capacity) intern_grow(table, ast);
+    if (id >= table->uses_capacity) {
+        table->uses_capacity = ast->node_capacity > id ? ast->node_capacity : id + 1;
+        table->uses = realloc(table->uses, sizeof(uint32_t) * table->uses_capacity);
+    }
+    table->stats.lookups++;
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = node_hash(ast, id) & mask; table->slots[i]; i = (i + 1) & mask) {
+        NodeId other = table->slots[i];
+        if (!node_equal(ast, id, other)) continue;
+        table->stats.hits++;
+        table->stats.bytes_saved += sizeof(AstNode) + sizeof(NodeId) * ast->nodes[id].num_children;
+        table->uses[other]++;
+        ast->child_count -= ast->nodes[id].num_children;
+        ast->node_count--;
+        return other;
+    }
+    intern_insert(table, ast, id);
+    table->uses[id] = 1;
+    table->stats.unique++;
+    return id;
+}
+
+void parser_set_hash_cons(Parser *p, int enabled) {
+    p->hash_cons = enabled;
+}
+
+void parser_hash_cons_stats(const Parser *p, HashConsStats *stats) {
+    *stats = p->intern.stats;
+}
+
+// Copies made by passes are not in the table and count as used once
+uint32_t parser_expr_uses(const Parser *p, NodeId id) {
+    const InternTable *table = &p->intern;
+    if (!p->hash_cons || !table->count || !is_pure_expr(ast_kind(&p->ast, id))) return 1;
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = node_hash(&p->ast, id) & mask; table->slots[i]; i = (i + 1) & mask) {
+        if (table->slots[i] == id) return table->uses[id];
+    }
+    return 1;
+}
+
+// Shallow copy that is not shared, for a pass about to change its children
+NodeId copy_node(Parser *p, NodeId id) {
+    int n = ast_num_children(&p->ast, id);
+    NodeId copy = new_node(p, ast_kind(&p->ast, id), n, p->ast.nodes[id].token);
+    for (int i = 0; i < n; i++) p->ast.children[p->ast.nodes[copy].first_child + i] = ast_child(&p->ast, id, i);
+    return copy;
+}
+
+const char* node_kind_label(NodeKind kind) {
+    static const char *labels[NK_COUNT] = {
+        "", "Prog", "Stmts", "IfStmt", "IfThen", "ElseOpt",
+        "DoWhileStmt", "PrintStmt", "DeclStmt", "Type_int", "Type_bool",
+        "InitDecl", "AssignStmt", "ForStmt", "ForInit", "Update",
+        "EqExpr", "Gt", "Gte", "AddExpr", "MulExpr", "Id", "Num",
+        "True", "False", "", "LazyStmts"
+    };
+    return kind < NK_COUNT ? labels[kind] : "";
+}
+
+const char* ast_text(const Ast *ast, NodeId id) {
+    return ast->tokens->tokens[ast->nodes[id].token].text;
+}
+
+// Kinds that are reported as leaf events and carry token text
+int kind_has_text(NodeKind kind) {
+    return kind == NK_NAME || kind == NK_ID || kind == NK_NUM || kind == NK_TYPE_INT
+        || kind == NK_TYPE_BOOL || kind == NK_TRUE || kind == NK_FALSE;
+}
+
+// Replay a built subtree as events, without recursion
+void ast_emit(const Ast *ast, NodeId node, const ParseEvents *events) {
+    if (!node) return;
+    int capacity = 64, top = 0;
+    uint32_t *stack = malloc(sizeof(uint32_t) * capacity);
+    stack[top++] = node << 1;
+    while (top > 0) {
+        uint32_t entry = stack[--top];
+        NodeId id = entry >> 1;
+        NodeKind kind = ast_kind(ast, id);
+        if (entry & 1) {
+            events->exit(events->ctx, kind);
+            continue;
         }
-        skip_to_sync();
-        free_tree(expr);
-        return NULL;
+        const Token *token = &ast->tokens->tokens[ast->nodes[id].token];
+        if (kind_has_text(kind)) {
+            events->leaf(events->ctx, kind, token->text, strlen(token->text), token->line);
+            continue;
+        }
+        events->enter(events->ctx, kind, token->line);
+        int n = ast_num_children(ast, id);
+        if (top + n + 1 > capacity) {
+            while (top + n + 1 > capacity) capacity *= 2;
+            stack = realloc(stack, sizeof(uint32_t) * capacity);
+        }
+        stack[top++] = (id << 1) | 1;
+        for (int i = n - 1; i >= 0; i--) {
+            NodeId child = ast_child(ast, id, i);
+            if (child) stack[top++] = child << 1;
+        }
+    }
+    free(stack);
+}
+
+void ev_enter(Parser *p, NodeKind kind, int line) {
+    if (!p->events) return;
+    if (p->ev_depth >= p->ev_capacity) {
+        p->ev_capacity = p->ev_capacity ? p->ev_capacity * 2 : 64;
+        p->ev_stack = realloc(p->ev_stack, sizeof(NodeKind) * p->ev_capacity);
+    }
+    p->ev_stack[p->ev_depth++] = kind;
+    p->events->enter(p->events->ctx, kind, line);
+    if (kind == NK_STMTS && p->ev_depth == 2 && p->import_count && !p->imports_emitted) import_emit(p);
+}
+
+void ev_leaf(Parser *p, NodeKind kind, int token) {
+    if (!p->events) return;
+    const Token *t = &p->token_list.tokens[token];
+    p->events->leaf(p->events->ctx, kind, t->text, strlen(t->text), t->line);
+}
+
+void ev_exit(Parser *p) {
+    if (!p->events || p->ev_depth == 0) return;
+    p->ev_depth--;
+    p->events->exit(p->events->ctx, p->ev_stack[p->ev_depth]);
+}
+
+// Close the frames an abandoned construct left open
+void ev_unwind(Parser *p, int depth) {
+    while (p->events && p->ev_depth > depth) ev_exit(p);
+}
+
+typedef struct {
+    FILE *out;
+    int depth;
+} TextPrinter;
+
+void text_enter(void *ctx, NodeKind kind, int line) {
+    TextPrinter *tp = ctx;
+    (void)line;
+    for (int i = 0; i < tp->depth; i++) fprintf(tp->out, "  ");
+    fprintf(tp->out, "%s\n", node_kind_label(kind));
+    tp->depth++;
+}
+
+void text_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line) {
+    TextPrinter *tp = ctx;
+    (void)line;
+    for (int i = 0; i < tp->depth; i++) fprintf(tp->out, "  ");
+    if (kind == NK_NAME) {
+        fprintf(tp->out, "%.*s\n", (int)len, text);
+        return;
+    }
+    fprintf(tp->out, "%s\n", node_kind_label(kind));
+    if (kind == NK_ID || kind == NK_NUM) {
+        for (int i = 0; i <= tp->depth; i++) fprintf(tp->out, "  ");
+        fprintf(tp->out, "%.*s\n", (int)len, text);
+    }
+}
+
+void text_exit(void *ctx, NodeKind kind) {
+    TextPrinter *tp = ctx;
+    (void)kind;
+    tp->depth--;
+}
+
+// Print the tree in the upl output format, as an event consumer
+void print_tree(FILE *out, const Ast *ast, NodeId node, int depth) {
+    TextPrinter tp = { out, depth };
+    ParseEvents events = { text_enter, text_leaf, text_exit, &tp };
+    ast_emit(ast, node, &events);
+}
+
+typedef struct {
+    FILE *out;
+    int need_comma;
+} JsonPrinter;
+
+void json_string(FILE *out, const char *text, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+const char* json_kind(NodeKind kind) {
+    return kind == NK_NAME ? "Name" : node_kind_label(kind);
+}
+
+void json_enter(void *ctx, NodeKind kind, int line) {
+    JsonPrinter *jp = ctx;
+    fprintf(jp->out, "%s{\"kind\":\"%s\",\"line\":%d,\"children\":[", jp->need_comma ? "," : "", json_kind(kind), line);
+    jp->need_comma = 0;
+}
+
+void json_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line) {
+    JsonPrinter *jp = ctx;
+    fprintf(jp->out, "%s{\"kind\":\"%s\",\"text\":", jp->need_comma ? "," : "", json_kind(kind));
+    json_string(jp->out, text, len);
+    fprintf(jp->out, ",\"line\":%d}", line);
+    jp->need_comma = 1;
+}
+
+void json_exit(void *ctx, NodeKind kind) {
+    JsonPrinter *jp = ctx;
+    (void)kind;
+    fprintf(jp->out, "]}");
+    jp->need_comma = 1;
+}
+
+// First statement boundary after index at the same brace depth; blocks
+// opened in between are jumped over through their matching '}'
+int next_boundary(const TokenList *list, int index) {
+    const Token *tokens = list->tokens;
+    int depth = tokens[index].depth;
+    int i = index + 1;
+    while (i < list->count) {
+        int boundary = tokens[i].next_sync;
+        if (boundary < 0) break;
+        if (tokens[boundary].depth <= depth) return boundary;
+        int open = tokens[boundary].enclosing;
+        while (open >= 0 && tokens[open].depth > depth) open = tokens[open].enclosing;
+        if (open < 0 || tokens[open].match < 0) break;
+        i = tokens[open].match + 1;
     }
-    next_token();
-    Node *stmts = parse_stmts();
-    if (current_token.type != TOK_RBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '}'");
+    return list->count;
+}
+
+// Report an error at the current token and resynchronize
+void syntax_error(Parser *p, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vadd_error(p, p->current_token.line, format, args);
+    va_end(args);
+    skip_to_sync(p);
+}
+
+// Jump to the next statement boundary or the next line, whichever is first.
+// Only the first call after an error moves; the callers unwinding from the
+// same error find the parser already synchronized.
+void skip_to_sync(Parser *p) {
+    if (p->synced || governor_check(p)) return;
+    p->synced = 1;
+    if (p->token_index < 0) p->token_index = 0;
+    pull_tokens(p, p->token_index + 1);
+    if (p->token_index < p->token_list.count) {
+        // A pipelined parse waits until the jump targets are final: the next
+        // line is known and every token before it has its next_sync
+        while (p->ring_in && (p->token_list.tokens[p->token_index].next_line < 0
+                || p->token_list.sync_pending < p->token_list.tokens[p->token_index].next_line)) {
+            pull_tokens(p, p->token_list.count + 1);
         }
-        skip_to_sync();
-        free_tree(expr);
-        free_tree(stmts);
-        return NULL;
+        const Token *token = &p->token_list.tokens[p->token_index];
+        if (!(SYNC_STOP_SET & TOKEN_BIT(token->type))) {
+            int target = token->next_line >= 0 ? token->next_line : p->token_list.count;
+            int boundary = next_boundary(&p->token_list, p->token_index);
+            if (boundary < target) target = boundary;
+            if (p->profile) profile_sync(p, target - p->token_index);
+            p->token_index = target;
+        }
+    }
+    if (p->token_index < p->token_list.count) {
+        p->current_token = p->token_list.tokens[p->token_index];
+    } else {
+        p->current_token.type = TOK_EOF;
+        p->current_token.line = p->line;
+        p->current_token.text[0] = '\0';
     }
-    next_token();
-    return make_node("IfThen", 2, expr, stmts ? stmts : make_node("Stmts", 0));
 }
 
-Node* parse_else_opt() {
-    if (current_token.type == TOK_ELSE) {
-        next_token();
-        if (current_token.type != TOK_LBRACE) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected '{'");
-            }
-            skip_to_sync();
-            return NULL;
+NodeId parse_prog(Parser *p) {
+    if (p->current_token.type != TOK_BEGIN) {
+        syntax_error(p, "Expected 'begin'");
+        return NO_NODE;
+    }
+    ev_enter(p, NK_PROG, p->current_token.line);
+    next_token(p);
+    NodeId stmts = parse_stmts(p);
+    if (p->current_token.type != TOK_END) {
+        syntax_error(p, "Expected 'end'");
+        return NO_NODE;
+    }
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_PROG, 1, stmts ? stmts : make_node(p, NK_STMTS, 0));
+}
+
+NodeId parse_stmts(Parser *p) {
+    NodeId stmt_list[MAX_STMTS];
+    int stmt_count = 0;
+    int ev_base = p->ev_depth;
+    ev_enter(p, NK_STMTS, p->current_token.line);
+    while (!(follow_sets[NT_STMTS] & TOKEN_BIT(p->current_token.type)) && !governor_check(p)) {
+        if (stmt_count >= MAX_STMTS) {
+            syntax_error(p, "Too many statements");
+            break;
+        }
+        uint32_t node_mark = p->ast.node_count, child_mark = p->ast.child_count;
+        NodeId stmt = parse_stmt(p);
+        if (p->events) {
+            // Close what a failed statement left open; its nodes are no longer needed
+            ev_unwind(p, ev_base + 1);
+            p->ast.node_count = node_mark;
+            p->ast.child_count = child_mark;
         }
-        next_token();
-        Node *stmts = parse_stmts();
-        if (current_token.type != TOK_RBRACE) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected '}'");
+        if (stmt) {
+            stmt_list[stmt_count++] = stmt;
+        } else {
+            if (p->current_token.line != p->last_error_line) {
+                skip_to_sync(p);
             }
-            skip_to_sync();
-            free_tree(stmts);
-            return NULL;
         }
-        next_token();
-        return make_node("ElseOpt", 1, stmts ? stmts : make_node("Stmts", 0));
     }
-    return NULL;
+    ev_exit(p);
+    if (stmt_count == 0) return NO_NODE;
+    return make_node_list(p, NK_STMTS, stmt_list, stmt_count);
 }
 
-Node* parse_do_while_stmt() {
-    if (current_token.type != TOK_DO) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'do'");
-        }
-        skip_to_sync();
-        return NULL;
+// Statements of a block whose '{' was just consumed. A lazy parse skims a
+// body without declarations: the lexer already matched its '}', and since
+// the body cannot change the symbol table, the statements after it parse
+// the same whether or not it has been parsed yet. Errors inside a skimmed
+// body are not found until it is forced.
+NodeId parse_block_stmts(Parser *p) {
+    int lbrace = p->token_index - 1;
+    if (!p->lazy || p->events || p->profile || p->limit_hit || lbrace < 0) return parse_stmts(p);
+    while (p->ring_in && p->token_list.tokens[lbrace].match < 0) pull_tokens(p, p->token_list.count + 1);
+    const Token *tokens = p->token_list.tokens;
+    int match = tokens[lbrace].match;
+    if (match < 0 || tokens[match].decls != tokens[lbrace].decls) return parse_stmts(p);
+    if (p->lazy_count >= p->lazy_capacity) {
+        p->lazy_capacity = p->lazy_capacity ? p->lazy_capacity * 2 : 64;
+        p->lazy_blocks = realloc(p->lazy_blocks, sizeof(LazyBlock) * p->lazy_capacity);
     }
-    next_token();
-    if (current_token.type != TOK_LBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '{'");
-        }
-        skip_to_sync();
-        return NULL;
+    NodeId id = new_node(p, NK_LAZY_STMTS, 0, lbrace);
+    p->ast.nodes[id].first_child = p->lazy_count; // No children; indexes the block instead
+    LazyBlock *block = &p->lazy_blocks[p->lazy_count++];
+    block->node = id;
+    block->lbrace = lbrace;
+    block->symbols = p->symbol_table.count;
+    block->last_error_line = p->last_error_line;
+    p->token_index = match - 1;
+    next_token(p);
+    return id;
+}
+
+NodeId parse_stmt(Parser *p) {
+    // Reset last_error_line for a new statement
+    if (p->current_token.line != p->last_error_line) {
+        p->last_error_line = 0;
     }
-    next_token();
-    Node *stmts = parse_stmts();
-    if (current_token.type != TOK_RBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '}'");
+    p->synced = 0; // A new statement attempt must be able to skip again
+    if (p->current_token.type == TOK_IF) return parse_if_stmt(p);
+    else if (p->current_token.type == TOK_DO) return parse_do_while_stmt(p);
+    else if (p->current_token.type == TOK_PRINT) return parse_print_stmt(p);
+    else if (p->current_token.type == TOK_INT || p->current_token.type == TOK_BOOL) return parse_decl_stmt(p);
+    else if (p->current_token.type == TOK_FOR) return parse_for_stmt(p);
+    else if (p->current_token.type == TOK_ID) {
+        // Peek at the next token to distinguish assignment from invalid declaration
+        pull_tokens(p, p->token_index + 2);
+        Token next = p->token_index + 1 < p->token_list.count ? p->token_list.tokens[p->token_index + 1] : p->current_token;
+        if (next.type == TOK_ASSIGN) {
+            return parse_assign_stmt(p);
+        } else {
+            syntax_error(p, "Expected 'int' or 'bool' for declaration or '=' for assignment");
+            return NO_NODE;
         }
-        skip_to_sync();
-        free_tree(stmts);
-        return NULL;
     }
-    next_token();
-    if (current_token.type != TOK_WHILE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'while'");
-        }
-        skip_to_sync();
-        free_tree(stmts);
-        return NULL;
+    else {
+        syntax_error(p, "Expected 'int', 'bool', identifier, or statement keyword");
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_LPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '('");
-        }
-        skip_to_sync();
-        free_tree(stmts);
-        return NULL;
+}
+
+NodeId parse_if_stmt(Parser *p) {
+    ev_enter(p, NK_IF_STMT, p->current_token.line);
+    NodeId if_then = parse_if_then(p);
+    if (!if_then) return NO_NODE;
+    NodeId else_opt = parse_else_opt(p);
+    ev_exit(p);
+    return make_node(p, NK_IF_STMT, 2, if_then, else_opt);
+}
+
+NodeId parse_if_then(Parser *p) {
+    if (p->current_token.type != TOK_IF) {
+        syntax_error(p, "Expected 'if'");
+        return NO_NODE;
+    }
+    int if_line = p->current_token.line;
+    ev_enter(p, NK_IF_THEN, if_line);
+    next_token(p);
+    if (p->current_token.type != TOK_LPAREN) {
+        syntax_error(p, "Expected '('");
+        return NO_NODE;
     }
-    next_token();
-    Node *expr = parse_expr();
+    next_token(p);
+    NodeId expr = parse_expr(p);
     if (!expr) {
-        skip_to_sync();
-        free_tree(stmts);
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    if (current_token.type != TOK_RPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ')'");
-        }
-        skip_to_sync();
-        free_tree(stmts);
-        free_tree(expr);
-        return NULL;
+    if (p->current_token.type != TOK_RPAREN) {
+        syntax_error(p, "Expected ')'");
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_SEMICOLON) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ';'");
-        }
-        skip_to_sync();
-        free_tree(stmts);
-        free_tree(expr);
-        return NULL;
+    next_token(p);
+    if (p->current_token.type != TOK_THEN) {
+        syntax_error(p, "Expected 'then'");
+        return NO_NODE;
+    }
+    next_token(p);
+    if (p->current_token.type != TOK_LBRACE) {
+        syntax_error(p, "Expected '{'");
+        return NO_NODE;
     }
-    next_token();
-    return make_node("DoWhileStmt", 2, stmts ? stmts : make_node("Stmts", 0), expr);
+    next_token(p);
+    NodeId stmts = parse_block_stmts(p);
+    if (p->current_token.type != TOK_RBRACE) {
+        syntax_error(p, "Expected '}'");
+        return NO_NODE;
+    }
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_IF_THEN, 2, expr, stmts ? stmts : make_node(p, NK_STMTS, 0));
 }
 
-Node* parse_print_stmt() {
-    if (current_token.type != TOK_PRINT) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'print'");
+NodeId parse_else_opt(Parser *p) {
+    if (p->current_token.type == TOK_ELSE) {
+        ev_enter(p, NK_ELSE_OPT, p->current_token.line);
+        next_token(p);
+        if (p->current_token.type != TOK_LBRACE) {
+            syntax_error(p, "Expected '{'");
+            return NO_NODE;
         }
-        skip_to_sync();
-        return NULL;
-    }
-    next_token();
-    if (current_token.type != TOK_LPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '('");
+        next_token(p);
+        NodeId stmts = parse_block_stmts(p);
+        if (p->current_token.type != TOK_RBRACE) {
+            syntax_error(p, "Expected '}'");
+            return NO_NODE;
         }
-        skip_to_sync();
-        return NULL;
+        next_token(p);
+        ev_exit(p);
+        return make_node(p, NK_ELSE_OPT, 1, stmts ? stmts : make_node(p, NK_STMTS, 0));
+    }
+    return NO_NODE;
+}
+
+NodeId parse_do_while_stmt(Parser *p) {
+    if (p->current_token.type != TOK_DO) {
+        syntax_error(p, "Expected 'do'");
+        return NO_NODE;
+    }
+    ev_enter(p, NK_DO_WHILE_STMT, p->current_token.line);
+    next_token(p);
+    if (p->current_token.type != TOK_LBRACE) {
+        syntax_error(p, "Expected '{'");
+        return NO_NODE;
+    }
+    next_token(p);
+    NodeId stmts = parse_block_stmts(p);
+    if (p->current_token.type != TOK_RBRACE) {
+        syntax_error(p, "Expected '}'");
+        return NO_NODE;
+    }
+    next_token(p);
+    if (p->current_token.type != TOK_WHILE) {
+        syntax_error(p, "Expected 'while'");
+        return NO_NODE;
     }
-    next_token();
-    Node *expr = parse_expr();
+    next_token(p);
+    if (p->current_token.type != TOK_LPAREN) {
+        syntax_error(p, "Expected '('");
+        return NO_NODE;
+    }
+    next_token(p);
+    NodeId expr = parse_expr(p);
     if (!expr) {
-        skip_to_sync();
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    if (current_token.type != TOK_RPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ')'");
-        }
-        skip_to_sync();
-        free_tree(expr);
-        return NULL;
+    if (p->current_token.type != TOK_RPAREN) {
+        syntax_error(p, "Expected ')'");
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_SEMICOLON) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ';'");
-        }
-        skip_to_sync();
-        free_tree(expr);
-        return NULL;
+    next_token(p);
+    if (p->current_token.type != TOK_SEMICOLON) {
+        syntax_error(p, "Expected ';'");
+        return NO_NODE;
+    }
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_DO_WHILE_STMT, 2, stmts ? stmts : make_node(p, NK_STMTS, 0), expr);
+}
+
+NodeId parse_print_stmt(Parser *p) {
+    if (p->current_token.type != TOK_PRINT) {
+        syntax_error(p, "Expected 'print'");
+        return NO_NODE;
+    }
+    ev_enter(p, NK_PRINT_STMT, p->current_token.line);
+    next_token(p);
+    if (p->current_token.type != TOK_LPAREN) {
+        syntax_error(p, "Expected '('");
+        return NO_NODE;
+    }
+    next_token(p);
+    NodeId expr = parse_expr(p);
+    if (!expr) {
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    next_token();
-    return make_node("PrintStmt", 1, expr);
+    if (p->current_token.type != TOK_RPAREN) {
+        syntax_error(p, "Expected ')'");
+        return NO_NODE;
+    }
+    next_token(p);
+    if (p->current_token.type != TOK_SEMICOLON) {
+        syntax_error(p, "Expected ';'");
+        return NO_NODE;
+    }
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_PRINT_STMT, 1, expr);
 }
 
-Node* parse_decl_stmt() {
-    Node *type = parse_type();
+NodeId parse_decl_stmt(Parser *p) {
+    ev_enter(p, NK_DECL_STMT, p->current_token.line);
+    NodeId type = parse_type(p);
     if (!type) {
-        skip_to_sync();
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
     int decl_line;
-    const char *type_str = strcmp(type->label, "Type_int") == 0 ? "int" : "bool";
-    Node *init_decl = parse_init_decl(&decl_line, type_str);
+    const char *type_str = p->ast.nodes[type].kind == NK_TYPE_INT ? "int" : "bool";
+    NodeId init_decl = parse_init_decl(p, &decl_line, type_str);
     if (!init_decl) {
-        free_tree(type);
-        skip_to_sync();
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    if (current_token.type != TOK_SEMICOLON) {
-        if (decl_line != last_error_line) {
-            add_error(decl_line, "Expected ';'");
+    if (p->current_token.type != TOK_SEMICOLON) {
+        if (decl_line != p->last_error_line) {
+            add_error(p, decl_line, "Expected ';'");
         }
-        skip_to_sync();
-        free_tree(type);
-        free_tree(init_decl);
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    next_token();
-    return make_node("DeclStmt", 2, type, init_decl);
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_DECL_STMT, 2, type, init_decl);
 }
 
-Node* parse_type() {
-    if (current_token.type == TOK_INT) {
-        next_token();
-        return make_node("Type_int", 0);
-    } else if (current_token.type == TOK_BOOL) {
-        next_token();
-        return make_node("Type_bool", 0);
+NodeId parse_type(Parser *p) {
+    if (p->current_token.type == TOK_INT || p->current_token.type == TOK_BOOL) {
+        NodeKind kind = p->current_token.type == TOK_INT ? NK_TYPE_INT : NK_TYPE_BOOL;
+        int type_tok = p->token_index;
+        ev_leaf(p, kind, type_tok);
+        next_token(p);
+        return make_leaf(p, kind, type_tok);
     } else {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'int' or 'bool'");
-        }
-        skip_to_sync();
-        return NULL;
+        syntax_error(p, "Expected 'int' or 'bool'");
+        return NO_NODE;
     }
 }
 
-Node* parse_init_decl(int *line, const char *type) {
-    if (current_token.type != TOK_ID) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected identifier");
-        }
-        skip_to_sync();
-        return NULL;
+NodeId parse_init_decl(Parser *p, int *line, const char *type) {
+    if (p->current_token.type != TOK_ID) {
+        syntax_error(p, "Expected identifier");
+        return NO_NODE;
     }
-    *line = current_token.line;
-    char *id = strdup(current_token.text);
-    next_token();
-    if (current_token.type == TOK_ASSIGN) {
-        next_token();
-        Node *expr = parse_expr();
+    *line = p->current_token.line;
+    int id_tok = p->token_index;
+    ev_enter(p, NK_INIT_DECL, *line);
+    ev_leaf(p, NK_NAME, id_tok);
+    next_token(p);
+    if (p->current_token.type == TOK_ASSIGN) {
+        next_token(p);
+        NodeId expr = parse_expr(p);
         if (!expr) {
-            free(id);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        add_symbol(id, type, *line);
-        return make_node("InitDecl", 2, make_node(id, 0), expr);
+        add_symbol(p, token_text(p, id_tok), type, *line);
+        ev_exit(p);
+        return make_node(p, NK_INIT_DECL, 2, make_leaf(p, NK_NAME, id_tok), expr);
     }
-    add_symbol(id, type, *line);
-    return make_node("InitDecl", 1, make_node(id, 0));
+    add_symbol(p, token_text(p, id_tok), type, *line);
+    ev_exit(p);
+    return make_node(p, NK_INIT_DECL, 1, make_leaf(p, NK_NAME, id_tok));
 }
 
-Node* parse_assign_stmt() {
-    if (current_token.type != TOK_ID) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected identifier");
-        }
-        skip_to_sync();
-        return NULL;
+NodeId parse_assign_stmt(Parser *p) {
+    if (p->current_token.type != TOK_ID) {
+        syntax_error(p, "Expected identifier");
+        return NO_NODE;
     }
-    char *id = strdup(current_token.text);
-    int assign_line = current_token.line;
-    if (!is_variable_declared(id)) {
-        if (assign_line != last_error_line) {
-            add_error(assign_line, "Undeclared variable: %s", id);
-        }
-        free(id);
-        skip_to_sync();
-        return NULL;
+    int id_tok = p->token_index;
+    int assign_line = p->current_token.line;
+    if (!is_variable_declared(p, token_text(p, id_tok))) {
+        syntax_error(p, "Undeclared variable: %s", token_text(p, id_tok));
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_ASSIGN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '='");
-        }
-        free(id);
-        skip_to_sync();
-        return NULL;
+    ev_enter(p, NK_ASSIGN_STMT, assign_line);
+    ev_leaf(p, NK_NAME, id_tok);
+    next_token(p);
+    if (p->current_token.type != TOK_ASSIGN) {
+        syntax_error(p, "Expected '='");
+        return NO_NODE;
     }
-    next_token();
-    Node *expr = parse_expr();
+    next_token(p);
+    NodeId expr = parse_expr(p);
     if (!expr) {
-        free(id);
-        skip_to_sync();
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    if (current_token.type != TOK_SEMICOLON) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ';'");
-        }
-        free(id);
-        free_tree(expr);
-        skip_to_sync();
-        return NULL;
+    if (p->current_token.type != TOK_SEMICOLON) {
+        syntax_error(p, "Expected ';'");
+        return NO_NODE;
     }
-    next_token();
-    return make_node("AssignStmt", 2, make_node(id, 0), expr);
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_ASSIGN_STMT, 2, make_leaf(p, NK_NAME, id_tok), expr);
 }
 
-Node* parse_for_stmt() {
-    if (current_token.type != TOK_FOR) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'for'");
-        }
-        skip_to_sync();
-        return NULL;
+NodeId parse_for_stmt(Parser *p) {
+    if (p->current_token.type != TOK_FOR) {
+        syntax_error(p, "Expected 'for'");
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_LPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '('");
-        }
-        skip_to_sync();
-        return NULL;
+    ev_enter(p, NK_FOR_STMT, p->current_token.line);
+    next_token(p);
+    if (p->current_token.type != TOK_LPAREN) {
+        syntax_error(p, "Expected '('");
+        return NO_NODE;
     }
-    next_token();
-    Node *init = NULL;
-    if (current_token.type == TOK_INT || current_token.type == TOK_BOOL) {
-        Node *type = parse_type();
+    next_token(p);
+    NodeId init = NO_NODE;
+    if (p->current_token.type == TOK_INT || p->current_token.type == TOK_BOOL) {
+        ev_enter(p, NK_FOR_INIT, p->current_token.line);
+        NodeId type = parse_type(p);
         if (!type) {
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
         int decl_line;
-        const char *type_str = strcmp(type->label, "Type_int") == 0 ? "int" : "bool";
-        Node *init_decl = parse_init_decl(&decl_line, type_str);
+        const char *type_str = p->ast.nodes[type].kind == NK_TYPE_INT ? "int" : "bool";
+        NodeId init_decl = parse_init_decl(p, &decl_line, type_str);
         if (!init_decl) {
-            free_tree(type);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        init = make_node("ForInit", 2, type, init_decl);
-    } else if (current_token.type == TOK_ID) {
-        char *id = strdup(current_token.text);
-        int assign_line = current_token.line;
-        if (!is_variable_declared(id)) {
-            if (assign_line != last_error_line) {
-                add_error(assign_line, "Undeclared variable: %s", id);
-            }
-            free(id);
-            skip_to_sync();
-            return NULL;
+        ev_exit(p);
+        init = make_node(p, NK_FOR_INIT, 2, type, init_decl);
+    } else if (p->current_token.type == TOK_ID) {
+        int id_tok = p->token_index;
+        int assign_line = p->current_token.line;
+        if (!is_variable_declared(p, token_text(p, id_tok))) {
+            syntax_error(p, "Undeclared variable: %s", token_text(p, id_tok));
+            return NO_NODE;
         }
-        next_token();
-        if (current_token.type != TOK_ASSIGN) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected '='");
-            }
-            free(id);
-            skip_to_sync();
-            return NULL;
+        ev_enter(p, NK_FOR_INIT, assign_line);
+        ev_leaf(p, NK_NAME, id_tok);
+        next_token(p);
+        if (p->current_token.type != TOK_ASSIGN) {
+            syntax_error(p, "Expected '='");
+            return NO_NODE;
         }
-        next_token();
-        Node *expr = parse_expr();
+        next_token(p);
+        NodeId expr = parse_expr(p);
         if (!expr) {
-            free(id);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        init = make_node("ForInit", 2, make_node(id, 0), expr);
+        ev_exit(p);
+        init = make_node(p, NK_FOR_INIT, 2, make_leaf(p, NK_NAME, id_tok), expr);
     } else {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected 'int', 'bool', or identifier for for-loop initialization");
-        }
-        skip_to_sync();
-        return NULL;
+        syntax_error(p, "Expected 'int', 'bool', or identifier for for-loop initialization");
+        return NO_NODE;
     }
-    if (current_token.type != TOK_SEMICOLON) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ';' after for-loop initialization");
-        }
-        free_tree(init);
-        skip_to_sync();
-        return NULL;
+    if (p->current_token.type != TOK_SEMICOLON) {
+        syntax_error(p, "Expected ';' after for-loop initialization");
+        return NO_NODE;
     }
-    next_token();
-    Node *cond = parse_expr();
+    next_token(p);
+    NodeId cond = parse_expr(p);
     if (!cond) {
-        free_tree(init);
-        skip_to_sync();
-        return NULL;
+        skip_to_sync(p);
+        return NO_NODE;
     }
-    if (current_token.type != TOK_SEMICOLON) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ';' after for-loop condition");
-        }
-        free_tree(init);
-        free_tree(cond);
-        skip_to_sync();
-        return NULL;
+    if (p->current_token.type != TOK_SEMICOLON) {
+        syntax_error(p, "Expected ';' after for-loop condition");
+        return NO_NODE;
     }
-    next_token();
-    Node *update = NULL;
-    if (current_token.type == TOK_ID) {
-        char *id = strdup(current_token.text);
-        int update_line = current_token.line;
-        if (!is_variable_declared(id)) {
-            if (update_line != last_error_line) {
-                add_error(update_line, "Undeclared variable: %s", id);
-            }
-            free(id);
-            free_tree(init);
-            free_tree(cond);
-            skip_to_sync();
-            return NULL;
+    next_token(p);
+    NodeId update = NO_NODE;
+    if (p->current_token.type == TOK_ID) {
+        int id_tok = p->token_index;
+        int update_line = p->current_token.line;
+        if (!is_variable_declared(p, token_text(p, id_tok))) {
+            syntax_error(p, "Undeclared variable: %s", token_text(p, id_tok));
+            return NO_NODE;
         }
-        next_token();
-        if (current_token.type != TOK_ASSIGN) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected '=' in for-loop update");
-            }
-            free(id);
-            free_tree(init);
-            free_tree(cond);
-            skip_to_sync();
-            return NULL;
+        ev_enter(p, NK_UPDATE, update_line);
+        ev_leaf(p, NK_NAME, id_tok);
+        next_token(p);
+        if (p->current_token.type != TOK_ASSIGN) {
+            syntax_error(p, "Expected '=' in for-loop update");
+            return NO_NODE;
         }
-        next_token();
-        Node *expr = parse_expr();
+        next_token(p);
+        NodeId expr = parse_expr(p);
         if (!expr) {
-            free(id);
-            free_tree(init);
-            free_tree(cond);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        update = make_node("Update", 2, make_node(id, 0), expr);
+        ev_exit(p);
+        update = make_node(p, NK_UPDATE, 2, make_leaf(p, NK_NAME, id_tok), expr);
     } else {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected identifier in for-loop update");
-        }
-        free_tree(init);
-        free_tree(cond);
-        skip_to_sync();
-        return NULL;
+        syntax_error(p, "Expected identifier in for-loop update");
+        return NO_NODE;
     }
-    if (current_token.type != TOK_RPAREN) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected ')' after for-loop update");
-        }
-        free_tree(init);
-        free_tree(cond);
-        free_tree(update);
-        skip_to_sync();
-        return NULL;
+    if (p->current_token.type != TOK_RPAREN) {
+        syntax_error(p, "Expected ')' after for-loop update");
+        return NO_NODE;
     }
-    next_token();
-    if (current_token.type != TOK_LBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '{' for for-loop body");
-        }
-        free_tree(init);
-        free_tree(cond);
-        free_tree(update);
-        skip_to_sync();
-        return NULL;
+    next_token(p);
+    if (p->current_token.type != TOK_LBRACE) {
+        syntax_error(p, "Expected '{' for for-loop body");
+        return NO_NODE;
     }
-    next_token();
-    Node *stmts = parse_stmts();
-    if (current_token.type != TOK_RBRACE) {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Expected '}' after for-loop body");
-        }
-        free_tree(init);
-        free_tree(cond);
-        free_tree(update);
-        free_tree(stmts);
-        skip_to_sync();
-        return NULL;
+    next_token(p);
+    NodeId stmts = parse_block_stmts(p);
+    if (p->current_token.type != TOK_RBRACE) {
+        syntax_error(p, "Expected '}' after for-loop body");
+        return NO_NODE;
     }
-    next_token();
-    return make_node("ForStmt", 4, init, cond, update, stmts ? stmts : make_node("Stmts", 0));
+    next_token(p);
+    ev_exit(p);
+    return make_node(p, NK_FOR_STMT, 4, init, cond, update, stmts ? stmts : make_node(p, NK_STMTS, 0));
 }
 
-Node* parse_expr() {
-    Node *eq = parse_eq_expr();
+// Full expression; in event mode the subtree is emitted and then dropped
+NodeId parse_expr(Parser *p) {
+    uint32_t node_mark = p->ast.node_count, child_mark = p->ast.child_count;
+    NodeId eq = parse_eq_expr(p);
+    if (eq && p->events) {
+        ast_emit(&p->ast, eq, p->events);
+        p->ast.node_count = node_mark;
+        p->ast.child_count = child_mark;
+    }
     return eq;
 }
 
-Node* parse_eq_expr() {
-    Node *rel = parse_rel_expr();
-    if (!rel) return NULL;
-    while (current_token.type == TOK_EQ) {
-        next_token();
-        Node *rel2 = parse_rel_expr();
+NodeId parse_eq_expr(Parser *p) {
+    if (governor_check(p)) return NO_NODE;
+    NodeId rel = parse_rel_expr(p);
+    if (!rel) return NO_NODE;
+    while (p->current_token.type == TOK_EQ) {
+        next_token(p);
+        NodeId rel2 = parse_rel_expr(p);
         if (!rel2) {
-            free_tree(rel);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        rel = make_node("EqExpr", 2, rel, rel2);
+        rel = make_node(p, NK_EQ_EXPR, 2, rel, rel2);
     }
     return rel;
 }
 
-Node* parse_rel_expr() {
-    Node *add = parse_add_expr();
-    if (!add) return NULL;
-    while (current_token.type == TOK_GT || current_token.type == TOK_GTE) {
-        TokenType op = current_token.type;
-        next_token();
-        Node *add2 = parse_add_expr();
+NodeId parse_rel_expr(Parser *p) {
+    NodeId add = parse_add_expr(p);
+    if (!add) return NO_NODE;
+    while (p->current_token.type == TOK_GT || p->current_token.type == TOK_GTE) {
+        TokenType op = p->current_token.type;
+        next_token(p);
+        NodeId add2 = parse_add_expr(p);
         if (!add2) {
-            free_tree(add);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        add = make_node(op == TOK_GT ? "Gt" : "Gte", 2, add, add2);
+        add = make_node(p, op == TOK_GT ? NK_GT : NK_GTE, 2, add, add2);
     }
     return add;
 }
 
-Node* parse_add_expr() {
-    Node *mul = parse_mul_expr();
-    if (!mul) return NULL;
-    while (current_token.type == TOK_PLUS) {
-        next_token();
-        Node *mul2 = parse_mul_expr();
+NodeId parse_add_expr(Parser *p) {
+    NodeId mul = parse_mul_expr(p);
+    if (!mul) return NO_NODE;
+    while (p->current_token.type == TOK_PLUS) {
+        next_token(p);
+        NodeId mul2 = parse_mul_expr(p);
         if (!mul2) {
-            free_tree(mul);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        mul = make_node("AddExpr", 2, mul, mul2);
+        mul = make_node(p, NK_ADD_EXPR, 2, mul, mul2);
     }
     return mul;
 }
 
-Node* parse_mul_expr() {
-    Node *prim = parse_prim_expr();
-    if (!prim) return NULL;
-    while (current_token.type == TOK_MUL) {
-        next_token();
-        Node *prim2 = parse_prim_expr();
+NodeId parse_mul_expr(Parser *p) {
+    NodeId prim = parse_prim_expr(p);
+    if (!prim) return NO_NODE;
+    while (p->current_token.type == TOK_MUL) {
+        next_token(p);
+        NodeId prim2 = parse_prim_expr(p);
         if (!prim2) {
-            free_tree(prim);
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        prim = make_node("MulExpr", 2, prim, prim2);
+        prim = make_node(p, NK_MUL_EXPR, 2, prim, prim2);
     }
     return prim;
 }
 
-Node* parse_prim_expr() {
-    if (current_token.type == TOK_ID) {
-        char *id = strdup(current_token.text);
-        int expr_line = current_token.line;
-        if (!is_variable_declared(id)) {
-            if (expr_line != last_error_line) {
-                add_error(expr_line, "Undeclared variable: %s", id);
-            }
-            free(id);
-            skip_to_sync();
-            return NULL;
+NodeId parse_prim_expr(Parser *p) {
+    if (p->current_token.type == TOK_ID) {
+        int id_tok = p->token_index;
+        if (!is_variable_declared(p, token_text(p, id_tok))) {
+            syntax_error(p, "Undeclared variable: %s", token_text(p, id_tok));
+            return NO_NODE;
         }
-        next_token();
-        return make_node("Id", 1, make_node(id, 0));
-    } else if (current_token.type == TOK_NUM || current_token.type == TOK_TRUE || current_token.type == TOK_FALSE) {
-        return parse_lit();
-    } else if (current_token.type == TOK_LPAREN) {
-        next_token();
-        Node *expr = parse_expr();
+        next_token(p);
+        return make_leaf(p, NK_ID, id_tok);
+    } else if (p->current_token.type == TOK_NUM || p->current_token.type == TOK_TRUE || p->current_token.type == TOK_FALSE) {
+        return parse_lit(p);
+    } else if (p->current_token.type == TOK_LPAREN) {
+        next_token(p);
+        NodeId expr = parse_eq_expr(p);
         if (!expr) {
-            skip_to_sync();
-            return NULL;
+            skip_to_sync(p);
+            return NO_NODE;
         }
-        if (current_token.type != TOK_RPAREN) {
-            if (current_token.line != last_error_line) {
-                add_error(current_token.line, "Expected ')'");
-            }
-            free_tree(expr);
-            skip_to_sync();
-            return NULL;
+        if (p->current_token.type != TOK_RPAREN) {
+            syntax_error(p, "Expected ')'");
+            return NO_NODE;
         }
-        next_token();
+        next_token(p);
         return expr;
     } else {
-        if (current_token.line != last_error_line) {
-            add_error(current_token.line, "Invalid primary expression");
-        }
-        skip_to_sync();
-        return NULL;
+        syntax_error(p, "Invalid primary expression");
+        return NO_NODE;
     }
 }
 
-Node* parse_lit() {
-    if (current_token.type == TOK_NUM) {
-        char *num = strdup(current_token.text);
-        next_token();
-        return make_node("Num", 1, make_node(num, 0));
-    } else if (current_token.type == TOK_TRUE) {
-        next_token();
-        return make_node("True", 0);
-    } else if (current_token.type == TOK_FALSE) {
-        next_token();
-        return make_node("False", 0);
-    }
-    if (current_token.line != last_error_line) {
-        add_error(current_token.line, "Expected literal");
+NodeId parse_lit(Parser *p) {
+    if (p->current_token.type == TOK_NUM) {
+        int num_tok = p->token_index;
+        next_token(p);
+        return make_leaf(p, NK_NUM, num_tok);
+    } else if (p->current_token.type == TOK_TRUE || p->current_token.type == TOK_FALSE) {
+        NodeKind kind = p->current_token.type == TOK_TRUE ? NK_TRUE : NK_FALSE;
+        int lit_tok = p->token_index;
+        next_token(p);
+        return make_leaf(p, kind, lit_tok);
     }
-    skip_to_sync();
-    return NULL;
+    syntax_error(p, "Expected literal");
+    return NO_NODE;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
-        exit(1);
-    }
-    file = fopen(argv[1], "r");
-    if (!file) {
-        fprintf(stderr, "Could not open file %s\n", argv[1]);
-        exit(1);
-    }
-    init_token_list();
-    init_symbol_table();
-    tokenize_file();
-    fclose(file);
-    token_index = -1;
-    next_token();
-    Node *root = parse_prog();
-    if (error_count > 0 || !root || current_token.type != TOK_EOF) {
-        printf("- source code has correct syntax: no\n");
-        print_errors();
-    } else {
-        printf("- source code has correct syntax: yes\n");
-        print_tree(root, 0);
+// LL(1) engine: the grammar below is turned into a prediction table at first
+// use and run with explicit heap stacks, so nesting depth is only bounded by
+// memory. Actions reproduce the recursive descent's events, node shapes and
+// diagnostics; a failure unwinds to the innermost statement (or else branch).
+
+#define G_P(lhs) { GI_PROD, lhs, 0, 0, NULL }
+#define G_DEFAULT(lhs) { GI_PROD, lhs, 1, 0, NULL } // Also used for tokens with no entry
+#define G_T(tok, msg) { GI_TERM, tok, 0, 0, msg }
+#define G_T_DECL(tok, msg) { GI_TERM, tok, 1, 0, msg } // Reported at the declaration's line
+#define G_N(nt) { GI_NONTERM, nt, 0, 0, NULL }
+#define G_A(act, kind, count) { GI_ACTION, act, kind, count, NULL }
+#define G_A_MSG(act, msg) { GI_ACTION, act, 0, 0, msg }
+
+const GrammarItem grammar[] = {
+    G_A(A_NONE, 0, 0), // Index 0 stands for no production in the table
+
+    G_P(G_PROG), G_A(A_ENTER, NK_PROG, 0), G_T(TOK_BEGIN, "Expected 'begin'"), G_N(G_STMTS),
+        G_T(TOK_END, "Expected 'end'"), G_A(A_EXIT, 0, 0), G_A(A_BLOCK, 0, 0), G_A(A_BUILD, NK_PROG, 1),
+
+    G_DEFAULT(G_STMTS), G_A(A_LIST_BEGIN, 0, 0), G_N(G_STMT_LIST), G_A(A_LIST_END, 0, 0),
+    G_DEFAULT(G_STMT_LIST), G_A(A_STMT_BEGIN, 0, 0), G_N(G_STMT), G_A(A_STMT_END, 0, 0), G_N(G_STMT_LIST),
+    G_P(G_STMT_LIST),
+
+    G_P(G_STMT), G_N(G_IF_STMT),
+    G_P(G_STMT), G_N(G_DO_WHILE),
+    G_P(G_STMT), G_N(G_PRINT),
+    G_P(G_STMT), G_N(G_DECL),
+    G_P(G_STMT), G_N(G_FOR),
+    G_P(G_STMT), G_A_MSG(A_PEEK_ASSIGN, "Expected 'int' or 'bool' for declaration or '=' for assignment"), G_N(G_ASSIGN),
+
+    G_P(G_IF_STMT), G_A(A_ENTER, NK_IF_STMT, 0), G_A(A_ENTER, NK_IF_THEN, 0), G_T(TOK_IF, "Expected 'if'"),
+        G_T(TOK_LPAREN, "Expected '('"), G_N(G_EXPR), G_T(TOK_RPAREN, "Expected ')'"),
+        G_T(TOK_THEN, "Expected 'then'"), G_T(TOK_LBRACE, "Expected '{'"), G_N(G_STMTS),
+        G_T(TOK_RBRACE, "Expected '}'"), G_A(A_EXIT, 0, 0), G_A(A_BLOCK, 0, 0), G_A(A_BUILD, NK_IF_THEN, 2),
+        G_N(G_ELSE_OPT), G_A(A_EXIT, 0, 0), G_A(A_BUILD, NK_IF_STMT, 2),
+    G_P(G_ELSE_OPT), G_A(A_ELSE_BEGIN, 0, 0), G_A(A_ENTER, NK_ELSE_OPT, 0), G_T(TOK_ELSE, "Expected 'else'"),
+        G_T(TOK_LBRACE, "Expected '{'"), G_N(G_STMTS), G_T(TOK_RBRACE, "Expected '}'"), G_A(A_EXIT, 0, 0),
+        G_A(A_BLOCK, 0, 0), G_A(A_BUILD, NK_ELSE_OPT, 1), G_A(A_ELSE_END, 0, 0),
+    G_DEFAULT(G_ELSE_OPT), G_A(A_NONE, 0, 0),
+
+    G_P(G_DO_WHILE), G_A(A_ENTER, NK_DO_WHILE_STMT, 0), G_T(TOK_DO, "Expected 'do'"), G_T(TOK_LBRACE, "Expected '{'"),
+        G_N(G_STMTS), G_T(TOK_RBRACE, "Expected '}'"), G_T(TOK_WHILE, "Expected 'while'"),
+        G_T(TOK_LPAREN, "Expected '('"), G_N(G_EXPR), G_T(TOK_RPAREN, "Expected ')'"),
+        G_T(TOK_SEMICOLON, "Expected ';'"), G_A(A_EXIT, 0, 0), G_A(A_BLOCK, 0, 1), G_A(A_BUILD, NK_DO_WHILE_STMT, 2),
+
+    G_P(G_PRINT), G_A(A_ENTER, NK_PRINT_STMT, 0), G_T(TOK_PRINT, "Expected 'print'"), G_T(TOK_LPAREN, "Expected '('"),
+        G_N(G_EXPR), G_T(TOK_RPAREN, "Expected ')'"), G_T(TOK_SEMICOLON, "Expected ';'"), G_A(A_EXIT, 0, 0),
+        G_A(A_BUILD, NK_PRINT_STMT, 1),
+
+    G_P(G_DECL), G_A(A_ENTER, NK_DECL_STMT, 0), G_N(G_TYPE), G_N(G_INIT_DECL), G_T_DECL(TOK_SEMICOLON, "Expected ';'"),
+        G_A(A_EXIT, 0, 0), G_A(A_BUILD, NK_DECL_STMT, 2),
+    G_P(G_TYPE), G_A(A_EV_LEAF, NK_TYPE_INT, 0), G_T(TOK_INT, "Expected 'int' or 'bool'"),
+    G_P(G_TYPE), G_A(A_EV_LEAF, NK_TYPE_BOOL, 0), G_T(TOK_BOOL, "Expected 'int' or 'bool'"),
+    G_P(G_INIT_DECL), G_A(A_DECL_LINE, 0, 0), G_A(A_ENTER, NK_INIT_DECL, 0), G_A(A_EV_LEAF, NK_NAME, 0),
+        G_T(TOK_ID, "Expected identifier"), G_N(G_INIT_TAIL),
+    G_P(G_INIT_TAIL), G_T(TOK_ASSIGN, "Expected '='"), G_N(G_EXPR), G_A(A_ADD_SYMBOL, 0, 2), G_A(A_EXIT, 0, 0),
+        G_A(A_BUILD, NK_INIT_DECL, 2),
+    G_DEFAULT(G_INIT_TAIL), G_A(A_ADD_SYMBOL, 0, 1), G_A(A_EXIT, 0, 0), G_A(A_BUILD, NK_INIT_DECL, 1),
+
+    G_P(G_ASSIGN), G_A(A_DECLARED, 0, 0), G_A(A_ENTER, NK_ASSIGN_STMT, 0), G_A(A_EV_LEAF, NK_NAME, 0),
+        G_T(TOK_ID, "Expected identifier"), G_T(TOK_ASSIGN, "Expected '='"), G_N(G_EXPR),
+        G_T(TOK_SEMICOLON, "Expected ';'"), G_A(A_EXIT, 0, 0), G_A(A_BUILD, NK_ASSIGN_STMT, 2),
+
+    G_P(G_FOR), G_A(A_ENTER, NK_FOR_STMT, 0), G_T(TOK_FOR, "Expected 'for'"), G_T(TOK_LPAREN, "Expected '('"),
+        G_N(G_FOR_INIT), G_T(TOK_SEMICOLON, "Expected ';' after for-loop initialization"), G_N(G_EXPR),
+        G_T(TOK_SEMICOLON, "Expected ';' after for-loop condition"), G_N(G_UPDATE),
+        G_T(TOK_RPAREN, "Expected ')' after for-loop update"), G_T(TOK_LBRACE, "Expected '{' for for-loop body"),
+        G_N(G_STMTS), G_T(TOK_RBRACE, "Expected '}' after for-loop body"), G_A(A_EXIT, 0, 0), G_A(A_BLOCK, 0, 0),
+        G_A(A_BUILD, NK_FOR_STMT, 4),
+    G_P(G_FOR_INIT), G_A(A_ENTER, NK_FOR_INIT, 0), G_N(G_TYPE), G_N(G_INIT_DECL), G_A(A_EXIT, 0, 0),
+        G_A(A_BUILD, NK_FOR_INIT, 2),
+    G_P(G_FOR_INIT), G_A(A_DECLARED, 0, 0), G_A(A_ENTER, NK_FOR_INIT, 0), G_A(A_EV_LEAF, NK_NAME, 0),
+        G_T(TOK_ID, "Expected identifier"), G_T(TOK_ASSIGN, "Expected '='"), G_N(G_EXPR), G_A(A_EXIT, 0, 0),
+        G_A(A_BUILD, NK_FOR_INIT, 2),
+    G_P(G_UPDATE), G_A(A_DECLARED, 0, 0), G_A(A_ENTER, NK_UPDATE, 0), G_A(A_EV_LEAF, NK_NAME, 0),
+        G_T(TOK_ID, "Expected identifier in for-loop update"), G_T(TOK_ASSIGN, "Expected '=' in for-loop update"),
+        G_N(G_EXPR), G_A(A_EXIT, 0, 0), G_A(A_BUILD, NK_UPDATE, 2),
+
+    G_DEFAULT(G_EXPR), G_A(A_EXPR_BEGIN, 0, 0), G_N(G_EQ), G_A(A_EXPR_END, 0, 0),
+    G_DEFAULT(G_EQ), G_N(G_REL), G_N(G_EQ_TAIL),
+    G_P(G_EQ_TAIL), G_T(TOK_EQ, "Expected '=='"), G_N(G_REL), G_A(A_BUILD, NK_EQ_EXPR, 2), G_N(G_EQ_TAIL),
+    G_DEFAULT(G_EQ_TAIL),
+    G_DEFAULT(G_REL), G_N(G_ADD), G_N(G_REL_TAIL),
+    G_P(G_REL_TAIL), G_T(TOK_GT, "Expected '>'"), G_N(G_ADD), G_A(A_BUILD, NK_GT, 2), G_N(G_REL_TAIL),
+    G_P(G_REL_TAIL), G_T(TOK_GTE, "Expected '>='"), G_N(G_ADD), G_A(A_BUILD, NK_GTE, 2), G_N(G_REL_TAIL),
+    G_DEFAULT(G_REL_TAIL),
+    G_DEFAULT(G_ADD), G_N(G_MUL), G_N(G_ADD_TAIL),
+    G_P(G_ADD_TAIL), G_T(TOK_PLUS, "Expected '+'"), G_N(G_MUL), G_A(A_BUILD, NK_ADD_EXPR, 2), G_N(G_ADD_TAIL),
+    G_DEFAULT(G_ADD_TAIL),
+    G_DEFAULT(G_MUL), G_N(G_PRIM), G_N(G_MUL_TAIL),
+    G_P(G_MUL_TAIL), G_T(TOK_MUL, "Expected '*'"), G_N(G_PRIM), G_A(A_BUILD, NK_MUL_EXPR, 2), G_N(G_MUL_TAIL),
+    G_DEFAULT(G_MUL_TAIL),
+    G_P(G_PRIM), G_A(A_DECLARED, 0, 0), G_A(A_LEAF, NK_ID, 0), G_T(TOK_ID, "Expected identifier"),
+    G_P(G_PRIM), G_A(A_LEAF, NK_NUM, 0), G_T(TOK_NUM, "Expected literal"),
+    G_P(G_PRIM), G_A(A_LEAF, NK_TRUE, 0), G_T(TOK_TRUE, "Expected literal"),
+    G_P(G_PRIM), G_A(A_LEAF, NK_FALSE, 0), G_T(TOK_FALSE, "Expected literal"),
+    G_P(G_PRIM), G_T(TOK_LPAREN, "Expected '('"), G_N(G_EQ), G_T(TOK_RPAREN, "Expected ')'"),
+};
+
+#define GRAMMAR_SIZE (sizeof(grammar) / sizeof(grammar[0]))
+
+// Reported when a nonterminal has no production for the current token
+const char *const grammar_errors[G_COUNT] = {
+    [G_PROG] = "Expected 'begin'",
+    [G_STMT] = "Expected 'int', 'bool', identifier, or statement keyword",
+    [G_TYPE] = "Expected 'int' or 'bool'",
+    [G_INIT_DECL] = "Expected identifier",
+    [G_FOR_INIT] = "Expected 'int', 'bool', or identifier for for-loop initialization",
+    [G_UPDATE] = "Expected identifier in for-loop update",
+    [G_PRIM] = "Invalid primary expression",
+};
+
+// Prediction table: index of the production header in grammar[], 0 for none
+uint16_t ll1_table[G_COUNT][TOKEN_COUNT];
+uint16_t ll1_end[GRAMMAR_SIZE]; // For production headers, the index past the last item
+pthread_once_t ll1_once = PTHREAD_ONCE_INIT;
+
+// FIRST of grammar[start..end); returns 1 if the whole sequence can be empty
+int ll1_first(uint32_t start, uint32_t end, const TokenSet *first, const int *nullable, TokenSet *set) {
+    for (uint32_t i = start; i < end; i++) {
+        if (grammar[i].type == GI_TERM) {
+            *set |= TOKEN_BIT(grammar[i].arg);
+            return 0;
+        }
+        if (grammar[i].type == GI_NONTERM) {
+            *set |= first[grammar[i].arg];
+            if (!nullable[grammar[i].arg]) return 0;
+        }
+    }
+    return 1;
+}
+
+// Compute FIRST, nullable and FOLLOW to a fixed point and fill the table.
+// EOF follows every nonterminal, so truncated input ends lists and tails and
+// the missing token is reported by the construct that needs it.
+void ll1_build_table(void) {
+    TokenSet first[G_COUNT] = { 0 }, follow[G_COUNT] = { 0 };
+    int nullable[G_COUNT] = { 0 };
+    for (uint32_t i = 0; i < GRAMMAR_SIZE; i++) {
+        if (grammar[i].type != GI_PROD) continue;
+        uint32_t end = i + 1;
+        while (end < GRAMMAR_SIZE && grammar[end].type != GI_PROD) end++;
+        ll1_end[i] = end;
+    }
+    for (int nt = 0; nt < G_COUNT; nt++) follow[nt] = TOKEN_BIT(TOK_EOF);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (uint32_t i = 0; i < GRAMMAR_SIZE; i++) {
+            if (grammar[i].type != GI_PROD) continue;
+            int lhs = grammar[i].arg;
+            TokenSet set = first[lhs];
+            int empty = ll1_first(i + 1, ll1_end[i], first, nullable, &set);
+            if (set != first[lhs] || (empty && !nullable[lhs])) changed = 1;
+            first[lhs] = set;
+            nullable[lhs] |= empty;
+            for (uint32_t j = i + 1; j < ll1_end[i]; j++) {
+                if (grammar[j].type != GI_NONTERM) continue;
+                int nt = grammar[j].arg;
+                TokenSet rest = follow[nt];
+                if (ll1_first(j + 1, ll1_end[i], first, nullable, &rest)) rest |= follow[lhs];
+                if (rest != follow[nt]) changed = 1;
+                follow[nt] = rest;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < GRAMMAR_SIZE; i++) {
+        if (grammar[i].type != GI_PROD) continue;
+        int lhs = grammar[i].arg;
+        TokenSet set = 0;
+        if (ll1_first(i + 1, ll1_end[i], first, nullable, &set)) set |= follow[lhs];
+        for (int t = 0; t < TOKEN_COUNT; t++) {
+            if ((set & TOKEN_BIT(t)) && !ll1_table[lhs][t]) ll1_table[lhs][t] = i;
+        }
+    }
+    for (uint32_t i = 0; i < GRAMMAR_SIZE; i++) {
+        if (grammar[i].type != GI_PROD || !grammar[i].kind) continue;
+        for (int t = 0; t < TOKEN_COUNT; t++) {
+            if (!ll1_table[grammar[i].arg][t]) ll1_table[grammar[i].arg][t] = i;
+        }
+    }
+}
+
+void ll1_push_value(LLState *s, NodeId value) {
+    if (s->value_count >= s->value_capacity) {
+        s->value_capacity = s->value_capacity ? s->value_capacity * 2 : 1024;
+        s->values = realloc(s->values, sizeof(NodeId) * s->value_capacity);
+    }
+    s->values[s->value_count++] = value;
+}
+
+LLFrame* ll1_push_frame(LLState *s, int type) {
+    if (s->frame_count >= s->frame_capacity) {
+        s->frame_capacity = s->frame_capacity ? s->frame_capacity * 2 : 256;
+        s->frames = realloc(s->frames, sizeof(LLFrame) * s->frame_capacity);
+    }
+    LLFrame *frame = &s->frames[s->frame_count++];
+    memset(frame, 0, sizeof(LLFrame));
+    frame->type = type;
+    frame->values = s->value_count;
+    return frame;
+}
+
+// Replace a nonterminal by the predicted production; 0 on a syntax error
+int ll1_expand(Parser *p, int nt) {
+    LLState *s = &p->ll;
+    uint16_t prod = ll1_table[nt][p->current_token.type];
+    if (!prod) {
+        syntax_error(p, "%s", grammar_errors[nt]);
+        return 0;
+    }
+    uint32_t length = ll1_end[prod] - prod - 1;
+    if (s->item_count + length > s->item_capacity) {
+        while (s->item_count + length > s->item_capacity) {
+            s->item_capacity = s->item_capacity ? s->item_capacity * 2 : 1024;
+        }
+        s->items = realloc(s->items, sizeof(uint16_t) * s->item_capacity);
+    }
+    for (uint32_t i = ll1_end[prod]; i > prod + 1u; i--) s->items[s->item_count++] = i - 1;
+    return 1;
+}
+
+// Run a semantic action; 0 on a syntax error
+int ll1_action(Parser *p, const GrammarItem *item) {
+    LLState *s = &p->ll;
+    LLFrame *frame;
+    switch (item->arg) {
+    case A_ENTER:
+        ev_enter(p, item->kind, p->current_token.line);
+        break;
+    case A_EXIT:
+        ev_exit(p);
+        break;
+    case A_EV_LEAF:
+        ev_leaf(p, item->kind, p->token_index);
+        ll1_push_value(s, make_leaf(p, item->kind, p->token_index));
+        break;
+    case A_LEAF:
+        ll1_push_value(s, make_leaf(p, item->kind, p->token_index));
+        break;
+    case A_NONE:
+        ll1_push_value(s, NO_NODE);
+        break;
+    case A_BUILD: {
+        NodeId id = make_node_list(p, item->kind, s->values + s->value_count - item->count, item->count);
+        s->value_count -= item->count;
+        ll1_push_value(s, id);
+        break;
+    }
+    case A_BLOCK:
+        if (!s->values[s->value_count - 1 - item->count]) {
+            s->values[s->value_count - 1 - item->count] = make_node(p, NK_STMTS, 0);
+        }
+        break;
+    case A_DECLARED:
+        if (!is_variable_declared(p, p->current_token.text)) {
+            syntax_error(p, "Undeclared variable: %s", p->current_token.text);
+            return 0;
+        }
+        break;
+    case A_PEEK_ASSIGN: {
+        // The one place the grammar needs a second token of lookahead
+        int next = p->token_index + 1;
+        pull_tokens(p, next + 1);
+        TokenType type = next < p->token_list.count ? p->token_list.tokens[next].type : p->current_token.type;
+        if (type != TOK_ASSIGN) {
+            syntax_error(p, "%s", item->message);
+            return 0;
+        }
+        break;
+    }
+    case A_DECL_LINE:
+        s->decl_line = p->current_token.line;
+        break;
+    case A_ADD_SYMBOL: {
+        NodeId name = s->values[s->value_count - item->count];
+        NodeId type = s->values[s->value_count - item->count - 1];
+        add_symbol(p, ast_text(&p->ast, name), ast_kind(&p->ast, type) == NK_TYPE_INT ? "int" : "bool", s->decl_line);
+        break;
+    }
+    case A_EXPR_BEGIN:
+        s->expr_node_mark = p->ast.node_count;
+        s->expr_child_mark = p->ast.child_count;
+        break;
+    case A_EXPR_END:
+        if (p->events) {
+            ast_emit(&p->ast, s->values[s->value_count - 1], p->events);
+            p->ast.node_count = s->expr_node_mark;
+            p->ast.child_count = s->expr_child_mark;
+        }
+        break;
+    case A_LIST_BEGIN:
+        frame = ll1_push_frame(s, A_LIST_BEGIN);
+        frame->ev_base = p->ev_depth;
+        ev_enter(p, NK_STMTS, p->current_token.line);
+        break;
+    case A_LIST_END: {
+        frame = &s->frames[--s->frame_count];
+        ev_exit(p);
+        NodeId list = frame->count ? make_node_list(p, NK_STMTS, s->values + frame->values, frame->count) : NO_NODE;
+        s->value_count = frame->values;
+        ll1_push_value(s, list);
+        break;
+    }
+    case A_STMT_BEGIN:
+        if (s->frames[s->frame_count - 1].count >= MAX_STMTS) {
+            syntax_error(p, "Too many statements");
+            while (grammar[s->items[s->item_count - 1]].arg != A_LIST_END
+                || grammar[s->items[s->item_count - 1]].type != GI_ACTION) {
+                s->item_count--;
+            }
+            break;
+        }
+        if (p->current_token.line != p->last_error_line) p->last_error_line = 0;
+        p->synced = 0;
+        frame = ll1_push_frame(s, A_STMT_BEGIN);
+        frame->ev_base = p->ev_depth;
+        frame->node_mark = p->ast.node_count;
+        frame->child_mark = p->ast.child_count;
+        break;
+    case A_STMT_END:
+        frame = &s->frames[--s->frame_count];
+        if (p->events) {
+            // Close what a failed statement left open; its nodes are no longer needed
+            ev_unwind(p, frame->ev_base);
+            p->ast.node_count = frame->node_mark;
+            p->ast.child_count = frame->child_mark;
+        }
+        if (frame->failed) {
+            if (p->current_token.line != p->last_error_line) skip_to_sync(p);
+        } else {
+            s->frames[s->frame_count - 1].count++;
+        }
+        break;
+    case A_ELSE_BEGIN:
+        ll1_push_frame(s, A_ELSE_BEGIN);
+        break;
+    case A_ELSE_END:
+        frame = &s->frames[--s->frame_count];
+        if (frame->failed) ll1_push_value(s, NO_NODE);
+        break;
+    }
+    return 1;
+}
+
+// After a syntax error, drop the rest of the innermost statement or else
+// branch. Returns 0 if the error is outside any statement.
+int ll1_recover(Parser *p) {
+    LLState *s = &p->ll;
+    while (s->frame_count > 0 && s->frames[s->frame_count - 1].type == A_LIST_BEGIN) s->frame_count--;
+    if (s->frame_count == 0) return 0;
+    LLFrame *frame = &s->frames[s->frame_count - 1];
+    int end = frame->type == A_STMT_BEGIN ? A_STMT_END : A_ELSE_END;
+    frame->failed = 1;
+    s->value_count = frame->values;
+    while (grammar[s->items[s->item_count - 1]].type != GI_ACTION || grammar[s->items[s->item_count - 1]].arg != end) {
+        s->item_count--;
+    }
+    return 1;
+}
+
+NodeId ll1_parse(Parser *p) {
+    pthread_once(&ll1_once, ll1_build_table);
+    LLState *s = &p->ll;
+    s->item_count = 0;
+    s->value_count = 0;
+    s->frame_count = 0;
+    if (!ll1_expand(p, G_PROG)) return NO_NODE;
+    while (s->item_count > 0) {
+        if (governor_check(p)) return NO_NODE;
+        const GrammarItem *item = &grammar[s->items[--s->item_count]];
+        int ok = 1;
+        if (item->type == GI_TERM) {
+            if (p->current_token.type == item->arg) {
+                next_token(p);
+            } else if (item->kind) {
+                if (s->decl_line != p->last_error_line) add_error(p, s->decl_line, "%s", item->message);
+                skip_to_sync(p);
+                ok = 0;
+            } else {
+                syntax_error(p, "%s", item->message);
+                ok = 0;
+            }
+        } else if (item->type == GI_NONTERM) {
+            ok = ll1_expand(p, item->arg);
+        } else {
+            ok = ll1_action(p, item);
+        }
+        if (!ok && !ll1_recover(p)) return NO_NODE;
+    }
+    return s->value_count > 0 ? s->values[s->value_count - 1] : NO_NODE;
+}
+
+// Loop optimization pass: induction variables, constant trip counts,
+// invariant hoisting, unrolling and closed-form accumulations
+
+void node_list_push(NodeList *list, NodeId id) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = realloc(list->items, sizeof(NodeId) * list->capacity);
+    }
+    list->items[list->count++] = id;
+}
+
+void walk_push(WalkStack *stack, NodeId id) {
+    if (stack->count >= stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 16;
+        stack->items = realloc(stack->items, sizeof(WalkFrame) * stack->capacity);
+    }
+    stack->items[stack->count++] = (WalkFrame){ id, 0 };
+}
+
+// Tokens made up by passes go after EOF, where the parser never looks
+int synth_token(Parser *p, TokenType type, const char *text, int line) {
+    add_token(p, type, text, line);
+    return p->token_list.count - 1;
+}
+
+int node_line(Parser *p, NodeId id) {
+    return p->token_list.tokens[p->ast.nodes[id].token].line;
+}
+
+NodeId make_num(Parser *p, long long value, int line) {
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", value);
+    return make_leaf(p, NK_NUM, synth_token(p, TOK_NUM, text, line));
+}
+
+// Point a node at a fresh run of child ids
+void set_children(Parser *p, NodeId id, const NodeId *children, int num_children) {
+    Ast *ast = &p->ast;
+    while (ast->child_count + num_children > ast->child_capacity) {
+        ast->child_capacity *= 2;
+        ast->children = realloc(ast->children, sizeof(NodeId) * ast->child_capacity);
+    }
+    if (num_children > 0) memcpy(ast->children + ast->child_count, children, sizeof(NodeId) * num_children);
+    ast->nodes[id].first_child = ast->child_count;
+    ast->nodes[id].num_children = num_children;
+    ast->child_count += num_children;
+}
+
+// Copy a subtree, parents before children
+NodeId clone_tree(Parser *p, NodeId id) {
+    if (!id) return NO_NODE;
+    WalkStack stack = { NULL, 0, 0 };
+    NodeId root = copy_node(p, id);
+    walk_push(&stack, root);
+    while (stack.count > 0) {
+        WalkFrame *f = &stack.items[stack.count - 1];
+        if (f->child == ast_num_children(&p->ast, f->id)) {
+            stack.count--;
+            continue;
+        }
+        NodeId copy = f->id;
+        int i = f->child++;
+        NodeId child = ast_child(&p->ast, copy, i);
+        if (!child) continue;
+        child = copy_node(p, child);
+        p->ast.children[p->ast.nodes[copy].first_child + i] = child;
+        walk_push(&stack, child);
+    }
+    free(stack.items);
+    return root;
+}
+
+int is_var(const Ast *ast, NodeId id, const char *name) {
+    NodeKind kind = ast_kind(ast, id);
+    return (kind == NK_ID || kind == NK_NAME) && strcmp(ast_text(ast, id), name) == 0;
+}
+
+// Sum or product of two forms, into y; a product needs a constant factor
+int affine_combine(NodeKind kind, const Affine *x, Affine *y) {
+    if (kind == NK_ADD_EXPR) {
+        y->constant = x->constant && y->constant;
+        return !__builtin_add_overflow(x->a, y->a, &y->a) && !__builtin_add_overflow(x->b, y->b, &y->b);
+    }
+    long long c;
+    if (x->constant) {
+        c = x->b;
+    } else if (y->constant) {
+        c = y->b;
+        *y = *x;
+    } else {
+        return 0;
+    }
+    return !__builtin_mul_overflow(y->a, c, &y->a) && !__builtin_mul_overflow(y->b, c, &y->b);
+}
+
+// Write expr as a * var + b with constant a and b, or as a constant if var
+// is NULL. Operators are kept on an explicit stack, so any depth the parser
+// builds can be evaluated.
+int affine_form(const Ast *ast, NodeId expr, const char *var, Affine *form) {
+    AffineFrame *frames = NULL;
+    int count = 0, capacity = 0, ok = 1;
+    NodeId id = expr;
+    Affine value;
+    for (;;) {
+        NodeKind kind = ast_kind(ast, id);
+        if (kind == NK_ADD_EXPR || kind == NK_MUL_EXPR) {
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(AffineFrame) * capacity);
+            }
+            frames[count++] = (AffineFrame){ id, 0, { 0, 0, 0 } };
+            id = ast_child(ast, id, 0);
+            continue;
+        }
+        if (kind == NK_NUM) {
+            errno = 0;
+            value = (Affine){ 1, 0, strtoll(ast_text(ast, id), NULL, 10) };
+            ok = errno == 0;
+        } else {
+            value = (Affine){ 0, 1, 0 };
+            ok = kind == NK_ID && var && is_var(ast, id, var);
+        }
+        // Finish the operators whose second operand this was
+        while (ok && count > 0 && frames[count - 1].child == 1) {
+            ok = affine_combine(ast_kind(ast, frames[count - 1].id), &frames[count - 1].first, &value);
+            count--;
+        }
+        if (!ok || count == 0) break;
+        frames[count - 1].first = value;
+        frames[count - 1].child = 1;
+        id = ast_child(ast, frames[count - 1].id, 1);
+    }
+    free(frames);
+    if (ok) *form = value;
+    return ok;
+}
+
+// Value of a constant integer expression
+int eval_int(const Ast *ast, NodeId id, long long *value) {
+    Affine form;
+    if (!affine_form(ast, id, NULL, &form)) return 0;
+    *value = form.b;
+    return 1;
+}
+
+void effects_add(LoopEffects *e, int var) {
+    if (var < 0) return;
+    if (var_has(&e->once, var)) var_add(&e->twice, var);
+    var_add(&e->once, var);
+}
+
+// What a loop already optimized assigns, or NULL. Outer loops leave such a
+// loop's stores alone, so they are recorded once.
+const LoopEffects* optimized_loop(LoopPass *lp, NodeId id) {
+    if ((int)id >= lp->optimized_count || lp->optimized[id] == 0) return NULL;
+    return &lp->effects[lp->optimized[id] - 1];
+}
+
+void remember_loop(LoopPass *lp, NodeId loop, const LoopEffects *e) {
+    if ((int)loop >= lp->optimized_count) {
+        int count = lp->p->ast.node_count;
+        lp->optimized = realloc(lp->optimized, sizeof(int) * count);
+        memset(lp->optimized + lp->optimized_count, 0, sizeof(int) * (count - lp->optimized_count));
+        lp->optimized_count = count;
+    }
+    if (lp->effects_count >= lp->effects_capacity) {
+        lp->effects_capacity = lp->effects_capacity ? lp->effects_capacity * 2 : 16;
+        lp->effects = realloc(lp->effects, sizeof(LoopEffects) * lp->effects_capacity);
+    }
+    lp->effects[lp->effects_count++] = *e;
+    lp->optimized[loop] = lp->effects_count;
+}
+
+// Assignments and declarations in a subtree. A loop already optimized is
+// looked up instead of walked again, so nested loops cost linear time.
+void loop_effects(LoopPass *lp, NodeId id, LoopEffects *e) {
+    Parser *p = lp->p;
+    const Ast *ast = &p->ast;
+    memset(e, 0, sizeof(LoopEffects));
+    lp->stack.count = 0;
+    if (id) node_list_push(&lp->stack, id);
+    while (lp->stack.count > 0) {
+        NodeId node = lp->stack.items[--lp->stack.count];
+        const LoopEffects *inner = node != id ? optimized_loop(lp, node) : NULL;
+        if (inner) {
+            for (int w = 0; w < VAR_WORDS; w++) {
+                e->twice.bits[w] |= inner->twice.bits[w] | (e->once.bits[w] & inner->once.bits[w]);
+                e->once.bits[w] |= inner->once.bits[w];
+            }
+            e->declares |= inner->declares;
+            continue;
+        }
+        NodeKind kind = ast_kind(ast, node);
+        if (kind == NK_INIT_DECL) e->declares = 1;
+        if ((kind == NK_ASSIGN_STMT || kind == NK_UPDATE || kind == NK_FOR_INIT || kind == NK_INIT_DECL)
+            && ast_kind(ast, ast_child(ast, node, 0)) == NK_NAME) {
+            effects_add(e, symbol_index(p, ast_text(ast, ast_child(ast, node, 0))));
+        }
+        for (int i = 0; i < ast_num_children(ast, node); i++) {
+            NodeId child = ast_child(ast, node, i);
+            if (child) node_list_push(&lp->stack, child);
+        }
+    }
+}
+
+// Number of assignments and declarations of name in a subtree, up to two
+int count_assigns(LoopPass *lp, NodeId id, const char *name) {
+    LoopEffects e;
+    loop_effects(lp, id, &e);
+    int var = symbol_index(lp->p, name);
+    if (var < 0) return 0;
+    return var_has(&e.twice, var) ? 2 : var_has(&e.once, var);
+}
+
+// Whether a subtree declares a variable; symbols are global, so a copy of
+// the declaration would declare it again
+int declares_vars(LoopPass *lp, NodeId id) {
+    LoopEffects e;
+    loop_effects(lp, id, &e);
+    return e.declares;
+}
+
+// An expression is invariant in a loop if no variable it reads is assigned there
+int is_invariant(LoopPass *lp, NodeId expr, const LoopEffects *loop, int *reads) {
+    const Ast *ast = &lp->p->ast;
+    NodeList stack = { NULL, 0, 0 };
+    int invariant = 1;
+    node_list_push(&stack, expr);
+    while (stack.count > 0 && invariant) {
+        NodeId id = stack.items[--stack.count];
+        if (ast_kind(ast, id) == NK_ID) {
+            (*reads)++;
+            int var = symbol_index(lp->p, ast_text(ast, id));
+            invariant = var < 0 || !var_has(&loop->once, var);
+            continue;
+        }
+        for (int i = 0; i < ast_num_children(ast, id); i++) {
+            NodeId child = ast_child(ast, id, i);
+            if (child) node_list_push(&stack, child);
+        }
+    }
+    free(stack.items);
+    return invariant;
+}
+
+// Write expr as a * var + b with constant a and b
+int affine_in(const Ast *ast, NodeId expr, const char *var, long long *a, long long *b) {
+    Affine form;
+    if (!affine_form(ast, expr, var, &form)) return 0;
+    *a = form.a;
+    *b = form.b;
+    return 1;
+}
+
+// Recognize var = var + c or var = c + var with a constant c > 0
+int induction_step(const Ast *ast, NodeId stmt, const char **var, long long *step) {
+    NodeId name = ast_child(ast, stmt, 0), expr = ast_child(ast, stmt, 1);
+    if (ast_kind(ast, expr) != NK_ADD_EXPR) return 0;
+    const char *v = ast_text(ast, name);
+    NodeId lhs = ast_child(ast, expr, 0), rhs = ast_child(ast, expr, 1);
+    long long c;
+    if (!(is_var(ast, lhs, v) && eval_int(ast, rhs, &c)) && !(is_var(ast, rhs, v) && eval_int(ast, lhs, &c))) {
+        return 0;
+    }
+    if (c <= 0) return 0;
+    *var = v;
+    *step = c;
+    return 1;
+}
+
+// Count body runs from the condition. The condition is first tested on
+// start + first_test * step: 0 for a for loop, 1 for a do-while.
+int trip_count(const Ast *ast, NodeId cond, Induction *ind, int first_test) {
+    NodeKind kind = ast_kind(ast, cond);
+    if (kind != NK_GT && kind != NK_GTE && kind != NK_EQ_EXPR) return 0;
+    NodeId lhs = ast_child(ast, cond, 0), rhs = ast_child(ast, cond, 1);
+    long long bound, first, span, count;
+    int var_on_left;
+    if (is_var(ast, lhs, ind->var) && eval_int(ast, rhs, &bound)) {
+        var_on_left = 1;
+    } else if (is_var(ast, rhs, ind->var) && eval_int(ast, lhs, &bound)) {
+        var_on_left = 0;
+    } else {
+        return 0;
+    }
+    if (__builtin_add_overflow(ind->start, first_test ? ind->step : 0, &first)) return 0;
+    if (kind == NK_EQ_EXPR) {
+        count = first == bound;
+    } else if (var_on_left) {
+        // var only grows, so var > bound either never holds or never stops holding
+        if (kind == NK_GT ? first > bound : first >= bound) return 0;
+        count = 0;
+    } else if (kind == NK_GT ? first >= bound : first > bound) {
+        count = 0;
+    } else if (__builtin_sub_overflow(bound, first, &span)) {
+        return 0;
+    } else if (kind == NK_GT) {
+        // Rounded up: the last run has var < bound
+        if (__builtin_add_overflow(span, ind->step - 1, &span)) return 0;
+        count = span / ind->step;
+    } else if (__builtin_add_overflow(span / ind->step, 1, &count)) {
+        return 0;
+    }
+    if (__builtin_add_overflow(count, first_test, &ind->trips)) return 0;
+    ind->has_trips = 1;
+    return 1;
+}
+
+// for (init; cond; var = var + c): the body must leave var alone
+int analyze_for(LoopPass *lp, NodeId loop, Induction *ind) {
+    const Ast *ast = &lp->p->ast;
+    NodeId init = ast_child(ast, loop, 0), update = ast_child(ast, loop, 2);
+    NodeId name = ast_child(ast, init, 0), start = ast_child(ast, init, 1);
+    if (ast_kind(ast, name) != NK_NAME) {
+        if (ast_num_children(ast, start) != 2) return 0;
+        name = ast_child(ast, start, 0);
+        start = ast_child(ast, start, 1);
+    }
+    if (!induction_step(ast, update, &ind->var, &ind->step)) return 0;
+    if (strcmp(ind->var, ast_text(ast, name)) != 0) return 0;
+    if (count_assigns(lp, ast_child(ast, loop, 3), ind->var) != 0) return 0;
+    ind->update = update;
+    ind->has_trips = 0;
+    if (eval_int(ast, start, &ind->start)) trip_count(ast, ast_child(ast, loop, 1), ind, 0);
+    return 1;
+}
+
+// do { ... var = var + c; ... } while (cond): one top-level step in the body,
+// and a constant start assigned by an earlier statement of the same block
+int analyze_do_while(LoopPass *lp, NodeId stmts, int index, Induction *ind) {
+    const Ast *ast = &lp->p->ast;
+    NodeId loop = ast_child(ast, stmts, index), body = ast_child(ast, loop, 0);
+    ind->update = NO_NODE;
+    for (int i = 0; i < ast_num_children(ast, body); i++) {
+        NodeId stmt = ast_child(ast, body, i);
+        if (ast_kind(ast, stmt) == NK_ASSIGN_STMT && induction_step(ast, stmt, &ind->var, &ind->step)
+            && count_assigns(lp, body, ind->var) == 1) {
+            ind->update = stmt;
+            break;
+        }
+    }
+    if (!ind->update) return 0;
+    ind->has_trips = 0;
+    for (int i = index - 1; i >= 0; i--) {
+        NodeId stmt = ast_child(ast, stmts, i);
+        if (count_assigns(lp, stmt, ind->var) == 0) continue;
+        NodeId value = NO_NODE;
+        if (ast_kind(ast, stmt) == NK_ASSIGN_STMT) {
+            value = ast_child(ast, stmt, 1);
+        } else if (ast_kind(ast, stmt) == NK_DECL_STMT && ast_num_children(ast, ast_child(ast, stmt, 1)) == 2) {
+            value = ast_child(ast, ast_child(ast, stmt, 1), 1);
+        }
+        if (value && eval_int(ast, value, &ind->start)) trip_count(ast, ast_child(ast, loop, 1), ind, 1);
+        break;
+    }
+    return 1;
+}
+
+// Statement run once before the loop, from a ForInit
+NodeId init_stmt(Parser *p, NodeId init) {
+    NodeId first = ast_child(&p->ast, init, 0), second = ast_child(&p->ast, init, 1);
+    if (ast_kind(&p->ast, first) == NK_NAME) return make_node(p, NK_ASSIGN_STMT, 2, first, second);
+    return make_node(p, NK_DECL_STMT, 2, first, second);
+}
+
+// Body of only s = s + e statements, e affine in the induction variable and
+// each s distinct: the loop becomes one addition per accumulator
+int closed_form(LoopPass *lp, NodeId loop, const Induction *ind, NodeList *out) {
+    Parser *p = lp->p;
+    const Ast *ast = &p->ast;
+    int is_for = ast_kind(ast, loop) == NK_FOR_STMT;
+    NodeId body = ast_child(ast, loop, is_for ? 3 : 0);
+    int n = ast_num_children(ast, body), line = node_line(p, loop);
+    long long trips = ind->trips, sums[n + 1], last;
+    int offset = 0;
+    for (int i = 0; i < n; i++) {
+        NodeId stmt = ast_child(ast, body, i);
+        if (stmt == ind->update) {
+            offset = 1;
+            continue;
+        }
+        if (ast_kind(ast, stmt) != NK_ASSIGN_STMT) return 0;
+        const char *acc = ast_text(ast, ast_child(ast, stmt, 0));
+        NodeId expr = ast_child(ast, stmt, 1);
+        if (ast_kind(ast, expr) != NK_ADD_EXPR || strcmp(acc, ind->var) == 0) return 0;
+        if (count_assigns(lp, body, acc) != 1) return 0;
+        NodeId term;
+        if (is_var(ast, ast_child(ast, expr, 0), acc)) {
+            term = ast_child(ast, expr, 1);
+        } else if (is_var(ast, ast_child(ast, expr, 1), acc)) {
+            term = ast_child(ast, expr, 0);
+        } else {
+            return 0;
+        }
+        // sum over k < trips of a * (start + (k + offset) * step) + b
+        long long a, b, first, t, pairs;
+        if (!affine_in(ast, term, ind->var, &a, &b)) return 0;
+        if (__builtin_mul_overflow(offset, ind->step, &first) || __builtin_add_overflow(first, ind->start, &first)
+            || __builtin_mul_overflow(a, first, &t) || __builtin_add_overflow(t, b, &t)
+            || __builtin_mul_overflow(t, trips, &sums[i])) {
+            return 0;
+        }
+        if (trips % 2 == 0 ? __builtin_mul_overflow(trips / 2, trips - 1, &pairs)
+                : __builtin_mul_overflow(trips, (trips - 1) / 2, &pairs)) {
+            return 0;
+        }
+        if (__builtin_mul_overflow(a, ind->step, &t) || __builtin_mul_overflow(t, pairs, &t)
+            || __builtin_add_overflow(sums[i], t, &sums[i])) {
+            return 0;
+        }
+    }
+    if (__builtin_mul_overflow(ind->step, trips, &last) || __builtin_add_overflow(last, ind->start, &last)) return 0;
+    if (is_for) {
+        NodeId init = ast_child(ast, loop, 0);
+        NodeId stmt = init_stmt(p, init);
+        NodeId target = ast_kind(ast, stmt) == NK_ASSIGN_STMT ? stmt : ast_child(ast, stmt, 1);
+        NodeId value = make_num(p, last, line);
+        p->ast.children[p->ast.nodes[target].first_child + 1] = value;
+        node_list_push(out, stmt);
+    }
+    for (int i = 0; i < n; i++) {
+        NodeId stmt = ast_child(&p->ast, body, i);
+        if (stmt == ind->update || sums[i] == 0) continue;
+        NodeId name = ast_child(&p->ast, stmt, 0);
+        NodeId acc = make_leaf(p, NK_ID, p->ast.nodes[name].token);
+        NodeId sum = make_node(p, NK_ADD_EXPR, 2, acc, make_num(p, sums[i], line));
+        node_list_push(out, make_node(p, NK_ASSIGN_STMT, 2, name, sum));
+    }
+    if (!is_for) {
+        NodeId name = ast_child(&p->ast, ind->update, 0);
+        node_list_push(out, make_node(p, NK_ASSIGN_STMT, 2, name, make_num(p, last, line)));
+    }
+    return 1;
+}
+
+// Replace a loop with few constant trips by copies of its body
+int unroll(LoopPass *lp, NodeId loop, const Induction *ind, NodeList *out) {
+    Parser *p = lp->p;
+    int is_for = ast_kind(&p->ast, loop) == NK_FOR_STMT;
+    NodeId body = ast_child(&p->ast, loop, is_for ? 3 : 0);
+    int n = ast_num_children(&p->ast, body) + is_for;
+    if (ind->trips > UNROLL_MAX_TRIPS || ind->trips * n > UNROLL_MAX_STMTS) return 0;
+    if (is_for) node_list_push(out, init_stmt(p, ast_child(&p->ast, loop, 0)));
+    for (long long k = 0; k < ind->trips; k++) {
+        for (int i = 0; i < ast_num_children(&p->ast, body); i++) {
+            node_list_push(out, clone_tree(p, ast_child(&p->ast, body, i)));
+        }
+        if (is_for) {
+            NodeId update = ast_child(&p->ast, loop, 2);
+            NodeId name = ast_child(&p->ast, update, 0);
+            node_list_push(out, make_node(p, NK_ASSIGN_STMT, 2, name, clone_tree(p, ast_child(&p->ast, update, 1))));
+        }
+    }
+    return 1;
+}
+
+// Move an invariant operator expression in a child slot into a temporary
+// declared before the loop; returns 0 to look further down instead
+int hoist_expr(LoopPass *lp, const LoopEffects *loop, NodeId parent, int slot, NodeList *out) {
+    Parser *p = lp->p;
+    NodeId child = ast_child(&p->ast, parent, slot);
+    NodeKind kind = ast_kind(&p->ast, child);
+    int reads = 0;
+    if (!is_operator(kind) || !is_invariant(lp, child, loop, &reads) || reads == 0) return 0;
+    if (p->symbol_table.count >= MAX_SYMBOLS) return 0;
+    char name[32];
+    do {
+        snprintf(name, sizeof(name), "licm%d", lp->temp_count++);
+    } while (is_variable_declared(p, name));
+    int is_int = kind == NK_ADD_EXPR || kind == NK_MUL_EXPR;
+    int line = node_line(p, child);
+    add_symbol(p, name, is_int ? "int" : "bool", line);
+    int name_tok = synth_token(p, TOK_ID, name, line);
+    int type_tok = synth_token(p, is_int ? TOK_INT : TOK_BOOL, is_int ? "int" : "bool", line);
+    NodeId type = make_leaf(p, is_int ? NK_TYPE_INT : NK_TYPE_BOOL, type_tok);
+    NodeId decl = make_node(p, NK_INIT_DECL, 2, make_leaf(p, NK_NAME, name_tok), child);
+    node_list_push(out, make_node(p, NK_DECL_STMT, 2, type, decl));
+    NodeId temp = make_leaf(p, NK_ID, name_tok);
+    p->ast.children[p->ast.nodes[parent].first_child + slot] = temp;
+    return 1;
+}
+
+// Hoist the invariant expressions in a child slot, outermost first, from an
+// explicit stack. What an inner loop left in its test and body reads
+// variables it assigns, so only a for header is searched there.
+int hoist_slot(LoopPass *lp, const LoopEffects *loop, NodeId parent, int slot, NodeList *out) {
+    Parser *p = lp->p;
+    HoistFrame *frames = malloc(sizeof(HoistFrame) * 16);
+    int count = 1, capacity = 16, hoisted = 0;
+    frames[0] = (HoistFrame){ parent, slot, slot + 1, 0, 0 };
+    while (count > 0) {
+        HoistFrame *f = &frames[count - 1];
+        if (f->child < f->end) {
+            NodeId id = f->id;
+            int i = f->child++;
+            NodeId child = ast_child(&p->ast, id, i);
+            if (!child) continue;
+            if (hoist_expr(lp, loop, id, i, out)) {
+                hoisted++;
+                continue;
+            }
+            if (count + 1 >= capacity) {
+                capacity *= 2;
+                frames = realloc(frames, sizeof(HoistFrame) * capacity);
+            }
+            if (optimized_loop(lp, child)) {
+                if (ast_kind(&p->ast, child) != NK_FOR_STMT) continue;
+                frames[count++] = (HoistFrame){ child, 2, 3, 0, hoisted };
+                frames[count++] = (HoistFrame){ child, 0, 1, 0, hoisted };
+                continue;
+            }
+            // Shared with other occurrences: work on a private copy
+            int copied = parser_expr_uses(p, child) >= 2;
+            if (copied) child = copy_node(p, child);
+            frames[count++] = (HoistFrame){ child, 0, ast_num_children(&p->ast, child), copied, hoisted };
+            continue;
+        }
+        count--;
+        if (!f->copied) continue;
+        if (hoisted > f->hoisted) {
+            HoistFrame *up = &frames[count - 1];
+            p->ast.children[p->ast.nodes[up->id].first_child + up->child - 1] = f->id;
+        } else {
+            p->ast.child_count -= ast_num_children(&p->ast, f->id);
+            p->ast.node_count--;
+        }
+    }
+    free(frames);
+    return hoisted;
+}
+
+int hoist_invariants(LoopPass *lp, const LoopEffects *loop, NodeId id, NodeList *out) {
+    int hoisted = 0;
+    for (int i = 0; i < ast_num_children(&lp->p->ast, id); i++) {
+        hoisted += hoist_slot(lp, loop, id, i, out);
+    }
+    return hoisted;
+}
+
+// Optimize the loop at stmts[index], appending what replaces it to out
+void optimize_loop(LoopPass *lp, NodeId stmts, int index, NodeList *out) {
+    Parser *p = lp->p;
+    NodeId loop = ast_child(&p->ast, stmts, index);
+    int is_for = ast_kind(&p->ast, loop) == NK_FOR_STMT;
+    Induction ind;
+    int found = is_for ? analyze_for(lp, loop, &ind) : analyze_do_while(lp, stmts, index, &ind);
+    fprintf(lp->report, "- loop at line %d (%s): ", node_line(p, loop), node_kind_label(ast_kind(&p->ast, loop)));
+    if (!found) {
+        fprintf(lp->report, "no induction variable");
+    } else {
+        fprintf(lp->report, "induction %s", ind.var);
+        if (ind.has_trips) {
+            fprintf(lp->report, " from %lld step %lld, %lld iteration%s", ind.start, ind.step, ind.trips,
+                ind.trips == 1 ? "" : "s");
+        } else {
+            fprintf(lp->report, " step %lld, unknown trip count", ind.step);
+        }
+    }
+    if (found && ind.has_trips && closed_form(lp, loop, &ind, out)) {
+        fprintf(lp->report, "; replaced by closed form\n");
+        lp->changed++;
+        return;
+    }
+    NodeId body = ast_child(&p->ast, loop, is_for ? 3 : 0);
+    if (found && ind.has_trips && !declares_vars(lp, body) && unroll(lp, loop, &ind, out)) {
+        fprintf(lp->report, "; unrolled\n");
+        lp->changed++;
+        return;
+    }
+    // The for condition is tested before the body, the do-while one after it
+    LoopEffects effects;
+    loop_effects(lp, loop, &effects);
+    int hoisted;
+    if (is_for) {
+        hoisted = hoist_slot(lp, &effects, loop, 1, out) + hoist_invariants(lp, &effects, ast_child(&p->ast, loop, 3), out);
+    } else {
+        hoisted = hoist_invariants(lp, &effects, ast_child(&p->ast, loop, 0), out) + hoist_slot(lp, &effects, loop, 1, out);
+    }
+    node_list_push(out, loop);
+    remember_loop(lp, loop, &effects); // Hoisting left its stores alone
+    if (hoisted > 0) {
+        fprintf(lp->report, "; hoisted %d invariant expression%s\n", hoisted, hoisted == 1 ? "" : "s");
+        lp->changed++;
+    } else {
+        fprintf(lp->report, "; unchanged\n");
+    }
+}
+
+// The statement lists right inside a node: a loop body, the branches of
+// an if, or the program's statements
+int nested_stmts(const Ast *ast, NodeId id, NodeId lists[2]) {
+    int count = 0;
+    for (int i = 0; i < ast_num_children(ast, id) && count < 2; i++) {
+        NodeId child = ast_child(ast, id, i);
+        NodeKind kind = child ? ast_kind(ast, child) : NK_NONE;
+        if (kind == NK_STMTS) lists[count++] = child;
+        if (kind != NK_IF_THEN && kind != NK_ELSE_OPT) continue;
+        for (int j = 0; j < ast_num_children(ast, child) && count < 2; j++) {
+            NodeId list = ast_child(ast, child, j);
+            if (list && ast_kind(ast, list) == NK_STMTS) lists[count++] = list;
+        }
+    }
+    return count;
+}
+
+// Rewrite the statement at f->index once the statement lists inside it are
+// done: returns the next of those lists, or NO_NODE once what replaces the
+// statement is in f->out
+NodeId optimize_stmt(LoopPass *lp, LoopFrame *f) {
+    Parser *p = lp->p;
+    NodeId stmt = ast_child(&p->ast, f->stmts, f->index);
+    NodeId lists[2];
+    if (stmt && f->phase < nested_stmts(&p->ast, stmt, lists)) return lists[f->phase++];
+    NodeKind kind = ast_kind(&p->ast, stmt);
+    if (kind == NK_FOR_STMT || kind == NK_DO_WHILE_STMT) {
+        int before = f->out.count;
+        optimize_loop(lp, f->stmts, f->index, &f->out);
+        f->changed |= f->out.count != before + 1 || f->out.items[before] != stmt;
+    } else {
+        node_list_push(&f->out, stmt);
+    }
+    f->index++;
+    f->phase = 0;
+    return NO_NODE;
+}
+
+// Rewrite a statement list, innermost loops first. Nested lists are kept on
+// an explicit stack, so nesting depth is bounded by memory, not the C stack.
+void optimize_stmts(LoopPass *lp, NodeId stmts) {
+    Parser *p = lp->p;
+    LoopFrame *frames = NULL;
+    int count = 0, capacity = 0;
+    NodeId list = stmts;
+    for (;;) {
+        if (list) {
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(LoopFrame) * capacity);
+            }
+            frames[count++] = (LoopFrame){ list, 0, 0, { NULL, 0, 0 }, 0 };
+        }
+        LoopFrame *f = &frames[count - 1];
+        if (f->index < ast_num_children(&p->ast, f->stmts)) {
+            list = optimize_stmt(lp, f);
+            continue;
+        }
+        if (f->changed) set_children(p, f->stmts, f->out.items, f->out.count);
+        free(f->out.items);
+        if (--count == 0) break;
+        list = optimize_stmt(lp, &frames[count - 1]);
+    }
+    free(frames);
+}
+
+// Run the loop pass over a parsed program; returns the number of loops changed
+int optimize_loops(Parser *p, NodeId root, FILE *report) {
+    LoopPass lp = { p, report, 0, 0, NULL, 0, NULL, 0, 0, { NULL, 0, 0 } };
+    NodeId lists[2];
+    int n = root ? nested_stmts(&p->ast, root, lists) : 0;
+    for (int i = 0; i < n; i++) optimize_stmts(&lp, lists[i]);
+    free(lp.optimized);
+    free(lp.effects);
+    free(lp.stack.items);
+    return lp.changed;
+}
+
+// Dataflow pass: a control-flow graph of single statements and loop tests,
+// bit-vector liveness and possibly-uninitialized analysis keyed by symbol
+// table index, dead-store and unused-declaration removal
+
+void var_add(VarSet *set, int var) {
+    set->bits[var / 64] |= (uint64_t)1 << (var % 64);
+}
+
+int var_has(const VarSet *set, int var) {
+    return (set->bits[var / 64] >> (var % 64)) & 1;
+}
+
+int symbol_index(Parser *p, const char *name) {
+    for (int i = 0; i < p->symbol_table.count; i++) {
+        if (strcmp(p->symbol_table.symbols[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Add the variables an expression reads to set, and to the program-wide reads
+void collect_reads(Cfg *g, NodeId expr, VarSet *set) {
+    const Ast *ast = &g->p->ast;
+    g->stack.count = 0;
+    if (expr) node_list_push(&g->stack, expr);
+    while (g->stack.count > 0) {
+        NodeId id = g->stack.items[--g->stack.count];
+        if (ast_kind(ast, id) == NK_ID) {
+            int var = symbol_index(g->p, ast_text(ast, id));
+            if (var >= 0) {
+                var_add(set, var);
+                var_add(&g->read, var);
+            }
+            continue;
+        }
+        for (int i = 0; i < ast_num_children(ast, id); i++) {
+            NodeId child = ast_child(ast, id, i);
+            if (child) node_list_push(&g->stack, child);
+        }
+    }
+}
+
+int cfg_add(Cfg *g, NodeId node, NodeId expr, int next) {
+    if (g->count >= g->capacity) {
+        g->capacity = g->capacity ? g->capacity * 2 : 64;
+        g->nodes = realloc(g->nodes, sizeof(CfgNode) * g->capacity);
+    }
+    CfgNode *n = &g->nodes[g->count];
+    memset(n, 0, sizeof(CfgNode));
+    n->node = node;
+    n->expr = expr;
+    n->succ[0] = next;
+    n->succ[1] = -1;
+    n->var = -1;
+    collect_reads(g, expr, &n->use);
+    return g->count++;
+}
+
+// A store of expr to the variable named by name
+int cfg_store(Cfg *g, NodeId node, NodeId name, NodeId expr, int next) {
+    int n = cfg_add(g, node, expr, next);
+    g->nodes[n].var = symbol_index(g->p, ast_text(&g->p->ast, name));
+    return n;
+}
+
+// A declaration stores its initializer, or leaves the variable uninitialized
+int cfg_decl(Cfg *g, NodeId node, NodeId init_decl, int next) {
+    const Ast *ast = &g->p->ast;
+    NodeId name = ast_child(ast, init_decl, 0);
+    if (ast_num_children(ast, init_decl) > 1) return cfg_store(g, node, name, ast_child(ast, init_decl, 1), next);
+    int n = cfg_add(g, node, NO_NODE, next);
+    int var = symbol_index(g->p, ast_text(ast, name));
+    if (var >= 0) var_add(&g->nodes[n].gen_uninit, var);
+    return n;
+}
+
+// Nodes are added from the last statement back, so each knows its successor.
+// Adds the statement at f->index up to its next statement list, given the
+// entry of the list added last; returns that list, to be added before
+// *list_next, or NO_NODE once the statement is complete.
+NodeId cfg_stmt(Cfg *g, CfgFrame *f, int entry, int *list_next) {
+    const Ast *ast = &g->p->ast;
+    NodeId stmt = ast_child(ast, f->stmts, f->index);
+    int phase = f->phase++, next = f->next;
+    switch (ast_kind(ast, stmt)) {
+    case NK_ASSIGN_STMT:
+        next = cfg_store(g, stmt, ast_child(ast, stmt, 0), ast_child(ast, stmt, 1), next);
+        break;
+    case NK_DECL_STMT:
+        next = cfg_decl(g, stmt, ast_child(ast, stmt, 1), next);
+        break;
+    case NK_PRINT_STMT:
+        next = cfg_add(g, stmt, ast_child(ast, stmt, 0), next);
+        break;
+    case NK_IF_STMT: {
+        NodeId if_then = ast_child(ast, stmt, 0);
+        NodeId else_opt = ast_child(ast, stmt, 1);
+        *list_next = next;
+        if (phase == 0) return ast_child(ast, if_then, 1);
+        if (phase == 1) {
+            f->held[0] = entry;
+            if (else_opt) return ast_child(ast, else_opt, 0);
+            entry = next;
+        }
+        int test = cfg_add(g, if_then, ast_child(ast, if_then, 0), f->held[0]);
+        g->nodes[test].succ[1] = entry;
+        next = test;
+        break;
+    }
+    case NK_DO_WHILE_STMT:
+        if (phase == 0) {
+            f->held[0] = cfg_add(g, stmt, ast_child(ast, stmt, 1), next);
+            *list_next = f->held[0];
+            return ast_child(ast, stmt, 0);
+        }
+        g->nodes[f->held[0]].succ[1] = entry;
+        next = entry;
+        break;
+    case NK_FOR_STMT: {
+        NodeId init = ast_child(ast, stmt, 0);
+        NodeId update = ast_child(ast, stmt, 2);
+        if (phase == 0) {
+            f->held[0] = cfg_add(g, stmt, ast_child(ast, stmt, 1), next);
+            f->held[1] = cfg_store(g, update, ast_child(ast, update, 0), ast_child(ast, update, 1), f->held[0]);
+            *list_next = f->held[1];
+            return ast_child(ast, stmt, 3);
+        }
+        int test = f->held[0], step = f->held[1];
+        g->nodes[test].succ[1] = entry;
+        if (ast_kind(ast, ast_child(ast, init, 0)) == NK_NAME) {
+            next = cfg_store(g, init, ast_child(ast, init, 0), ast_child(ast, init, 1), test);
+        } else {
+            next = cfg_decl(g, init, ast_child(ast, init, 1), test);
+        }
+        // Stores in a for header cannot be removed
+        if (g->nodes[step].var >= 0) var_add(&g->pinned, g->nodes[step].var);
+        if (g->nodes[next].var >= 0) var_add(&g->pinned, g->nodes[next].var);
+        break;
+    }
+    default:
+        break;
+    }
+    f->next = next;
+    f->index--;
+    f->phase = 0;
+    return NO_NODE;
+}
+
+// Returns the entry node of a statement list. Nested lists are kept on an
+// explicit stack, so nesting depth is bounded by memory, not the C stack.
+int cfg_stmts(Cfg *g, NodeId stmts, int next) {
+    const Ast *ast = &g->p->ast;
+    CfgFrame *frames = NULL;
+    int count = 0, capacity = 0, entry = next;
+    NodeId list = stmts;
+    for (;;) {
+        if (list) {
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(CfgFrame) * capacity);
+            }
+            frames[count++] = (CfgFrame){ list, ast_num_children(ast, list) - 1, next, 0, { -1, -1 } };
+        }
+        CfgFrame *f = &frames[count - 1];
+        if (f->index >= 0) {
+            list = cfg_stmt(g, f, entry, &next);
+            continue;
+        }
+        // The list is complete: go on with the statement it belongs to
+        entry = f->next;
+        if (--count == 0) break;
+        list = cfg_stmt(g, &frames[count - 1], entry, &next);
+    }
+    free(frames);
+    return entry;
+}
+
+// Backward: live_in = use | (live_out & ~def), live_out = union of the
+// successors' live_in. Nodes were added roughly in reverse program order,
+// which is the fast order for a backward problem.
+void solve_liveness(Cfg *g) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int n = 0; n < g->count; n++) {
+            CfgNode *node = &g->nodes[n];
+            for (int w = 0; w < VAR_WORDS; w++) {
+                uint64_t out = 0;
+                for (int s = 0; s < 2; s++) {
+                    if (node->succ[s] >= 0) out |= g->nodes[node->succ[s]].live_in.bits[w];
+                }
+                uint64_t def = 0;
+                if (node->var >= 0 && node->var / 64 == w) def = (uint64_t)1 << (node->var % 64);
+                uint64_t in = node->use.bits[w] | (out & ~def);
+                if (in != node->live_in.bits[w]) changed = 1;
+                node->live_out.bits[w] = out;
+                node->live_in.bits[w] = in;
+            }
+        }
+    }
+}
+
+// Forward: a variable is possibly uninitialized where some path from its
+// uninitialized declaration reaches without a store to it. The sets only
+// grow, so successors' inputs are accumulated in place.
+void solve_uninit(Cfg *g) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int n = g->count - 1; n >= 0; n--) {
+            CfgNode *node = &g->nodes[n];
+            for (int w = 0; w < VAR_WORDS; w++) {
+                uint64_t kill = 0;
+                if (node->var >= 0 && node->var / 64 == w) kill = (uint64_t)1 << (node->var % 64);
+                uint64_t out = node->gen_uninit.bits[w] | (node->uninit_in.bits[w] & ~kill);
+                for (int s = 0; s < 2; s++) {
+                    if (node->succ[s] < 0) continue;
+                    uint64_t *in = &g->nodes[node->succ[s]].uninit_in.bits[w];
+                    if ((*in | out) != *in) {
+                        *in |= out;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void dataflow_note(Cfg *g, int line, const char *format, ...) {
+    if (g->note_count >= g->note_capacity) {
+        g->note_capacity = g->note_capacity ? g->note_capacity * 2 : 16;
+        g->notes = realloc(g->notes, sizeof(DataflowNote) * g->note_capacity);
+    }
+    DataflowNote *note = &g->notes[g->note_count];
+    note->line = line;
+    note->order = g->note_count++;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(note->text, sizeof(note->text), format, args);
+    va_end(args);
+}
+
+int compare_notes(const void *a, const void *b) {
+    const DataflowNote *x = a, *y = b;
+    if (x->line != y->line) return x->line < y->line ? -1 : 1;
+    return x->order - y->order;
+}
+
+// Warn about reads of variables that are possibly uninitialized
+void warn_uninit(Cfg *g) {
+    const Ast *ast = &g->p->ast;
+    for (int n = 0; n < g->count; n++) {
+        CfgNode *node = &g->nodes[n];
+        VarSet risky;
+        int any = 0;
+        for (int w = 0; w < VAR_WORDS; w++) {
+            risky.bits[w] = node->use.bits[w] & node->uninit_in.bits[w];
+            any |= risky.bits[w] != 0;
+        }
+        if (!any) continue;
+        // Report each variable once per node, at its first read
+        g->stack.count = 0;
+        node_list_push(&g->stack, node->expr);
+        while (g->stack.count > 0) {
+            NodeId id = g->stack.items[--g->stack.count];
+            if (ast_kind(ast, id) == NK_ID) {
+                int var = symbol_index(g->p, ast_text(ast, id));
+                if (var >= 0 && var_has(&risky, var)) {
+                    risky.bits[var / 64] &= ~((uint64_t)1 << (var % 64));
+                    dataflow_note(g, node_line(g->p, id), "warning: %s may be used uninitialized", ast_text(ast, id));
+                }
+                continue;
+            }
+            for (int i = ast_num_children(ast, id) - 1; i >= 0; i--) {
+                NodeId child = ast_child(ast, id, i);
+                if (child) node_list_push(&g->stack, child);
+            }
+        }
+    }
+}
+
+// Mark dead stores and unused declarations in g->drop; returns how many
+int find_dead_stores(Cfg *g) {
+    Parser *p = g->p;
+    const Ast *ast = &p->ast;
+    int found = 0;
+    for (int n = 0; n < g->count; n++) {
+        CfgNode *node = &g->nodes[n];
+        NodeKind kind = ast_kind(ast, node->node);
+        if (kind == NK_DECL_STMT) {
+            NodeId init_decl = ast_child(ast, node->node, 1);
+            NodeId name = ast_child(ast, init_decl, 0);
+            int var = symbol_index(p, ast_text(ast, name));
+            if (var >= 0 && !var_has(&g->read, var) && !var_has(&g->pinned, var)) {
+                g->drop[node->node] = 1;
+                dataflow_note(g, node_line(p, name), "unused declaration of %s removed", ast_text(ast, name));
+                found++;
+            } else if (node->var >= 0 && !var_has(&node->live_out, node->var)) {
+                // The variable is used later, but never sees this value
+                set_children(p, init_decl, &name, 1);
+                dataflow_note(g, node_line(p, name), "dead initializer of %s removed", ast_text(ast, name));
+                found++;
+            }
+        } else if (kind == NK_ASSIGN_STMT && node->var >= 0 && !var_has(&node->live_out, node->var)) {
+            NodeId name = ast_child(ast, node->node, 0);
+            g->drop[node->node] = 1;
+            dataflow_note(g, node_line(p, name), "dead store to %s removed", ast_text(ast, name));
+            found++;
+        }
+    }
+    return found;
+}
+
+// Rebuild the statement lists without the dropped statements
+void drop_stmts(Cfg *g, NodeId id) {
+    Parser *p = g->p;
+    NodeList out = { NULL, 0, 0 };
+    g->stack.count = 0;
+    node_list_push(&g->stack, id);
+    while (g->stack.count > 0) {
+        id = g->stack.items[--g->stack.count];
+        int n = ast_num_children(&p->ast, id);
+        int dropped = 0;
+        out.count = 0;
+        for (int i = 0; i < n; i++) {
+            NodeId child = ast_child(&p->ast, id, i);
+            if (!child) continue;
+            if (g->drop[child]) {
+                dropped = 1;
+                continue;
+            }
+            NodeKind kind = ast_kind(&p->ast, child);
+            if (kind == NK_STMTS || kind == NK_IF_STMT || kind == NK_IF_THEN || kind == NK_ELSE_OPT
+                    || kind == NK_DO_WHILE_STMT || kind == NK_FOR_STMT) {
+                node_list_push(&g->stack, child);
+            }
+            node_list_push(&out, child);
+        }
+        if (dropped) set_children(p, id, out.items, out.count);
+    }
+    free(out.items);
+}
+
+// Run the dataflow pass over a parsed program: report possibly uninitialized
+// reads, then remove dead stores until none are left. Removing one store can
+// make the stores feeding it dead, so the analysis is repeated. Writes one
+// report line per finding, in line order; returns the number of removals.
+int optimize_dead_stores(Parser *p, NodeId root, FILE *report) {
+    Cfg g;
+    memset(&g, 0, sizeof(g));
+    g.p = p;
+    int removed = 0;
+    for (int round = 0; root; round++) {
+        g.count = 0;
+        memset(&g.read, 0, sizeof(g.read));
+        memset(&g.pinned, 0, sizeof(g.pinned));
+        int end = cfg_add(&g, NO_NODE, NO_NODE, -1); // Nothing is live after the program
+        cfg_stmts(&g, ast_child(&p->ast, root, 0), end);
+        solve_liveness(&g);
+        if (round == 0) {
+            solve_uninit(&g);
+            warn_uninit(&g);
+        }
+        g.drop = calloc(p->ast.node_count, 1);
+        int found = find_dead_stores(&g);
+        if (found > 0) drop_stmts(&g, root);
+        free(g.drop);
+        removed += found;
+        if (found == 0) break;
+    }
+    if (g.note_count > 0) qsort(g.notes, g.note_count, sizeof(DataflowNote), compare_notes);
+    for (int i = 0; i < g.note_count; i++) fprintf(report, "- line %d: %s\n", g.notes[i].line, g.notes[i].text);
+    free(g.nodes);
+    free(g.stack.items);
+    free(g.notes);
+    return removed;
+}
+
+Parser* parser_new() {
+    Parser *p = calloc(1, sizeof(Parser));
+    init_token_list(p);
+    init_symbol_table(p);
+    init_ast(p);
+    parser_reset(p);
+    return p;
+}
+
+// Forget the previous parse; token, symbol and node buffers stay allocated
+void parser_reset(Parser *p) {
+    p->token_list.count = 0;
+    p->token_list.line_pending = 0;
+    p->token_list.sync_pending = 0;
+    p->token_list.brace_count = 0;
+    p->token_list.paren_count = 0;
+    p->token_list.decl_count = 0;
+    p->symbol_table.count = 0;
+    release_imports(p);
+    p->import_source_count = 0;
+    arena_rewind(&p->arena);
+    p->ast.node_count = 1;
+    p->ast.child_count = 0;
+    if (p->intern.count) memset(p->intern.slots, 0, sizeof(NodeId) * p->intern.capacity);
+    p->intern.count = 0;
+    memset(&p->intern.stats, 0, sizeof(p->intern.stats));
+    p->src = NULL;
+    p->src_len = 0;
+    p->src_pos = 0;
+    p->line = 1;
+    p->error_count = 0;
+    p->token_index = -1;
+    p->last_error_line = 0;
+    p->synced = 0;
+    p->events = NULL;
+    p->ev_depth = 0;
+    p->current_token.type = TOK_EOF;
+    p->current_token.line = 0;
+    p->current_token.text[0] = '\0';
+    p->limit_hit = UPL_LIMIT_NONE;
+    p->deadline_ns = 0;
+    p->poll_count = 0;
+    p->lazy_count = 0;
+    p->lazy_diverged = 0;
+}
+
+void parser_free(Parser *p) {
+    if (!p) return;
+    free_token_list(p);
+    free_symbol_table(p);
+    free_ast(p);
+    free(p->ev_stack);
+    free(p->ll.items);
+    free(p->ll.values);
+    free(p->ll.frames);
+    free(p->intern.slots);
+    free(p->intern.uses);
+    free(p->lazy_blocks);
+    release_imports(p);
+    free(p->imports);
+    free(p->import_sources);
+    free(p->module_dir);
+    arena_free(&p->arena);
+    free(p->ring);
+    parser_free(p->lexer);
+    free(p);
+}
+
+void parser_set_engine(Parser *p, ParserEngine engine) {
+    p->engine = engine;
+}
+
+void parser_set_pipelined(Parser *p, int enabled) {
+    p->pipelined = enabled;
+}
+
+void parser_set_limits(Parser *p, const ParseLimits *limits) {
+    memset(&p->limits, 0, sizeof(p->limits));
+    if (limits) p->limits = *limits;
+    const ParseLimits *l = &p->limits;
+    p->limited = l->max_input_bytes || l->max_tokens || l->max_nodes || l->max_depth || l->max_ms > 0
+        || l->max_memory || l->cancel;
+}
+
+void parser_set_lazy(Parser *p, int enabled) {
+    p->lazy = enabled;
+}
+
+void parser_set_capture(Parser *p, CaptureLog *log) {
+    p->capture = log;
+}
+
+// Parse a skimmed body where the skim left it, with the symbols and error
+// state it had then, and rewrite the placeholder into the Stmts node
+NodeId parser_force(Parser *p, NodeId id) {
+    if (!id || ast_kind(&p->ast, id) != NK_LAZY_STMTS) return id;
+    LazyBlock block = p->lazy_blocks[p->ast.nodes[id].first_child];
+    Token current = p->current_token;
+    int token_index = p->token_index, symbols = p->symbol_table.count, errors = p->error_count;
+    int last_error_line = p->last_error_line, synced = p->synced;
+    p->token_index = block.lbrace;
+    p->symbol_table.count = block.symbols;
+    p->last_error_line = block.last_error_line;
+    next_token(p);
+    NodeId stmts = parse_stmts(p);
+    // Errors, or stopping short of the '}', would have changed the state the
+    // rest of the program was parsed in
+    if (p->error_count != errors || p->token_index != p->token_list.tokens[block.lbrace].match) p->lazy_diverged = 1;
+    if (!stmts) stmts = make_node(p, NK_STMTS, 0);
+    p->ast.nodes[id] = p->ast.nodes[stmts];
+    p->current_token = current;
+    p->token_index = token_index;
+    p->symbol_table.count = symbols;
+    p->last_error_line = last_error_line;
+    p->synced = synced;
+    return id;
+}
+
+ParseResult parser_force_all(Parser *p) {
+    // Forcing a body can skim the blocks inside it, which are appended
+    for (int i = 0; i < p->lazy_count && !p->lazy_diverged; i++) parser_force(p, p->lazy_blocks[i].node);
+    if (!p->lazy_diverged) return p->result;
+    int lazy = p->lazy;
+    p->lazy = 0;
+    ParseResult result = parser_parse(p, p->src, p->src_len);
+    p->lazy = lazy;
+    return result;
+}
+
+// Take one limit option (--max-bytes, --max-tokens, --max-nodes,
+// --max-depth, --max-ms, --max-memory) at argv[*i] with its value
+int limit_option(int argc, char *argv[], int *i, ParseLimits *limits) {
+    if (*i + 1 >= argc || strncmp(argv[*i], "--max-", 6) != 0) return 0;
+    const char *name = argv[*i] + 6, *value = argv[*i + 1];
+    if (strcmp(name, "bytes") == 0) limits->max_input_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(name, "tokens") == 0) limits->max_tokens = strtoul(value, NULL, 10);
+    else if (strcmp(name, "nodes") == 0) limits->max_nodes = strtoul(value, NULL, 10);
+    else if (strcmp(name, "depth") == 0) limits->max_depth = strtoul(value, NULL, 10);
+    else if (strcmp(name, "ms") == 0) limits->max_ms = atof(value);
+    else if (strcmp(name, "memory") == 0) limits->max_memory = strtoull(value, NULL, 10);
+    else return 0;
+    (*i)++;
+    return 1;
+}
+
+ParseResult parser_parse(Parser *p, const char *src, size_t len) {
+    return parser_parse_events(p, src, len, NULL);
+}
+
+// With events set, no tree is kept: constructs are reported as they are recognized
+ParseResult parser_parse_events(Parser *p, const char *src, size_t len, const ParseEvents *events) {
+    int timed = p->timed || p->capture;
+    uint64_t start = timed ? now_ns() : 0, lexed = start;
+    parser_reset(p);
+    p->src = src;
+    p->src_len = len;
+    p->events = events;
+    if (p->limits.max_ms > 0) p->deadline_ns = now_ns() + (uint64_t)(p->limits.max_ms * 1e6);
+    if (p->limits.max_input_bytes && len > p->limits.max_input_bytes) governor_stop(p, UPL_LIMIT_INPUT, 1);
+    int pipelined = p->pipelined && !events && !p->profile && !p->limit_hit && pipeline_start(p);
+    ALLOC_PHASE(ALLOC_LEX);
+    if (!pipelined) tokenize_file(p);
+    if (timed) lexed = now_ns();
+    ALLOC_PHASE(ALLOC_PARSE);
+    next_token(p);
+    parse_imports(p);
+    NodeId root = p->engine == UPL_ENGINE_LL1 ? ll1_parse(p) : parse_prog(p);
+    ev_unwind(p, 0);
+    ALLOC_PHASE(ALLOC_OTHER);
+    if (pipelined && pipeline_finish(p) > 0) {
+        // Lexical errors come first in a sequential parse and suppress later
+        // errors on their lines; parse again in place to report the same
+        p->pipelined = 0;
+        ParseResult result = parser_parse_events(p, src, len, NULL);
+        p->pipelined = 1;
+        return result;
+    }
+    p->events = NULL;
+    link_imports(p, events ? NO_NODE : root);
+    ParseResult result = parse_result(p, root, !events);
+    if (timed) {
+        uint64_t end = now_ns();
+        p->lex_ns = lexed - start;
+        p->parse_ns = end - lexed;
+        if (p->capture) {
+            capture_record(p, events != NULL, start, lexed, end,
+                result.limit ? LIMIT_EXIT_STATUS : result.error_count > 0 ? 1 : 0);
+        }
+    }
+    return result;
+}
+
+// Result of the parse that just ended; event parses keep no root
+ParseResult parse_result(Parser *p, NodeId root, int keep_tree) {
+    ParseResult result;
+    result.ast = &p->ast;
+    result.ok = p->error_count == 0 && root && p->current_token.type == TOK_EOF;
+    result.root = keep_tree ? root : NO_NODE;
+    result.errors = p->errors;
+    result.error_count = p->error_count;
+    result.limit = p->limit_hit;
+    p->result = result;
+    return result;
+}
+
+void print_result(FILE *out, const ParseResult *result) {
+    if (!result->ok) {
+        fprintf(out, "- source code has correct syntax: no\n");
+        print_errors(out, result->errors, result->error_count);
+    } else {
+        fprintf(out, "- source code has correct syntax: yes\n");
+        print_tree(out, result->ast, result->root, 0);
+    }
+}
+
+// Read a whole stream into a heap buffer
+char* read_file(FILE *file, size_t *len) {
+    size_t capacity = 4096, count = 0;
+    char *buf = malloc(capacity);
+    size_t n;
+    while ((n = fread(buf + count, 1, capacity - count, file)) > 0) {
+        count += n;
+        if (count == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+    }
+    *len = count;
+    return buf;
+}
+
+// Read exactly len bytes; returns 0 on clean EOF before any byte, -1 on error
+int read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n == 0) return done == 0 ? 0 : -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Modules (import directives and precompiled snapshots)
+
+void parser_set_module_dir(Parser *p, const char *dir) {
+    free(p->module_dir);
+    p->module_dir = dir ? strdup(dir) : NULL;
+}
+
+void parser_set_module_access(Parser *p, ModuleAccess access) {
+    p->module_access = access;
+}
+
+// A module name is a file name in the module directory, never a path
+int module_name_ok(const char *name) {
+    return name[0] && strlen(name) < MAX_TOKEN_LEN && !strchr(name, '/') && !strstr(name, "..");
+}
+
+void module_path(const Parser *p, const char *name, const char *ext, char *out) {
+    snprintf(out, MODULE_PATH_MAX, "%s/%s%s", p->module_dir ? p->module_dir : ".", name, ext);
+}
+
+// FNV-1a over the source bytes
+uint64_t content_hash(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    return hash;
+}
+
+// Point s at the sections of a snapshot and check every count, offset and
+// child id, so the snapshot can be used without further checks. Returns 0 if
+// it is malformed.
+int snapshot_view(Snapshot *s, char *data, size_t size, int mapped) {
+    memset(s, 0, sizeof(*s));
+    s->data = data;
+    s->size = size;
+    s->mapped = mapped;
+    if (size < sizeof(SnapshotHeader)) return 0;
+    const SnapshotHeader *h = (const SnapshotHeader *)data;
+    uint64_t need = sizeof(SnapshotHeader) + sizeof(SnapshotSource) * (uint64_t)h->source_count
+        + sizeof(SnapshotSymbol) * (uint64_t)h->symbol_count + sizeof(AstNode) * (uint64_t)h->node_count
+        + sizeof(NodeId) * (uint64_t)h->child_count + h->string_bytes;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0 || h->size != size || need != size) return 0;
+    if (h->source_count == 0 || h->node_count < 2 || h->string_bytes == 0) return 0;
+    s->header = h;
+    s->sources = (const SnapshotSource *)(h + 1);
+    s->symbols = (const SnapshotSymbol *)(s->sources + h->source_count);
+    s->nodes = (const AstNode *)(s->symbols + h->symbol_count);
+    s->children = (const NodeId *)(s->nodes + h->node_count);
+    s->strings = (const char *)(s->children + h->child_count);
+    if (s->strings[h->string_bytes - 1] != '\0') return 0;
+    // Every string ends inside the table; names and texts must fit a token
+    #define SNAPSHOT_TEXT_OK(offset) ((offset) < h->string_bytes && strlen(s->strings + (offset)) < MAX_TOKEN_LEN)
+    for (uint32_t i = 0; i < h->source_count; i++) {
+        if (!SNAPSHOT_TEXT_OK(s->sources[i].name)) return 0;
+    }
+    for (uint32_t i = 0; i < h->symbol_count; i++) {
+        if (!SNAPSHOT_TEXT_OK(s->symbols[i].name)) return 0;
+        if (s->symbols[i].type != NK_TYPE_INT && s->symbols[i].type != NK_TYPE_BOOL) return 0;
+        if (s->symbols[i].source >= h->source_count) return 0;
+    }
+    for (uint32_t i = 1; i < h->node_count; i++) {
+        const AstNode *node = &s->nodes[i];
+        if ((uint64_t)node->first_child + node->num_children > h->child_count) return 0;
+        if (kind_has_text(node->kind) && !SNAPSHOT_TEXT_OK(node->token)) return 0;
+        for (int c = 0; c < node->num_children; c++) {
+            NodeId child = s->children[node->first_child + c];
+            if (!child || child >= i) return 0; // Children come first
+        }
+        if (!snapshot_shape_ok(s, i, i + 1 == h->node_count)) return 0;
+    }
+    #undef SNAPSHOT_TEXT_OK
+    // One symbol per declaration, in order
+    const AstNode *root = &s->nodes[h->node_count - 1];
+    if (root->num_children != h->symbol_count) return 0;
+    for (uint32_t i = 0; i < h->symbol_count; i++) {
+        const AstNode *decl = &s->nodes[s->children[root->first_child + i]];
+        const AstNode *init = &s->nodes[s->children[decl->first_child + 1]];
+        const AstNode *name = &s->nodes[s->children[init->first_child]];
+        if (s->nodes[s->children[decl->first_child]].kind != s->symbols[i].type) return 0;
+        if (strcmp(s->strings + name->token, s->strings + s->symbols[i].name) != 0) return 0;
+    }
+    return 1;
+}
+
+// Leaf text as the lexer would have produced it
+int snapshot_text_ok(NodeKind kind, const char *text) {
+    if (kind == NK_TYPE_INT) return strcmp(text, "int") == 0;
+    if (kind == NK_TYPE_BOOL) return strcmp(text, "bool") == 0;
+    if (kind == NK_TRUE) return strcmp(text, "true") == 0;
+    if (kind == NK_FALSE) return strcmp(text, "false") == 0;
+    int (*allowed)(int) = kind == NK_NUM ? isdigit : isalnum;
+    if (!text[0] || (kind != NK_NUM && !isalpha((unsigned char)text[0]))) return 0;
+    for (const char *c = text; *c; c++) {
+        if (!allowed((unsigned char)*c)) return 0;
+    }
+    return 1;
+}
+
+int snapshot_shape_ok(const Snapshot *s, NodeId id, int last) {
+    const AstNode *node = &s->nodes[id];
+    const NodeId *children = s->children + node->first_child;
+    #define SNAPSHOT_KIND(i) ((NodeKind)s->nodes[children[i]].kind)
+    int n = node->num_children;
+    if (last != (node->kind == NK_STMTS)) return 0;
+    switch (node->kind) {
+    case NK_STMTS:
+        for (int i = 0; i < n; i++) {
+            if (SNAPSHOT_KIND(i) != NK_DECL_STMT) return 0;
+        }
+        return 1;
+    case NK_DECL_STMT:
+        return n == 2 && (SNAPSHOT_KIND(0) == NK_TYPE_INT || SNAPSHOT_KIND(0) == NK_TYPE_BOOL)
+            && SNAPSHOT_KIND(1) == NK_INIT_DECL;
+    case NK_INIT_DECL:
+        return (n == 1 || n == 2) && SNAPSHOT_KIND(0) == NK_NAME && (n == 1 || is_pure_expr(SNAPSHOT_KIND(1)));
+    case NK_EQ_EXPR: case NK_GT: case NK_GTE: case NK_ADD_EXPR: case NK_MUL_EXPR:
+        return n == 2 && is_pure_expr(SNAPSHOT_KIND(0)) && is_pure_expr(SNAPSHOT_KIND(1));
+    case NK_TYPE_INT: case NK_TYPE_BOOL: case NK_NAME: case NK_ID: case NK_NUM: case NK_TRUE: case NK_FALSE:
+        return n == 0 && snapshot_text_ok(node->kind, s->strings + node->token);
+    default:
+        return 0;
+    }
+    #undef SNAPSHOT_KIND
+}
+
+int snapshot_open(Snapshot *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    return snapshot_view(s, data, st.st_size, 1);
+}
+
+void snapshot_close(Snapshot *s) {
+    if (s->mapped) munmap(s->data, s->size);
+    else free(s->data);
+    free(s->skip);
+    s->data = NULL;
+    s->skip = NULL;
+}
+
+// A snapshot is fresh while every source it was built from has the size and
+// content hash it had then
+int snapshot_fresh(const Parser *p, const Snapshot *s) {
+    char path[MODULE_PATH_MAX];
+    for (uint32_t i = 0; i < s->header->source_count; i++) {
+        const SnapshotSource *source = &s->sources[i];
+        module_path(p, s->strings + source->name, ".upl", path);
+        FILE *file = fopen(path, "r");
+        if (!file) return 0;
+        size_t len;
+        char *src = read_file(file, &len);
+        fclose(file);
+        int same = len == source->size && content_hash(src, len) == source->hash;
+        free(src);
+        if (!same) return 0;
+    }
+    return 1;
+}
+
+// Serialize the declarations of a parsed module with the sources it was
+// built from: itself, then those of its imports
+char* snapshot_build(Parser *m, NodeId root, const char *name, uint64_t hash, uint64_t size, size_t *out_size) {
+    const Ast *ast = &m->ast;
+    NodeId stmts = ast_child(ast, root, 0);
+    // Number the nodes in post order, children first
+    NodeId *ids = calloc(ast->node_count, sizeof(NodeId));
+    NodeId *order = malloc(sizeof(NodeId) * ast->node_count);
+    uint32_t node_count = 1, child_count = 0, string_bytes = 0;
+    NodeList stack = { NULL, 0, 0 };
+    node_list_push(&stack, stmts);
+    while (stack.count > 0) {
+        NodeId id = stack.items[stack.count - 1];
+        if (ids[id]) {
+            stack.count--;
+            continue;
+        }
+        int n = ast_num_children(ast, id), pending = 0;
+        for (int i = 0; i < n; i++) {
+            NodeId child = ast_child(ast, id, i);
+            if (child && !ids[child]) {
+                node_list_push(&stack, child);
+                pending = 1;
+            }
+        }
+        if (pending) continue;
+        stack.count--;
+        order[node_count] = id;
+        ids[id] = node_count++;
+        child_count += n;
+        if (kind_has_text(ast_kind(ast, id))) string_bytes += strlen(ast_text(ast, id)) + 1;
+    }
+    free(stack.items);
+    int source_count = 1;
+    string_bytes += strlen(name) + 1;
+    for (int i = 0; i < m->import_source_count; i++) {
+        if (strcmp(m->import_sources[i].name, name) == 0) continue;
+        string_bytes += strlen(m->import_sources[i].name) + 1;
+        source_count++;
+    }
+    for (int i = 0; i < m->symbol_table.count; i++) string_bytes += strlen(m->symbol_table.symbols[i].name) + 1;
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+    h.source_count = source_count;
+    h.symbol_count = m->symbol_table.count;
+    h.node_count = node_count;
+    h.child_count = child_count;
+    h.string_bytes = string_bytes;
+    h.size = sizeof(h) + sizeof(SnapshotSource) * h.source_count + sizeof(SnapshotSymbol) * h.symbol_count
+        + sizeof(AstNode) * h.node_count + sizeof(NodeId) * h.child_count + h.string_bytes;
+    char *data = calloc(1, h.size);
+    memcpy(data, &h, sizeof(h));
+    SnapshotSource *sources = (SnapshotSource *)(data + sizeof(h));
+    SnapshotSymbol *symbols = (SnapshotSymbol *)(sources + h.source_count);
+    AstNode *nodes = (AstNode *)(symbols + h.symbol_count);
+    NodeId *children = (NodeId *)(nodes + h.node_count);
+    char *strings = (char *)(children + h.child_count);
+    uint32_t used = 0;
+    #define SNAPSHOT_STRING(text) (strcpy(strings + used, (text)), used += strlen(text) + 1, used - strlen(text) - 1)
+    sources[0] = (SnapshotSource){ hash, size, SNAPSHOT_STRING(name), 0 };
+    for (int i = 0, n = 1; i < m->import_source_count; i++) {
+        const ModuleSource *source = &m->import_sources[i];
+        if (strcmp(source->name, name) == 0) continue;
+        sources[n++] = (SnapshotSource){ source->hash, source->size, SNAPSHOT_STRING(source->name), 0 };
+    }
+    for (int i = 0; i < m->symbol_table.count; i++) {
+        const Symbol *symbol = &m->symbol_table.symbols[i];
+        symbols[i].name = SNAPSHOT_STRING(symbol->name);
+        symbols[i].type = strcmp(symbol->type, "int") == 0 ? NK_TYPE_INT : NK_TYPE_BOOL;
+        symbols[i].source = 0;
+        for (uint32_t n = 1; symbol->module && n < h.source_count; n++) {
+            if (strcmp(strings + sources[n].name, symbol->module) == 0) symbols[i].source = n;
+        }
+    }
+    uint32_t next_child = 0;
+    for (uint32_t i = 1; i < node_count; i++) {
+        NodeId id = order[i];
+        int n = ast_num_children(ast, id);
+        nodes[i].kind = ast_kind(ast, id);
+        nodes[i].num_children = n;
+        nodes[i].first_child = next_child;
+        nodes[i].token = kind_has_text(nodes[i].kind) ? SNAPSHOT_STRING(ast_text(ast, id)) : 0;
+        for (int c = 0; c < n; c++) {
+            NodeId child = ast_child(ast, id, c);
+            children[next_child++] = child ? ids[child] : NO_NODE;
+        }
+    }
+    #undef SNAPSHOT_STRING
+    free(order);
+    free(ids);
+    *out_size = h.size;
+    return data;
+}
+
+// Write name.upls through a temporary file, so readers never see half of it
+int snapshot_write(const Parser *p, const char *name, const char *data, size_t size) {
+    char path[MODULE_PATH_MAX], temp[MODULE_PATH_MAX + 32];
+    module_path(p, name, ".upls", path);
+    snprintf(temp, sizeof(temp), "%s.%d.%ld", path, (int)getpid(), (long)syscall(SYS_gettid));
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int failed = write_full(fd, data, size) < 0;
+    failed |= close(fd) < 0;
+    if (failed || rename(temp, path) < 0) {
+        int saved = errno;
+        unlink(temp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Parse module name.upl with m and serialize it. Returns the snapshot, or
+// NULL with the reasons in m's diagnostics.
+char* module_build(Parser *m, const char *name, size_t *size, ParseResult *result) {
+    char path[MODULE_PATH_MAX];
+    module_path(m, name, ".upl", path);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        parser_reset(m);
+        m->error_count = 1;
+        m->errors[0].line = 0; // Not about a line of the module
+        snprintf(m->errors[0].message, sizeof(m->errors[0].message), "Cannot find module %s", name);
+        *result = parse_result(m, NO_NODE, 1);
+        return NULL;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    int lazy = m->lazy;
+    m->lazy = 0;
+    *result = parser_parse(m, src, len);
+    m->lazy = lazy;
+    char *data = NULL;
+    if (result->ok) {
+        NodeId stmts = ast_child(&m->ast, result->root, 0);
+        for (int i = 0; i < ast_num_children(&m->ast, stmts); i++) {
+            NodeId stmt = ast_child(&m->ast, stmts, i);
+            if (ast_kind(&m->ast, stmt) != NK_DECL_STMT) {
+                add_error(m, node_line(m, ast_child(&m->ast, stmt, 0)), "A module may only declare variables");
+            }
+        }
+        *result = parse_result(m, result->root, 1);
+    }
+    if (result->ok) data = snapshot_build(m, result->root, name, content_hash(src, len), len, size);
+    free(src);
+    return data;
+}
+
+ParseResult parser_precompile(Parser *p, const char *name) {
+    size_t size;
+    ParseResult result;
+    if (!module_name_ok(name)) {
+        parser_reset(p);
+        p->error_count = 1;
+        p->errors[0].line = 0;
+        snprintf(p->errors[0].message, sizeof(p->errors[0].message), "Invalid module name %.200s", name);
+        return parse_result(p, NO_NODE, 1);
+    }
+    char *data = module_build(p, name, &size, &result);
+    if (data && snapshot_write(p, name, data, size) < 0 && p->error_count < MAX_ERRORS) {
+        char path[MODULE_PATH_MAX];
+        module_path(p, name, ".upls", path);
+        Error *error = &p->errors[p->error_count++];
+        error->line = 0;
+        snprintf(error->message, sizeof(error->message), "Could not write %.200s: %s", path, strerror(errno));
+        result = parse_result(p, result.root, 1);
+    }
+    free(data);
+    return result;
+}
+
+// Load module name for an import at line: from its snapshot if that is
+// fresh, otherwise by parsing it and, with UPL_MODULES_WRITE, writing the
+// snapshot again. A snapshot that is not written is used from memory.
+int module_load(Parser *p, const char *name, int line, Snapshot *s) {
+    char path[MODULE_PATH_MAX];
+    module_path(p, name, ".upls", path);
+    if (snapshot_open(s, path) && snapshot_fresh(p, s)) return 1;
+    if (s->data) snapshot_close(s);
+    for (const ImportChain *c = p->chain; c; c = c->parent) {
+        if (strcmp(c->name, name) == 0) {
+            add_error(p, line, "Import cycle through module %s", name);
+            return 0;
+        }
+    }
+    Parser *m = parser_new();
+    parser_set_module_dir(m, p->module_dir);
+    parser_set_module_access(m, p->module_access);
+    ImportChain link = { name, p->chain };
+    m->chain = &link;
+    size_t size;
+    ParseResult result;
+    char *data = module_build(m, name, &size, &result);
+    if (!data) {
+        int first = 0;
+        while (first < result.error_count - 1 && !error_is_reported(result.errors, first)) first++;
+        if (result.error_count == 0) add_error(p, line, "Module %s has errors", name);
+        else if (result.errors[first].line == 0) add_error(p, line, "%s", result.errors[first].message);
+        else add_error(p, line, "Module %s, line %d: %s", name, result.errors[first].line, result.errors[first].message);
+    } else {
+        if (p->module_access == UPL_MODULES_WRITE) snapshot_write(p, name, data, size);
+        snapshot_view(s, data, size, 0);
+    }
+    parser_free(m);
+    return data != NULL;
+}
+
+// Declare a module's variables, except those of modules already imported.
+// Snapshot names are unique, so they are checked only against the variables
+// declared before the module.
+void import_symbols(Parser *p, const Snapshot *s) {
+    SymbolTable *table = &p->symbol_table;
+    int before = table->count;
+    for (uint32_t i = 0; i < s->header->symbol_count; i++) {
+        const char *name = s->strings + s->symbols[i].name;
+        if (s->skip[i]) continue;
+        if (table->count >= MAX_SYMBOLS) {
+            add_error(p, s->line, "Too many variables declared");
+            return;
+        }
+        int declared = 0;
+        for (int j = 0; j < before && !declared; j++) declared = strcmp(table->symbols[j].name, name) == 0;
+        if (declared) {
+            add_error(p, s->line, "Variable %s already declared", name);
+            continue;
+        }
+        table->symbols[table->count].name = arena_strdup(&p->arena, name);
+        table->symbols[table->count].type = arena_strdup(&p->arena, s->symbols[i].type == NK_TYPE_INT ? "int" : "bool");
+        table->symbols[table->count].line = s->line;
+        table->symbols[table->count].module = arena_strdup(&p->arena, s->strings + s->sources[s->symbols[i].source].name);
+        table->count++;
+    }
+}
+
+// Whether the declarations of module name are in, imported directly or
+// through another module
+int module_imported(const Parser *p, const char *name) {
+    for (int i = 0; i < p->import_source_count; i++) {
+        if (strcmp(p->import_sources[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+// A snapshot holds the declarations of every module it imports, so in a
+// diamond the shared module is taken from the first import only
+void import_module(Parser *p, const char *name, int line) {
+    if (p->module_access == UPL_MODULES_OFF) {
+        add_error(p, line, "Imports are not enabled");
+        return;
+    }
+    if (!module_name_ok(name)) {
+        add_error(p, line, "Invalid module name %s", name);
+        return;
+    }
+    if (module_imported(p, name)) return;
+    Snapshot s;
+    if (!module_load(p, name, line, &s)) return;
+    s.line = line;
+    s.skip = calloc(s.header->symbol_count + 1, 1);
+    for (uint32_t i = 0; i < s.header->symbol_count; i++) {
+        s.skip[i] = module_imported(p, s.strings + s.sources[s.symbols[i].source].name);
+    }
+    if (p->import_count >= p->import_capacity) {
+        p->import_capacity = p->import_capacity ? p->import_capacity * 2 : 8;
+        p->imports = realloc(p->imports, sizeof(Snapshot) * p->import_capacity);
+    }
+    p->imports[p->import_count++] = s;
+    import_symbols(p, &s);
+    for (uint32_t i = 0; i < s.header->source_count; i++) {
+        const char *source_name = s.strings + s.sources[i].name;
+        if (module_imported(p, source_name)) continue;
+        if (p->import_source_count >= p->import_source_capacity) {
+            p->import_source_capacity = p->import_source_capacity ? p->import_source_capacity * 2 : 8;
+            p->import_sources = realloc(p->import_sources, sizeof(ModuleSource) * p->import_source_capacity);
+        }
+        ModuleSource *source = &p->import_sources[p->import_source_count++];
+        strcpy(source->name, source_name);
+        source->hash = s.sources[i].hash;
+        source->size = s.sources[i].size;
+    }
+}
+
+// "import name;" directives before 'begin'. 'import' is an identifier here,
+// since no program starts with one.
+void parse_imports(Parser *p) {
+    while (p->current_token.type == TOK_ID && strcmp(p->current_token.text, "import") == 0 && !governor_check(p)) {
+        int line = p->current_token.line;
+        next_token(p);
+        if (p->current_token.type != TOK_ID) {
+            add_error(p, p->current_token.line, "Expected module name");
+        } else {
+            char name[MAX_TOKEN_LEN];
+            strcpy(name, p->current_token.text);
+            next_token(p);
+            if (p->current_token.type != TOK_SEMICOLON) add_error(p, p->current_token.line, "Expected ';'");
+            else import_module(p, name, line);
+        }
+        while (p->current_token.type != TOK_SEMICOLON && p->current_token.type != TOK_BEGIN
+            && p->current_token.type != TOK_EOF) {
+            next_token(p);
+        }
+        if (p->current_token.type == TOK_SEMICOLON) next_token(p);
+    }
+}
+
+// Imported declarations as events, at the start of the program's statement
+// list; they carry the line of their import directive
+void import_emit(Parser *p) {
+    const ParseEvents *events = p->events;
+    NodeList stack = { NULL, 0, 0 };
+    p->imports_emitted = 1;
+    for (int m = 0; m < p->import_count; m++) {
+        const Snapshot *s = &p->imports[m];
+        const AstNode *root = &s->nodes[s->header->node_count - 1];
+        for (int i = root->num_children - 1; i >= 0; i--) {
+            if (!s->skip[i]) node_list_push(&stack, s->children[root->first_child + i] << 1);
+        }
+        while (stack.count > 0) {
+            uint32_t entry = stack.items[--stack.count];
+            const AstNode *node = &s->nodes[entry >> 1];
+            if (entry & 1) {
+                events->exit(events->ctx, node->kind);
+            } else if (kind_has_text(node->kind)) {
+                const char *text = s->strings + node->token;
+                events->leaf(events->ctx, node->kind, text, strlen(text), s->line);
+            } else {
+                events->enter(events->ctx, node->kind, s->line);
+                node_list_push(&stack, entry | 1);
+                for (int i = node->num_children - 1; i >= 0; i--) {
+                    NodeId child = s->children[node->first_child + i];
+                    if (child) node_list_push(&stack, child << 1);
+                }
+            }
+        }
+    }
+    free(stack.items);
+}
+
+// Copy a module's declarations into the tree. Their tokens have the line
+// of the import directive.
+void import_tree(Parser *p, const Snapshot *s, NodeList *decls) {
+    static const TokenType types[NK_COUNT] = {
+        [NK_NAME] = TOK_ID, [NK_ID] = TOK_ID, [NK_NUM] = TOK_NUM, [NK_TYPE_INT] = TOK_INT,
+        [NK_TYPE_BOOL] = TOK_BOOL, [NK_TRUE] = TOK_TRUE, [NK_FALSE] = TOK_FALSE
+    };
+    NodeId *ids = malloc(sizeof(NodeId) * s->header->node_count);
+    ids[0] = NO_NODE;
+    for (uint32_t i = 1; i + 1 < s->header->node_count; i++) {
+        const AstNode *node = &s->nodes[i];
+        if (kind_has_text(node->kind)) {
+            ids[i] = make_leaf(p, node->kind, synth_token(p, types[node->kind], s->strings + node->token, s->line));
+            continue;
+        }
+        ids[i] = new_node(p, node->kind, node->num_children, 0);
+        NodeId *children = p->ast.children + p->ast.nodes[ids[i]].first_child;
+        for (int c = 0; c < node->num_children; c++) children[c] = ids[s->children[node->first_child + c]];
+        set_anchor_token(p, ids[i]);
+        ids[i] = intern_node(p, ids[i]);
+    }
+    const AstNode *root = &s->nodes[s->header->node_count - 1];
+    for (int i = 0; i < root->num_children; i++) {
+        if (!s->skip[i]) node_list_push(decls, ids[s->children[root->first_child + i]]);
+    }
+    free(ids);
+}
+
+// End of a parse: put the imported declarations at the start of the
+// program's statements, then let go of the snapshots
+void link_imports(Parser *p, NodeId root) {
+    if (root && p->import_count > 0) {
+        NodeList decls = { NULL, 0, 0 };
+        for (int i = 0; i < p->import_count; i++) import_tree(p, &p->imports[i], &decls);
+        NodeId stmts = ast_child(&p->ast, root, 0);
+        for (int i = 0; i < ast_num_children(&p->ast, stmts); i++) node_list_push(&decls, ast_child(&p->ast, stmts, i));
+        NodeId list = make_node_list(p, NK_STMTS, decls.items, decls.count);
+        p->ast.children[p->ast.nodes[root].first_child] = list;
+        free(decls.items);
+    }
+    release_imports(p);
+}
+
+void release_imports(Parser *p) {
+    for (int i = 0; i < p->import_count; i++) snapshot_close(&p->imports[i]);
+    p->import_count = 0;
+    p->imports_emitted = 0;
+}
+
+// The tools look up the imports of a file next to it
+void set_module_dir_of(Parser *p, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        parser_set_module_dir(p, NULL);
+        return;
+    }
+    char dir[MODULE_PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    parser_set_module_dir(p, dir);
+}
+
+// Write name.upls next to each name.upl given
+int precompile_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --precompile <module file>...\n", argv[0]);
+        return 1;
+    }
+    int status = 0;
+    Parser *p = parser_new();
+    for (int i = 2; i < argc; i++) {
+        const char *path = argv[i], *base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        size_t len = strlen(base);
+        if (len <= 4 || len - 4 >= MAX_TOKEN_LEN || strcmp(base + len - 4, ".upl") != 0) {
+            fprintf(stderr, "Module files are named <name>.upl: %s\n", path);
+            status = 1;
+            continue;
+        }
+        if (access(path, R_OK) != 0) {
+            fprintf(stderr, "Could not open file %s\n", path);
+            status = 1;
+            continue;
+        }
+        char name[MAX_TOKEN_LEN], snapshot[MODULE_PATH_MAX];
+        snprintf(name, sizeof(name), "%.*s", (int)(len - 4), base);
+        set_module_dir_of(p, path);
+        ParseResult result = parser_precompile(p, name);
+        if (!result.ok) {
+            printf("%s:\n", path);
+            print_errors(stdout, result.errors, result.error_count);
+            status = 1;
+            continue;
+        }
+        module_path(p, name, ".upls", snapshot);
+        struct stat st;
+        stat(snapshot, &st);
+        printf("%s: %d variables, %lld bytes\n", snapshot, p->symbol_table.count, (long long)st.st_size);
+    }
+    parser_free(p);
+    return status;
+}
+
+typedef struct {
+    int listen_fd;
+    ParseLimits limits; // Applied to every request
+    CaptureLog *capture;
+    const char *module_dir; // Imports are off without one
+    ModuleAccess module_access;
+    int timeout_ms;     // Socket read and write timeout per connection
+} Server;
+
+// Answer framed requests on one connection until the client hangs up
+void serve_connection(Parser *p, int fd, char **src, size_t *src_cap) {
+    uint32_t header[2];
+    while (read_full(fd, header, sizeof(header)) == 1) {
+        uint32_t flags = ntohl(header[0]);
+        uint32_t len = ntohl(header[1]);
+        if (len > MAX_REQUEST_LEN) return;
+        if (len > *src_cap) {
+            *src_cap = len;
+            *src = realloc(*src, *src_cap);
+        }
+        if (len > 0 && read_full(fd, *src, len) != 1) return;
+        ParseResult result = parser_parse(p, *src, len);
+        char *out = NULL;
+        size_t out_len = 0;
+        FILE *stream = open_memstream(&out, &out_len);
+        if ((flags & UPL_REQ_CHECK_ONLY) && result.ok) {
+            fprintf(stream, "- source code has correct syntax: yes\n");
+        } else {
+            print_result(stream, &result);
+        }
+        fclose(stream);
+        uint32_t reply[2];
+        reply[0] = htonl(result.limit ? LIMIT_EXIT_STATUS : result.error_count > 0 ? 1 : 0);
+        reply[1] = htonl((uint32_t)out_len);
+        int failed = write_full(fd, reply, sizeof(reply)) < 0 || write_full(fd, out, out_len) < 0;
+        free(out);
+        if (failed) return;
+    }
+}
+
+// Each worker owns one warm parser and serves one connection at a time
+void* serve_worker(void *arg) {
+    Server *server = arg;
+    Parser *p = parser_new();
+    parser_set_limits(p, &server->limits);
+    parser_set_capture(p, server->capture);
+    parser_set_module_dir(p, server->module_dir);
+    parser_set_module_access(p, server->module_dir ? server->module_access : UPL_MODULES_OFF);
+    char *src = NULL;
+    size_t src_cap = 0;
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        // A client that stops sending or reading would hold this worker forever
+        struct timeval timeout = { server->timeout_ms / 1000, server->timeout_ms % 1000 * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_connection(p, fd, &src, &src_cap);
+        close(fd);
+    }
+    free(src);
+    parser_free(p);
+    return NULL;
+}
+
+void serve_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --serve <socket> [--workers N] [--timeout-ms N] [--capture <log>]\n"
+        "       [--modules <dir> [--write-snapshots]] [limits]\n", program);
+    fprintf(stderr, "limits: --max-bytes N --max-tokens N --max-nodes N --max-depth N --max-ms N --max-memory N\n"
+        "--max-depth is %d unless given\n", SERVE_MAX_DEPTH);
+}
+
+int serve_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        serve_usage(argv[0]);
+        return 1;
+    }
+    const char *path = argv[2], *capture_path = NULL;
+    int workers = 4;
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.timeout_ms = SERVE_TIMEOUT_MS;
+    server.module_access = UPL_MODULES_READ; // Requests leave the module directory alone
+    server.limits.max_depth = SERVE_MAX_DEPTH;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--timeout-ms") == 0 && i + 1 < argc) server.timeout_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) capture_path = argv[++i];
+        else if (strcmp(argv[i], "--modules") == 0 && i + 1 < argc) server.module_dir = argv[++i];
+        else if (strcmp(argv[i], "--write-snapshots") == 0) server.module_access = UPL_MODULES_WRITE;
+        else if (!limit_option(argc, argv, &i, &server.limits)) {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            serve_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (server.timeout_ms < 1) server.timeout_ms = 1;
+    if (capture_path && !(server.capture = capture_open(capture_path))) {
+        fprintf(stderr, "Could not open file %s\n", capture_path);
+        return 1;
+    }
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(server.listen_fd, 128) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t threads[MAX_WORKERS];
+    int started = 0, error = 0;
+    // Serve with the workers that could be started
+    while (started < workers && (error = pthread_create(&threads[started], NULL, serve_worker, &server)) == 0) started++;
+    if (error) fprintf(stderr, "Could not start worker %d of %d: %s\n", started + 1, workers, strerror(error));
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(server.listen_fd);
+    unlink(path);
+    capture_close(server.capture);
+    return started > 0 ? 0 : 1;
+}
+
+typedef struct {
+    const char *path;
+    const char *src;
+    size_t len;
+    uint32_t flags;
+    int requests;
+    double *latencies; // Milliseconds, one slot per request
+    int failed;
+    int threaded;      // Ran on a thread of its own, to be joined
+} ClientJob;
+
+int connect_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Send one request and read its reply into *out; returns the status or -1
+int client_request(int fd, const ClientJob *job, char **out, size_t *out_cap, uint32_t *out_len) {
+    uint32_t header[2];
+    header[0] = htonl(job->flags);
+    header[1] = htonl((uint32_t)job->len);
+    if (write_full(fd, header, sizeof(header)) < 0 || write_full(fd, job->src, job->len) < 0) return -1;
+    uint32_t reply[2];
+    if (read_full(fd, reply, sizeof(reply)) != 1) return -1;
+    *out_len = ntohl(reply[1]);
+    if (*out_len > *out_cap) {
+        *out_cap = *out_len;
+        *out = realloc(*out, *out_cap);
+    }
+    if (*out_len > 0 && read_full(fd, *out, *out_len) != 1) return -1;
+    return (int)ntohl(reply[0]);
+}
+
+void* client_worker(void *arg) {
+    ClientJob *job = arg;
+    int fd = connect_socket(job->path);
+    if (fd < 0) {
+        job->failed = job->requests;
+        return NULL;
+    }
+    char *out = NULL;
+    size_t out_cap = 0;
+    uint32_t out_len;
+    for (int i = 0; i < job->requests; i++) {
+        double start = now_ms();
+        if (client_request(fd, job, &out, &out_cap, &out_len) < 0) {
+            job->failed = job->requests - i;
+            break;
+        }
+        job->latencies[i] = now_ms() - start;
+    }
+    free(out);
+    close(fd);
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void client_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --client <socket> <filename> [-n requests] [-c connections] [--check-only]\n", program);
+}
+
+// Load generator: -n total requests spread over -c connections
+int client_main(int argc, char *argv[]) {
+    if (argc < 4) {
+        client_usage(argv[0]);
+        return 1;
+    }
+    int requests = 1, connections = 1;
+    uint32_t flags = 0;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) requests = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) connections = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--check-only") == 0) flags |= UPL_REQ_CHECK_ONLY;
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            client_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (requests < 1) requests = 1;
+    if (connections < 1) connections = 1;
+    if (connections > requests) connections = requests;
+    FILE *file = fopen(argv[3], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[3]);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    if (requests == 1) {
+        // Single request: behave like the local tool
+        ClientJob job = { argv[2], src, len, flags, 1, NULL, 0, 0 };
+        int fd = connect_socket(argv[2]);
+        char *out = NULL;
+        size_t out_cap = 0;
+        uint32_t out_len = 0;
+        int status = fd < 0 ? -1 : client_request(fd, &job, &out, &out_cap, &out_len);
+        if (status < 0) {
+            fprintf(stderr, "Request to %s failed\n", argv[2]);
+            status = 1;
+        } else {
+            fwrite(out, 1, out_len, stdout);
+        }
+        if (fd >= 0) close(fd);
+        free(out);
+        free(src);
+        return status;
+    }
+    double *latencies = calloc(requests, sizeof(double));
+    ClientJob *jobs = calloc(connections, sizeof(ClientJob));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    int offset = 0;
+    double start = now_ms();
+    for (int i = 0; i < connections; i++) {
+        int share = requests / connections + (i < requests % connections ? 1 : 0);
+        jobs[i] = (ClientJob){ argv[2], src, len, flags, share, latencies + offset, 0, 0 };
+        offset += share;
+        jobs[i].threaded = pthread_create(&threads[i], NULL, client_worker, &jobs[i]) == 0;
+        // Out of threads: this connection's share runs here instead
+        if (!jobs[i].threaded) client_worker(&jobs[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < connections; i++) {
+        if (jobs[i].threaded) pthread_join(threads[i], NULL);
+        failed += jobs[i].failed;
+    }
+    double elapsed = now_ms() - start;
+    // Keep only completed requests, which sit at the front of each job's slice
+    int done = 0;
+    for (int i = 0; i < connections; i++) {
+        int completed = jobs[i].requests - jobs[i].failed;
+        memmove(latencies + done, jobs[i].latencies, completed * sizeof(double));
+        done += completed;
+    }
+    qsort(latencies, done, sizeof(double), compare_double);
+    printf("requests: %d ok, %d failed, %d connections\n", done, failed, connections);
+    if (done > 0) {
+        int p99 = done * 99 / 100;
+        if (p99 >= done) p99 = done - 1;
+        printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n", latencies[done / 2], latencies[p99], latencies[done - 1]);
+        printf("throughput: %.0f req/s\n", done / (elapsed / 1e3));
+    }
+    free(threads);
+    free(jobs);
+    free(latencies);
+    free(src);
+    return failed > 0 ? 1 : 0;
+}
+
+// Traffic capture (upl --capture) and replay (upl --replay)
+
+// Records are appended, so one log can collect the parses of many runs
+CaptureLog* capture_open(const char *path) {
+    FILE *file = fopen(path, "a+b");
+    if (!file) return NULL;
+    size_t magic = strlen(CAPTURE_MAGIC);
+    char head[16];
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+        fwrite(CAPTURE_MAGIC, 1, magic, file);
+    } else {
+        rewind(file);
+        if (fread(head, 1, magic, file) != magic || memcmp(head, CAPTURE_MAGIC, magic) != 0) {
+            fclose(file);
+            return NULL;
+        }
+    }
+    CaptureLog *log = calloc(1, sizeof(CaptureLog));
+    log->file = file;
+    pthread_mutex_init(&log->lock, NULL);
+    return log;
+}
+
+void capture_close(CaptureLog *log) {
+    if (!log) return;
+    fclose(log->file);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+// LEB128: seven bits per byte, low bits first
+int put_varint(uint8_t *out, uint64_t value) {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+// Returns 0 if the varint runs past end or is too long
+int get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        uint8_t byte = *(*pos)++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Append the parse that just ended. The record is flushed at once, so a
+// daemon that is killed loses no traffic; the times were taken before.
+void capture_record(Parser *p, int events, uint64_t start, uint64_t lexed, uint64_t end, int status) {
+    CaptureLog *log = p->capture;
+    uint8_t header[48];
+    int n = put_varint(header, start);
+    header[n++] = (events ? CAPTURE_EVENTS : 0) | (p->engine == UPL_ENGINE_LL1 ? CAPTURE_LL1 : 0)
+        | (p->pipelined && !events ? CAPTURE_PIPELINED : 0) | (p->lazy ? CAPTURE_LAZY : 0)
+        | (p->hash_cons ? CAPTURE_HASH_CONS : 0);
+    header[n++] = (uint8_t)status;
+    n += put_varint(header + n, lexed - start);
+    n += put_varint(header + n, end - lexed);
+    n += put_varint(header + n, p->src_len);
+    pthread_mutex_lock(&log->lock);
+    fwrite(header, 1, n, log->file);
+    fwrite(p->src, 1, p->src_len, log->file);
+    fflush(log->file);
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Map a capture log and index its records. A record cut short by a crash
+// ends the log with a warning. Returns NULL if the file is not a log.
+CaptureRecord* capture_load(const char *path, int *count, void **map, size_t *map_len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    size_t magic = strlen(CAPTURE_MAGIC);
+    *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= magic) {
+        *map_len = st.st_size;
+        *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (*map == MAP_FAILED || memcmp(*map, CAPTURE_MAGIC, magic) != 0) {
+        if (*map != MAP_FAILED) munmap(*map, *map_len);
+        fprintf(stderr, "%s is not a capture log\n", path);
+        return NULL;
+    }
+    const uint8_t *pos = (const uint8_t *)*map + magic, *end = (const uint8_t *)*map + *map_len;
+    int capacity = 256;
+    CaptureRecord *records = malloc(sizeof(CaptureRecord) * capacity);
+    *count = 0;
+    while (pos < end) {
+        CaptureRecord r;
+        uint64_t len;
+        int ok = get_varint(&pos, end, &r.start_ns) && end - pos >= 2;
+        if (ok) {
+            r.flags = *pos++;
+            r.status = *pos++;
+            ok = get_varint(&pos, end, &r.lex_ns) && get_varint(&pos, end, &r.parse_ns)
+                && get_varint(&pos, end, &len) && len <= (uint64_t)(end - pos);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: record %d is truncated, ignoring the rest\n", path, *count + 1);
+            break;
+        }
+        r.src = (const char *)pos;
+        r.len = len;
+        pos += len;
+        if (*count >= capacity) {
+            capacity *= 2;
+            records = realloc(records, sizeof(CaptureRecord) * capacity);
+        }
+        records[(*count)++] = r;
+    }
+    return records;
+}
+
+int hist_index(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS)) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Largest value counted in a bucket
+uint64_t hist_bucket_max(int index) {
+    if (index < (1 << HIST_SUB_BITS)) return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (index & ((1u << HIST_SUB_BITS) - 1)) | (1u << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_add(Histogram *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->count += from->count;
+    if (from->max > into->max) into->max = from->max;
+}
+
+// Smallest bucket bound that at least q of the values are under
+uint64_t hist_percentile(const Histogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+void print_hist_row(FILE *out, const char *name, const Histogram *h) {
+    static const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+    fprintf(out, "%-10s", name);
+    for (int i = 0; i < 4; i++) fprintf(out, " %10.1f", hist_percentile(h, quantiles[i]) / 1e3);
+    fprintf(out, " %10.1f\n", h->max / 1e3);
+}
+
+void replay_enter(void *ctx, NodeKind kind, int line) {
+    (void)ctx;
+    (void)kind;
+    (void)line;
+}
+
+void replay_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line) {
+    (void)ctx;
+    (void)kind;
+    (void)text;
+    (void)len;
+    (void)line;
+}
+
+void replay_exit(void *ctx, NodeKind kind) {
+    (void)ctx;
+    (void)kind;
+}
+
+typedef struct {
+    const CaptureRecord *records;
+    int record_count;
+    uint64_t total;         // Parses to run over all threads
+    _Atomic uint64_t *next; // Next parse to take
+    uint64_t start_ns;
+    double rate;            // Parses per second; 0 runs flat out
+    int ll1;                // Override the captured engine
+    const ParseLimits *limits;
+    Histogram lex;
+    Histogram parse;
+    Histogram service;      // Lex and parse
+    Histogram response;     // From the scheduled start, so waits count too
+    uint64_t bytes;
+    int changed;            // Parses whose exit status differs from the capture
+} ReplayJob;
+
+// Threads take parses in order from a shared counter. At a target rate parse
+// i is due at start + i / rate; a thread that falls behind starts at once and
+// the delay shows in the response time instead of being hidden.
+void* replay_worker(void *arg) {
+    ReplayJob *job = arg;
+    Parser *p = parser_new();
+    parser_set_limits(p, job->limits);
+    p->timed = 1;
+    ParseEvents events = { replay_enter, replay_leaf, replay_exit, NULL };
+    for (;;) {
+        uint64_t i = atomic_fetch_add(job->next, 1);
+        if (i >= job->total) break;
+        const CaptureRecord *r = &job->records[i % job->record_count];
+        uint64_t due = job->rate > 0 ? job->start_ns + (uint64_t)(i * 1e9 / job->rate) : now_ns();
+        if (job->rate > 0) {
+            struct timespec ts = { (time_t)(due / 1000000000u), (long)(due % 1000000000u) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+        parser_set_engine(p, job->ll1 || (r->flags & CAPTURE_LL1) ? UPL_ENGINE_LL1 : UPL_ENGINE_RECURSIVE);
+        parser_set_pipelined(p, (r->flags & CAPTURE_PIPELINED) != 0);
+        parser_set_lazy(p, (r->flags & CAPTURE_LAZY) != 0);
+        parser_set_hash_cons(p, (r->flags & CAPTURE_HASH_CONS) != 0);
+        ParseResult result = r->flags & CAPTURE_EVENTS ? parser_parse_events(p, r->src, r->len, &events)
+            : parser_parse(p, r->src, r->len);
+        uint64_t end = now_ns();
+        hist_add(&job->lex, p->lex_ns);
+        hist_add(&job->parse, p->parse_ns);
+        hist_add(&job->service, p->lex_ns + p->parse_ns);
+        hist_add(&job->response, end > due ? end - due : 0);
+        job->bytes += r->len;
+        int status = result.limit ? LIMIT_EXIT_STATUS : result.error_count > 0 ? 1 : 0;
+        job->changed += status != r->status;
+    }
+    parser_free(p);
+    return NULL;
+}
+
+void replay_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --replay <log> [-n passes] [-j threads] [--rate N] [--ll1] [limits]\n", program);
+    fprintf(stderr, "limits: --max-bytes N --max-tokens N --max-nodes N --max-depth N --max-ms N --max-memory N\n");
+}
+
+// Feed a capture log back through the parser, -n times over, on -j threads,
+// at --rate parses per second or flat out. Prints latency percentiles of the
+// captured and replayed parses, throughput and peak RSS; exits with 1 if some
+// parse ended with another status than when it was captured.
+int replay_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        replay_usage(argv[0]);
+        return 1;
+    }
+    int passes = 1, threads = 1, ll1 = 0;
+    double rate = 0;
+    ParseLimits limits;
+    memset(&limits, 0, sizeof(limits));
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) passes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--ll1") == 0) ll1 = 1;
+        else if (!limit_option(argc, argv, &i, &limits)) {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            replay_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (passes < 1) passes = 1;
+    if (threads < 1) threads = 1;
+    if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+    int count;
+    void *map;
+    size_t map_len;
+    CaptureRecord *records = capture_load(argv[2], &count, &map, &map_len);
+    if (!records) return 1;
+    if (count == 0) {
+        fprintf(stderr, "%s has no records\n", argv[2]);
+        free(records);
+        munmap(map, map_len);
+        return 1;
+    }
+    Histogram *captured = calloc(1, sizeof(Histogram));
+    // Threads append in the order parses end, so start times are not sorted
+    uint64_t captured_bytes = 0, first = records[0].start_ns, last = first;
+    for (int i = 0; i < count; i++) {
+        hist_add(captured, records[i].lex_ns + records[i].parse_ns);
+        captured_bytes += records[i].len;
+        if (records[i].start_ns < first) first = records[i].start_ns;
+        if (records[i].start_ns > last) last = records[i].start_ns;
+    }
+    uint64_t span = last - first;
+    printf("log: %d parses, %llu bytes", count, (unsigned long long)captured_bytes);
+    if (span > 0) printf(", captured over %.3f s (%.0f parses/s)", span / 1e9, (count - 1) / (span / 1e9));
+    printf("\n");
+
+    _Atomic uint64_t next = 0;
+    ReplayJob *jobs = calloc(threads, sizeof(ReplayJob));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    int started = 0, error = 0;
+    for (int i = 0; i < threads; i++) {
+        jobs[i].records = records;
+        jobs[i].record_count = count;
+        jobs[i].total = (uint64_t)count * passes;
+        jobs[i].next = &next;
+        jobs[i].start_ns = start;
+        jobs[i].rate = rate;
+        jobs[i].ll1 = ll1;
+        jobs[i].limits = &limits;
+    }
+    // Workers take parses from one counter, so those started share the rest
+    while (started < threads && (error = pthread_create(&ids[started], NULL, replay_worker, &jobs[started])) == 0) started++;
+    if (error) fprintf(stderr, "Could not start thread %d of %d: %s\n", started + 1, threads, strerror(error));
+    if (started == 0) replay_worker(&jobs[0]);
+    for (int i = 0; i < started; i++) pthread_join(ids[i], NULL);
+    threads = started > 0 ? started : 1;
+    double elapsed = (now_ns() - start) / 1e9;
+    Histogram *sum = calloc(4, sizeof(Histogram));
+    uint64_t bytes = 0;
+    int changed = 0;
+    for (int i = 0; i < threads; i++) {
+        hist_merge(&sum[0], &jobs[i].lex);
+        hist_merge(&sum[1], &jobs[i].parse);
+        hist_merge(&sum[2], &jobs[i].service);
+        hist_merge(&sum[3], &jobs[i].response);
+        bytes += jobs[i].bytes;
+        changed += jobs[i].changed;
+    }
+    printf("replay: %llu parses, %d threads, ", (unsigned long long)sum[2].count, threads);
+    if (rate > 0) printf("target %.0f parses/s\n", rate);
+    else printf("flat out\n");
+    printf("%-10s %10s %10s %10s %10s %10s\n", "us", "p50", "p90", "p99", "p99.9", "max");
+    print_hist_row(stdout, "captured", captured);
+    print_hist_row(stdout, "lex", &sum[0]);
+    print_hist_row(stdout, "parse", &sum[1]);
+    print_hist_row(stdout, "total", &sum[2]);
+    if (rate > 0) print_hist_row(stdout, "response", &sum[3]);
+    printf("throughput: %.0f parses/s, %.1f MB/s\n", sum[2].count / elapsed, bytes / elapsed / 1e6);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak rss: %ld KB\n", usage.ru_maxrss);
+    printf("status changed from capture: %d\n", changed);
+    free(sum);
+    free(ids);
+    free(jobs);
+    free(captured);
+    free(records);
+    munmap(map, map_len);
+    return changed > 0 ? 1 : 0;
+}
+
+// Stream the tree as JSON while parsing; the verdict and errors follow it
+int json_main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s --json <filename>\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(argv[2], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    Parser *p = parser_new();
+    set_module_dir_of(p, argv[2]);
+    JsonPrinter jp = { stdout, 0 };
+    ParseEvents events = { json_enter, json_leaf, json_exit, &jp };
+    printf("{\"tree\":[");
+    ParseResult result = parser_parse_events(p, src, len, &events);
+    printf("],\"ok\":%s,\"errors\":[", result.ok ? "true" : "false");
+    int first = 1;
+    for (int i = 0; i < result.error_count; i++) {
+        if (!error_is_reported(result.errors, i)) continue;
+        printf("%s{\"line\":%d,\"message\":", first ? "" : ",", result.errors[i].line);
+        json_string(stdout, result.errors[i].message, strlen(result.errors[i].message));
+        printf("}");
+        first = 0;
+    }
+    printf("]}\n");
+    int status = result.error_count > 0 ? 1 : 0;
+    parser_free(p);
+    free(src);
+    return status;
+}
+
+// Compare two trees node by node, without recursion
+int ast_same_shape(const Ast *a, NodeId x, const Ast *b, NodeId y) {
+    int capacity = 64, top = 0, same = 1;
+    NodeId *stack = malloc(sizeof(NodeId) * capacity);
+    stack[top++] = x;
+    stack[top++] = y;
+    while (same && top > 0) {
+        y = stack[--top];
+        x = stack[--top];
+        if (!x || !y) {
+            same = x == y;
+            continue;
+        }
+        NodeKind kind = ast_kind(a, x);
+        int n = ast_num_children(a, x);
+        if (kind != ast_kind(b, y) || n != ast_num_children(b, y)
+            || (kind_has_text(kind) && strcmp(ast_text(a, x), ast_text(b, y)) != 0)) {
+            same = 0;
+            continue;
+        }
+        if (top + 2 * n > capacity) {
+            while (top + 2 * n > capacity) capacity *= 2;
+            stack = realloc(stack, sizeof(NodeId) * capacity);
+        }
+        for (int i = 0; i < n; i++) {
+            stack[top++] = ast_child(a, x, i);
+            stack[top++] = ast_child(b, y, i);
+        }
+    }
+    free(stack);
+    return same;
+}
+
+// Deepest brace or parenthesis nesting in the last parse's tokens
+int max_nesting(Parser *p) {
+    int max = 0, parens = 0;
+    for (int i = 0; i < p->token_list.count; i++) {
+        const Token *token = &p->token_list.tokens[i];
+        if (token->type == TOK_LPAREN) parens++;
+        if (token->type == TOK_RPAREN && parens > 0) parens--;
+        if (token->depth + parens > max) max = token->depth + parens;
+    }
+    return max;
+}
+
+// Same verdict, diagnostics and tree shape
+int results_agree(const ParseResult *a, const ParseResult *b) {
+    int same = a->ok == b->ok && a->error_count == b->error_count;
+    for (int i = 0; same && i < a->error_count; i++) {
+        same = a->errors[i].line == b->errors[i].line
+            && strcmp(a->errors[i].message, b->errors[i].message) == 0;
+    }
+    return same && ast_same_shape(a->ast, a->root, b->ast, b->root);
+}
+
+// Time the recursive descent and LL(1) engines and the pipelined parse on one
+// file and check that they agree. The lex row times tokenizing alone, the
+// lower bound for a pipelined parse. Inputs nested too deeply for the C
+// stack are run on LL(1) only.
+int bench_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --bench <filename> [-n parses]\n", argv[0]);
+        return 1;
+    }
+    int count = 100;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+    }
+    if (count < 1) count = 1;
+    FILE *file = fopen(argv[2], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    Parser *parsers[4] = { parser_new(), parser_new(), parser_new(), parser_new() };
+    const char *names[4] = { "recursive", "ll1", "pipelined", "lazy" };
+    parser_set_engine(parsers[1], UPL_ENGINE_LL1);
+    parser_set_pipelined(parsers[2], 1);
+    parser_set_lazy(parsers[3], 1);
+    ParseResult results[4];
+    results[1] = parser_parse(parsers[1], src, len);
+    int depth = max_nesting(parsers[1]);
+    int run_recursive = depth <= BENCH_RECURSIVE_MAX_DEPTH;
+    printf("input: %zu bytes, %d tokens, nesting depth %d, correct syntax: %s\n", len,
+        parsers[1]->token_list.count, depth, results[1].ok ? "yes" : "no");
+    double start = now_ms();
+    for (int i = 0; i < count; i++) {
+        parser_reset(parsers[1]);
+        parsers[1]->src = src;
+        parsers[1]->src_len = len;
+        tokenize_file(parsers[1]);
+    }
+    double elapsed = now_ms() - start;
+    printf("%-10s %10.3f ms/parse %10.1f MB/s\n", "lex", elapsed / count,
+        len / (elapsed / count / 1e3) / 1e6);
+    for (int e = run_recursive ? 0 : 1; e < (run_recursive ? 4 : 2); e++) {
+        start = now_ms();
+        for (int i = 0; i < count; i++) results[e] = parser_parse(parsers[e], src, len);
+        elapsed = now_ms() - start;
+        printf("%-10s %10.3f ms/parse %10.1f MB/s\n", names[e], elapsed / count,
+            len / (elapsed / count / 1e3) / 1e6);
+    }
+    int status = 0;
+    if (!run_recursive) {
+        printf("recursive  skipped: nesting deeper than %d\n", BENCH_RECURSIVE_MAX_DEPTH);
+        printf("pipelined  skipped: runs the recursive engine\n");
+        printf("lazy       skipped: runs the recursive engine\n");
+    } else {
+        // The lazy row times the skim alone, the time to the top-level result
+        start = now_ms();
+        results[3] = parser_force_all(parsers[3]);
+        printf("%-10s %10.3f ms to force every block\n", "", now_ms() - start);
+        int same = results_agree(&results[0], &results[1]) && results_agree(&results[0], &results[2])
+            && results_agree(&results[0], &results[3]);
+        printf("engines agree: %s\n", same ? "yes" : "no");
+        status = same ? 0 : 1;
+    }
+    parser_free(parsers[0]);
+    parser_free(parsers[1]);
+    parser_free(parsers[2]);
+    parser_free(parsers[3]);
+    free(src);
+    return status;
+}
+
+// Source-line profiler (upl --profile). Hooks in the lexer and parser charge
+// time and work to the line of the token being handled, and to the stack of
+// open constructs, which is followed through parse events.
+
+LineProfile* profile_line(Profile *prof, int line) {
+    if (line < 0) line = 0;
+    if (line >= prof->line_capacity) {
+        int capacity = prof->line_capacity ? prof->line_capacity : 256;
+        while (capacity <= line) capacity *= 2;
+        prof->lines = realloc(prof->lines, sizeof(LineProfile) * capacity);
+        memset(prof->lines + prof->line_capacity, 0, sizeof(LineProfile) * (capacity - prof->line_capacity));
+        prof->line_capacity = capacity;
+    }
+    return &prof->lines[line];
+}
+
+// A token was added: the time since the previous one went into lexing it
+void profile_lex(Parser *p, int line) {
+    uint64_t now = now_ns();
+    LineProfile *lp = profile_line(p->profile, line);
+    lp->lex_ns += now - p->profile->last_ns;
+    lp->tokens++;
+    p->profile->last_ns = now;
+}
+
+// The parser moves past the current token: charge the time spent on it
+void profile_tick(Parser *p) {
+    Profile *prof = p->profile;
+    uint64_t now = now_ns();
+    profile_line(prof, p->current_token.line)->parse_ns += now - prof->last_ns;
+    prof->frames[prof->current].parse_ns += now - prof->last_ns;
+    prof->last_ns = now;
+}
+
+void profile_node(Parser *p) {
+    profile_line(p->profile, p->current_token.line)->nodes++;
+    p->profile->frames[p->profile->current].nodes++;
+}
+
+void profile_probe(Parser *p, int steps) {
+    LineProfile *lp = profile_line(p->profile, p->current_token.line);
+    lp->probes++;
+    lp->probe_steps += steps;
+    p->profile->frames[p->profile->current].probes++;
+}
+
+void profile_sync(Parser *p, int skipped) {
+    LineProfile *lp = profile_line(p->profile, p->current_token.line);
+    lp->syncs++;
+    lp->sync_tokens += skipped;
+    p->profile->frames[p->profile->current].sync_tokens += skipped;
+}
+
+void profile_enter(void *ctx, NodeKind kind, int line) {
+    Profile *prof = ctx;
+    (void)line;
+    int child = prof->frames[prof->current].first_child;
+    while (child && prof->frames[child].kind != kind) child = prof->frames[child].next_sibling;
+    if (!child) {
+        if (prof->frame_count >= prof->frame_capacity) {
+            prof->frame_capacity *= 2;
+            prof->frames = realloc(prof->frames, sizeof(ProfileFrame) * prof->frame_capacity);
+        }
+        child = prof->frame_count++;
+        memset(&prof->frames[child], 0, sizeof(ProfileFrame));
+        prof->frames[child].parent = prof->current;
+        prof->frames[child].kind = kind;
+        prof->frames[child].next_sibling = prof->frames[prof->current].first_child;
+        prof->frames[prof->current].first_child = child;
+    }
+    prof->current = child;
+}
+
+void profile_leaf(void *ctx, NodeKind kind, const char *text, size_t len, int line) {
+    (void)ctx;
+    (void)kind;
+    (void)text;
+    (void)len;
+    (void)line;
+}
+
+void profile_exit(void *ctx, NodeKind kind) {
+    Profile *prof = ctx;
+    (void)kind;
+    prof->current = prof->frames[prof->current].parent;
+}
+
+// One "Prog;Stmts;ForStmt;... nanoseconds" line per construct stack, the
+// folded format read by flame graph tools
+void print_folded(FILE *out, const Profile *prof) {
+    int *path = malloc(sizeof(int) * prof->frame_count);
+    for (int i = 1; i < prof->frame_count; i++) {
+        if (prof->frames[i].parse_ns == 0) continue;
+        int depth = 0;
+        for (int f = i; f != 0; f = prof->frames[f].parent) path[depth++] = f;
+        for (int d = depth - 1; d >= 0; d--) {
+            fprintf(out, "%s%s", node_kind_label(prof->frames[path[d]].kind), d > 0 ? ";" : "");
+        }
+        fprintf(out, " %llu\n", (unsigned long long)prof->frames[i].parse_ns);
+    }
+    free(path);
+}
+
+int compare_line_cost(const void *a, const void *b, void *arg) {
+    const LineProfile *lines = arg;
+    uint64_t ca = lines[*(const int *)a].lex_ns + lines[*(const int *)a].parse_ns;
+    uint64_t cb = lines[*(const int *)b].lex_ns + lines[*(const int *)b].parse_ns;
+    return ca < cb ? 1 : ca > cb ? -1 : *(const int *)a - *(const int *)b;
+}
+
+// Parse one file with the profiler attached; print the hottest lines and the
+// cost per construct kind, and optionally write folded stacks
+int profile_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --profile <filename> [--top N] [--folded <file>] [--ll1]\n", argv[0]);
+        return 1;
+    }
+    int top = 20;
+    const char *folded_path = NULL;
+    ParserEngine engine = UPL_ENGINE_RECURSIVE;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) folded_path = argv[++i];
+        else if (strcmp(argv[i], "--ll1") == 0) engine = UPL_ENGINE_LL1;
+    }
+    FILE *file = fopen(argv[2], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+
+    Profile prof = { 0 };
+    prof.frame_capacity = 256;
+    prof.frames = calloc(prof.frame_capacity, sizeof(ProfileFrame));
+    prof.frame_count = 1; // Frame 0 is outside any construct
+    Parser *p = parser_new();
+    set_module_dir_of(p, argv[2]);
+    parser_set_engine(p, engine);
+    p->profile = &prof;
+    ParseEvents events = { profile_enter, profile_leaf, profile_exit, &prof };
+    ParseResult result = parser_parse_events(p, src, len, &events);
+    profile_tick(p);
+    p->profile = NULL;
+
+    // Line start offsets, to show the source of the hot lines
+    int line_count = 1;
+    for (size_t i = 0; i < len; i++) line_count += src[i] == '\n';
+    size_t *starts = malloc(sizeof(size_t) * (line_count + 1));
+    starts[1] = 0;
+    for (size_t i = 0, line = 1; i < len; i++) {
+        if (src[i] == '\n' && (int)line < line_count) starts[++line] = i + 1;
+    }
+    LineProfile total = { 0 };
+    int *order = malloc(sizeof(int) * (prof.line_capacity + 1));
+    int used = 0;
+    for (int i = 0; i < prof.line_capacity; i++) {
+        const LineProfile *lp = &prof.lines[i];
+        total.lex_ns += lp->lex_ns;
+        total.parse_ns += lp->parse_ns;
+        total.tokens += lp->tokens;
+        total.nodes += lp->nodes;
+        total.probes += lp->probes;
+        total.probe_steps += lp->probe_steps;
+        total.syncs += lp->syncs;
+        total.sync_tokens += lp->sync_tokens;
+        if (i > 0 && (lp->tokens || lp->parse_ns)) order[used++] = i; // Line 0 is before the first token
+    }
+    qsort_r(order, used, sizeof(int), compare_line_cost, prof.lines);
+
+    printf("- source code has correct syntax: %s\n", result.ok ? "yes" : "no");
+    printf("- lex %.3f ms, parse %.3f ms, %u tokens, %u nodes, %u symbol probes (%u compares), %u resyncs skipping %u tokens\n",
+        total.lex_ns / 1e6, total.parse_ns / 1e6, total.tokens, total.nodes, total.probes, total.probe_steps,
+        total.syncs, total.sync_tokens);
+    printf("hot lines:\n");
+    printf("%8s %10s %10s %10s %7s %7s %7s %8s %8s  %s\n", "line", "total_us", "lex_us", "parse_us", "tokens",
+        "nodes", "probes", "compares", "skipped", "source");
+    for (int i = 0; i < used && i < top; i++) {
+        int line = order[i];
+        const LineProfile *lp = &prof.lines[line];
+        printf("%8d %10.1f %10.1f %10.1f %7u %7u %7u %8u %8u  ", line, (lp->lex_ns + lp->parse_ns) / 1e3,
+            lp->lex_ns / 1e3, lp->parse_ns / 1e3, lp->tokens, lp->nodes, lp->probes, lp->probe_steps, lp->sync_tokens);
+        if (line >= 1 && line <= line_count) {
+            size_t end = line < line_count ? starts[line + 1] : len;
+            int shown = 0;
+            for (size_t j = starts[line]; j < end && src[j] != '\n' && shown < 60; j++) {
+                if (shown == 0 && isspace((unsigned char)src[j])) continue;
+                putchar(src[j] == '\t' ? ' ' : src[j]);
+                shown++;
+            }
+        }
+        putchar('\n');
+    }
+
+    // Self cost of each construct kind, summed over every stack it is innermost in
+    ProfileFrame kinds[NK_COUNT] = { 0 };
+    for (int i = 1; i < prof.frame_count; i++) {
+        ProfileFrame *k = &kinds[prof.frames[i].kind];
+        k->parse_ns += prof.frames[i].parse_ns;
+        k->nodes += prof.frames[i].nodes;
+        k->probes += prof.frames[i].probes;
+        k->sync_tokens += prof.frames[i].sync_tokens;
+    }
+    printf("constructs:\n");
+    printf("%-12s %10s %7s %8s %8s\n", "kind", "parse_us", "nodes", "probes", "skipped");
+    for (int k = 1; k < NK_COUNT; k++) {
+        if (!kinds[k].parse_ns && !kinds[k].nodes) continue;
+        printf("%-12s %10.1f %7u %8u %8u\n", node_kind_label(k), kinds[k].parse_ns / 1e3, kinds[k].nodes,
+            kinds[k].probes, kinds[k].sync_tokens);
+    }
+    int status = result.error_count > 0 ? 1 : 0;
+    if (folded_path) {
+        FILE *out = fopen(folded_path, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open file %s\n", folded_path);
+            status = 1;
+        } else {
+            fprintf(out, "lex %llu\n", (unsigned long long)total.lex_ns);
+            print_folded(out, &prof);
+            fclose(out);
+        }
+    }
+    free(order);
+    free(starts);
+    free(prof.lines);
+    free(prof.frames);
+    parser_free(p);
+    free(src);
+    return status;
+}
+
+// Parse a file, run one tree pass, then print the rewritten tree and the report
+int run_pass_main(int argc, char *argv[], int (*pass)(Parser *p, NodeId root, FILE *report)) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s %s <filename>\n", argv[0], argv[1]);
+        return 1;
+    }
+    FILE *file = fopen(argv[2], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    Parser *p = parser_new();
+    set_module_dir_of(p, argv[2]);
+    ParseResult result = parser_parse(p, src, len);
+    char *report = NULL;
+    size_t report_len = 0;
+    if (result.ok) {
+        FILE *stream = open_memstream(&report, &report_len);
+        pass(p, result.root, stream);
+        fclose(stream);
+    }
+    print_result(stdout, &result);
+    if (report) fwrite(report, 1, report_len, stdout);
+    int status = result.error_count > 0 ? 1 : 0;
+    free(report);
+    parser_free(p);
+    free(src);
+    return status;
+}
+
+int opt_loops_main(int argc, char *argv[]) {
+    return run_pass_main(argc, argv, optimize_loops);
+}
+
+// Allocation tracker (build with -DUPL_ALLOC_TRACK). Live blocks are kept in
+// an address-keyed table, so blocks allocated by libc, such as memstream
+// buffers, pass through free untouched. Reallocation counts as a new block.
+
+#ifdef UPL_ALLOC_TRACK
+typedef struct {
+    uint64_t calls; // Allocations and reallocations
+    uint64_t bytes; // Bytes requested by them
+    uint64_t frees; // Blocks released, by free or by moving in realloc
+    int64_t live;   // Bytes allocated and not yet released
+    int64_t peak;
+    uint64_t lifetimes[LIFETIME_BUCKETS];
+} AllocStats;
+
+typedef struct {
+    const char *func;
+    int line;
+    AllocStats stats;
+} AllocSite;
+
+typedef struct {
+    void *ptr; // NULL marks a free slot
+    size_t size;
+    uint64_t birth_ns;
+    uint16_t site;
+    uint8_t phase;
+} AllocBlock;
+
+AllocSite alloc_sites[ALLOC_MAX_SITES];
+int alloc_site_count;
+AllocStats alloc_phases[ALLOC_PHASE_COUNT];
+AllocStats alloc_total;
+AllocBlock *alloc_blocks; // Open addressing by address
+size_t alloc_block_capacity;
+size_t alloc_block_count;
+int alloc_enabled;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread AllocPhase alloc_phase;
+
+int alloc_site(const char *func, int line) {
+    for (int i = 0; i < alloc_site_count; i++) {
+        if (alloc_sites[i].func == func && alloc_sites[i].line == line) return i;
+    }
+    if (alloc_site_count == ALLOC_MAX_SITES) return ALLOC_MAX_SITES - 1;
+    alloc_sites[alloc_site_count].func = func;
+    alloc_sites[alloc_site_count].line = line;
+    return alloc_site_count++;
+}
+
+size_t alloc_slot(uintptr_t address) {
+    return ((address >> 4) * 0x9E3779B97F4A7C15u) & (alloc_block_capacity - 1);
+}
+
+void alloc_stats_add(AllocStats *stats, size_t size) {
+    stats->calls++;
+    stats->bytes += size;
+    stats->live += size;
+    if (stats->live > stats->peak) stats->peak = stats->live;
+}
+
+void alloc_stats_release(AllocStats *stats, size_t size, uint64_t lifetime_ns) {
+    int bucket = 0;
+    for (uint64_t limit = 1000; bucket < LIFETIME_BUCKETS - 1 && lifetime_ns >= limit; limit *= 10) bucket++;
+    stats->frees++;
+    stats->live -= size;
+    stats->lifetimes[bucket]++;
+}
+
+void alloc_record(void *ptr, size_t size, const char *func, int line) {
+    if (2 * (alloc_block_count + 1) > alloc_block_capacity) {
+        AllocBlock *old = alloc_blocks;
+        size_t old_capacity = alloc_block_capacity;
+        alloc_block_capacity = old_capacity ? old_capacity * 2 : 4096;
+        alloc_blocks = (calloc)(alloc_block_capacity, sizeof(AllocBlock));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (!old[i].ptr) continue;
+            size_t j = alloc_slot((uintptr_t)old[i].ptr);
+            while (alloc_blocks[j].ptr) j = (j + 1) & (alloc_block_capacity - 1);
+            alloc_blocks[j] = old[i];
+        }
+        (free)(old);
+    }
+    size_t i = alloc_slot((uintptr_t)ptr);
+    while (alloc_blocks[i].ptr) i = (i + 1) & (alloc_block_capacity - 1);
+    int site = alloc_site(func, line);
+    alloc_blocks[i] = (AllocBlock){ ptr, size, now_ns(), (uint16_t)site, (uint8_t)alloc_phase };
+    alloc_block_count++;
+    alloc_stats_add(&alloc_sites[site].stats, size);
+    alloc_stats_add(&alloc_phases[alloc_phase], size);
+    alloc_stats_add(&alloc_total, size);
+}
+
+// Charge a released block to the site and phase that allocated it
+void alloc_release(uintptr_t address) {
+    if (!alloc_block_count) return;
+    size_t mask = alloc_block_capacity - 1;
+    size_t i = alloc_slot(address);
+    while (alloc_blocks[i].ptr && (uintptr_t)alloc_blocks[i].ptr != address) i = (i + 1) & mask;
+    if (!alloc_blocks[i].ptr) return;
+    AllocBlock block = alloc_blocks[i];
+    uint64_t lifetime = now_ns() - block.birth_ns;
+    alloc_stats_release(&alloc_sites[block.site].stats, block.size, lifetime);
+    alloc_stats_release(&alloc_phases[block.phase], block.size, lifetime);
+    alloc_stats_release(&alloc_total, block.size, lifetime);
+    // Backward-shift deletion keeps probe runs unbroken
+    alloc_blocks[i].ptr = NULL;
+    alloc_block_count--;
+    for (size_t j = (i + 1) & mask; alloc_blocks[j].ptr; j = (j + 1) & mask) {
+        size_t home = alloc_slot((uintptr_t)alloc_blocks[j].ptr);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            alloc_blocks[i] = alloc_blocks[j];
+            alloc_blocks[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+void* track_malloc(size_t size, const char *func, int line) {
+    void *ptr = (malloc)(size);
+    if (ptr && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_record(ptr, size, func, line);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return ptr;
+}
+
+void* track_calloc(size_t count, size_t size, const char *func, int line) {
+    void *ptr = (calloc)(count, size);
+    if (ptr && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_record(ptr, count * size, func, line);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return ptr;
+}
+
+// The old block is released before the call, as its address must not be
+// used after a move; if realloc fails it stays allocated but untracked
+void* track_realloc(void *ptr, size_t size, const char *func, int line) {
+    if (ptr && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_release((uintptr_t)ptr);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    void *moved = (realloc)(ptr, size);
+    if (moved && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_record(moved, size, func, line);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return moved;
+}
+
+void* track_aligned_alloc(size_t alignment, size_t size, const char *func, int line) {
+    void *ptr = (aligned_alloc)(alignment, size);
+    if (ptr && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_record(ptr, size, func, line);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return ptr;
+}
+
+char* track_strdup(const char *s, const char *func, int line) {
+    char *copy = (strdup)(s);
+    if (copy && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_record(copy, strlen(s) + 1, func, line);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return copy;
+}
+
+void track_free(void *ptr) {
+    if (ptr && alloc_enabled) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_release((uintptr_t)ptr);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    (free)(ptr);
+}
+
+void print_alloc_stats(FILE *out, const char *name, const AllocStats *stats) {
+    fprintf(out, "%-28s %9llu %12llu %9llu %12lld %10lld", name, (unsigned long long)stats->calls,
+        (unsigned long long)stats->bytes, (unsigned long long)stats->frees, (long long)stats->peak, (long long)stats->live);
+    for (int b = 0; b < LIFETIME_BUCKETS; b++) fprintf(out, " %7llu", (unsigned long long)stats->lifetimes[b]);
+    fprintf(out, "\n");
+}
+
+void print_alloc_header(FILE *out, const char *what) {
+    fprintf(out, "%-28s %9s %12s %9s %12s %10s %7s %7s %7s %7s %7s %7s %7s %7s\n", what, "calls", "bytes", "frees",
+        "peak_live", "live", "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s");
+}
+
+int compare_alloc_sites(const void *a, const void *b) {
+    const AllocSite *x = a, *y = b;
+    if (x->stats.bytes != y->stats.bytes) return x->stats.bytes > y->stats.bytes ? -1 : 1;
+    return x->line - y->line;
+}
+
+// Per phase and per call site tables; lifetimes are of released blocks
+void print_alloc_report(FILE *out) {
+    static const char *phase_names[ALLOC_PHASE_COUNT] = { "other", "lex", "parse" };
+    pthread_mutex_lock(&alloc_lock);
+    AllocSite sites[ALLOC_MAX_SITES];
+    int count = alloc_site_count;
+    memcpy(sites, alloc_sites, sizeof(AllocSite) * count);
+    print_alloc_header(out, "phase");
+    for (int i = 0; i < ALLOC_PHASE_COUNT; i++) print_alloc_stats(out, phase_names[i], &alloc_phases[i]);
+    print_alloc_stats(out, "total", &alloc_total);
+    pthread_mutex_unlock(&alloc_lock);
+    qsort(sites, count, sizeof(AllocSite), compare_alloc_sites);
+    fprintf(out, "\n");
+    print_alloc_header(out, "site");
+    for (int i = 0; i < count; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d", sites[i].func, sites[i].line);
+        print_alloc_stats(out, name, &sites[i].stats);
+    }
+}
+#endif
+
+// upl --alloc-profile: parse a file n times with allocation recording on.
+// upl --alloc-check: after one warm-up parse, fail if the lexer makes more
+// than the budget of allocations per token; a warm parser reuses its token
+// buffer, so the steady state is zero.
+int alloc_main(int argc, char *argv[]) {
+    int check = strcmp(argv[1], "--alloc-check") == 0;
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s %s <filename> [-n parses]%s\n", argv[0], argv[1], check ? " [--max-per-token X]" : "");
+        return 1;
+    }
+#ifndef UPL_ALLOC_TRACK
+    fprintf(stderr, "%s needs a build with -DUPL_ALLOC_TRACK\n", argv[1]);
+    return 1;
+#else
+    int count = check ? 10 : 1;
+    double budget = ALLOC_CHECK_MAX_PER_TOKEN;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-per-token") == 0 && i + 1 < argc) budget = atof(argv[++i]);
+    }
+    if (count < 1) count = 1;
+    FILE *file = fopen(argv[2], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    alloc_enabled = 1;
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    Parser *p = parser_new();
+    int status = 0;
+    if (check) {
+        parser_parse(p, src, len);
+        uint64_t before = alloc_phases[ALLOC_LEX].calls;
+        long long tokens = 0;
+        for (int i = 0; i < count; i++) {
+            parser_parse(p, src, len);
+            tokens += p->token_list.count;
+        }
+        double per_token = (double)(alloc_phases[ALLOC_LEX].calls - before) / (tokens ? tokens : 1);
+        status = per_token > budget;
+        printf("lexer allocations per token, steady state: %.4f (budget %.4f): %s\n", per_token, budget,
+            status ? "FAIL" : "ok");
+    } else {
+        for (int i = 0; i < count; i++) parser_parse(p, src, len);
+    }
+    parser_free(p);
+    free(src);
+    // Printed after cleanup, so live bytes are leaks
+    if (!check) print_alloc_report(stdout);
+    return status;
+#endif
+}
+
+// Sharing report for upl --hash-cons; storage counts node and child id
+// arrays as they would be without sharing
+void print_hash_cons_stats(FILE *out, const Parser *p) {
+    HashConsStats stats;
+    parser_hash_cons_stats(p, &stats);
+    size_t used = sizeof(AstNode) * p->ast.node_count + sizeof(NodeId) * p->ast.child_count;
+    size_t total = used + stats.bytes_saved;
+    fprintf(out, "- hash-consing: %u expression nodes built, %u shared (%.1f%% hit rate), %u distinct\n",
+        stats.lookups, stats.hits, stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0, stats.unique);
+    fprintf(out, "- tree storage: %zu bytes, %zu saved (%.1f%%)\n", used, stats.bytes_saved,
+        total ? 100.0 * stats.bytes_saved / total : 0.0);
+}
+
+// Complexity fuzzer (upl --fuzz). Grammar-aware mutations of a corpus,
+// kept when they reach new coverage (parent/child construct pairs, error
+// kinds, nesting and error count buckets) or cost more per byte. Time is
+// the minimum of a few parses less the time of an empty program; memory
+// is the token and tree storage. The worst inputs are minimized and can be
+// written to a regression corpus for upl --fuzz-regress.
+
+uint64_t fuzz_rand(Fuzzer *f) {
+    f->rng ^= f->rng << 13;
+    f->rng ^= f->rng >> 7;
+    f->rng ^= f->rng << 17;
+    return f->rng;
+}
+
+int fuzz_below(Fuzzer *f, int n) {
+    return n > 0 ? (int)(fuzz_rand(f) % (uint64_t)n) : 0;
+}
+
+int fuzz_feature(Fuzzer *f, uint32_t hash) {
+    hash = (hash ^ (hash >> 16)) * 0x45d9f3bu;
+    hash = (hash ^ (hash >> 16)) & (FUZZ_FEATURES - 1);
+    if (f->features[hash / 8] & (1 << (hash % 8))) return 0;
+    f->features[hash / 8] |= 1 << (hash % 8);
+    f->feature_count++;
+    return 1;
+}
+
+int log2_bucket(uint64_t n) {
+    int bucket = 0;
+    while (n > 1) {
+        n >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Coverage of the last parse; returns the number of new features
+int fuzz_coverage(Fuzzer *f, const ParseResult *result) {
+    const Ast *ast = result->ast;
+    int found = fuzz_feature(f, 0x100 | result->ok);
+    found += fuzz_feature(f, 0x200 | log2_bucket(result->error_count));
+    found += fuzz_feature(f, 0x300 | log2_bucket(max_nesting(f->p)));
+    for (int i = 0; i < result->error_count; i++) {
+        // The message up to any name or character it quotes
+        uint32_t hash = 0x400;
+        for (const char *c = result->errors[i].message; *c && *c != ':'; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+        found += fuzz_feature(f, hash);
+    }
+    f->stack.count = 0;
+    if (result->root) node_list_push(&f->stack, result->root);
+    while (f->stack.count > 0) {
+        NodeId id = f->stack.items[--f->stack.count];
+        int n = ast_num_children(ast, id);
+        for (int i = 0; i < n; i++) {
+            NodeId child = ast_child(ast, id, i);
+            if (!child) continue;
+            found += fuzz_feature(f, 0x10000 | ast_kind(ast, id) << 8 | ast_kind(ast, child) << 2 | (i < 3 ? i : 3));
+            node_list_push(&f->stack, child);
+        }
+    }
+    return found;
+}
+
+// Parse runs times and fill in the input's cost; returns new coverage
+int fuzz_measure(Fuzzer *f, FuzzInput *input, int runs) {
+    uint64_t best = UINT64_MAX;
+    ParseResult result;
+    for (int i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        result = parser_parse(f->p, input->text, input->len);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    f->execs += runs;
+    double ns = best > f->baseline_ns ? best - f->baseline_ns : 0;
+    size_t memory = sizeof(Token) * f->p->token_list.count + sizeof(AstNode) * f->p->ast.node_count
+        + sizeof(NodeId) * f->p->ast.child_count;
+    input->ns_per_byte = ns / (input->len ? input->len : 1);
+    input->mem_per_byte = (double)memory / (input->len ? input->len : 1);
+    return fuzz_coverage(f, &result);
+}
+
+// Append a random expression of at most depth levels
+void fuzz_expr(Fuzzer *f, char *out, size_t cap, int depth) {
+    size_t len = strlen(out);
+    int choice = fuzz_below(f, depth > 0 ? 7 : 3);
+    if (choice == 0) snprintf(out + len, cap - len, "x%d", fuzz_below(f, FUZZ_NAMES));
+    else if (choice == 1) snprintf(out + len, cap - len, "%d", fuzz_below(f, 100));
+    else if (choice == 2) snprintf(out + len, cap - len, "%s", fuzz_below(f, 2) ? "true" : "false");
+    else if (choice == 6) {
+        snprintf(out + len, cap - len, "(");
+        fuzz_expr(f, out, cap, depth - 1);
+        len = strlen(out);
+        snprintf(out + len, cap - len, ")");
+    } else {
+        static const char *ops[] = { " + ", " * ", " > ", " >= ", " == " };
+        fuzz_expr(f, out, cap, depth - 1);
+        len = strlen(out);
+        snprintf(out + len, cap - len, "%s", ops[fuzz_below(f, 5)]);
+        fuzz_expr(f, out, cap, depth - 1);
+    }
+}
+
+// A statement, a broken fragment or a lone token to insert
+void fuzz_snippet(Fuzzer *f, char *out, size_t cap) {
+    static const char *tokens[] = {
+        "begin", "end", "if", "then", "else", "do", "while", "for", "print", "int", "bool", "{", "}", "(", ")",
+        ";", "=", "==", ">", ">=", "+", "*", "@", "/*", "*/", "//", "1x", "\n"
+    };
+    char a[128] = "", b[128] = "";
+    int v = fuzz_below(f, FUZZ_NAMES);
+    out[0] = '\0';
+    switch (fuzz_below(f, 9)) {
+    case 0:
+        fuzz_expr(f, a, sizeof(a), 3);
+        snprintf(out, cap, "%s x%d = %s; ", fuzz_below(f, 2) ? "int" : "bool", v, a);
+        break;
+    case 1:
+        fuzz_expr(f, a, sizeof(a), 3);
+        snprintf(out, cap, "x%d = %s; ", v, a);
+        break;
+    case 2:
+        fuzz_expr(f, a, sizeof(a), 3);
+        snprintf(out, cap, "print(%s); ", a);
+        break;
+    case 3:
+        fuzz_expr(f, a, sizeof(a), 2);
+        snprintf(out, cap, "if (%s) then { ", a);
+        break;
+    case 4:
+        fuzz_expr(f, a, sizeof(a), 2);
+        fuzz_expr(f, b, sizeof(b), 2);
+        snprintf(out, cap, "do { print(%s); } while (%s); ", a, b);
+        break;
+    case 5:
+        fuzz_expr(f, a, sizeof(a), 2);
+        snprintf(out, cap, "for (x%d = 0; %s; x%d = x%d + 1) { ", v, a, v, v);
+        break;
+    case 6:
+        snprintf(out, cap, "} ");
+        break;
+    case 7:
+        fuzz_expr(f, out, cap, 4);
+        break;
+    default:
+        snprintf(out, cap, "%s ", tokens[fuzz_below(f, sizeof(tokens) / sizeof(tokens[0]))]);
+        break;
+    }
+}
+
+// One grammar-aware edit of buf, which has room for FUZZ_MAX_LEN bytes
+void fuzz_mutate(Fuzzer *f, char *buf, size_t *len) {
+    size_t n = *len;
+    size_t at = n ? (size_t)fuzz_below(f, (int)n + 1) : 0;
+    size_t span = n > at ? 1 + (size_t)fuzz_below(f, (int)(n - at < 64 ? n - at : 64)) : 0;
+    char piece[FUZZ_MAX_LEN];
+    size_t piece_len = 0;
+    switch (fuzz_below(f, 6)) {
+    case 0:
+        fuzz_snippet(f, piece, sizeof(piece));
+        piece_len = strlen(piece);
+        break;
+    case 1: // Delete
+        memmove(buf + at, buf + at + span, n - at - span);
+        *len = n - span;
+        return;
+    case 2: // Repeat a stretch, to amplify whatever it costs
+        piece_len = span;
+        memcpy(piece, buf + at, span);
+        break;
+    case 3: { // Splice from another corpus entry
+        const FuzzInput *other = &f->corpus[fuzz_below(f, f->corpus_count)];
+        if (!other->len) return;
+        size_t from = (size_t)fuzz_below(f, (int)other->len);
+        piece_len = 1 + (size_t)fuzz_below(f, (int)(other->len - from < 256 ? other->len - from : 256));
+        memcpy(piece, other->text + from, piece_len);
+        break;
+    }
+    case 4: { // Wrap a stretch in one more level of nesting
+        static const char *open[] = { "(", "{ ", "if (x0 > 1) then { ", "do { " };
+        static const char *close[] = { ")", " }", " }", " } while (x1 > 2);" };
+        int k = fuzz_below(f, 4);
+        size_t open_len = strlen(open[k]), close_len = strlen(close[k]);
+        if (n + open_len + close_len > FUZZ_MAX_LEN) return;
+        memmove(buf + at + span + close_len, buf + at + span, n - at - span);
+        memcpy(buf + at + span, close[k], close_len);
+        memmove(buf + at + open_len, buf + at, n - at + close_len);
+        memcpy(buf + at, open[k], open_len);
+        *len = n + open_len + close_len;
+        return;
+    }
+    default: // Replace a stretch
+        fuzz_snippet(f, piece, sizeof(piece));
+        piece_len = strlen(piece);
+        memmove(buf + at, buf + at + span, n - at - span);
+        n -= span;
+        break;
+    }
+    if (n + piece_len > FUZZ_MAX_LEN) piece_len = FUZZ_MAX_LEN - n;
+    memmove(buf + at + piece_len, buf + at, n - at);
+    memcpy(buf + at, piece, piece_len);
+    *len = n + piece_len;
+}
+
+void fuzz_add(Fuzzer *f, const FuzzInput *input) {
+    FuzzInput *slot;
+    if (f->corpus_count < FUZZ_CORPUS_MAX) {
+        slot = &f->corpus[f->corpus_count++];
+    } else {
+        // Full: replace a random entry other than the seeds
+        slot = &f->corpus[f->seed_count + fuzz_below(f, FUZZ_CORPUS_MAX - f->seed_count)];
+        free(slot->text);
+    }
+    *slot = *input;
+    slot->text = malloc(input->len + 1);
+    memcpy(slot->text, input->text, input->len);
+    slot->text[input->len] = '\0';
+}
+
+double fuzz_score(const FuzzInput *input, int by_memory) {
+    return by_memory ? input->mem_per_byte : input->ns_per_byte;
+}
+
+// Remove ever smaller stretches while the cost per byte stays within
+// FUZZ_MINIMIZE_KEEP of the original
+void fuzz_minimize(Fuzzer *f, FuzzInput *input, int by_memory) {
+    double target = fuzz_score(input, by_memory) * FUZZ_MINIMIZE_KEEP;
+    char *buf = malloc(input->len + 1);
+    for (size_t chunk = input->len / 2; chunk >= 1; chunk /= 2) {
+        for (size_t at = 0; at + chunk <= input->len && input->len - chunk >= FUZZ_MIN_LEN;) {
+            memcpy(buf, input->text, at);
+            memcpy(buf + at, input->text + at + chunk, input->len - at - chunk);
+            FuzzInput trial = { buf, input->len - chunk, 0, 0 };
+            fuzz_measure(f, &trial, by_memory ? 1 : FUZZ_TIMING_RUNS);
+            if (fuzz_score(&trial, by_memory) >= target) {
+                memcpy(input->text, buf, trial.len);
+                input->len = trial.len;
+                input->ns_per_byte = trial.ns_per_byte;
+                input->mem_per_byte = trial.mem_per_byte;
+            } else {
+                at += chunk;
+            }
+        }
+    }
+    input->text[input->len] = '\0';
+    free(buf);
+}
+
+// Write an input to dir, named by kind and content hash
+void fuzz_save(const char *dir, const char *kind, const FuzzInput *input) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < input->len; i++) hash = (hash ^ (unsigned char)input->text[i]) * 16777619u;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%08x.upl", dir, kind, hash);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return;
+    }
+    fwrite(input->text, 1, input->len, file);
+    fclose(file);
+    printf("wrote %s: %zu bytes, %.1f ns/byte, %.1f bytes/byte\n", path, input->len, input->ns_per_byte,
+        input->mem_per_byte);
+}
+
+int fuzz_main(int argc, char *argv[]) {
+    double seconds = 10;
+    long long max_execs = 0;
+    const char *out_dir = NULL;
+    Fuzzer f;
+    memset(&f, 0, sizeof(f));
+    f.rng = (uint64_t)now_ns() | 1;
+    f.p = parser_new();
+    f.features = calloc(FUZZ_FEATURES / 8, 1);
+    f.corpus = calloc(FUZZ_CORPUS_MAX, sizeof(FuzzInput));
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) max_execs = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_dir = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) f.rng = strtoull(argv[++i], NULL, 10) | 1;
+        else if (strcmp(argv[i], "--ll1") == 0) parser_set_engine(f.p, UPL_ENGINE_LL1);
+        else if (f.corpus_count < FUZZ_CORPUS_MAX / 2) {
+            FILE *file = fopen(argv[i], "r");
+            if (!file) {
+                fprintf(stderr, "Could not open file %s\n", argv[i]);
+                continue;
+            }
+            size_t len;
+            char *src = read_file(file, &len);
+            fclose(file);
+            FuzzInput seed = { src, len < FUZZ_MAX_LEN ? len : FUZZ_MAX_LEN, 0, 0 };
+            fuzz_add(&f, &seed);
+            free(src);
+        }
+    }
+    static const char *builtin = "begin int x0 = 1; bool x1 = true; x0 = (x0 + 2) * x0; "
+        "if (x0 > 1) then { print(x0); } else { x1 = false; } "
+        "do { x0 = x0 + 1; } while (3 > x0); for (x0 = 0; 3 > x0; x0 = x0 + 1) { print(x0); } end";
+    if (f.corpus_count == 0) {
+        FuzzInput seed = { (char *)builtin, strlen(builtin), 0, 0 };
+        fuzz_add(&f, &seed);
+    }
+    f.seed_count = f.corpus_count;
+    // Fixed cost of a parse, taken off every timing
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 50; i++) {
+        uint64_t start = now_ns();
+        parser_parse(f.p, "begin end", 9);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    f.baseline_ns = best;
+    FuzzInput worst[2] = { { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 } }; // By time, by memory
+    for (int i = 0; i < f.corpus_count; i++) fuzz_measure(&f, &f.corpus[i], FUZZ_TIMING_RUNS);
+    char *buf = malloc(FUZZ_MAX_LEN + 1);
+    double start = now_ms(), last_status = start;
+    while ((now_ms() - start) / 1e3 < seconds && (!max_execs || f.execs < max_execs)) {
+        // Favor costly entries: best of two random picks
+        const FuzzInput *a = &f.corpus[fuzz_below(&f, f.corpus_count)];
+        const FuzzInput *b = &f.corpus[fuzz_below(&f, f.corpus_count)];
+        const FuzzInput *parent = a->ns_per_byte >= b->ns_per_byte ? a : b;
+        FuzzInput child = { buf, parent->len, 0, 0 };
+        memcpy(buf, parent->text, parent->len);
+        for (int k = 1 + fuzz_below(&f, 4); k > 0; k--) fuzz_mutate(&f, buf, &child.len);
+        if (child.len == 0) continue;
+        int fresh = fuzz_measure(&f, &child, FUZZ_TIMING_RUNS);
+        int sized = child.len >= FUZZ_MIN_LEN;
+        int slower = sized && child.ns_per_byte > worst[0].ns_per_byte;
+        int bigger = sized && child.mem_per_byte > worst[1].mem_per_byte;
+        if (fresh || slower || bigger) fuzz_add(&f, &child);
+        for (int w = 0; w < 2; w++) {
+            if (w == 0 ? !slower : !bigger) continue;
+            free(worst[w].text);
+            worst[w] = child;
+            worst[w].text = malloc(child.len + 1);
+            memcpy(worst[w].text, buf, child.len);
+        }
+        if (now_ms() - last_status >= 1000) {
+            last_status = now_ms();
+            printf("execs %lld, corpus %d, features %d, worst %.1f ns/byte (%zu bytes), %.1f bytes/byte (%zu bytes)\n",
+                f.execs, f.corpus_count, f.feature_count, worst[0].ns_per_byte, worst[0].len,
+                worst[1].mem_per_byte, worst[1].len);
+            fflush(stdout);
+        }
+    }
+    printf("done: %lld execs, corpus %d, features %d\n", f.execs, f.corpus_count, f.feature_count);
+    const char *kinds[2] = { "slow", "mem" };
+    for (int w = 0; w < 2; w++) {
+        if (!worst[w].text) continue;
+        // Re-measure first: the winning timing may have been noise
+        fuzz_measure(&f, &worst[w], FUZZ_TIMING_RUNS);
+        fuzz_minimize(&f, &worst[w], w);
+        printf("worst %s: %zu bytes after minimizing, %.1f ns/byte, %.1f bytes/byte\n", kinds[w], worst[w].len,
+            worst[w].ns_per_byte, worst[w].mem_per_byte);
+        if (out_dir) fuzz_save(out_dir, kinds[w], &worst[w]);
+        free(worst[w].text);
+    }
+    for (int i = 0; i < f.corpus_count; i++) free(f.corpus[i].text);
+    free(f.corpus);
+    free(f.features);
+    free(f.stack.items);
+    free(buf);
+    parser_free(f.p);
+    return 0;
+}
+
+// Parse every .upl file in a directory and fail if one costs more per byte
+// than the time or memory budget
+int fuzz_regress_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --fuzz-regress <dir> [--max-ns-per-byte N] [--max-mem-per-byte N]\n", argv[0]);
+        return 1;
+    }
+    double max_ns = FUZZ_MAX_NS_PER_BYTE, max_mem = FUZZ_MAX_MEM_PER_BYTE;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--max-ns-per-byte") == 0 && i + 1 < argc) max_ns = atof(argv[++i]);
+        else if (strcmp(argv[i], "--max-mem-per-byte") == 0 && i + 1 < argc) max_mem = atof(argv[++i]);
+    }
+    DIR *dir = opendir(argv[2]);
+    if (!dir) {
+        fprintf(stderr, "Could not open directory %s\n", argv[2]);
+        return 1;
+    }
+    Fuzzer f;
+    memset(&f, 0, sizeof(f));
+    f.p = parser_new();
+    f.features = calloc(FUZZ_FEATURES / 8, 1);
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 50; i++) {
+        uint64_t start = now_ns();
+        parser_parse(f.p, "begin end", 9);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    f.baseline_ns = best;
+    int files = 0, failed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len < 4 || strcmp(entry->d_name + name_len - 4, ".upl") != 0) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", argv[2], entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (!file) continue;
+        FuzzInput input;
+        input.text = read_file(file, &input.len);
+        fclose(file);
+        fuzz_measure(&f, &input, FUZZ_REGRESS_RUNS);
+        int ok = input.ns_per_byte <= max_ns && input.mem_per_byte <= max_mem;
+        printf("%-40s %8zu bytes %10.1f ns/byte %8.1f bytes/byte  %s\n", entry->d_name, input.len,
+            input.ns_per_byte, input.mem_per_byte, ok ? "ok" : "FAIL");
+        files++;
+        failed += !ok;
+        free(input.text);
+    }
+    closedir(dir);
+    printf("%d files, %d over budget (%.0f ns/byte, %.0f bytes/byte)\n", files, failed, max_ns, max_mem);
+    free(f.features);
+    free(f.stack.items);
+    parser_free(f.p);
+    return failed > 0 ? 1 : 0;
+}
+
+// Batched file input for upl --check-files. Readers load whole files into
+// heap buffers ahead of the parser, which lexes them in place: a pread
+// thread pool, or one thread driving io_uring through raw syscalls. The
+// stdio mode is the plain fopen/read_file/fclose path, for comparison.
+
+long uring_enter(Uring *ring, unsigned submit, unsigned wait) {
+    long n;
+    do {
+        n = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Set up a ring and map its queues; returns 0 or an errno value
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return errno;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQ_RING);
+    ring->cq_ring = single ? ring->sq_ring
+        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        if (single) ring->cq_ring = MAP_FAILED;
+        uring_free(ring);
+        return error;
+    }
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 0;
+}
+
+void uring_free(Uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->fd = -1;
+}
+
+// Next free submission entry, cleared; published by uring_submit
+struct io_uring_sqe* uring_sqe(Uring *ring, uint8_t opcode, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// Submit the queued entries and wait until wait completions are posted;
+// returns the number of io_uring_enter calls, or -1
+int uring_submit(Uring *ring, unsigned wait) {
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + ring->queued, memory_order_release);
+    unsigned submit = ring->queued;
+    ring->queued = 0;
+    int calls = 0;
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned ready = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire) - head;
+        if (submit == 0 && ready >= wait) return calls;
+        long n = uring_enter(ring, submit, wait > ready ? wait - ready : 0);
+        calls++;
+        if (n < 0) return -1;
+        submit -= (unsigned)n;
+    }
+}
+
+// Take one completion, which uring_submit has already waited for; returns
+// its result
+int uring_reap(Uring *ring, uint64_t *user_data) {
+    unsigned head = *ring->cq_head;
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    int res = cqe->res;
+    *user_data = cqe->user_data;
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head + 1, memory_order_release);
+    return res;
+}
+
+// Read from fd until EOF into file->data, which holds file->len bytes
+// already; for files whose size was unknown or changed
+void read_rest(InputReader *r, InputFile *file, int fd, size_t capacity) {
+    for (;;) {
+        if (file->len == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            file->data = realloc(file->data, capacity + 1);
+        }
+        ssize_t n = pread(fd, file->data + file->len, capacity - file->len, (off_t)file->len);
+        r->syscalls++;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) file->error = errno;
+        if (n <= 0) break;
+        file->len += (size_t)n;
+    }
+}
+
+// Pool worker load: open, fstat, pread the whole size, close
+void load_file_pread(InputReader *r, InputFile *file) {
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    r->syscalls++;
+    if (fd < 0) {
+        file->error = errno;
+        return;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+    r->syscalls++;
+    file->data = malloc(size + 1);
+    while (file->len < size) {
+        ssize_t n = pread(fd, file->data + file->len, size - file->len, (off_t)file->len);
+        r->syscalls++;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        file->len += (size_t)n;
+    }
+    if (file->len < size || size == 0) read_rest(r, file, fd, size);
+    close(fd);
+    r->syscalls++;
+}
+
+void* pool_reader_main(void *arg) {
+    InputReader *r = arg;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->next < r->count && r->next >= r->consumed + READ_AHEAD) pthread_cond_wait(&r->changed, &r->lock);
+        int i = r->next < r->count ? r->next++ : -1;
+        pthread_mutex_unlock(&r->lock);
+        if (i < 0) break;
+        load_file_pread(r, &r->files[i]);
+        pthread_mutex_lock(&r->lock);
+        r->files[i].ready = 1;
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+// Load files [first, first + n) in two rounds of one submission each:
+// open and statx together, then each read hard-linked to its close so the
+// descriptor is closed even if the read fails
+void uring_load_batch(InputReader *r, int first, int n) {
+    Uring *ring = &r->ring;
+    int fds[URING_BATCH];
+    struct statx stats[URING_BATCH];
+    for (int k = 0; k < n; k++) {
+        InputFile *file = &r->files[first + k];
+        struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, (uint64_t)k << 1);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)file->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe = uring_sqe(ring, IORING_OP_STATX, (uint64_t)k << 1 | 1);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)file->path;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uint64_t)(uintptr_t)&stats[k];
+    }
+    int calls = uring_submit(ring, 2 * n);
+    r->syscalls += calls > 0 ? calls : 0;
+    for (int k = 0; k < 2 * n; k++) {
+        uint64_t user_data;
+        int res = uring_reap(ring, &user_data);
+        int slot = (int)(user_data >> 1);
+        if (user_data & 1) {
+            if (res < 0) r->files[first + slot].error = -res;
+        } else {
+            fds[slot] = res;
+        }
+    }
+    int queued = 0;
+    for (int k = 0; k < n; k++) {
+        InputFile *file = &r->files[first + k];
+        if (fds[k] < 0) {
+            file->error = -fds[k];
+            continue;
+        }
+        if (file->error || !S_ISREG(stats[k].stx_mode) || stats[k].stx_size == 0) continue;
+        file->data = malloc(stats[k].stx_size + 1);
+        struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ, (uint64_t)k << 1);
+        sqe->fd = fds[k];
+        sqe->addr = (uint64_t)(uintptr_t)file->data;
+        sqe->len = (unsigned)stats[k].stx_size;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe = uring_sqe(ring, IORING_OP_CLOSE, (uint64_t)k << 1 | 1);
+        sqe->fd = fds[k];
+        fds[k] = -1;
+        queued += 2;
+    }
+    calls = uring_submit(ring, queued);
+    r->syscalls += calls > 0 ? calls : 0;
+    for (int k = 0; k < queued; k++) {
+        uint64_t user_data;
+        int res = uring_reap(ring, &user_data);
+        InputFile *file = &r->files[first + (int)(user_data >> 1)];
+        if (user_data & 1) continue;
+        if (res < 0) file->error = -res;
+        else file->len = (size_t)res;
+    }
+    // Files the rounds could not finish: statx failures, special files,
+    // empty or short reads. Reopen and read them the pool's way.
+    for (int k = 0; k < n; k++) {
+        InputFile *file = &r->files[first + k];
+        if (fds[k] >= 0) {
+            close(fds[k]);
+            r->syscalls++;
+        }
+        int unfinished = file->error ? fds[k] >= 0 : !file->data || file->len < stats[k].stx_size;
+        if (!unfinished) continue;
+        free(file->data);
+        file->data = NULL;
+        file->len = 0;
+        file->error = 0;
+        load_file_pread(r, file);
+    }
+}
+
+void* uring_reader_main(void *arg) {
+    InputReader *r = arg;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->next < r->count && r->next >= r->consumed + READ_AHEAD) pthread_cond_wait(&r->changed, &r->lock);
+        int first = r->next;
+        int n = r->count - first < URING_BATCH ? r->count - first : URING_BATCH;
+        r->next += n;
+        pthread_mutex_unlock(&r->lock);
+        if (n <= 0) break;
+        uring_load_batch(r, first, n);
+        pthread_mutex_lock(&r->lock);
+        for (int k = 0; k < n; k++) r->files[first + k].ready = 1;
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+const char* input_mode_name(InputMode mode) {
+    return mode == IO_URING ? "io_uring" : mode == IO_POOL ? "pread pool" : "stdio";
+}
+
+// Start loading files in the background; io_uring falls back to the pool
+// when the kernel refuses it, and the pool to stdio when no thread starts
+void input_reader_start(InputReader *r, InputFile *files, int count, InputMode mode, int threads) {
+    memset(r, 0, sizeof(*r));
+    r->files = files;
+    r->count = count;
+    r->ring.fd = -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    for (int i = 0; i < count; i++) {
+        files[i].data = NULL;
+        files[i].len = 0;
+        files[i].error = 0;
+        files[i].ready = 0;
+    }
+    if (mode == IO_URING) {
+        int error = uring_init(&r->ring, 2 * URING_BATCH);
+        if (error == 0 && (error = pthread_create(&r->threads[0], NULL, uring_reader_main, r)) == 0) {
+            r->thread_count = 1;
+        } else {
+            uring_free(&r->ring);
+            memset(&r->ring, 0, sizeof(r->ring));
+            r->ring.fd = -1;
+            fprintf(stderr, "io_uring unavailable (%s); using the pread pool\n", strerror(error));
+            mode = IO_POOL;
+        }
+    }
+    if (mode == IO_POOL) {
+        int wanted = threads < 1 ? 1 : threads > MAX_WORKERS ? MAX_WORKERS : threads, error = 0;
+        // Readers claim files from one counter, so any that start share them
+        while (r->thread_count < wanted
+            && (error = pthread_create(&r->threads[r->thread_count], NULL, pool_reader_main, r)) == 0) {
+            r->thread_count++;
+        }
+        if (r->thread_count == 0) {
+            fprintf(stderr, "No reader thread started (%s); using stdio\n", strerror(error));
+            mode = IO_STDIO;
+        }
+    }
+    r->mode = mode;
+}
+
+// Wait for file i to be loaded; the stdio mode loads it here
+InputFile* input_reader_wait(InputReader *r, int i) {
+    InputFile *file = &r->files[i];
+    if (r->mode == IO_STDIO) {
+        FILE *stream = fopen(file->path, "r");
+        if (!stream) {
+            file->error = errno;
+            return file;
+        }
+        file->data = read_file(stream, &file->len);
+        if (ferror(stream)) file->error = errno;
+        fclose(stream);
+        return file;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (!file->ready) pthread_cond_wait(&r->changed, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    return file;
+}
+
+// The parser is done with file i; frees its buffer and opens the window
+void input_reader_release(InputReader *r, int i) {
+    free(r->files[i].data);
+    r->files[i].data = NULL;
+    pthread_mutex_lock(&r->lock);
+    r->consumed = i + 1;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void input_reader_finish(InputReader *r) {
+    for (int i = 0; i < r->thread_count; i++) pthread_join(r->threads[i], NULL);
+    uring_free(&r->ring);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->changed);
+}
+
+// Parse every file in order as the reader delivers it. Diagnostics are
+// printed when report is set; returns the number of files with errors.
+int check_files(Parser *p, InputFile *files, int count, InputMode mode, int threads, int report, CheckStats *stats) {
+    InputReader r;
+    int failed = 0;
+    double start = now_ms();
+    input_reader_start(&r, files, count, mode, threads);
+    memset(stats, 0, sizeof(*stats));
+    stats->mode = r.mode;
+    for (int i = 0; i < count; i++) {
+        InputFile *file = input_reader_wait(&r, i);
+        if (file->error) {
+            if (report) printf("%s: could not read: %s\n", file->path, strerror(file->error));
+            stats->unreadable++;
+            failed++;
+        } else {
+            set_module_dir_of(p, file->path);
+            ParseResult result = parser_parse(p, file->data, file->len);
+            stats->bytes += file->len;
+            if (result.error_count > 0) {
+                if (report) {
+                    printf("%s:\n", file->path);
+                    print_errors(stdout, result.errors, result.error_count);
+                }
+                failed++;
+            }
+        }
+        input_reader_release(&r, i);
+    }
+    input_reader_finish(&r);
+    stats->ms = now_ms() - start;
+    stats->syscalls = r.mode == IO_STDIO ? -1 : r.syscalls;
+    stats->failed = failed;
+    return failed;
+}
+
+void print_check_stats(int count, const CheckStats *stats) {
+    double seconds = stats->ms / 1e3;
+    printf("%-10s %8.0f files/s %8.1f MB/s", input_mode_name(stats->mode),
+        seconds > 0 ? count / seconds : 0.0, seconds > 0 ? stats->bytes / 1e6 / seconds : 0.0);
+    if (stats->syscalls >= 0) printf(" %6.2f syscalls/file", count ? (double)stats->syscalls / count : 0.0);
+    printf("\n");
+}
+
+// upl --check-files: syntax-check many files, reporting diagnostics per
+// file and the input throughput; --compare runs each input mode in turn
+int check_files_main(int argc, char *argv[]) {
+    InputMode mode = IO_URING;
+    int threads = 4, compare = 0, count = 0, capacity = 256;
+    InputFile *files = malloc(sizeof(InputFile) * capacity);
+    char **lists = NULL; // Buffers of the --list files, which the paths point into
+    int list_count = 0;
+    for (int i = 2; i < argc; i++) {
+        const char *path = argv[i];
+        if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uring") == 0) mode = IO_URING;
+            else if (strcmp(argv[i], "pool") == 0) mode = IO_POOL;
+            else if (strcmp(argv[i], "stdio") == 0) mode = IO_STDIO;
+            else {
+                fprintf(stderr, "Unknown input mode %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--compare") == 0) {
+            compare = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--list") == 0 && i + 1 < argc) {
+            // One path per line; the lines stay in the list buffer, kept
+            // until the end since --list can be given more than once
+            FILE *stream = fopen(argv[++i], "r");
+            if (!stream) {
+                fprintf(stderr, "Could not open file %s\n", argv[i]);
+                return 1;
+            }
+            size_t len;
+            char *list = read_file(stream, &len);
+            fclose(stream);
+            list = realloc(list, len + 1);
+            list[len] = '\0';
+            lists = realloc(lists, sizeof(char *) * (list_count + 1));
+            lists[list_count++] = list;
+            for (char *line = strtok(list, "\n"); line; line = strtok(NULL, "\n")) {
+                if (count == capacity) files = realloc(files, sizeof(InputFile) * (capacity *= 2));
+                files[count++].path = line;
+            }
+            continue;
+        }
+        if (count == capacity) files = realloc(files, sizeof(InputFile) * (capacity *= 2));
+        files[count++].path = path;
+    }
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s --check-files [--io uring|pool|stdio] [-j threads] [--compare] [--list <file>] <filename>...\n",
+            argv[0]);
+        free(files);
+        for (int i = 0; i < list_count; i++) free(lists[i]);
+        free(lists);
+        return 1;
+    }
+    Parser *p = parser_new();
+    CheckStats stats;
+    int failed = check_files(p, files, count, compare ? IO_STDIO : mode, threads, 1, &stats);
+    printf("%d files, %d with errors, %d unreadable\n", count, failed - stats.unreadable, stats.unreadable);
+    print_check_stats(count, &stats);
+    if (compare) {
+        // The first run warmed the page cache, so every mode reads cached files
+        for (InputMode other = IO_POOL; other <= IO_URING; other++) {
+            CheckStats other_stats;
+            if (check_files(p, files, count, other, threads, 0, &other_stats) != failed) {
+                printf("%s: results differ from stdio\n", input_mode_name(other));
+            }
+            if (other_stats.mode == other) print_check_stats(count, &other_stats);
+        }
+    }
+    parser_free(p);
+    free(files);
+    for (int i = 0; i < list_count; i++) free(lists[i]);
+    free(lists);
+    return failed > 0 ? 1 : 0;
+}
+
+// Merkle hashes, computed children first with an explicit stack so shared
+// (hash-consed) subtrees are hashed once
+void ast_merkle_hashes(const Ast *ast, NodeId root, uint64_t *hashes) {
+    memset(hashes, 0, sizeof(uint64_t) * ast->node_count);
+    if (!root) return;
+    NodeList stack = { NULL, 0, 0 };
+    node_list_push(&stack, root);
+    while (stack.count > 0) {
+        NodeId id = stack.items[stack.count - 1];
+        if (hashes[id]) {
+            stack.count--;
+            continue;
+        }
+        int n = ast_num_children(ast, id), pending = 0;
+        for (int i = 0; i < n; i++) {
+            NodeId child = ast_child(ast, id, i);
+            if (child && !hashes[child]) {
+                node_list_push(&stack, child);
+                pending = 1;
+            }
+        }
+        if (pending) continue;
+        stack.count--;
+        uint64_t hash = 14695981039346656037ull ^ ast_kind(ast, id);
+        if (kind_has_text(ast_kind(ast, id))) {
+            for (const char *c = ast_text(ast, id); *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+        }
+        hash = (hash ^ (uint64_t)n) * 1099511628211ull;
+        for (int i = 0; i < n; i++) {
+            NodeId child = ast_child(ast, id, i);
+            hash = (hash ^ (child ? hashes[child] : 0)) * 1099511628211ull;
+            hash ^= hash >> 29;
+        }
+        // Mix, and keep 0 free to mean not yet hashed
+        hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hashes[id] = hash ? hash : 1;
+    }
+    free(stack.items);
+}
+
+uint64_t diff_hash(const AstDiff *d, int side, NodeId id) {
+    return id ? d->hashes[side][id] : 0;
+}
+
+// Name a statement by the first declared or assigned variable in it
+const char* stmt_name(const Ast *ast, NodeId stmt) {
+    NodeId id = stmt;
+    for (int depth = 0; depth < 3 && id && ast_num_children(ast, id) > 0; depth++) {
+        NodeId child = ast_child(ast, id, 0);
+        if (!child) return "";
+        if (ast_kind(ast, child) == NK_NAME) return ast_text(ast, child);
+        id = child;
+    }
+    return "";
+}
+
+void diff_report(AstDiff *d, const char *what, NodeId x, NodeId y) {
+    NodeId stmt = x ? x : y;
+    const Ast *ast = x ? d->ast[0] : d->ast[1];
+    const char *name = stmt_name(ast, stmt);
+    fprintf(d->out, "- %s %s%s%s:", what, node_kind_label(ast_kind(ast, stmt)), *name ? " " : "", name);
+    if (x) fprintf(d->out, " %s line %d", d->names[0], node_line(d->p[0], x));
+    if (x && y) fprintf(d->out, ",");
+    if (y) fprintf(d->out, " %s line %d", d->names[1], node_line(d->p[1], y));
+    fprintf(d->out, "\n");
+}
+
+// Whether two nodes differ outside the statement lists they contain,
+// which are diffed separately
+int header_differs(AstDiff *d, NodeId x, NodeId y) {
+    if (diff_hash(d, 0, x) == diff_hash(d, 1, y)) return 0;
+    if (!x || !y || ast_kind(d->ast[0], x) != ast_kind(d->ast[1], y)
+        || ast_num_children(d->ast[0], x) != ast_num_children(d->ast[1], y)) {
+        return 1;
+    }
+    if (ast_kind(d->ast[0], x) == NK_STMTS) return 0;
+    if (ast_num_children(d->ast[0], x) == 0) return 1;
+    for (int i = 0; i < ast_num_children(d->ast[0], x); i++) {
+        if (header_differs(d, ast_child(d->ast[0], x, i), ast_child(d->ast[1], y, i))) return 1;
+    }
+    return 0;
+}
+
+// Diff the statement lists inside two nodes of the same shape
+void diff_lists(AstDiff *d, NodeId x, NodeId y) {
+    if (!x || !y || ast_kind(d->ast[0], x) != ast_kind(d->ast[1], y)
+        || ast_num_children(d->ast[0], x) != ast_num_children(d->ast[1], y)) {
+        return;
+    }
+    for (int i = 0; i < ast_num_children(d->ast[0], x); i++) {
+        NodeId a = ast_child(d->ast[0], x, i), b = ast_child(d->ast[1], y, i);
+        if (diff_hash(d, 0, a) == diff_hash(d, 1, b)) d->skipped++;
+        else if (ast_kind(d->ast[0], a) == NK_STMTS && ast_kind(d->ast[1], b) == NK_STMTS) diff_stmts(d, a, b);
+        else diff_lists(d, a, b);
+    }
+}
+
+// Two statements in the same place that differ: report the statement if
+// its own parts changed, then the changes in its bodies
+void diff_stmt(AstDiff *d, NodeId x, NodeId y) {
+    if (header_differs(d, x, y)) {
+        diff_report(d, "changed", x, y);
+        d->changed++;
+    }
+    diff_lists(d, x, y);
+}
+
+// Pair up a run of removed and added statements between two matches:
+// each removed statement is a change to the next added one of its kind,
+// keeping order; the rest are removals and additions
+void diff_run(AstDiff *d, const NodeId *removed, int removed_count, const NodeId *added, int added_count) {
+    int next = 0;
+    for (int k = 0; k < removed_count; k++) {
+        NodeId x = removed[k];
+        int match = next;
+        while (match < added_count && ast_kind(d->ast[1], added[match]) != ast_kind(d->ast[0], x)) match++;
+        if (match == added_count) {
+            diff_report(d, "removed", x, NO_NODE);
+            d->removed++;
+            continue;
+        }
+        for (; next < match; next++) {
+            diff_report(d, "added", NO_NODE, added[next]);
+            d->added++;
+        }
+        diff_stmt(d, x, added[next++]);
+    }
+    for (; next < added_count; next++) {
+        diff_report(d, "added", NO_NODE, added[next]);
+        d->added++;
+    }
+}
+
+// Match two statement lists by hash: common ends first, then a longest
+// common subsequence of the rest, so a few edits cost little
+void diff_stmts(AstDiff *d, NodeId x, NodeId y) {
+    const NodeId *a = d->ast[0]->children + d->ast[0]->nodes[x].first_child;
+    const NodeId *b = d->ast[1]->children + d->ast[1]->nodes[y].first_child;
+    int n = ast_num_children(d->ast[0], x), m = ast_num_children(d->ast[1], y);
+    int lo = 0;
+    while (lo < n && lo < m && diff_hash(d, 0, a[lo]) == diff_hash(d, 1, b[lo])) lo++;
+    while (n > lo && m > lo && diff_hash(d, 0, a[n - 1]) == diff_hash(d, 1, b[m - 1])) {
+        n--;
+        m--;
+    }
+    d->skipped += lo + (ast_num_children(d->ast[0], x) - n);
+    int rows = n - lo + 1, cols = m - lo + 1;
+    // lcs[i * cols + j]: length for a[lo + i..n) and b[lo + j..m)
+    int *lcs = calloc((size_t)rows * cols, sizeof(int));
+    for (int i = rows - 2; i >= 0; i--) {
+        for (int j = cols - 2; j >= 0; j--) {
+            if (diff_hash(d, 0, a[lo + i]) == diff_hash(d, 1, b[lo + j])) {
+                lcs[i * cols + j] = lcs[(i + 1) * cols + j + 1] + 1;
+            } else {
+                int down = lcs[(i + 1) * cols + j], right = lcs[i * cols + j + 1];
+                lcs[i * cols + j] = down > right ? down : right;
+            }
+        }
+    }
+    NodeId *removed = malloc(sizeof(NodeId) * rows), *added = malloc(sizeof(NodeId) * cols);
+    int removed_count = 0, added_count = 0;
+    int i = 0, j = 0;
+    while (i < rows - 1 || j < cols - 1) {
+        if (i < rows - 1 && j < cols - 1 && diff_hash(d, 0, a[lo + i]) == diff_hash(d, 1, b[lo + j])) {
+            diff_run(d, removed, removed_count, added, added_count);
+            removed_count = added_count = 0;
+            d->skipped++;
+            i++;
+            j++;
+        } else if (j == cols - 1 || (i < rows - 1 && lcs[(i + 1) * cols + j] >= lcs[i * cols + j + 1])) {
+            removed[removed_count++] = a[lo + i++];
+        } else {
+            added[added_count++] = b[lo + j++];
+        }
+    }
+    diff_run(d, removed, removed_count, added, added_count);
+    free(lcs);
+    free(removed);
+    free(added);
+}
+
+// upl --diff: compare two programs by structure; exits 0 if they are the
+// same, 1 if they differ, 2 if either does not parse
+int diff_main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s --diff <old file> <new file>\n", argv[0]);
+        return 2;
+    }
+    AstDiff d;
+    memset(&d, 0, sizeof(d));
+    d.out = stdout;
+    char *src[2] = { NULL, NULL };
+    NodeId root[2] = { NO_NODE, NO_NODE };
+    int status = 0;
+    for (int side = 0; side < 2; side++) {
+        d.names[side] = argv[2 + side];
+        d.p[side] = parser_new();
+        FILE *file = fopen(d.names[side], "r");
+        if (!file) {
+            fprintf(stderr, "Could not open file %s\n", d.names[side]);
+            status = 2;
+            continue;
+        }
+        size_t len;
+        src[side] = read_file(file, &len);
+        fclose(file);
+        set_module_dir_of(d.p[side], d.names[side]);
+        ParseResult result = parser_parse(d.p[side], src[side], len);
+        if (!result.ok) {
+            printf("%s:\n", d.names[side]);
+            print_errors(stdout, result.errors, result.error_count);
+            status = 2;
+            continue;
+        }
+        d.ast[side] = result.ast;
+        root[side] = result.root;
+        d.hashes[side] = malloc(sizeof(uint64_t) * result.ast->node_count);
+        ast_merkle_hashes(result.ast, result.root, d.hashes[side]);
+    }
+    if (status == 0) {
+        if (diff_hash(&d, 0, root[0]) == diff_hash(&d, 1, root[1])) {
+            printf("- no differences\n");
+        } else {
+            diff_lists(&d, root[0], root[1]);
+            printf("- %d statements differ: %d changed, %d added, %d removed; %ld identical subtrees skipped\n",
+                d.changed + d.added + d.removed, d.changed, d.added, d.removed, d.skipped);
+            status = 1;
+        }
+    }
+    for (int side = 0; side < 2; side++) {
+        free(d.hashes[side]);
+        free(src[side]);
+        parser_free(d.p[side]);
+    }
+    return status;
+}
+
+// SSA middle end. The tree is lowered into basic blocks of SSA values
+// with the on-the-fly construction of Braun et al.: a variable read looks
+// for a definition in the block, then in its predecessors, and a phi is
+// placed where two definitions meet, or left incomplete in a block whose
+// predecessors are not all known yet (a loop header before its latch).
+// Trivial phis are removed once the program is lowered.
+
+void int_list_push(IntList *list, int value) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = realloc(list->items, sizeof(int) * list->capacity);
+    }
+    list->items[list->count++] = value;
+}
+
+void ir_def_push(IrDef **items, int *count, int *capacity, int var, int value) {
+    if (*count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        *items = realloc(*items, sizeof(IrDef) * *capacity);
+    }
+    (*items)[*count].var = var;
+    (*items)[*count].value = value;
+    (*count)++;
+}
+
+int ir_arity(IrOp op) {
+    if (op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_GT || op == IR_GTE) return 2;
+    return op == IR_PRINT || op == IR_BR ? 1 : 0;
+}
+
+// A new instruction, not yet in a block
+int ir_instr(Ir *ir, IrOp op, NodeKind type, int a, int b) {
+    if (ir->instr_count >= ir->instr_capacity) {
+        ir->instr_capacity = ir->instr_capacity ? ir->instr_capacity * 2 : 256;
+        ir->instrs = realloc(ir->instrs, sizeof(IrInstr) * ir->instr_capacity);
+    }
+    IrInstr *in = &ir->instrs[ir->instr_count];
+    memset(in, 0, sizeof(IrInstr));
+    in->op = op;
+    in->type = type;
+    in->num_args = ir_arity(op);
+    in->args[0] = a;
+    in->args[1] = b;
+    in->targets[0] = in->targets[1] = -1;
+    in->block = -1;
+    in->var = -1;
+    in->forward = -1;
+    return ir->instr_count++;
+}
+
+// Append an instruction to the block being filled
+int ir_emit(Ir *ir, IrOp op, NodeKind type, int a, int b) {
+    int i = ir_instr(ir, op, type, a, b);
+    ir->instrs[i].block = ir->current;
+    int_list_push(&ir->blocks[ir->current].code, i);
+    return i;
+}
+
+int ir_const(Ir *ir, NodeKind type, long long value) {
+    int i = ir_emit(ir, IR_CONST, type, -1, -1);
+    ir->instrs[i].value = value;
+    return i;
+}
+
+int ir_new_block(Ir *ir) {
+    if (ir->block_count >= ir->block_capacity) {
+        ir->block_capacity = ir->block_capacity ? ir->block_capacity * 2 : 64;
+        ir->blocks = realloc(ir->blocks, sizeof(IrBlock) * ir->block_capacity);
+    }
+    memset(&ir->blocks[ir->block_count], 0, sizeof(IrBlock));
+    return ir->block_count++;
+}
+
+void ir_jump(Ir *ir, int target) {
+    int j = ir_emit(ir, IR_JMP, NK_NONE, -1, -1);
+    ir->instrs[j].targets[0] = target;
+    IrBlock *b = &ir->blocks[target];
+    b->preds[b->pred_count++] = ir->current;
+}
+
+void ir_branch(Ir *ir, int cond, int then_block, int else_block) {
+    int j = ir_emit(ir, IR_BR, NK_NONE, cond, -1);
+    ir->instrs[j].targets[0] = then_block;
+    ir->instrs[j].targets[1] = else_block;
+    ir->blocks[then_block].preds[ir->blocks[then_block].pred_count++] = ir->current;
+    ir->blocks[else_block].preds[ir->blocks[else_block].pred_count++] = ir->current;
+}
+
+NodeKind ir_var_type(Ir *ir, int var) {
+    return strcmp(ir->p->symbol_table.symbols[var].type, "int") == 0 ? NK_TYPE_INT : NK_TYPE_BOOL;
+}
+
+void ir_write(Ir *ir, int block, int var, int value) {
+    IrBlock *b = &ir->blocks[block];
+    for (int i = 0; i < b->def_count; i++) {
+        if (b->defs[i].var == var) {
+            b->defs[i].value = value;
+            return;
+        }
+    }
+    ir_def_push(&b->defs, &b->def_count, &b->def_capacity, var, value);
+}
+
+int ir_new_phi(Ir *ir, int block, int var) {
+    int phi = ir_instr(ir, IR_PHI, ir_var_type(ir, var), -1, -1);
+    ir->instrs[phi].block = block;
+    ir->instrs[phi].var = var;
+    int_list_push(&ir->blocks[block].phis, phi);
+    return phi;
+}
+
+// Value of a variable at the end of what has been lowered into a block, or
+// with phi >= 0, the operands of that phi. Reads through predecessors wait
+// on an explicit stack, so long chains of blocks cannot exhaust the C stack.
+int ir_read_from(Ir *ir, int block, int var, int phi) {
+    IrReadFrame *frames = NULL;
+    int count = 0, capacity = 0, value = -1;
+    if (phi >= 0) {
+        if (ir->blocks[block].pred_count == 0) {
+            ir->instrs[phi].num_args = 0;
+            return phi;
+        }
+        frames = malloc(sizeof(IrReadFrame) * 16);
+        capacity = 16;
+        frames[count++] = (IrReadFrame){ -1, phi, 0, { -1, -1 } };
+        block = ir->blocks[block].preds[0];
+    }
+    for (;;) {
+        IrBlock *b = &ir->blocks[block];
+        int found = 0;
+        for (int i = 0; i < b->def_count && !found; i++) {
+            if (b->defs[i].var == var) {
+                value = b->defs[i].value;
+                found = 1;
+            }
+        }
+        if (!found && b->sealed && b->pred_count > 0) {
+            int merge = -1;
+            if (b->pred_count > 1) {
+                merge = ir_new_phi(ir, block, var);
+                ir_write(ir, block, var, merge); // A read around a loop finds the phi
+            }
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(IrReadFrame) * capacity);
+            }
+            frames[count++] = (IrReadFrame){ block, merge, 0, { -1, -1 } };
+            block = ir->blocks[block].preds[0];
+            continue;
+        }
+        if (!found && !b->sealed) {
+            value = ir_new_phi(ir, block, var);
+            ir_def_push(&b->incomplete, &b->incomplete_count, &b->incomplete_capacity, var, value);
+            ir_write(ir, block, var, value);
+        } else if (!found) {
+            // Read before any store on some path: an undefined value at entry
+            value = ir_instr(ir, IR_UNDEF, ir_var_type(ir, var), -1, -1);
+            ir->instrs[value].block = block;
+            ir->instrs[value].var = var;
+            IntList *code = &b->code;
+            int_list_push(code, value);
+            memmove(code->items + 1, code->items, sizeof(int) * (code->count - 1));
+            code->items[0] = value;
+            ir_write(ir, block, var, value);
+        }
+        // Hand the value to the reads waiting on it
+        while (count > 0) {
+            IrReadFrame *f = &frames[count - 1];
+            if (f->phi >= 0) {
+                const IrBlock *at = &ir->blocks[ir->instrs[f->phi].block];
+                f->args[f->arg++] = value;
+                if (f->arg < at->pred_count) break;
+                IrInstr *in = &ir->instrs[f->phi];
+                for (int i = 0; i < f->arg; i++) in->args[i] = f->args[i];
+                in->num_args = f->arg;
+                // Removed now, a phi need not be looked through by the
+                // phis placed around it later, as in a deep loop nest
+                ir_trivial_phi(ir, f->phi);
+                value = f->phi;
+            }
+            if (f->block >= 0) ir_write(ir, f->block, var, value);
+            count--;
+        }
+        if (count == 0) break;
+        IrReadFrame *f = &frames[count - 1];
+        block = ir->blocks[ir->instrs[f->phi].block].preds[f->arg];
+    }
+    free(frames);
+    return value;
+}
+
+int ir_read(Ir *ir, int block, int var) {
+    return ir_read_from(ir, block, var, -1);
+}
+
+void ir_phi_operands(Ir *ir, int phi) {
+    ir_read_from(ir, ir->instrs[phi].block, ir->instrs[phi].var, phi);
+}
+
+// All predecessors are known: complete the phis placed meanwhile
+void ir_seal(Ir *ir, int block) {
+    for (int i = 0; i < ir->blocks[block].incomplete_count; i++) {
+        ir_phi_operands(ir, ir->blocks[block].incomplete[i].value);
+    }
+    ir->blocks[block].incomplete_count = 0;
+    ir->blocks[block].sealed = 1;
+}
+
+int ir_find(Ir *ir, int value) {
+    int root = value;
+    while (ir->instrs[root].forward >= 0) root = ir->instrs[root].forward;
+    while (value != root) {
+        int next = ir->instrs[value].forward;
+        ir->instrs[value].forward = root;
+        value = next;
+    }
+    return root;
+}
+
+// Operands are lowered left to right before their operator, from an
+// explicit stack
+int ir_lower_expr(Ir *ir, NodeId id) {
+    const Ast *ast = &ir->p->ast;
+    WalkStack stack = { NULL, 0, 0 };
+    IntList values = { NULL, 0, 0 };
+    walk_push(&stack, id);
+    while (stack.count > 0) {
+        WalkFrame *f = &stack.items[stack.count - 1];
+        NodeKind kind = ast_kind(ast, f->id);
+        int value;
+        if (kind == NK_NUM) {
+            long long n = 0;
+            if (!eval_int(ast, f->id, &n)) ir->failed = 1;
+            value = ir_const(ir, NK_TYPE_INT, n);
+        } else if (kind == NK_TRUE || kind == NK_FALSE) {
+            value = ir_const(ir, NK_TYPE_BOOL, kind == NK_TRUE);
+        } else if (kind == NK_ID) {
+            int var = symbol_index(ir->p, ast_text(ast, f->id));
+            if (var >= 0) {
+                value = ir_read(ir, ir->current, var);
+            } else {
+                ir->failed = 1;
+                value = ir_const(ir, NK_TYPE_INT, 0);
+            }
+        } else if (f->child < 2) {
+            NodeId child = ast_child(ast, f->id, f->child++);
+            walk_push(&stack, child);
+            continue;
+        } else {
+            int b = values.items[--values.count];
+            int a = values.items[--values.count];
+            IrOp op = kind == NK_ADD_EXPR ? IR_ADD : kind == NK_MUL_EXPR ? IR_MUL : kind == NK_EQ_EXPR ? IR_EQ
+                : kind == NK_GT ? IR_GT : IR_GTE;
+            value = ir_emit(ir, op, op == IR_ADD || op == IR_MUL ? NK_TYPE_INT : NK_TYPE_BOOL, a, b);
+        }
+        int_list_push(&values, value);
+        stack.count--;
+    }
+    int value = values.items[0];
+    free(stack.items);
+    free(values.items);
+    return value;
+}
+
+// A store to name of value, or of an undefined value for a bare declaration
+void ir_lower_store(Ir *ir, NodeId name, NodeId value) {
+    int var = symbol_index(ir->p, ast_text(&ir->p->ast, name));
+    if (var < 0) {
+        ir->failed = 1;
+        return;
+    }
+    int v;
+    if (value) {
+        v = ir_lower_expr(ir, value);
+    } else {
+        v = ir_emit(ir, IR_UNDEF, ir_var_type(ir, var), -1, -1);
+        ir->instrs[v].var = var;
+    }
+    ir_write(ir, ir->current, var, v);
+}
+
+void ir_lower_init_decl(Ir *ir, NodeId init_decl) {
+    const Ast *ast = &ir->p->ast;
+    NodeId value = ast_num_children(ast, init_decl) > 1 ? ast_child(ast, init_decl, 1) : NO_NODE;
+    ir_lower_store(ir, ast_child(ast, init_decl, 0), value);
+}
+
+// Lowers the statement at f->index up to its next statement list, and
+// returns that list with ir->current set to the block it goes in; returns
+// NO_NODE once the statement is complete.
+NodeId ir_lower_stmt(Ir *ir, IrFrame *f) {
+    const Ast *ast = &ir->p->ast;
+    NodeId stmt = ast_child(ast, f->stmts, f->index);
+    int phase = f->phase++;
+    switch (stmt ? ast_kind(ast, stmt) : NK_NONE) {
+    case NK_ASSIGN_STMT:
+        ir_lower_store(ir, ast_child(ast, stmt, 0), ast_child(ast, stmt, 1));
+        break;
+    case NK_DECL_STMT:
+        ir_lower_init_decl(ir, ast_child(ast, stmt, 1));
+        break;
+    case NK_PRINT_STMT:
+        ir_emit(ir, IR_PRINT, NK_NONE, ir_lower_expr(ir, ast_child(ast, stmt, 0)), -1);
+        break;
+    case NK_IF_STMT: {
+        NodeId if_then = ast_child(ast, stmt, 0);
+        NodeId else_opt = ast_child(ast, stmt, 1);
+        int *then_block = &f->blocks[0], *else_block = &f->blocks[1], *join = &f->blocks[2];
+        if (phase == 0) {
+            int cond = ir_lower_expr(ir, ast_child(ast, if_then, 0));
+            *then_block = ir_new_block(ir);
+            *else_block = else_opt ? ir_new_block(ir) : -1;
+            *join = ir_new_block(ir);
+            ir_branch(ir, cond, *then_block, else_opt ? *else_block : *join);
+            ir_seal(ir, *then_block);
+            ir->current = *then_block;
+            return ast_child(ast, if_then, 1);
+        }
+        ir_jump(ir, *join);
+        if (phase == 1 && else_opt) {
+            ir_seal(ir, *else_block);
+            ir->current = *else_block;
+            return ast_child(ast, else_opt, 0);
+        }
+        ir_seal(ir, *join);
+        ir->current = *join;
+        break;
+    }
+    case NK_DO_WHILE_STMT: {
+        int *body = &f->blocks[0];
+        if (phase == 0) {
+            *body = ir_new_block(ir);
+            ir_jump(ir, *body);
+            ir->current = *body;
+            return ast_child(ast, stmt, 0);
+        }
+        int cond = ir_lower_expr(ir, ast_child(ast, stmt, 1));
+        int exit = ir_new_block(ir);
+        ir_branch(ir, cond, *body, exit);
+        ir_seal(ir, *body);
+        ir_seal(ir, exit);
+        ir->current = exit;
+        break;
+    }
+    case NK_FOR_STMT: {
+        NodeId init = ast_child(ast, stmt, 0);
+        NodeId update = ast_child(ast, stmt, 2);
+        int *header = &f->blocks[0], *exit = &f->blocks[1];
+        if (phase == 0) {
+            if (ast_kind(ast, ast_child(ast, init, 0)) == NK_NAME) ir_lower_store(ir, ast_child(ast, init, 0), ast_child(ast, init, 1));
+            else ir_lower_init_decl(ir, ast_child(ast, init, 1));
+            *header = ir_new_block(ir);
+            ir_jump(ir, *header);
+            ir->current = *header;
+            int cond = ir_lower_expr(ir, ast_child(ast, stmt, 1));
+            int body = ir_new_block(ir);
+            *exit = ir_new_block(ir);
+            ir_branch(ir, cond, body, *exit);
+            ir_seal(ir, body);
+            ir_seal(ir, *exit);
+            ir->current = body;
+            return ast_child(ast, stmt, 3);
+        }
+        ir_lower_store(ir, ast_child(ast, update, 0), ast_child(ast, update, 1));
+        ir_jump(ir, *header);
+        ir_seal(ir, *header);
+        ir->current = *exit;
+        break;
+    }
+    default:
+        break;
+    }
+    f->index++;
+    f->phase = 0;
+    return NO_NODE;
+}
+
+// Nested lists are kept on an explicit stack, so nesting depth is bounded
+// by memory, not the C stack
+void ir_lower_stmts(Ir *ir, NodeId stmts) {
+    const Ast *ast = &ir->p->ast;
+    IrFrame *frames = NULL;
+    int count = 0, capacity = 0;
+    NodeId list = stmts;
+    for (;;) {
+        if (list) {
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(IrFrame) * capacity);
+            }
+            frames[count++] = (IrFrame){ list, 0, 0, { -1, -1, -1 } };
+        }
+        if (count == 0) break;
+        IrFrame *f = &frames[count - 1];
+        if (f->index < ast_num_children(ast, f->stmts)) {
+            list = ir_lower_stmt(ir, f);
+            continue;
+        }
+        // The list is complete: go on with the statement it belongs to
+        if (--count == 0) break;
+        list = ir_lower_stmt(ir, &frames[count - 1]);
+    }
+    free(frames);
+}
+
+// A phi whose operands are itself and one other value is that value; one
+// with no other value reads a variable never stored, and is undefined.
+// Returns the value the phi forwards to now, -1 if it became undefined, or
+// the phi itself if it is needed.
+int ir_trivial_phi(Ir *ir, int phi) {
+    IrInstr *in = &ir->instrs[phi];
+    int same = -1;
+    for (int k = 0; k < in->num_args; k++) {
+        int a = ir_find(ir, in->args[k]);
+        if (a == phi || a == same) continue;
+        if (same >= 0) return phi;
+        same = a;
+    }
+    if (same < 0) {
+        in->op = IR_UNDEF;
+        in->num_args = 0;
+    } else {
+        in->forward = same;
+        in->dead = 1;
+    }
+    return same;
+}
+
+// Removing a phi can make the phis using it trivial, so those are looked at
+// again from a work queue rather than by sweeping every instruction
+int ir_remove_trivial_phis(Ir *ir) {
+    int n = ir->instr_count, removed = 0, edges = 0;
+    // Phis using each value, as lists that move to the replacement
+    int *head = malloc(sizeof(int) * (n + 1)), *tail = malloc(sizeof(int) * (n + 1));
+    int *next = malloc(sizeof(int) * (2 * n + 1)), *user = malloc(sizeof(int) * (2 * n + 1));
+    char *queued = calloc(n + 1, 1);
+    IntList work = { NULL, 0, 0 };
+    for (int i = 0; i < n; i++) head[i] = tail[i] = -1;
+    for (int i = 0; i < n; i++) {
+        IrInstr *in = &ir->instrs[i];
+        if (in->dead || in->op != IR_PHI) continue;
+        for (int k = 0; k < in->num_args; k++) {
+            int a = ir_find(ir, in->args[k]);
+            if (a == i) continue;
+            next[edges] = -1;
+            user[edges] = i;
+            if (tail[a] >= 0) next[tail[a]] = edges;
+            else head[a] = edges;
+            tail[a] = edges++;
+        }
+        int_list_push(&work, i);
+        queued[i] = 1;
+    }
+    for (int w = 0; w < work.count; w++) {
+        int i = work.items[w];
+        queued[i] = 0;
+        IrInstr *in = &ir->instrs[i];
+        if (in->dead || in->op != IR_PHI) continue;
+        int same = ir_trivial_phi(ir, i);
+        if (same == i) continue;
+        removed++;
+        if (same < 0) continue;
+        // Users removed meanwhile are dropped rather than handed on
+        for (int e = head[i], after; e >= 0; e = after) {
+            after = next[e];
+            if (ir->instrs[user[e]].dead) continue;
+            if (!queued[user[e]]) int_list_push(&work, user[e]);
+            queued[user[e]] = 1;
+            next[e] = -1;
+            if (tail[same] >= 0) next[tail[same]] = e;
+            else head[same] = e;
+            tail[same] = e;
+        }
+        head[i] = tail[i] = -1;
+    }
+    free(head);
+    free(tail);
+    free(next);
+    free(user);
+    free(queued);
+    free(work.items);
+    return removed;
+}
+
+// Rewrite operands to the values their replacements forward to, drop dead
+// instructions, and move former phis that became plain values into the code
+void ir_resolve(Ir *ir) {
+    IntList moved = { NULL, 0, 0 };
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock *block = &ir->blocks[b];
+        if (block->dead) continue;
+        moved.count = 0;
+        for (int list = 0; list < 2; list++) {
+            IntList *items = list == 0 ? &block->phis : &block->code;
+            int kept = 0;
+            for (int j = 0; j < items->count; j++) {
+                int i = items->items[j];
+                IrInstr *in = &ir->instrs[i];
+                if (in->dead) continue;
+                for (int k = 0; k < in->num_args; k++) in->args[k] = ir_find(ir, in->args[k]);
+                if (list == 0 && in->op != IR_PHI) int_list_push(&moved, i);
+                else items->items[kept++] = i;
+            }
+            items->count = kept;
+        }
+        if (moved.count == 0) continue;
+        IntList *code = &block->code;
+        for (int j = 0; j < moved.count; j++) int_list_push(code, 0);
+        memmove(code->items + moved.count, code->items, sizeof(int) * (code->count - moved.count));
+        memcpy(code->items, moved.items, sizeof(int) * moved.count);
+    }
+    free(moved.items);
+}
+
+void ir_free(Ir *ir) {
+    for (int b = 0; b < ir->block_count; b++) {
+        free(ir->blocks[b].phis.items);
+        free(ir->blocks[b].code.items);
+        free(ir->blocks[b].defs);
+        free(ir->blocks[b].incomplete);
+    }
+    free(ir->blocks);
+    free(ir->instrs);
+    memset(ir, 0, sizeof(Ir));
+}
+
+// Lower a parsed program; returns 0, with no blocks left, if a literal is
+// out of range
+int ir_build(Ir *ir, Parser *p, NodeId root) {
+    ir_free(ir);
+    ir->p = p;
+    ir->current = ir_new_block(ir);
+    ir->blocks[ir->current].sealed = 1;
+    ir_lower_stmts(ir, ast_child(&p->ast, root, 0));
+    ir_emit(ir, IR_RET, NK_NONE, -1, -1);
+    ir_remove_trivial_phis(ir);
+    ir_resolve(ir);
+    for (int b = 0; b < ir->block_count; b++) {
+        free(ir->blocks[b].defs);
+        free(ir->blocks[b].incomplete);
+        ir->blocks[b].defs = ir->blocks[b].incomplete = NULL;
+        ir->blocks[b].def_count = ir->blocks[b].def_capacity = 0;
+        ir->blocks[b].incomplete_count = ir->blocks[b].incomplete_capacity = 0;
+    }
+    if (!ir->failed) return 1;
+    ir_free(ir);
+    ir->p = p;
+    return 0;
+}
+
+void ir_size(const Ir *ir, int *blocks, int *instrs, int *phis) {
+    *blocks = *instrs = *phis = 0;
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        (*blocks)++;
+        *phis += ir->blocks[b].phis.count;
+        *instrs += ir->blocks[b].phis.count + ir->blocks[b].code.count;
+    }
+}
+
+int ir_succs(const Ir *ir, int block, int *succs) {
+    const IntList *code = &ir->blocks[block].code;
+    if (code->count == 0) return 0;
+    const IrInstr *last = &ir->instrs[code->items[code->count - 1]];
+    if (last->op == IR_JMP) {
+        succs[0] = last->targets[0];
+        return 1;
+    }
+    if (last->op != IR_BR) return 0;
+    succs[0] = last->targets[0];
+    succs[1] = last->targets[1];
+    return 2;
+}
+
+// Drop the edge from pred, and the matching operand of each phi
+void ir_remove_pred(Ir *ir, int block, int pred) {
+    IrBlock *b = &ir->blocks[block];
+    int j = 0;
+    while (j < b->pred_count && b->preds[j] != pred) j++;
+    if (j == b->pred_count) return;
+    for (int k = j; k + 1 < b->pred_count; k++) b->preds[k] = b->preds[k + 1];
+    b->pred_count--;
+    for (int n = 0; n < b->phis.count; n++) {
+        IrInstr *in = &ir->instrs[b->phis.items[n]];
+        if (in->op != IR_PHI || in->dead) continue;
+        for (int k = j; k + 1 < in->num_args; k++) in->args[k] = in->args[k + 1];
+        in->num_args--;
+    }
+}
+
+// Semidominator label of v's path to its linked ancestors, compressing the
+// path on the way; the path is walked from a list, not recursion
+int ir_dom_eval(int v, int *ancestor, int *label, const int *semi, IntList *path) {
+    if (ancestor[v] < 0) return v;
+    path->count = 0;
+    for (int x = v; ancestor[ancestor[x]] >= 0; x = ancestor[x]) int_list_push(path, x);
+    for (int j = path->count - 1; j >= 0; j--) {
+        int u = path->items[j], a = ancestor[u];
+        if (semi[label[a]] < semi[label[u]]) label[u] = label[a];
+        ancestor[u] = ancestor[a];
+    }
+    return label[v];
+}
+
+// Dominators by semi-NCA: semidominators as in Lengauer and Tarjan, then
+// each immediate dominator is the nearest ancestor of the depth-first tree
+// at or above its semidominator. Unlike iterating to a fixpoint over
+// reverse postorder, this stays near linear along deep loop nests. Tree
+// intervals then give constant-time dominance tests.
+void ir_dominators(const Ir *ir, IrDom *dom) {
+    int n = ir->block_count;
+    dom->order = malloc(sizeof(int) * (n + 1));
+    dom->rpo_index = malloc(sizeof(int) * (n + 1));
+    dom->idom = malloc(sizeof(int) * (n + 1));
+    dom->pre = malloc(sizeof(int) * (n + 1));
+    dom->post = malloc(sizeof(int) * (n + 1));
+    dom->child_start = calloc(n + 2, sizeof(int));
+    dom->children = malloc(sizeof(int) * (n + 1));
+    int *next_succ = calloc(n + 1, sizeof(int));
+    // Depth-first preorder number, tree parent and the vertex of each number
+    int *dfs = malloc(sizeof(int) * (n + 1)), *parent = malloc(sizeof(int) * (n + 1));
+    int *vertex = malloc(sizeof(int) * (n + 1)), *semi = malloc(sizeof(int) * (n + 1));
+    int *label = malloc(sizeof(int) * (n + 1)), *ancestor = malloc(sizeof(int) * (n + 1));
+    int visited = 0;
+    for (int b = 0; b < n; b++) dom->rpo_index[b] = dom->idom[b] = dom->pre[b] = dom->post[b] = dfs[b] = -1;
+    dom->count = 0;
+    IntList stack = { NULL, 0, 0 };
+    if (n > 0) {
+        int_list_push(&stack, 0);
+        dom->rpo_index[0] = 0; // Seen
+        parent[0] = -1;
+        dfs[0] = visited;
+        vertex[visited++] = 0;
+    }
+    while (stack.count > 0) {
+        int b = stack.items[stack.count - 1], succs[2];
+        int count = ir_succs(ir, b, succs);
+        if (next_succ[b] < count) {
+            int s = succs[next_succ[b]++];
+            if (dom->rpo_index[s] < 0 && !ir->blocks[s].dead) {
+                dom->rpo_index[s] = 0;
+                parent[s] = b;
+                dfs[s] = visited;
+                vertex[visited++] = s;
+                int_list_push(&stack, s);
+            }
+            continue;
+        }
+        stack.count--;
+        dom->order[dom->count++] = b; // Postorder for now
+    }
+    for (int i = 0; i < dom->count / 2; i++) {
+        int t = dom->order[i];
+        dom->order[i] = dom->order[dom->count - 1 - i];
+        dom->order[dom->count - 1 - i] = t;
+    }
+    for (int i = 0; i < dom->count; i++) dom->rpo_index[dom->order[i]] = i;
+    for (int i = 0; i < visited; i++) {
+        int b = vertex[i];
+        semi[b] = i;
+        label[b] = b;
+        ancestor[b] = -1;
+    }
+    for (int i = visited - 1; i > 0; i--) {
+        int w = vertex[i];
+        for (int k = 0; k < ir->blocks[w].pred_count; k++) {
+            int pred = ir->blocks[w].preds[k];
+            if (dfs[pred] < 0) continue;
+            int u = ir_dom_eval(pred, ancestor, label, semi, &stack);
+            if (semi[u] < semi[w]) semi[w] = semi[u];
+        }
+        ancestor[w] = parent[w];
+    }
+    if (dom->count > 0) dom->idom[0] = 0;
+    for (int i = 1; i < visited; i++) {
+        int w = vertex[i], idom = parent[w];
+        while (dfs[idom] > semi[w]) idom = dom->idom[idom];
+        dom->idom[w] = idom;
+    }
+    free(dfs);
+    free(parent);
+    free(vertex);
+    free(semi);
+    free(label);
+    free(ancestor);
+    // Children in reverse postorder, then preorder and postorder numbers
+    for (int i = 1; i < dom->count; i++) dom->child_start[dom->idom[dom->order[i]] + 1]++;
+    for (int b = 0; b < n; b++) dom->child_start[b + 1] += dom->child_start[b];
+    memcpy(next_succ, dom->child_start, sizeof(int) * n);
+    for (int i = 1; i < dom->count; i++) {
+        int b = dom->order[i];
+        dom->children[next_succ[dom->idom[b]]++] = b;
+    }
+    int clock = 0;
+    stack.count = 0;
+    if (dom->count > 0) int_list_push(&stack, 0);
+    while (stack.count > 0) {
+        int b = stack.items[--stack.count];
+        if (b < 0) {
+            dom->post[-b - 1] = clock++;
+            continue;
+        }
+        dom->pre[b] = clock++;
+        int_list_push(&stack, -b - 1);
+        for (int c = dom->child_start[b + 1] - 1; c >= dom->child_start[b]; c--) int_list_push(&stack, dom->children[c]);
+    }
+    free(next_succ);
+    free(stack.items);
+}
+
+int ir_dominates(const IrDom *dom, int a, int b) {
+    return dom->pre[a] >= 0 && dom->pre[b] >= 0 && dom->pre[a] <= dom->pre[b] && dom->post[b] <= dom->post[a];
+}
+
+void ir_dom_free(IrDom *dom) {
+    free(dom->order);
+    free(dom->rpo_index);
+    free(dom->idom);
+    free(dom->pre);
+    free(dom->post);
+    free(dom->child_start);
+    free(dom->children);
+}
+
+// Users of each value: uses[start[v]] .. uses[start[v + 1] - 1]
+void ir_users(const Ir *ir, int **start, int **uses) {
+    int n = ir->instr_count;
+    int *s = calloc(n + 2, sizeof(int));
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &ir->blocks[b].phis : &ir->blocks[b].code;
+            for (int j = 0; j < items->count; j++) {
+                const IrInstr *in = &ir->instrs[items->items[j]];
+                for (int k = 0; k < in->num_args; k++) s[in->args[k] + 2]++;
+            }
+        }
+    }
+    for (int v = 0; v < n; v++) s[v + 2] += s[v + 1];
+    int *u = malloc(sizeof(int) * (s[n + 1] + 1));
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &ir->blocks[b].phis : &ir->blocks[b].code;
+            for (int j = 0; j < items->count; j++) {
+                const IrInstr *in = &ir->instrs[items->items[j]];
+                for (int k = 0; k < in->num_args; k++) u[s[in->args[k] + 1]++] = items->items[j];
+            }
+        }
+    }
+    *start = s;
+    *uses = u;
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck): values start
+// unknown and only move down to a constant, then to overdefined; blocks and
+// edges are only followed once a branch can take them. Values found constant
+// become constants, branches on constants become jumps, and blocks never
+// reached are removed.
+
+void sccp_mark_edge(IrSccp *s, int from, int to) {
+    const IrBlock *b = &s->ir->blocks[to];
+    for (int j = 0; j < b->pred_count; j++) {
+        if (b->preds[j] != from || s->edge_exec[to * 2 + j]) continue;
+        s->edge_exec[to * 2 + j] = 1;
+        int_list_push(&s->flow, to * 2 + j);
+        return;
+    }
+}
+
+void sccp_set(IrSccp *s, int i, int state, long long value) {
+    if (state < s->state[i]) return;
+    if (state == SCCP_CONSTANT && s->state[i] == SCCP_CONSTANT && value != s->value[i]) state = SCCP_OVERDEFINED;
+    if (state == s->state[i] && (state != SCCP_CONSTANT || value == s->value[i])) return;
+    s->state[i] = state;
+    s->value[i] = value;
+    for (int u = s->use_start[i]; u < s->use_start[i + 1]; u++) int_list_push(&s->work, s->uses[u]);
+}
+
+void sccp_visit(IrSccp *s, int i) {
+    Ir *ir = s->ir;
+    const IrInstr *in = &ir->instrs[i];
+    int state = SCCP_UNKNOWN;
+    long long value = 0;
+    switch (in->op) {
+    case IR_JMP:
+        sccp_mark_edge(s, in->block, in->targets[0]);
+        return;
+    case IR_BR: {
+        int cond = in->args[0];
+        if (s->state[cond] == SCCP_CONSTANT) {
+            sccp_mark_edge(s, in->block, in->targets[s->value[cond] ? 0 : 1]);
+        } else if (s->state[cond] == SCCP_OVERDEFINED) {
+            sccp_mark_edge(s, in->block, in->targets[0]);
+            sccp_mark_edge(s, in->block, in->targets[1]);
+        }
+        return;
+    }
+    case IR_CONST:
+        state = SCCP_CONSTANT;
+        value = in->value;
+        break;
+    case IR_UNDEF:
+        state = SCCP_OVERDEFINED;
+        break;
+    case IR_PHI:
+        // Only operands on edges taken so far count
+        for (int k = 0; k < in->num_args; k++) {
+            int a = in->args[k];
+            if (!s->edge_exec[in->block * 2 + k] || s->state[a] == SCCP_UNKNOWN) continue;
+            if (s->state[a] == SCCP_OVERDEFINED || (state == SCCP_CONSTANT && s->value[a] != value)) {
+                state = SCCP_OVERDEFINED;
+                break;
+            }
+            state = SCCP_CONSTANT;
+            value = s->value[a];
+        }
+        break;
+    case IR_ADD:
+    case IR_MUL:
+    case IR_EQ:
+    case IR_GT:
+    case IR_GTE: {
+        int a = in->args[0], b = in->args[1];
+        if (s->state[a] == SCCP_OVERDEFINED || s->state[b] == SCCP_OVERDEFINED) {
+            state = SCCP_OVERDEFINED;
+            break;
+        }
+        if (s->state[a] != SCCP_CONSTANT || s->state[b] != SCCP_CONSTANT) break;
+        long long x = s->value[a], y = s->value[b];
+        state = SCCP_CONSTANT;
+        if (in->op == IR_ADD) {
+            if (__builtin_add_overflow(x, y, &value)) state = SCCP_OVERDEFINED;
+        } else if (in->op == IR_MUL) {
+            if (__builtin_mul_overflow(x, y, &value)) state = SCCP_OVERDEFINED;
+        } else if (in->op == IR_EQ) {
+            // int == bool is left alone, as by the fold pass
+            if (ir->instrs[a].type != ir->instrs[b].type) state = SCCP_OVERDEFINED;
+            value = x == y;
+        } else {
+            value = in->op == IR_GT ? x > y : x >= y;
+        }
+        break;
+    }
+    default:
+        return;
+    }
+    sccp_set(s, i, state, value);
+}
+
+void sccp_visit_block(IrSccp *s, int b, int phis_only) {
+    const IrBlock *block = &s->ir->blocks[b];
+    for (int j = 0; j < block->phis.count; j++) sccp_visit(s, block->phis.items[j]);
+    for (int j = 0; !phis_only && j < block->code.count; j++) sccp_visit(s, block->code.items[j]);
+}
+
+int ir_sccp(Ir *ir) {
+    IrSccp s;
+    memset(&s, 0, sizeof(s));
+    s.ir = ir;
+    s.state = calloc(ir->instr_count + 1, 1);
+    s.value = calloc(ir->instr_count + 1, sizeof(long long));
+    s.block_exec = calloc(ir->block_count + 1, 1);
+    s.edge_exec = calloc(ir->block_count * 2 + 1, 1);
+    ir_users(ir, &s.use_start, &s.uses);
+    if (ir->block_count > 0) {
+        s.block_exec[0] = 1;
+        sccp_visit_block(&s, 0, 0);
+    }
+    while (s.flow.count > 0 || s.work.count > 0) {
+        if (s.flow.count > 0) {
+            int edge = s.flow.items[--s.flow.count], b = edge / 2;
+            int first = !s.block_exec[b];
+            s.block_exec[b] = 1;
+            sccp_visit_block(&s, b, !first);
+            continue;
+        }
+        int i = s.work.items[--s.work.count];
+        if (s.block_exec[ir->instrs[i].block]) sccp_visit(&s, i);
+    }
+    int changes = 0;
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock *block = &ir->blocks[b];
+        if (block->dead) continue;
+        if (!s.block_exec[b]) {
+            int succs[2], count = ir_succs(ir, b, succs);
+            for (int k = 0; k < count; k++) ir_remove_pred(ir, succs[k], b);
+            block->dead = 1;
+            changes++;
+            continue;
+        }
+        for (int list = 0; list < 2; list++) {
+            IntList *items = list == 0 ? &block->phis : &block->code;
+            for (int j = 0; j < items->count; j++) {
+                int i = items->items[j];
+                IrInstr *in = &ir->instrs[i];
+                if (in->type == NK_NONE || in->op == IR_CONST || s.state[i] != SCCP_CONSTANT) continue;
+                in->op = IR_CONST;
+                in->value = s.value[i];
+                in->num_args = 0;
+                in->var = -1;
+                changes++;
+            }
+        }
+        IrInstr *last = &ir->instrs[block->code.items[block->code.count - 1]];
+        if (last->op == IR_BR && s.state[last->args[0]] == SCCP_CONSTANT) {
+            int taken = s.value[last->args[0]] ? 0 : 1;
+            ir_remove_pred(ir, last->targets[1 - taken], b);
+            last->op = IR_JMP;
+            last->targets[0] = last->targets[taken];
+            last->targets[1] = -1;
+            last->num_args = 0;
+            changes++;
+        }
+    }
+    changes += ir_remove_trivial_phis(ir);
+    ir_resolve(ir);
+    free(s.state);
+    free(s.value);
+    free(s.block_exec);
+    free(s.edge_exec);
+    free(s.use_start);
+    free(s.uses);
+    free(s.flow.items);
+    free(s.work.items);
+    return changes;
+}
+
+// Global value numbering over the dominator tree: a pure value computed
+// again where an equal one dominates it is replaced by that one. Operands of
+// add, mul and eq are compared in either order.
+
+int ir_commutes(IrOp op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_EQ;
+}
+
+uint32_t ir_value_hash(Ir *ir, int i) {
+    const IrInstr *in = &ir->instrs[i];
+    uint64_t h = in->op * 0x9e3779b97f4a7c15ull + in->type;
+    if (in->op == IR_CONST) h = h * 31 + (uint64_t)in->value;
+    if (in->op == IR_PHI) h = h * 31 + (uint64_t)in->block;
+    if (in->num_args == 2 && ir_commutes(in->op)) {
+        int a = ir_find(ir, in->args[0]), b = ir_find(ir, in->args[1]);
+        h = h * 31 + (uint64_t)(a < b ? a : b);
+        h = h * 31 + (uint64_t)(a < b ? b : a);
+    } else {
+        for (int k = 0; k < in->num_args; k++) h = h * 31 + (uint64_t)ir_find(ir, in->args[k]);
+    }
+    return (uint32_t)(h ^ (h >> 29));
+}
+
+int ir_same_value(Ir *ir, int i, int j) {
+    const IrInstr *x = &ir->instrs[i], *y = &ir->instrs[j];
+    if (x->op != y->op || x->type != y->type || x->num_args != y->num_args) return 0;
+    if (x->op == IR_CONST) return x->value == y->value;
+    if (x->op == IR_PHI && x->block != y->block) return 0;
+    int same = 1;
+    for (int k = 0; k < x->num_args && same; k++) same = ir_find(ir, x->args[k]) == ir_find(ir, y->args[k]);
+    if (same || !ir_commutes(x->op)) return same;
+    return ir_find(ir, x->args[0]) == ir_find(ir, y->args[1]) && ir_find(ir, x->args[1]) == ir_find(ir, y->args[0]);
+}
+
+int ir_gvn(Ir *ir) {
+    IrDom dom;
+    ir_dominators(ir, &dom);
+    uint32_t size = 64;
+    while (size < (uint32_t)ir->instr_count * 2) size *= 2;
+    int *heads = malloc(sizeof(int) * size);
+    memset(heads, -1, sizeof(int) * size);
+    int *next = malloc(sizeof(int) * (ir->instr_count + 1));
+    int *mark = malloc(sizeof(int) * (ir->block_count + 1));
+    IntList undo = { NULL, 0, 0 }, stack = { NULL, 0, 0 };
+    int removed = 0;
+    if (dom.count > 0) int_list_push(&stack, 0);
+    while (stack.count > 0) {
+        int b = stack.items[--stack.count];
+        if (b < 0) {
+            // Leaving a subtree: its values no longer dominate what follows
+            b = -b - 1;
+            while (undo.count > mark[b]) {
+                int bucket = undo.items[--undo.count];
+                heads[bucket] = next[heads[bucket]];
+            }
+            continue;
+        }
+        mark[b] = undo.count;
+        int_list_push(&stack, -b - 1);
+        for (int c = dom.child_start[b]; c < dom.child_start[b + 1]; c++) int_list_push(&stack, dom.children[c]);
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &ir->blocks[b].phis : &ir->blocks[b].code;
+            for (int j = 0; j < items->count; j++) {
+                int i = items->items[j];
+                IrInstr *in = &ir->instrs[i];
+                if (in->type == NK_NONE || in->op == IR_UNDEF) continue;
+                uint32_t bucket = ir_value_hash(ir, i) & (size - 1);
+                int found = heads[bucket];
+                while (found >= 0 && !ir_same_value(ir, i, found)) found = next[found];
+                if (found >= 0) {
+                    in->forward = found;
+                    in->dead = 1;
+                    removed++;
+                    continue;
+                }
+                next[i] = heads[bucket];
+                heads[bucket] = i;
+                int_list_push(&undo, bucket);
+            }
+        }
+    }
+    ir_resolve(ir);
+    free(heads);
+    free(next);
+    free(mark);
+    free(undo.items);
+    free(stack.items);
+    ir_dom_free(&dom);
+    return removed;
+}
+
+// Dead-code elimination: keep prints and terminators and what they use
+int ir_dce(Ir *ir) {
+    uint8_t *live = calloc(ir->instr_count + 1, 1);
+    IntList work = { NULL, 0, 0 };
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        const IntList *code = &ir->blocks[b].code;
+        for (int j = 0; j < code->count; j++) {
+            int i = code->items[j];
+            if (ir->instrs[i].type != NK_NONE) continue;
+            live[i] = 1;
+            int_list_push(&work, i);
+        }
+    }
+    while (work.count > 0) {
+        const IrInstr *in = &ir->instrs[work.items[--work.count]];
+        for (int k = 0; k < in->num_args; k++) {
+            if (live[in->args[k]]) continue;
+            live[in->args[k]] = 1;
+            int_list_push(&work, in->args[k]);
+        }
+    }
+    int removed = 0;
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &ir->blocks[b].phis : &ir->blocks[b].code;
+            for (int j = 0; j < items->count; j++) {
+                if (live[items->items[j]]) continue;
+                ir->instrs[items->items[j]].dead = 1;
+                removed++;
+            }
+        }
+    }
+    ir_resolve(ir);
+    free(live);
+    free(work.items);
+    return removed;
+}
+
+void ir_error(FILE *out, int *errors, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(out, "- ir error: ");
+    vfprintf(out, format, args);
+    fprintf(out, "\n");
+    va_end(args);
+    (*errors)++;
+}
+
+// Check block structure, edges both ways, phi arity, and that every operand
+// is a live value defined before its use: earlier in the same block, in a
+// dominating block, or for a phi, in one dominating the predecessor
+int ir_verify(Ir *ir, FILE *out) {
+    IrDom dom;
+    ir_dominators(ir, &dom);
+    int *pos = malloc(sizeof(int) * (ir->instr_count + 1));
+    for (int i = 0; i < ir->instr_count; i++) pos[i] = -1;
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].dead) continue;
+        int at = 0;
+        for (int j = 0; j < ir->blocks[b].phis.count; j++) pos[ir->blocks[b].phis.items[j]] = at++;
+        for (int j = 0; j < ir->blocks[b].code.count; j++) pos[ir->blocks[b].code.items[j]] = at++;
+    }
+    int errors = 0;
+    for (int b = 0; b < ir->block_count; b++) {
+        const IrBlock *block = &ir->blocks[b];
+        if (block->dead) continue;
+        if (dom.rpo_index[b] < 0) ir_error(out, &errors, "b%d is unreachable", b);
+        if (b == 0 && block->pred_count > 0) ir_error(out, &errors, "entry block b0 has predecessors");
+        if (block->code.count == 0) {
+            ir_error(out, &errors, "b%d has no terminator", b);
+            continue;
+        }
+        int succs[2], count = ir_succs(ir, b, succs);
+        for (int k = 0; k < count; k++) {
+            const IrBlock *succ = &ir->blocks[succs[k]];
+            int found = 0;
+            for (int j = 0; j < succ->pred_count; j++) found |= succ->preds[j] == b;
+            if (succ->dead || !found) ir_error(out, &errors, "b%d jumps to b%d, which does not list it as a predecessor", b, succs[k]);
+        }
+        for (int j = 0; j < block->pred_count; j++) {
+            int pred = block->preds[j], pred_succs[2], found = 0;
+            int pred_count = ir->blocks[pred].dead ? 0 : ir_succs(ir, pred, pred_succs);
+            for (int k = 0; k < pred_count; k++) found |= pred_succs[k] == b;
+            if (!found) ir_error(out, &errors, "b%d lists b%d as a predecessor, which does not jump to it", b, pred);
+        }
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &block->phis : &block->code;
+            for (int j = 0; j < items->count; j++) {
+                int i = items->items[j];
+                const IrInstr *in = &ir->instrs[i];
+                int terminator = in->op == IR_JMP || in->op == IR_BR || in->op == IR_RET;
+                if (in->dead || in->block != b) ir_error(out, &errors, "v%d in b%d is removed or belongs to another block", i, b);
+                if ((list == 0) != (in->op == IR_PHI)) ir_error(out, &errors, "v%d in b%d: phis must come first", i, b);
+                if (terminator != (list == 1 && j == items->count - 1)) ir_error(out, &errors, "v%d in b%d: a terminator must end the block", i, b);
+                if (in->op == IR_PHI && in->num_args != block->pred_count) {
+                    ir_error(out, &errors, "phi v%d in b%d has %d operands for %d predecessors", i, b, in->num_args, block->pred_count);
+                    continue;
+                }
+                for (int k = 0; k < in->num_args; k++) {
+                    int a = in->args[k];
+                    if (a < 0 || a >= ir->instr_count || pos[a] < 0 || ir->instrs[a].type == NK_NONE) {
+                        ir_error(out, &errors, "v%d in b%d uses v%d, which is not a live value", i, b, a);
+                        continue;
+                    }
+                    int def = ir->instrs[a].block;
+                    int ok = in->op == IR_PHI ? ir_dominates(&dom, def, block->preds[k])
+                        : def == b ? pos[a] < pos[i] : ir_dominates(&dom, def, b);
+                    if (!ok) ir_error(out, &errors, "v%d in b%d uses v%d before it is defined", i, b, a);
+                }
+            }
+        }
+    }
+    free(pos);
+    ir_dom_free(&dom);
+    return errors;
+}
+
+const char *const ir_op_names[] = {
+    "const", "undef", "phi", "add", "mul", "eq", "gt", "gte", "print", "jmp", "br", "ret"
+};
+
+void ir_print(FILE *out, const Ir *ir) {
+    for (int b = 0; b < ir->block_count; b++) {
+        const IrBlock *block = &ir->blocks[b];
+        if (block->dead) continue;
+        fprintf(out, "b%d:", b);
+        for (int j = 0; j < block->pred_count; j++) fprintf(out, "%s b%d", j ? "," : " ; preds", block->preds[j]);
+        fprintf(out, "\n");
+        for (int list = 0; list < 2; list++) {
+            const IntList *items = list == 0 ? &block->phis : &block->code;
+            for (int j = 0; j < items->count; j++) {
+                const IrInstr *in = &ir->instrs[items->items[j]];
+                fprintf(out, "  ");
+                if (in->type != NK_NONE) fprintf(out, "v%d = ", items->items[j]);
+                fprintf(out, "%s", ir_op_names[in->op]);
+                if (in->op == IR_CONST && in->type == NK_TYPE_BOOL) fprintf(out, " %s", in->value ? "true" : "false");
+                else if (in->op == IR_CONST) fprintf(out, " %lld", in->value);
+                else if (in->op == IR_UNDEF) fprintf(out, " %s", in->type == NK_TYPE_INT ? "int" : "bool");
+                for (int k = 0; k < in->num_args; k++) {
+                    if (in->op == IR_PHI) fprintf(out, "%s [v%d, b%d]", k ? "," : "", in->args[k], block->preds[k]);
+                    else fprintf(out, "%s v%d", k ? "," : "", in->args[k]);
+                }
+                if (in->op == IR_JMP) fprintf(out, " b%d", in->targets[0]);
+                if (in->op == IR_BR) fprintf(out, ", b%d, b%d", in->targets[0], in->targets[1]);
+                if (in->var >= 0) fprintf(out, " ; %s", ir->p->symbol_table.symbols[in->var].name);
+                fprintf(out, "\n");
+            }
+        }
+    }
+}
+
+// Pass manager (upl --passes=...). Lexing and parsing are stages, symbols,
+// types and the control-flow graph are analyses kept until a transform
+// changes the tree, and checks, transforms and output run when listed.
+// Each pass first runs the passes it requires, and is timed alone.
+
+// Heap bytes allocated and not yet freed, from the C library's counters
+size_t heap_in_use(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+void pass_note(PassManager *pm, int line, const char *format, ...) {
+    if (pm->note_count >= pm->note_capacity) {
+        pm->note_capacity = pm->note_capacity ? pm->note_capacity * 2 : 16;
+        pm->notes = realloc(pm->notes, sizeof(DataflowNote) * pm->note_capacity);
+    }
+    DataflowNote *note = &pm->notes[pm->note_count];
+    note->line = line;
+    note->order = pm->note_count++;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(note->text, sizeof(note->text), format, args);
+    va_end(args);
+}
+
+// Print notes in line order and empty the list
+void flush_notes(PassManager *pm, DataflowNote *notes, int *count) {
+    if (*count > 0) qsort(notes, *count, sizeof(DataflowNote), compare_notes);
+    for (int i = 0; i < *count; i++) fprintf(pm->out, "- line %d: %s\n", notes[i].line, notes[i].text);
+    *count = 0;
+}
+
+// The two halves of parser_parse_events, so each is timed on its own
+int pass_lex(PassManager *pm) {
+    Parser *p = pm->p;
+    parser_reset(p);
+    p->src = pm->src;
+    p->src_len = pm->len;
+    tokenize_file(p);
+    return 0;
+}
+
+int pass_parse(PassManager *pm) {
+    Parser *p = pm->p;
+    next_token(p);
+    parse_imports(p);
+    NodeId root = p->engine == UPL_ENGINE_LL1 ? ll1_parse(p) : parse_prog(p);
+    link_imports(p, root);
+    pm->result = parse_result(p, root, 1);
+    return 0;
+}
+
+// Type, declaration and use counts of every symbol, from the current tree
+int pass_symbols(PassManager *pm) {
+    Parser *p = pm->p;
+    const Ast *ast = &p->ast;
+    pm->symbol_count = p->symbol_table.count;
+    pm->symbols = realloc(pm->symbols, sizeof(SymbolInfo) * (pm->symbol_count + 1));
+    for (int i = 0; i < pm->symbol_count; i++) {
+        SymbolInfo *s = &pm->symbols[i];
+        s->type = strcmp(p->symbol_table.symbols[i].type, "int") == 0 ? NK_TYPE_INT : NK_TYPE_BOOL;
+        s->decl = NO_NODE;
+        s->reads = 0;
+        s->writes = 0;
+    }
+    pm->stack.count = 0;
+    node_list_push(&pm->stack, pm->result.root);
+    while (pm->stack.count > 0) {
+        NodeId id = pm->stack.items[--pm->stack.count];
+        NodeKind kind = ast_kind(ast, id);
+        int n = ast_num_children(ast, id);
+        if (kind == NK_ID) {
+            int var = symbol_index(p, ast_text(ast, id));
+            if (var >= 0) pm->symbols[var].reads++;
+        } else if (kind == NK_INIT_DECL || kind == NK_ASSIGN_STMT || kind == NK_UPDATE || kind == NK_FOR_INIT) {
+            NodeId name = ast_child(ast, id, 0);
+            int var = ast_kind(ast, name) == NK_NAME ? symbol_index(p, ast_text(ast, name)) : -1;
+            if (var >= 0 && kind == NK_INIT_DECL) pm->symbols[var].decl = id;
+            if (var >= 0 && (kind != NK_INIT_DECL || n > 1)) pm->symbols[var].writes++;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            NodeId child = ast_child(ast, id, i);
+            if (child) node_list_push(&pm->stack, child);
+        }
+    }
+    return 0;
+}
+
+NodeKind expr_type(PassManager *pm, NodeId id) {
+    if (pm->types[id] != NK_NONE) return pm->types[id];
+    const Ast *ast = &pm->p->ast;
+    for (int i = 0; i < ast_num_children(ast, id); i++) expr_type(pm, ast_child(ast, id, i));
+    NodeKind kind = ast_kind(ast, id), type = NK_NONE;
+    if (kind == NK_NUM || kind == NK_ADD_EXPR || kind == NK_MUL_EXPR) {
+        type = NK_TYPE_INT;
+    } else if (kind == NK_TRUE || kind == NK_FALSE || kind == NK_EQ_EXPR || kind == NK_GT || kind == NK_GTE) {
+        type = NK_TYPE_BOOL;
+    } else if (kind == NK_ID) {
+        int var = symbol_index(pm->p, ast_text(ast, id));
+        if (var >= 0 && var < pm->symbol_count) type = pm->symbols[var].type;
+    }
+    pm->types[id] = type;
+    return type;
+}
+
+// Type of every expression node, NK_NONE for names never declared
+int pass_types(PassManager *pm) {
+    const Ast *ast = &pm->p->ast;
+    pm->types = realloc(pm->types, ast->node_count);
+    memset(pm->types, NK_NONE, ast->node_count);
+    // Children are mostly built before their parents, so this recursion stays shallow
+    for (NodeId id = 1; id < ast->node_count; id++) {
+        if (is_pure_expr(ast_kind(ast, id))) expr_type(pm, id);
+    }
+    return 0;
+}
+
+// The graph of optimize_dead_stores with liveness and uninitialized sets solved
+int pass_cfg(PassManager *pm) {
+    Cfg *g = &pm->cfg;
+    g->p = pm->p;
+    g->count = 0;
+    memset(&g->read, 0, sizeof(g->read));
+    memset(&g->pinned, 0, sizeof(g->pinned));
+    int end = cfg_add(g, NO_NODE, NO_NODE, -1);
+    cfg_stmts(g, ast_child(&pm->p->ast, pm->result.root, 0), end);
+    solve_liveness(g);
+    solve_uninit(g);
+    return 0;
+}
+
+void check_store(PassManager *pm, NodeId name, NodeId value) {
+    const Ast *ast = &pm->p->ast;
+    int var = symbol_index(pm->p, ast_text(ast, name));
+    NodeKind type = pm->types[value];
+    if (var < 0 || type == NK_NONE || type == pm->symbols[var].type) return;
+    pass_note(pm, node_line(pm->p, name), "warning: %s value stored in %s %s", type == NK_TYPE_INT ? "int" : "bool",
+        pm->symbols[var].type == NK_TYPE_INT ? "int" : "bool", ast_text(ast, name));
+}
+
+void check_cond(PassManager *pm, NodeId cond, const char *what) {
+    if (pm->types[cond] == NK_TYPE_INT) pass_note(pm, node_line(pm->p, cond), "warning: %s condition is int, not bool", what);
+}
+
+void check_operands(PassManager *pm, NodeId id) {
+    const Ast *ast = &pm->p->ast;
+    NodeKind kind = ast_kind(ast, id);
+    NodeKind a = pm->types[ast_child(ast, id, 0)], b = pm->types[ast_child(ast, id, 1)];
+    if (kind == NK_EQ_EXPR) {
+        if (a != NK_NONE && b != NK_NONE && a != b) pass_note(pm, node_line(pm->p, id), "warning: '==' compares int with bool");
+        return;
+    }
+    const char *op = kind == NK_ADD_EXPR ? "+" : kind == NK_MUL_EXPR ? "*" : kind == NK_GT ? ">" : ">=";
+    if (a == NK_TYPE_BOOL || b == NK_TYPE_BOOL) pass_note(pm, node_line(pm->p, id), "warning: bool operand of '%s'", op);
+}
+
+// Semantic checks: int and bool mixed up, and variables never read
+int pass_check_types(PassManager *pm) {
+    const Ast *ast = &pm->p->ast;
+    pm->stack.count = 0;
+    node_list_push(&pm->stack, pm->result.root);
+    while (pm->stack.count > 0) {
+        NodeId id = pm->stack.items[--pm->stack.count];
+        switch (ast_kind(ast, id)) {
+        case NK_INIT_DECL:
+            if (ast_num_children(ast, id) > 1) check_store(pm, ast_child(ast, id, 0), ast_child(ast, id, 1));
+            break;
+        case NK_FOR_INIT:
+            if (ast_kind(ast, ast_child(ast, id, 0)) != NK_NAME) break;
+            // fall through
+        case NK_ASSIGN_STMT:
+        case NK_UPDATE:
+            check_store(pm, ast_child(ast, id, 0), ast_child(ast, id, 1));
+            break;
+        case NK_IF_THEN:
+            check_cond(pm, ast_child(ast, id, 0), "if");
+            break;
+        case NK_DO_WHILE_STMT:
+            check_cond(pm, ast_child(ast, id, 1), "do-while");
+            break;
+        case NK_FOR_STMT:
+            check_cond(pm, ast_child(ast, id, 1), "for");
+            break;
+        case NK_ADD_EXPR:
+        case NK_MUL_EXPR:
+        case NK_EQ_EXPR:
+        case NK_GT:
+        case NK_GTE:
+            check_operands(pm, id);
+            break;
+        default:
+            break;
+        }
+        for (int i = ast_num_children(ast, id) - 1; i >= 0; i--) {
+            NodeId child = ast_child(ast, id, i);
+            if (child) node_list_push(&pm->stack, child);
+        }
+    }
+    for (int i = 0; i < pm->symbol_count; i++) {
+        if (!pm->symbols[i].decl || pm->symbols[i].reads > 0) continue;
+        NodeId name = ast_child(ast, pm->symbols[i].decl, 0);
+        pass_note(pm, node_line(pm->p, name), "warning: %s is never read", ast_text(ast, name));
+    }
+    flush_notes(pm, pm->notes, &pm->note_count);
+    return 0;
+}
+
+int pass_uninit(PassManager *pm) {
+    Cfg *g = &pm->cfg;
+    g->note_count = 0;
+    warn_uninit(g);
+    flush_notes(pm, g->notes, &g->note_count);
+    return 0;
+}
+
+NodeId make_bool(Parser *p, int value, int line) {
+    int token = synth_token(p, value ? TOK_TRUE : TOK_FALSE, value ? "true" : "false", line);
+    return make_leaf(p, value ? NK_TRUE : NK_FALSE, token);
+}
+
+int is_int_expr(Parser *p, NodeId id) {
+    NodeKind kind = ast_kind(&p->ast, id);
+    if (kind == NK_ID) {
+        int var = symbol_index(p, ast_text(&p->ast, id));
+        return var >= 0 && strcmp(p->symbol_table.symbols[var].type, "int") == 0;
+    }
+    return kind == NK_NUM || kind == NK_ADD_EXPR || kind == NK_MUL_EXPR;
+}
+
+// Whether a subtree declares a variable, which later statements may use
+int declares_any(PassManager *pm, NodeId id) {
+    const Ast *ast = &pm->p->ast;
+    pm->stack.count = 0;
+    if (id) node_list_push(&pm->stack, id);
+    while (pm->stack.count > 0) {
+        NodeId node = pm->stack.items[--pm->stack.count];
+        if (ast_kind(ast, node) == NK_INIT_DECL) return 1;
+        for (int i = 0; i < ast_num_children(ast, node); i++) {
+            NodeId child = ast_child(ast, node, i);
+            if (child) node_list_push(&pm->stack, child);
+        }
+    }
+    return 0;
+}
+
+// Fold an operator whose operands are folded already: operators on literals
+// become literals, and x + 0, x * 1 and x * 0 on int x are simplified.
+// Returns the replacement.
+NodeId fold_node(PassManager *pm, NodeId id) {
+    Parser *p = pm->p;
+    NodeKind kind = ast_kind(&p->ast, id);
+    NodeId a = ast_child(&p->ast, id, 0), b = ast_child(&p->ast, id, 1);
+    NodeKind ka = ast_kind(&p->ast, a), kb = ast_kind(&p->ast, b);
+    long long x = 0, y = 0, value;
+    int na = ka == NK_NUM && eval_int(&p->ast, a, &x);
+    int nb = kb == NK_NUM && eval_int(&p->ast, b, &y);
+    int line = node_line(p, id);
+    NodeId folded = id;
+    if (na && nb) {
+        if (kind == NK_GT) folded = make_bool(p, x > y, line);
+        else if (kind == NK_GTE) folded = make_bool(p, x >= y, line);
+        else if (kind == NK_EQ_EXPR) folded = make_bool(p, x == y, line);
+        else if (eval_int(&p->ast, id, &value)) folded = make_num(p, value, line);
+    } else if (kind == NK_EQ_EXPR && (ka == NK_TRUE || ka == NK_FALSE) && (kb == NK_TRUE || kb == NK_FALSE)) {
+        folded = make_bool(p, ka == kb, line);
+    } else if (kind == NK_ADD_EXPR) {
+        if (na && x == 0 && is_int_expr(p, b)) folded = b;
+        else if (nb && y == 0 && is_int_expr(p, a)) folded = a;
+    } else if (kind == NK_MUL_EXPR) {
+        if (((na && x == 0) || (nb && y == 1)) && is_int_expr(p, na ? b : a)) folded = a;
+        else if (((nb && y == 0) || (na && x == 1)) && is_int_expr(p, nb ? a : b)) folded = b;
+    }
+    if (folded != id) pm->folds++;
+    return folded;
+}
+
+// Constant folding of an expression bottom up, from an explicit stack so
+// any depth the parser builds can be folded. Returns the replacement;
+// operands are rewritten in place.
+NodeId fold_expr(PassManager *pm, NodeId id) {
+    Parser *p = pm->p;
+    if (!is_operator(ast_kind(&p->ast, id))) return id;
+    WalkStack stack = { NULL, 0, 0 };
+    walk_push(&stack, id);
+    NodeId folded = id;
+    while (stack.count > 0) {
+        WalkFrame *f = &stack.items[stack.count - 1];
+        if (f->child < 2) {
+            NodeId child = ast_child(&p->ast, f->id, f->child++);
+            if (is_operator(ast_kind(&p->ast, child))) walk_push(&stack, child);
+            continue;
+        }
+        NodeId node = f->id;
+        folded = fold_node(pm, node);
+        if (--stack.count > 0 && folded != node) {
+            WalkFrame *parent = &stack.items[stack.count - 1];
+            p->ast.children[p->ast.nodes[parent->id].first_child + parent->child - 1] = folded;
+        }
+    }
+    free(stack.items);
+    return folded;
+}
+
+// Fold the expression in a child slot and report what became of it
+void fold_slot(PassManager *pm, NodeId parent, int slot) {
+    Parser *p = pm->p;
+    NodeId expr = ast_child(&p->ast, parent, slot);
+    int folds = pm->folds;
+    NodeId folded = fold_expr(pm, expr);
+    if (pm->folds == folds) return;
+    p->ast.children[p->ast.nodes[parent].first_child + slot] = folded;
+    NodeKind kind = ast_kind(&p->ast, folded);
+    if (kind == NK_NUM || kind == NK_TRUE || kind == NK_FALSE) {
+        fprintf(pm->out, "- line %d: constant expression folded to %s\n", node_line(p, expr), ast_text(&p->ast, folded));
+    } else {
+        fprintf(pm->out, "- line %d: expression simplified\n", node_line(p, expr));
+    }
+}
+
+// Fold the expressions of the statement at f->index up to its next statement
+// list, and return that list; once the statement is done, add what replaces
+// it to f->out and return NO_NODE. An if whose test became constant is
+// replaced by the branch that runs, unless the other one declares variables,
+// and a do-while whose test is false by its body.
+NodeId fold_stmt(PassManager *pm, FoldFrame *f) {
+    Parser *p = pm->p;
+    const Ast *ast = &p->ast;
+    NodeId stmt = ast_child(ast, f->stmts, f->index);
+    NodeId keep = stmt; // Or the statement list to splice in its place
+    int phase = f->phase++;
+    switch (stmt ? ast_kind(ast, stmt) : NK_NONE) {
+    case NK_ASSIGN_STMT:
+        fold_slot(pm, stmt, 1);
+        break;
+    case NK_PRINT_STMT:
+        fold_slot(pm, stmt, 0);
+        break;
+    case NK_DECL_STMT: {
+        NodeId init_decl = ast_child(ast, stmt, 1);
+        if (ast_num_children(ast, init_decl) > 1) fold_slot(pm, init_decl, 1);
+        break;
+    }
+    case NK_IF_STMT: {
+        NodeId if_then = ast_child(ast, stmt, 0);
+        NodeId else_opt = ast_child(ast, stmt, 1);
+        if (phase == 0) {
+            fold_slot(pm, if_then, 0);
+            return ast_child(ast, if_then, 1);
+        }
+        if (phase == 1 && else_opt) return ast_child(ast, else_opt, 0);
+        NodeId cond = ast_child(ast, if_then, 0);
+        NodeId then_stmts = ast_child(ast, if_then, 1);
+        NodeId else_stmts = else_opt ? ast_child(ast, else_opt, 0) : NO_NODE;
+        NodeKind kind = ast_kind(ast, cond);
+        if (kind != NK_TRUE && kind != NK_FALSE) break;
+        if (declares_any(pm, kind == NK_TRUE ? else_stmts : then_stmts)) break;
+        fprintf(pm->out, "- line %d: if condition is always %s, branch folded\n", node_line(p, cond), ast_text(ast, cond));
+        keep = kind == NK_TRUE ? then_stmts : else_stmts;
+        break;
+    }
+    case NK_DO_WHILE_STMT:
+        if (phase == 0) return ast_child(ast, stmt, 0);
+        fold_slot(pm, stmt, 1);
+        if (ast_kind(ast, ast_child(ast, stmt, 1)) != NK_FALSE) break;
+        fprintf(pm->out, "- line %d: do-while condition is always false, loop replaced by its body\n",
+            node_line(p, ast_child(ast, stmt, 1)));
+        keep = ast_child(ast, stmt, 0);
+        break;
+    case NK_FOR_STMT: {
+        if (phase > 0) break;
+        NodeId init = ast_child(ast, stmt, 0);
+        if (ast_kind(ast, ast_child(ast, init, 0)) == NK_NAME) fold_slot(pm, init, 1);
+        else if (ast_num_children(ast, ast_child(ast, init, 1)) > 1) fold_slot(pm, ast_child(ast, init, 1), 1);
+        fold_slot(pm, stmt, 1);
+        fold_slot(pm, ast_child(ast, stmt, 2), 1);
+        return ast_child(ast, stmt, 3);
+    }
+    default:
+        break;
+    }
+    f->index++;
+    f->phase = 0;
+    if (keep == stmt) {
+        node_list_push(&f->out, stmt);
+        return NO_NODE;
+    }
+    f->spliced = 1;
+    pm->folds++;
+    for (int j = 0; keep && j < ast_num_children(ast, keep); j++) node_list_push(&f->out, ast_child(ast, keep, j));
+    return NO_NODE;
+}
+
+// Fold a statement list and the lists nested in it, kept on an explicit
+// stack so nesting depth is bounded by memory, not the C stack
+void fold_stmts(PassManager *pm, NodeId stmts) {
+    Parser *p = pm->p;
+    FoldFrame *frames = NULL;
+    int count = 0, capacity = 0;
+    NodeId list = stmts;
+    for (;;) {
+        if (list) {
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                frames = realloc(frames, sizeof(FoldFrame) * capacity);
+            }
+            frames[count++] = (FoldFrame){ list, 0, 0, { NULL, 0, 0 }, 0 };
+        }
+        FoldFrame *f = &frames[count - 1];
+        if (f->index < ast_num_children(&p->ast, f->stmts)) {
+            list = fold_stmt(pm, f);
+            continue;
+        }
+        // The list is complete: go on with the statement it belongs to
+        if (f->spliced) set_children(p, f->stmts, f->out.items, f->out.count);
+        free(f->out.items);
+        if (--count == 0) break;
+        list = fold_stmt(pm, &frames[count - 1]);
+    }
+    free(frames);
+}
+
+int pass_fold(PassManager *pm) {
+    pm->folds = 0;
+    fold_stmts(pm, ast_child(&pm->p->ast, pm->result.root, 0));
+    return pm->folds;
+}
+
+int pass_loops(PassManager *pm) {
+    return optimize_loops(pm->p, pm->result.root, pm->out);
+}
+
+int pass_dse(PassManager *pm) {
+    return optimize_dead_stores(pm->p, pm->result.root, pm->out);
+}
+
+int pass_print(PassManager *pm) {
+    print_result(pm->out, &pm->result);
+    return 0;
+}
+
+int pass_ssa(PassManager *pm) {
+    if (!ir_build(&pm->ir, pm->p, pm->result.root)) {
+        fprintf(pm->out, "- ssa: integer literal out of range, no IR built\n");
+        return 0;
+    }
+    int blocks, instrs, phis;
+    ir_size(&pm->ir, &blocks, &instrs, &phis);
+    fprintf(pm->out, "- ssa: %d blocks, %d instructions, %d phis\n", blocks, instrs, phis);
+    return 0;
+}
+
+// Run an IR optimization and report the IR size before and after
+int run_ir_opt(PassManager *pm, const char *name, int (*opt)(Ir *ir)) {
+    int blocks, instrs, phis, new_blocks, new_instrs, new_phis;
+    ir_size(&pm->ir, &blocks, &instrs, &phis);
+    int changes = opt(&pm->ir);
+    ir_size(&pm->ir, &new_blocks, &new_instrs, &new_phis);
+    fprintf(pm->out, "- %s: %d changes; %d -> %d blocks, %d -> %d instructions, %d -> %d phis\n", name, changes,
+        blocks, new_blocks, instrs, new_instrs, phis, new_phis);
+    return changes;
+}
+
+int pass_sccp(PassManager *pm) {
+    return run_ir_opt(pm, "sccp", ir_sccp);
+}
+
+int pass_gvn(PassManager *pm) {
+    return run_ir_opt(pm, "gvn", ir_gvn);
+}
+
+int pass_dce(PassManager *pm) {
+    return run_ir_opt(pm, "dce", ir_dce);
+}
+
+int pass_verify_ir(PassManager *pm) {
+    int errors = ir_verify(&pm->ir, pm->out);
+    if (errors == 0) fprintf(pm->out, "- ir verified\n");
+    pm->ir_errors += errors;
+    return 0;
+}
+
+int pass_print_ir(PassManager *pm) {
+    ir_print(pm->out, &pm->ir);
+    return 0;
+}
+
+const PassInfo passes[PASS_COUNT] = {
+    [PASS_LEX] = { "lex", PASS_STAGE, 0, pass_lex },
+    [PASS_PARSE] = { "parse", PASS_STAGE, PASS_BIT(PASS_LEX), pass_parse },
+    [PASS_SYMBOLS] = { "symbols", PASS_ANALYSIS, PASS_BIT(PASS_PARSE), pass_symbols },
+    [PASS_TYPES] = { "types", PASS_ANALYSIS, PASS_BIT(PASS_SYMBOLS), pass_types },
+    [PASS_CFG] = { "cfg", PASS_ANALYSIS, PASS_BIT(PASS_PARSE), pass_cfg },
+    [PASS_CHECK_TYPES] = { "check", PASS_CHECK, PASS_BIT(PASS_SYMBOLS) | PASS_BIT(PASS_TYPES), pass_check_types },
+    [PASS_UNINIT] = { "uninit", PASS_CHECK, PASS_BIT(PASS_CFG), pass_uninit },
+    [PASS_FOLD] = { "fold", PASS_TRANSFORM, PASS_BIT(PASS_PARSE), pass_fold },
+    [PASS_LOOPS] = { "loops", PASS_TRANSFORM, PASS_BIT(PASS_PARSE), pass_loops },
+    [PASS_DSE] = { "dse", PASS_TRANSFORM, PASS_BIT(PASS_PARSE), pass_dse },
+    [PASS_PRINT] = { "print", PASS_OUTPUT, PASS_BIT(PASS_PARSE), pass_print },
+    [PASS_SSA] = { "ssa", PASS_ANALYSIS, PASS_BIT(PASS_PARSE), pass_ssa },
+    [PASS_SCCP] = { "sccp", PASS_IR, PASS_BIT(PASS_SSA), pass_sccp },
+    [PASS_GVN] = { "gvn", PASS_IR, PASS_BIT(PASS_SSA), pass_gvn },
+    [PASS_DCE] = { "dce", PASS_IR, PASS_BIT(PASS_SSA), pass_dce },
+    [PASS_VERIFY_IR] = { "verify", PASS_CHECK, PASS_BIT(PASS_SSA), pass_verify_ir },
+    [PASS_PRINT_IR] = { "print-ir", PASS_OUTPUT, PASS_BIT(PASS_SSA), pass_print_ir },
+};
+
+const char *const pass_kind_names[] = { "stage", "analysis", "check", "transform", "ir", "output" };
+
+int find_pass(const char *name, size_t len) {
+    for (int i = 0; i < PASS_COUNT; i++) {
+        if (strlen(passes[i].name) == len && strncmp(passes[i].name, name, len) == 0) return i;
+    }
+    return -1;
+}
+
+// Run a pass after the passes it requires. A still valid stage or analysis
+// is not run again; a transform that changed the tree invalidates every
+// analysis. Passes past parsing are skipped if the source has errors.
+void run_pass(PassManager *pm, PassId id, int listed) {
+    const PassInfo *info = &passes[id];
+    PassStats *stats = &pm->stats[id];
+    if (pm->valid & PASS_BIT(id)) {
+        stats->reused++;
+        return;
+    }
+    for (int dep = 0; dep < PASS_COUNT; dep++) {
+        if (info->requires & PASS_BIT(dep)) run_pass(pm, dep, 0);
+    }
+    if (info->kind != PASS_STAGE && id != PASS_PRINT && !pm->result.ok) {
+        if (listed && !(pm->skipped & PASS_BIT(id))) fprintf(pm->out, "- pass %s skipped: source has errors\n", info->name);
+        pm->skipped |= PASS_BIT(id);
+        return;
+    }
+    size_t tree = parser_memory(pm->p), heap = heap_in_use();
+    uint64_t start = now_ns();
+    int changes = info->run(pm);
+    stats->ns += now_ns() - start;
+    stats->tree_bytes += (long)parser_memory(pm->p) - (long)tree;
+    stats->heap_bytes += (long)heap_in_use() - (long)heap;
+    stats->runs++;
+    stats->changes += changes;
+    if (info->kind == PASS_STAGE || info->kind == PASS_ANALYSIS) pm->valid |= PASS_BIT(id);
+    if (info->kind == PASS_TRANSFORM && changes > 0) {
+        for (int i = 0; i < PASS_COUNT; i++) {
+            if (passes[i].kind == PASS_ANALYSIS) pm->valid &= ~PASS_BIT(i);
+        }
+    }
+}
+
+void print_pass_stats(FILE *out, const PassManager *pm) {
+    fprintf(out, "%-8s %-9s %10s %12s %12s %5s %7s %8s\n", "pass", "kind", "ms", "tree bytes", "heap bytes",
+        "runs", "reused", "changes");
+    uint64_t total = 0;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        const PassStats *s = &pm->stats[i];
+        if (!s->runs && !s->reused) continue;
+        fprintf(out, "%-8s %-9s %10.3f %+12ld %+12ld %5d %7d %8d\n", passes[i].name, pass_kind_names[passes[i].kind],
+            s->ns / 1e6, s->tree_bytes, s->heap_bytes, s->runs, s->reused, s->changes);
+        total += s->ns;
+    }
+    fprintf(out, "%-18s %10.3f\n", "total", total / 1e6);
+}
+
+// upl --passes=a,b,...: run the listed passes on one file, in order
+int passes_main(int argc, char *argv[]) {
+    ParserEngine engine = UPL_ENGINE_RECURSIVE;
+    int time_passes = 0;
+    int arg = 2;
+    for (; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--ll1") == 0) engine = UPL_ENGINE_LL1;
+        else if (strcmp(argv[arg], "--time-passes") == 0) time_passes = 1;
+        else break;
+    }
+    if (argc - arg != 1) {
+        fprintf(stderr, "Usage: %s --passes=<pass>,... [--ll1] [--time-passes] <filename>\n", argv[0]);
+        return 1;
+    }
+    const char *list = argv[1] + strlen("--passes=");
+    PassId *order = malloc(sizeof(PassId) * (strlen(list) + 1));
+    int count = 0;
+    for (const char *name = list; *name;) {
+        size_t len = strcspn(name, ",");
+        int id = find_pass(name, len);
+        if (id < 0) {
+            fprintf(stderr, "Unknown pass '%.*s'; passes are:", (int)len, name);
+            for (int i = 0; i < PASS_COUNT; i++) fprintf(stderr, " %s", passes[i].name);
+            fprintf(stderr, "\n");
+            free(order);
+            return 1;
+        }
+        order[count++] = id;
+        name += len;
+        if (*name == ',') name++;
+    }
+    FILE *file = fopen(argv[arg], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[arg]);
+        free(order);
+        return 1;
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    PassManager pm;
+    memset(&pm, 0, sizeof(pm));
+    pm.p = parser_new();
+    parser_set_engine(pm.p, engine);
+    set_module_dir_of(pm.p, argv[arg]);
+    pm.src = src;
+    pm.len = len;
+    pm.out = stdout;
+    for (int i = 0; i < count; i++) run_pass(&pm, order[i], 1);
+    if (time_passes) print_pass_stats(stdout, &pm);
+    int status = pm.p->error_count > 0 || pm.ir_errors > 0 ? 1 : 0;
+    ir_free(&pm.ir);
+    free(pm.symbols);
+    free(pm.types);
+    free(pm.cfg.nodes);
+    free(pm.cfg.stack.items);
+    free(pm.cfg.notes);
+    free(pm.stack.items);
+    free(pm.notes);
+    parser_free(pm.p);
+    free(order);
+    free(src);
+    return status;
+}
+
+#ifndef UPL_NO_MAIN
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0) return serve_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--client") == 0) return client_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--replay") == 0) return replay_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--precompile") == 0) return precompile_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--json") == 0) return json_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--opt-loops") == 0) return opt_loops_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--dse") == 0) return run_pass_main(argc, argv, optimize_dead_stores);
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) return bench_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--profile") == 0) return profile_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--alloc-profile") == 0) return alloc_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--alloc-check") == 0) return alloc_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--fuzz") == 0) return fuzz_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--fuzz-regress") == 0) return fuzz_regress_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--check-files") == 0) return check_files_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--diff") == 0) return diff_main(argc, argv);
+    if (argc >= 2 && strncmp(argv[1], "--passes=", 9) == 0) return passes_main(argc, argv);
+    ParserEngine engine = UPL_ENGINE_RECURSIVE;
+    ParseLimits limits;
+    memset(&limits, 0, sizeof(limits));
+    int pipelined = 0, hash_cons = 0, lazy = 0;
+    const char *capture_path = NULL, *module_dir = NULL;
+    int arg = 1;
+    for (; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--ll1") == 0) engine = UPL_ENGINE_LL1;
+        else if (strcmp(argv[arg], "--capture") == 0 && arg + 2 < argc) capture_path = argv[++arg];
+        else if (strcmp(argv[arg], "--modules") == 0 && arg + 2 < argc) module_dir = argv[++arg];
+        else if (strcmp(argv[arg], "--pipeline") == 0) pipelined = 1;
+        else if (strcmp(argv[arg], "--hash-cons") == 0) hash_cons = 1;
+        else if (strcmp(argv[arg], "--lazy") == 0) lazy = 1;
+        else if (!limit_option(argc - 1, argv, &arg, &limits)) break;
+    }
+    if (argc - arg != 1) {
+        fprintf(stderr, "Usage: %s [--ll1] [--pipeline] [--hash-cons] [--lazy] [--capture <log>] [--modules <dir>] [limits] <filename>\n", argv[0]);
+        fprintf(stderr, "       %s --precompile <module file>...\n", argv[0]);
+        fprintf(stderr, "       %s --json <filename>\n", argv[0]);
+        fprintf(stderr, "       %s --diff <old file> <new file>\n", argv[0]);
+        fprintf(stderr, "       %s --check-files [--io uring|pool|stdio] [-j threads] [--compare] [--list <file>] <filename>...\n", argv[0]);
+        fprintf(stderr, "       %s --opt-loops <filename>\n", argv[0]);
+        fprintf(stderr, "       %s --dse <filename>\n", argv[0]);
+        fprintf(stderr, "       %s --passes=<pass>,... [--ll1] [--time-passes] <filename>\n", argv[0]);
+        fprintf(stderr, "       %s --bench <filename> [-n parses]\n", argv[0]);
+        fprintf(stderr, "       %s --profile <filename> [--top N] [--folded <file>] [--ll1]\n", argv[0]);
+        fprintf(stderr, "       %s --alloc-profile <filename> [-n parses]\n", argv[0]);
+        fprintf(stderr, "       %s --alloc-check <filename> [-n parses] [--max-per-token X]\n", argv[0]);
+        fprintf(stderr, "       %s --fuzz [-t seconds] [-n parses] [--seed N] [--out <dir>] [--ll1] [seed files]\n", argv[0]);
+        fprintf(stderr, "       %s --fuzz-regress <dir> [--max-ns-per-byte N] [--max-mem-per-byte N]\n", argv[0]);
+        fprintf(stderr, "       %s --serve <socket> [--workers N] [--timeout-ms N] [--capture <log>] [--modules <dir> [--write-snapshots]] [limits]\n", argv[0]);
+        fprintf(stderr, "       %s --client <socket> <filename> [-n requests] [-c connections] [--check-only]\n", argv[0]);
+        fprintf(stderr, "       %s --replay <log> [-n passes] [-j threads] [--rate N] [--ll1] [limits]\n", argv[0]);
+        fprintf(stderr, "limits: --max-bytes N --max-tokens N --max-nodes N --max-depth N --max-ms N --max-memory N\n");
+        exit(1);
+    }
+    FILE *file = fopen(argv[arg], "r");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", argv[arg]);
+        exit(1);
+    }
+    size_t len;
+    char *src = read_file(file, &len);
+    fclose(file);
+    Parser *p = parser_new();
+    parser_set_engine(p, engine);
+    parser_set_pipelined(p, pipelined);
+    parser_set_hash_cons(p, hash_cons);
+    parser_set_limits(p, &limits);
+    parser_set_lazy(p, lazy);
+    if (module_dir) parser_set_module_dir(p, module_dir);
+    else set_module_dir_of(p, argv[arg]);
+    CaptureLog *capture = NULL;
+    if (capture_path && !(capture = capture_open(capture_path))) {
+        fprintf(stderr, "Could not open file %s\n", capture_path);
+        exit(1);
     }
-    free_tree(root);
-    free_token_list();
-    free_symbol_table();
-    return error_count > 0 ? 1 : 0;
+    parser_set_capture(p, capture);
+    ParseResult result = parser_parse(p, src, len);
+    parser_set_capture(p, NULL);
+    capture_close(capture);
+    if (lazy) result = parser_force_all(p);
+    print_result(stdout, &result);
+    if (hash_cons) print_hash_cons_stats(stdout, p);
+    int status = result.limit ? LIMIT_EXIT_STATUS : result.error_count > 0 ? 1 : 0;
+    parser_free(p);
+    free(src);
+    return status;
 }
+#endif
@@ -0,0 +1,228 @@
+#ifndef UPL_H
+#define UPL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define MAX_ERRORS 100
+
+// Parse tree node kinds; node_kind_label() gives the printed name
+typedef enum {
+    NK_NONE, NK_PROG, NK_STMTS, NK_IF_STMT, NK_IF_THEN, NK_ELSE_OPT,
+    NK_DO_WHILE_STMT, NK_PRINT_STMT, NK_DECL_STMT, NK_TYPE_INT, NK_TYPE_BOOL,
+    NK_INIT_DECL, NK_ASSIGN_STMT, NK_FOR_STMT, NK_FOR_INIT, NK_UPDATE,
+    NK_EQ_EXPR, NK_GT, NK_GTE, NK_ADD_EXPR, NK_MUL_EXPR, NK_ID, NK_NUM,
+    NK_TRUE, NK_FALSE, NK_NAME, NK_LAZY_STMTS, NK_COUNT
+} NodeKind;
+
+typedef uint32_t NodeId; // Index into Ast.nodes
+#define NO_NODE 0        // Slot 0 is never a real node
+
+// Id and Num keep their text in the token and print it as a child line;
+// NK_NAME is a declared or assigned variable name
+typedef struct {
+    uint32_t first_child; // Index of the first child id in Ast.children
+    uint32_t token;       // Token index for names and literals
+    uint16_t num_children;
+    uint8_t kind;         // NodeKind
+} AstNode;
+
+struct TokenList;
+
+// Flat parse tree: nodes and child id ranges in two growable arrays
+typedef struct {
+    AstNode *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    NodeId *children;
+    uint32_t child_count;
+    uint32_t child_capacity;
+    const struct TokenList *tokens;
+} Ast;
+
+static inline NodeKind ast_kind(const Ast *ast, NodeId id) {
+    return (NodeKind)ast->nodes[id].kind;
+}
+
+static inline int ast_num_children(const Ast *ast, NodeId id) {
+    return ast->nodes[id].num_children;
+}
+
+static inline NodeId ast_child(const Ast *ast, NodeId id, int i) {
+    return ast->children[ast->nodes[id].first_child + i];
+}
+
+const char* node_kind_label(NodeKind kind);
+const char* ast_text(const Ast *ast, NodeId id);
+
+typedef struct {
+    int line;
+    char message[256];
+} Error;
+
+// Parser instance; keeps its token, symbol and node buffers between parses
+typedef struct Parser Parser;
+
+// Resource limit that stopped a parse
+typedef enum {
+    UPL_LIMIT_NONE, UPL_LIMIT_INPUT, UPL_LIMIT_TOKENS, UPL_LIMIT_NODES, UPL_LIMIT_DEPTH,
+    UPL_LIMIT_TIME, UPL_LIMIT_MEMORY, UPL_LIMIT_CANCELLED
+} ParseLimit;
+
+typedef struct {
+    int ok;              // 1 if the source has correct syntax
+    const Ast *ast;      // Parse tree storage, owned by the parser until the next parse or reset
+    NodeId root;
+    const Error *errors; // Diagnostics in report order, owned by the parser
+    int error_count;
+    ParseLimit limit;    // Set if a limit or cancellation stopped the parse
+} ParseResult;
+
+// Parser lifecycle
+Parser* parser_new(void);
+void parser_reset(Parser *p);
+void parser_free(Parser *p);
+
+// Parsing engines. The LL(1) engine is table driven with heap stacks, so
+// nesting depth is bounded by memory instead of the C stack; it builds the
+// same trees and reports the same diagnostics.
+typedef enum {
+    UPL_ENGINE_RECURSIVE, UPL_ENGINE_LL1
+} ParserEngine;
+
+void parser_set_engine(Parser *p, ParserEngine engine);
+
+// Pipelined parsing: a second thread lexes into a token ring while the parser
+// consumes it, so lexing and parsing overlap. Applies to tree parses; event
+// parses tokenize first. Results are the same as with pipelining off.
+void parser_set_pipelined(Parser *p, int enabled);
+
+// Per-parse budgets; zero fields are unlimited. They are checked as tokens
+// arrive and in the statement, expression and error recovery loops. A parse
+// over budget, or whose cancel flag is set (from any thread), stops at once
+// with one "Resource limit exceeded" or "Parse cancelled" diagnostic and
+// ParseResult.limit set; upl exits with status 3.
+typedef struct {
+    size_t max_input_bytes;
+    uint32_t max_tokens;
+    uint32_t max_nodes;
+    uint32_t max_depth;         // Braces and parentheses open at once
+    double max_ms;              // Wall time
+    size_t max_memory;          // Token, tree and string arena bytes
+    const atomic_int *cancel;
+} ParseLimits;
+
+void parser_set_limits(Parser *p, const ParseLimits *limits);
+
+// Lazy block parsing (recursive engine, tree parses): the body of an if,
+// else, for or do-while block that declares no variables is skimmed to its
+// matching '}' and left as an NK_LAZY_STMTS node, so the statements around
+// it are ready sooner. parser_force parses one such body in place, turning
+// the node into Stmts. Until every body is forced, the result of
+// parser_parse is provisional: its ok and errors cover only the text outside
+// skimmed bodies, so a body with errors still parses as ok.
+// parser_force_all forces every body and returns the result and
+// diagnostics an eager parse gives, parsing the source again if a body had
+// errors. The source buffer must outlive the forcing.
+void parser_set_lazy(Parser *p, int enabled);
+NodeId parser_force(Parser *p, NodeId id);
+ParseResult parser_force_all(Parser *p);
+
+// Hash-consing: identical pure expression subtrees (names, literals,
+// arithmetic and comparisons) are built once and shared, so the tree becomes
+// a DAG and two expression ids are equal exactly when the expressions are.
+// A shared node keeps the token, and so the line, of its first occurrence.
+typedef struct {
+    uint32_t lookups;   // Expression nodes built
+    uint32_t hits;      // Of those, replaced by an existing node
+    uint32_t unique;    // Distinct expression nodes kept
+    size_t bytes_saved; // Node and child id storage not used
+} HashConsStats;
+
+void parser_set_hash_cons(Parser *p, int enabled);
+void parser_hash_cons_stats(const Parser *p, HashConsStats *stats);
+
+// Times an expression node was built by the last parse, 1 if not shared;
+// for a common subexpression pass
+uint32_t parser_expr_uses(const Parser *p, NodeId id);
+
+// Traffic capture: while a log is attached, every parse appends one record
+// with its input bytes, start time, lex and parse times, mode and exit
+// status. One log can be shared by parsers on several threads; upl --replay
+// feeds a log back through the parser.
+typedef struct CaptureLog CaptureLog;
+
+CaptureLog* capture_open(const char *path);
+void capture_close(CaptureLog *log);
+void parser_set_capture(Parser *p, CaptureLog *log);
+
+// Modules: a program may start with "import name;" directives before
+// 'begin'. Module name.upl in the module directory is a program that only
+// declares variables (it may import others); an import declares them and
+// puts the module's declarations first in the program, as if written there
+// on the directive's line. Modules are loaded from their snapshot name.upls,
+// without lexing or parsing, while the content hashes of the sources it was
+// built from match; otherwise the module is parsed and the snapshot written
+// again. A NULL directory is the current one.
+void parser_set_module_dir(Parser *p, const char *dir);
+
+// What imports may do: rewrite stale snapshots (the default), only read
+// fresh ones and compile other modules in memory, or nothing, so that an
+// import directive is an error. Module names are never paths.
+typedef enum {
+    UPL_MODULES_WRITE, UPL_MODULES_READ, UPL_MODULES_OFF
+} ModuleAccess;
+
+void parser_set_module_access(Parser *p, ModuleAccess access);
+
+// Parse module name.upl and write its snapshot; the result holds the
+// module's diagnostics
+ParseResult parser_precompile(Parser *p, const char *name);
+
+// Parse an in-memory UPL source; the buffer need not be NUL-terminated
+ParseResult parser_parse(Parser *p, const char *src, size_t len);
+
+// Streaming (SAX-style) parse events. enter/exit bracket inner nodes; names,
+// literals and types arrive as leaf events with their source text.
+typedef struct {
+    void (*enter)(void *ctx, NodeKind kind, int line);
+    void (*leaf)(void *ctx, NodeKind kind, const char *text, size_t len, int line);
+    void (*exit)(void *ctx, NodeKind kind);
+    void *ctx;
+} ParseEvents;
+
+// Parse without keeping a tree: events are delivered while parsing and the
+// result has no root. Open nodes are closed with exit events on errors.
+ParseResult parser_parse_events(Parser *p, const char *src, size_t len, const ParseEvents *events);
+
+// Deliver the events of an already built subtree
+void ast_emit(const Ast *ast, NodeId node, const ParseEvents *events);
+
+// Merkle hashes of the subtree at root, indexed by node id (node_count
+// entries). A node's hash covers its kind, the text of names, literals and
+// types, and its children's hashes, but not lines, comments or layout, so
+// equal hashes mean equal subtrees.
+void ast_merkle_hashes(const Ast *ast, NodeId root, uint64_t *hashes);
+
+// Parse daemon protocol (upl --serve): each request is two big-endian uint32
+// words, flags and source length, followed by the source bytes. The reply is
+// the exit status and output length, followed by the upl output text.
+#define UPL_REQ_CHECK_ONLY 0x1 // Verdict and diagnostics only, no tree
+
+// Output in the format of the upl command line tool
+void print_result(FILE *out, const ParseResult *result);
+void print_errors(FILE *out, const Error *errors, int count);
+void print_tree(FILE *out, const Ast *ast, NodeId node, int depth);
+
+// Loop pass: rewrites the parser's tree in place and writes one report line
+// per loop. Returns the number of loops changed.
+int optimize_loops(Parser *p, NodeId root, FILE *report);
+
+// Dataflow pass: warns about possibly uninitialized reads and removes dead
+// stores and unused declarations in place, one report line per finding.
+// Returns the number of removals.
+int optimize_dead_stores(Parser *p, NodeId root, FILE *report);
+
+#endif